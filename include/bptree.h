@@ -11,6 +11,24 @@
  * Key/value types and linkage can be customized via macros defined BEFORE
  * including the header (e.g., BPTREE_NUMERIC_TYPE, BPTREE_VALUE_TYPE,
  * BPTREE_KEY_TYPE_STRING/BPTREE_KEY_SIZE, BPTREE_STATIC).
+ * Defining BPTREE_AGGREGATE_TYPE enables subtree aggregates (see bptree_set_monoid).
+ * Defining BPTREE_ENABLE_THREADS lets bptree_free_async free nodes on background threads
+ * (needs POSIX threads).
+ * Defining BPTREE_ENABLE_TTL gives every entry an expiration time (see bptree_set_expiry).
+ * Defining BPTREE_ENABLE_COUNTERS counts structural events and per-operation costs (see
+ * bptree_get_counters); without it, the counting code compiles to nothing.
+ * Defining BPTREE_ENABLE_LATENCY keeps sampled latency histograms per operation kind (see
+ * bptree_set_latency_sampling).
+ * Defining BPTREE_ENABLE_HEATMAP keeps decayed access counts per leaf (see
+ * bptree_get_heatmap).
+ * Defining BPTREE_ENABLE_PROBES adds USDT probes for bpftrace and perf when <sys/sdt.h> is
+ * available (see the probe list in the implementation section).
+ * Defining BPTREE_ENABLE_TRACE allows recording structural events in a ring buffer of the
+ * tree (see bptree_set_trace).
+ * Defining BPTREE_TRIM_AFTER_COMPACT makes bptree_compact return freed heap memory to the
+ * operating system with malloc_trim on glibc (a process-wide call, off by default).
+ * BPTREE_DEBUG_LEVEL picks which debug messages are compiled in (BPTREE_DEBUG_OFF to
+ * BPTREE_DEBUG_STEPS, the default); `enable_debug` then turns them on at run time.
  * See implementation details for specific macro effects.
  *
  * ===============================================================================
@@ -42,6 +60,8 @@
  * - Thread Safety:
  *   - This implementation is NOT thread-safe. Caller must provide external
  *     synchronization (e.g., mutexes) for concurrent access.
+ *   - Plain lookups do not modify the tree (see bptree_get), so a reader-writer lock
+ *     lets lookups run in parallel.
  *
  * @version 0.4.1-beta
  * @author
@@ -67,15 +87,26 @@ extern "C" {
 #endif
 
 #include <assert.h>
+#include <limits.h>
 #include <stdalign.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+/** @brief Values of BPTREE_DEBUG_LEVEL; each level prints the messages of the lower ones. */
+#define BPTREE_DEBUG_OFF 0    /**< No debug messages (the calls compile to nothing) */
+#define BPTREE_DEBUG_ERRORS 1 /**< Failures and broken invariants */
+#define BPTREE_DEBUG_EVENTS 2 /**< Also structural events: splits, merges, new roots, and so on */
+#define BPTREE_DEBUG_STEPS 3  /**< Also every step of insertions and removals */
+#ifndef BPTREE_DEBUG_LEVEL
+#define BPTREE_DEBUG_LEVEL BPTREE_DEBUG_STEPS
+#endif
+
 #ifdef BPTREE_KEY_TYPE_STRING
 #ifndef BPTREE_KEY_SIZE
 #error "Define BPTREE_KEY_SIZE for fixed-size string keys"
@@ -106,6 +137,30 @@ typedef BPTREE_NUMERIC_TYPE bptree_key_t;
  */
 typedef BPTREE_VALUE_TYPE bptree_value_t;
 
+#ifdef BPTREE_AGGREGATE_TYPE
+/**
+ * @brief Aggregate type kept for every subtree (e.g., a sum, a min/max pair, or a struct).
+ */
+typedef BPTREE_AGGREGATE_TYPE bptree_agg_t;
+
+/**
+ * @brief A monoid used to aggregate the entries of the tree.
+ *
+ * `combine` must be associative and `identity` must be its neutral element. Entries are
+ * combined in key order, so `combine` does not need to be commutative.
+ */
+typedef struct bptree_monoid {
+    bptree_agg_t identity; /**< Neutral element of `combine` */
+    bptree_agg_t (*lift)(const bptree_key_t *key, bptree_value_t value); /**< Entry to aggregate */
+    bptree_agg_t (*combine)(bptree_agg_t a, bptree_agg_t b); /**< Combines two aggregates */
+} bptree_monoid;
+#endif
+
+#ifdef BPTREE_ENABLE_TTL
+/** @brief Expiration time of entries that never expire. */
+#define BPTREE_NO_EXPIRY INT64_MAX
+#endif
+
 /**
  * @brief Status codes returned by B+ tree functions.
  */
@@ -115,7 +170,8 @@ typedef enum {
     BPTREE_KEY_NOT_FOUND,      /**< Key not found */
     BPTREE_ALLOCATION_FAILURE, /**< Memory allocation failure */
     BPTREE_INVALID_ARGUMENT,   /**< Invalid argument passed */
-    BPTREE_INTERNAL_ERROR      /**< Internal consistency error */
+    BPTREE_INTERNAL_ERROR,     /**< Internal consistency error */
+    BPTREE_MEMORY_LIMIT        /**< Operation would take the tree over its memory budget */
 } bptree_status;
 
 /**
@@ -126,36 +182,347 @@ typedef enum {
 typedef struct bptree_node bptree_node;
 struct bptree_node {
     bool is_leaf;      /**< True if node is a leaf node */
+    bool in_slab;      /**< True if node was carved from a slab instead of allocated alone */
+    bool referenced;   /**< CLOCK reference bit of a leaf, set when an entry in it is read */
+    uint8_t level;     /**< Height above the leaves (0 for leaves), used for per-level counts */
     int num_keys;      /**< Number of keys stored in the node */
     bptree_node *next; /**< Pointer to the next leaf (used in range queries) */
-    char data[]; /**< Flexible array member that holds keys and either values or child pointers */
+#ifdef BPTREE_AGGREGATE_TYPE
+    bptree_agg_t agg; /**< Aggregate of every entry in the subtree rooted at this node */
+#endif
+#ifdef BPTREE_ENABLE_TTL
+    int64_t min_expiry; /**< Earliest expiration time in the subtree rooted at this node */
+#endif
+#ifdef BPTREE_ENABLE_HEATMAP
+    uint32_t heat;       /**< Decayed access count of a leaf (see bptree_get_heatmap) */
+    uint32_t heat_epoch; /**< Heat epoch of the tree when `heat` was last brought up to date */
+#endif
+    /** Flexible array member that holds keys and either values or child pointers */
+    alignas(max_align_t) char data[];
+};
+
+/**
+ * @brief Block of memory holding many nodes, filled by bptree_compact.
+ *
+ * The block is released once the last node in it is freed.
+ */
+typedef struct bptree_slab {
+    char *base;  /**< Start of the block */
+    size_t size; /**< Size of the block in bytes */
+    int live;    /**< Number of nodes in the block that are still in use */
+} bptree_slab;
+
+/** @brief State of an unfinished incremental compaction (internal). */
+typedef struct bptree_compaction bptree_compaction;
+
+/**
+ * @brief Which entry a capacity-bounded tree evicts first (see bptree_set_capacity).
+ */
+typedef enum {
+    BPTREE_EVICT_CLOCK,    /**< CLOCK over leaves: an entry of a leaf not used since last visit */
+    BPTREE_EVICT_SMALLEST, /**< The smallest key (oldest first, for time-ordered keys) */
+    BPTREE_EVICT_LARGEST   /**< The largest key */
+} bptree_eviction_policy;
+
+/**
+ * @brief Callback receiving tree entries, used to report evictions.
+ *
+ * @param key Pointer to the entry's key.
+ * @param value The entry's value.
+ * @param ctx User context.
+ */
+typedef void (*bptree_entry_callback)(const bptree_key_t *key, bptree_value_t value, void *ctx);
+
+typedef struct bptree_budget bptree_budget;
+
+/**
+ * @brief Callback invoked when an insertion would take a budget over its limit.
+ *
+ * @param budget The budget that would be exceeded.
+ * @param needed Bytes the insertion needs on top of `budget->used`.
+ * @param ctx User context.
+ * @return True after releasing node memory (e.g., by removing entries from an attached
+ *         tree), so the insertion checks the budget again; false to fail it.
+ */
+typedef bool (*bptree_pressure_callback)(bptree_budget *budget, size_t needed, void *ctx);
+
+/**
+ * @brief Limit on the node memory of one or more trees (see bptree_set_budget).
+ *
+ * The budget is owned by the caller and must outlive every tree attached to it. `used` is
+ * a plain counter that every attached tree updates as it allocates and frees nodes, so
+ * trees sharing a budget must all be guarded by one common lock (a lock per tree is not
+ * enough); the pressure callback runs under that lock too.
+ */
+struct bptree_budget {
+    size_t limit;                         /**< Most bytes the attached trees may hold (0: none) */
+    size_t used;                          /**< Bytes of node memory the attached trees hold */
+    bptree_pressure_callback on_pressure; /**< Called before an insertion fails (may be NULL) */
+    void *ctx;                            /**< User context passed to `on_pressure` */
 };
 
+/**
+ * @brief Counts of operations and structural events (see bptree_get_counters).
+ *
+ * Only kept when BPTREE_ENABLE_COUNTERS is defined; otherwise every count reads as zero.
+ */
+typedef struct bptree_counters {
+    uint64_t gets;             /**< Calls to bptree_get */
+    uint64_t puts;             /**< Calls to bptree_put */
+    uint64_t removes;          /**< Calls to bptree_remove, bptree_pop_min, and bptree_pop_max */
+    uint64_t compares;         /**< Comparator calls made by lookups, insertions, and removals */
+    uint64_t bytes_moved;      /**< Bytes shifted or copied within and between nodes */
+    uint64_t leaf_splits;      /**< Leaves split by insertions */
+    uint64_t internal_splits;  /**< Internal nodes split by insertions */
+    uint64_t root_splits;      /**< Root splits (the tree grew a level) */
+    uint64_t root_collapses;   /**< Root removals (the tree lost a level) */
+    uint64_t leaf_borrows;     /**< Entries borrowed by an underfull leaf from a sibling */
+    uint64_t internal_borrows; /**< Children borrowed by an underfull internal node */
+    uint64_t leaf_merges;      /**< Leaves merged into a sibling */
+    uint64_t internal_merges;  /**< Internal nodes merged into a sibling */
+} bptree_counters;
+
+/**
+ * @brief Kinds of operation timed by the latency histograms (see bptree_set_latency_sampling).
+ */
+typedef enum {
+    BPTREE_OP_GET_HIT,          /**< bptree_get that found the key */
+    BPTREE_OP_GET_MISS,         /**< bptree_get that did not find the key */
+    BPTREE_OP_PUT,              /**< bptree_put that split no leaf */
+    BPTREE_OP_PUT_SPLIT,        /**< bptree_put that split a leaf */
+    BPTREE_OP_REMOVE,           /**< bptree_remove that left every node full enough */
+    BPTREE_OP_REMOVE_REBALANCE, /**< bptree_remove that borrowed or merged */
+    BPTREE_OP_RANGE,            /**< bptree_get_range */
+    BPTREE_OP_KINDS             /**< Number of operation kinds */
+} bptree_op_kind;
+
+/** @brief Bits of precision below the leading bit of a latency bucket. */
+#define BPTREE_LATENCY_SUB_BITS 3
+
+/** @brief Number of buckets in a bptree_latency_histogram (covers every 64-bit duration). */
+#define BPTREE_LATENCY_BUCKETS ((65 - BPTREE_LATENCY_SUB_BITS) << BPTREE_LATENCY_SUB_BITS)
+
+/**
+ * @brief Log-scale histogram of operation durations, in timer ticks.
+ *
+ * Durations below 2^BPTREE_LATENCY_SUB_BITS ticks get a bucket each. Above that, each
+ * power of two is split into 2^BPTREE_LATENCY_SUB_BITS equal buckets, so a bucket's width
+ * is at most 1/8 of the durations it holds.
+ */
+typedef struct bptree_latency_histogram {
+    uint64_t samples;                         /**< Number of timed operations */
+    uint64_t total_ticks;                     /**< Sum of their durations */
+    uint64_t max_ticks;                       /**< Longest duration */
+    uint64_t buckets[BPTREE_LATENCY_BUCKETS]; /**< Operations per duration bucket */
+} bptree_latency_histogram;
+
+/**
+ * @brief Copy of the latency histograms of a tree (see bptree_get_latency).
+ */
+typedef struct bptree_latency_snapshot {
+    uint32_t sample_every; /**< One operation in this many is timed (0: sampling is off) */
+    double ns_per_tick;    /**< Nanoseconds per timer tick, measured against the clock */
+    bptree_latency_histogram ops[BPTREE_OP_KINDS]; /**< Histogram per operation kind */
+} bptree_latency_snapshot;
+
+/** @brief Sampling state and histograms of a tree (internal). */
+typedef struct bptree_latency bptree_latency;
+
+/**
+ * @brief Kinds of event recorded in a trace ring (see bptree_set_trace).
+ *
+ * Depths count from the root (0). Unless noted, `keys` and `other_keys` are the key counts
+ * of `node` and `other` after the event.
+ */
+typedef enum {
+    BPTREE_TRACE_LEAF_SPLIT,     /**< Leaf `node` split, moving its upper half to `other` */
+    BPTREE_TRACE_INTERNAL_SPLIT, /**< Internal `node` split, moving its upper half to `other` */
+    BPTREE_TRACE_ROOT_SPLIT,     /**< New root `node` added above the old root `other` */
+    BPTREE_TRACE_BORROW,         /**< Underfull `node` took an entry from its sibling `other` */
+    BPTREE_TRACE_MERGE,          /**< Sibling `other` is about to be merged into `node` */
+    BPTREE_TRACE_ROOT_COLLAPSE,  /**< Empty root `node` is about to give way to `other` */
+    BPTREE_TRACE_NODE_ALLOC,     /**< `node` was allocated (`keys` is 1 for a leaf, depth -1) */
+    BPTREE_TRACE_NODE_FREE,      /**< `node` is about to be freed (`keys` is 1 for a leaf) */
+    BPTREE_TRACE_RANGE_START,    /**< A range query starts scanning at leaf `node` */
+    BPTREE_TRACE_RANGE_END,      /**< A range query stopped in leaf `node` (results: other_keys) */
+    BPTREE_TRACE_EVENTS          /**< Number of event kinds */
+} bptree_trace_event;
+
+/**
+ * @brief Fixed-size binary record of one event in a trace ring.
+ */
+typedef struct bptree_trace_record {
+    uint64_t seq;       /**< Number of events recorded before this one */
+    uint64_t ticks;     /**< Timer reading (see bptree_trace_header for converting it) */
+    uint64_t node;      /**< Address of the node the event is about */
+    uint64_t other;     /**< Address of the second node, or 0 */
+    int32_t keys;       /**< Keys in `node` */
+    int32_t other_keys; /**< Keys in `other` */
+    int16_t depth;      /**< Depth of `node`, or -1 if not known */
+    uint16_t event;     /**< A bptree_trace_event */
+    uint32_t reserved;  /**< Always 0 */
+} bptree_trace_record;
+
+/**
+ * @brief Header of a trace file written by bptree_trace_write, followed by the records.
+ *
+ * An event recorded at `ticks` happened `(ticks - start_ticks) * ns_per_tick` nanoseconds
+ * after `start_ns`.
+ */
+typedef struct bptree_trace_header {
+    char magic[8];        /**< "BPTRACE" and a NUL */
+    uint32_t version;     /**< Format version (1) */
+    uint32_t record_size; /**< Size of each record in bytes */
+    uint64_t records;     /**< Number of records after the header */
+    uint64_t dropped;     /**< Earlier events already overwritten in the ring */
+    uint64_t start_ticks; /**< Timer reading when tracing started */
+    int64_t start_ns;     /**< Nanoseconds since the Unix epoch when tracing started */
+    double ns_per_tick;   /**< Nanoseconds per timer tick, measured against the clock */
+} bptree_trace_header;
+
+/** @brief Trace ring of a tree (internal). */
+typedef struct bptree_trace bptree_trace;
+
+/** @brief Most levels a tree can have (far more than 2^63 entries need). */
+#define BPTREE_MAX_LEVELS 64
+
+/**
+ * @brief Key range of a leaf and how often it was used (see bptree_get_heatmap).
+ */
+typedef struct bptree_hot_range {
+    bptree_key_t min_key; /**< Smallest key in the leaf */
+    bptree_key_t max_key; /**< Largest key in the leaf */
+    uint32_t heat;        /**< Decayed count of the gets, puts, and scans that reached the leaf */
+    int entries;          /**< Number of entries in the leaf */
+} bptree_hot_range;
+
+/** @brief Number of heat buckets per level in a bptree_heatmap. */
+#define BPTREE_HEAT_BUCKETS 33
+
+/**
+ * @brief Access heat of a tree, gathered in one pass over its nodes (see bptree_get_heatmap).
+ *
+ * The heat of an internal node is the sum of the heat of the leaves below it. On each
+ * level, bucket 0 counts the nodes without heat and bucket b counts the nodes with heat in
+ * [2^(b-1), 2^b); the last bucket also counts any hotter nodes.
+ */
+typedef struct bptree_heatmap {
+    uint64_t total_heat; /**< Heat of all leaves together */
+    uint32_t epoch;      /**< Number of times the heat has been halved so far */
+    int num_hot;         /**< Number of ranges written to the caller's array */
+    int64_t levels[BPTREE_MAX_LEVELS][BPTREE_HEAT_BUCKETS]; /**< Nodes per heat bucket */
+} bptree_heatmap;
+
 /**
  * @brief B+ tree structure.
  *
  * Represents the B+ tree and holds its configuration along with the root pointer.
  */
 typedef struct bptree {
-    int count;             /**< Total number of key/value pairs in the tree */
+    int64_t count;         /**< Total number of key/value pairs in the tree */
     int height;            /**< Current height of the tree */
     bool enable_debug;     /**< If true, debug messages will be printed */
     int max_keys;          /**< Maximum number of keys allowed in any node */
     int min_leaf_keys;     /**< Minimum keys needed in a non-root leaf node */
     int min_internal_keys; /**< Minimum keys needed in a non-root internal node */
     int (*compare)(const bptree_key_t *, const bptree_key_t *); /**< Function to compare two keys */
-    bptree_node *root; /**< Pointer to the root node of the tree */
+    bptree_node *root;       /**< Pointer to the root node of the tree */
+    bptree_node *first_leaf; /**< Pointer to the leftmost leaf (holds the smallest keys) */
+    bptree_node *last_leaf;  /**< Pointer to the rightmost leaf (holds the largest keys) */
+    uint64_t version;        /**< Bumped by every modification, so multi-step work can resume */
+    bptree_slab *slabs;      /**< Slabs holding nodes of this tree */
+    int num_slabs;           /**< Number of entries in `slabs` */
+    bptree_compaction *compaction;   /**< Compaction in progress, or NULL */
+    bool deferred;                   /**< If true, maintenance is queued for bptree_do_work */
+    bptree_key_t *repair_keys;       /**< Keys locating leaves left underfull by removals */
+    int repair_head;                 /**< Index of the next key in `repair_keys` to process */
+    int repair_len;                  /**< Number of keys stored in `repair_keys` */
+    int repair_cap;                  /**< Capacity of `repair_keys` */
+    bptree_node *garbage;            /**< Detached nodes waiting to be freed, linked via `next` */
+    int garbage_count;               /**< Number of nodes on `garbage` */
+    size_t node_bytes;               /**< Bytes of node memory held (single nodes and slabs) */
+    int64_t leaf_nodes;              /**< Number of leaves allocated (in the tree or not) */
+    int64_t internal_nodes;          /**< Number of internal nodes allocated */
+    bptree_budget *budget;           /**< Budget charged with `node_bytes`, or NULL */
+    int64_t level_nodes[BPTREE_MAX_LEVELS]; /**< Nodes in the tree per level, leaves first */
+    int64_t max_entries;             /**< Entry limit enforced by eviction (0 for none) */
+    size_t max_bytes;                /**< Eviction limit on live node memory (0 for none) */
+    bptree_eviction_policy eviction; /**< Which entries to evict first */
+    bptree_entry_callback on_evict;  /**< Called with each evicted entry (may be NULL) */
+    void *evict_ctx;                 /**< User context passed to `on_evict` */
+    bptree_key_t clock_hand;         /**< Key where the CLOCK sweep resumes */
+    bool clock_hand_set;             /**< If false, the CLOCK sweep starts at the first leaf */
+#ifdef BPTREE_AGGREGATE_TYPE
+    bptree_monoid monoid; /**< Monoid for subtree aggregates (`combine` is NULL when unset) */
+#endif
+#ifdef BPTREE_ENABLE_COUNTERS
+    bptree_counters counters; /**< Operation and structural event counts */
+#endif
+#ifdef BPTREE_ENABLE_LATENCY
+    bptree_latency *latency; /**< Latency sampling state, or NULL while sampling is off */
+#endif
+#ifdef BPTREE_ENABLE_TRACE
+    bptree_trace *trace; /**< Trace ring, or NULL while tracing is off */
+#endif
+#ifdef BPTREE_ENABLE_HEATMAP
+    uint32_t heat_epoch;     /**< Number of times the heat of the leaves has been halved */
+    uint64_t heat_half_life; /**< Accesses between halvings (0 to halve only on request) */
+    uint64_t heat_accesses;  /**< Accesses since the last halving */
+#endif
 } bptree;
 
 /**
  * @brief B+ tree statistics.
  */
 typedef struct bptree_stats {
-    int count;      /**< Total number of key/value pairs */
+    int count;      /**< Total number of key/value pairs (at most INT_MAX; see `entries`) */
     int height;     /**< Tree height */
-    int node_count; /**< Total number of nodes in the tree */
+    int node_count; /**< Total number of nodes in the tree (at most INT_MAX) */
+    int64_t entries;        /**< Total number of key/value pairs */
+    int64_t leaf_nodes;     /**< Number of leaves */
+    int64_t internal_nodes; /**< Number of internal nodes */
+    double avg_leaf_fill;     /**< Entries over leaf capacity (keys per leaf / max_keys) */
+    double avg_internal_fill; /**< Keys over capacity across all internal nodes */
+    int64_t level_nodes[BPTREE_MAX_LEVELS]; /**< Nodes per level, leaves at index 0 */
+    double level_fill[BPTREE_MAX_LEVELS];   /**< Average fill of the nodes on each level */
 } bptree_stats;
 
+/** @brief Number of buckets in a bptree_fill_histogram. */
+#define BPTREE_FILL_BUCKETS 10
+
+/**
+ * @brief Distribution of node fill factors, from a full scan (see bptree_scan_fill).
+ *
+ * Bucket i counts nodes whose fill (keys / max_keys) is in [i, i + 1) tenths; full nodes
+ * are counted in the last bucket.
+ */
+typedef struct bptree_fill_histogram {
+    int64_t leaves[BPTREE_FILL_BUCKETS];    /**< Leaves per fill bucket */
+    int64_t internals[BPTREE_FILL_BUCKETS]; /**< Internal nodes per fill bucket */
+    double min_leaf_fill;     /**< Lowest fill of a non-root leaf (1 if there is none) */
+    double min_internal_fill; /**< Lowest fill of a non-root internal node (1 if none) */
+} bptree_fill_histogram;
+
+/**
+ * @brief Breakdown of the node memory held by a tree (see bptree_get_memory).
+ */
+typedef struct bptree_memory {
+    size_t total_bytes;    /**< All node memory, including slab space of freed nodes */
+    size_t leaf_bytes;     /**< Memory of leaves */
+    size_t internal_bytes; /**< Memory of internal nodes */
+    size_t slack_bytes;    /**< Part of the above in unused slots and padding */
+} bptree_memory;
+
+/**
+ * @brief Predicate over tree entries, used by bptree_remove_if.
+ *
+ * @param key Pointer to the entry's key.
+ * @param value The entry's value.
+ * @param ctx User context.
+ * @return True if the entry matches.
+ */
+typedef bool (*bptree_entry_predicate)(const bptree_key_t *key, bptree_value_t value, void *ctx);
+
 /*------------------------------------------------------------------------------
  * Public API
  *----------------------------------------------------------------------------*/
@@ -185,10 +552,42 @@ BPTREE_API bptree *bptree_create(int max_keys,
  */
 BPTREE_API void bptree_free(bptree *tree);
 
+/** @brief Handle of a tree being freed by bptree_free_async. */
+typedef struct bptree_free_task bptree_free_task;
+
+/**
+ * @brief Frees a B+ tree without blocking the caller on the node walk.
+ *
+ * The tree is handed over in O(1) and its nodes are freed on a background thread. With
+ * @p num_threads above one, the subtrees below the top levels are split among that many
+ * threads. Nodes that live in slabs (see bptree_compact) are not freed one by one; each
+ * slab is released as a whole. The tree must not be used after this call.
+ *
+ * Without BPTREE_ENABLE_THREADS, or if a thread cannot be started, the tree is freed
+ * before returning and `*out_task` is set to NULL.
+ *
+ * @param tree Pointer to the B+ tree to free.
+ * @param num_threads Number of threads to free the nodes with (at least 1).
+ * @param out_task Receives a handle to pass to bptree_free_wait. If NULL, the background
+ *                 thread is detached and cleans up after itself.
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_free_async(bptree *tree, int num_threads,
+                                           bptree_free_task **out_task);
+
+/**
+ * @brief Waits for a bptree_free_async call to finish and releases its handle.
+ *
+ * @param task Handle from bptree_free_async (NULL is ignored).
+ */
+BPTREE_API void bptree_free_wait(bptree_free_task *task);
+
 /**
  * @brief Inserts a key-value pair into the tree.
  *
  * Inserts a new element. Returns BPTREE_DUPLICATE_KEY if the key already exists.
+ * With BPTREE_ENABLE_TTL, an expired entry that has not been swept yet does not count:
+ * its value is replaced and it no longer expires.
  * The function splits nodes if an overflow occurs.
  *
  * @param tree Pointer to the B+ tree.
@@ -201,7 +600,9 @@ BPTREE_API bptree_status bptree_put(bptree *tree, const bptree_key_t *key, bptre
 /**
  * @brief Retrieves the value associated with a key.
  *
- * Searches the tree for the given key and returns the associated value.
+ * Searches the tree for the given key and returns the associated value. Unless counters,
+ * latency sampling, the heatmap, or a CLOCK capacity limit are enabled, a lookup does not
+ * modify the tree, so concurrent readers can share it under a reader lock.
  *
  * @param tree Pointer to the B+ tree.
  * @param key Pointer to the key to search.
@@ -222,6 +623,22 @@ BPTREE_API bptree_status bptree_get(const bptree *tree, const bptree_key_t *key,
  */
 BPTREE_API bptree_status bptree_remove(bptree *tree, const bptree_key_t *key);
 
+/**
+ * @brief Removes every entry matching a predicate in a single pass.
+ *
+ * Surviving entries are compacted leaf by leaf along the leaf chain, emptied leaves are
+ * freed, and the internal levels are rebuilt once at the end from the old internal nodes.
+ * The cost is linear in the number of entries, however many of them are removed.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param predicate Returns true for entries to remove. It must not modify the tree.
+ * @param ctx User context passed to the predicate.
+ * @return BPTREE_OK if successful, BPTREE_INVALID_ARGUMENT, or BPTREE_ALLOCATION_FAILURE
+ *         (the tree is left unchanged).
+ */
+BPTREE_API bptree_status bptree_remove_if(bptree *tree, bptree_entry_predicate predicate,
+                                          void *ctx);
+
 /**
  * @brief Retrieves a range of values.
  *
@@ -251,7 +668,9 @@ BPTREE_API void bptree_free_range_results(bptree_value_t *results);
 /**
  * @brief Gets statistics about the tree.
  *
- * Returns a structure containing element count, tree height, and node count.
+ * Returns a structure containing element count, tree height, node counts (in total and
+ * per level), and average fill factors. Every node count is kept up to date as nodes are
+ * allocated and freed, so this takes O(height) time and does not visit the nodes.
  *
  * @param tree Pointer to the B+ tree.
  * @return A bptree_stats structure.
@@ -259,1154 +678,5569 @@ BPTREE_API void bptree_free_range_results(bptree_value_t *results);
 BPTREE_API bptree_stats bptree_get_stats(const bptree *tree);
 
 /**
- * @brief Checks the internal invariants of the tree.
+ * @brief Scans every node to build a histogram of fill factors.
  *
- * Verifies that the tree's properties (key order, occupancy, etc.) are maintained.
+ * Unlike bptree_get_stats, this visits every node, so it takes time linear in the size
+ * of the tree. The root is counted in the histogram but left out of the minimums, since
+ * it may hold as little as one key.
  *
  * @param tree Pointer to the B+ tree.
- * @return True if all invariants hold, false otherwise.
+ * @param out Receives the histogram.
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT.
  */
-BPTREE_API bool bptree_check_invariants(const bptree *tree);
+BPTREE_API bptree_status bptree_scan_fill(const bptree *tree, bptree_fill_histogram *out);
 
 /**
- * @brief Checks if a key exists in the tree.
+ * @brief Gets the operation and structural event counts of the tree.
  *
- * Searches for the key and returns true if found.
+ * Counts are kept per tree; sum them with bptree_counters_add for a group of trees. With
+ * BPTREE_ENABLE_COUNTERS defined, lookups also update the counts, so concurrent readers
+ * of one tree need the same synchronization as writers.
  *
  * @param tree Pointer to the B+ tree.
- * @param key Pointer to the key to check.
- * @return True if found, false otherwise.
+ * @return The counts since creation or the last bptree_reset_counters (all zero without
+ *         BPTREE_ENABLE_COUNTERS, or if @p tree is NULL).
  */
-BPTREE_API bool bptree_contains(const bptree *tree, const bptree_key_t *key);
-
-#ifdef BPTREE_IMPLEMENTATION
-
-/*==============================================================================
- * Internal Functions and Implementation Details
- *============================================================================*/
+BPTREE_API bptree_counters bptree_get_counters(const bptree *tree);
 
 /**
- * @brief Print a debug message if debugging is enabled.
+ * @brief Sets every count of the tree back to zero.
  *
- * This function wraps vprintf to add a timestamp and a tag to the debug output.
+ * @param tree Pointer to the B+ tree.
+ */
+BPTREE_API void bptree_reset_counters(bptree *tree);
+
+/**
+ * @brief Adds one set of counts to another.
  *
- * @param enable Debug flag.
- * @param fmt Format string.
- * @param ... Additional arguments.
+ * @param sum Counts to add to.
+ * @param counters Counts to add.
  */
-static void bptree_debug_print(const bool enable, const char *fmt, ...) {
-    if (!enable) return;  // Skip if debugging is turned off
-    char time_buf[64];
-    const time_t now = time(NULL);
-    const struct tm *tm_info = localtime(&now);
-    // Format the timestamp as "YYYY-MM-DD HH:MM:SS"
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
-    printf("[%s] [BPTREE DEBUG] ", time_buf);
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-}
+BPTREE_API void bptree_counters_add(bptree_counters *sum, const bptree_counters *counters);
 
 /**
- * @brief Compute the size of the keys area within a node.
+ * @brief Formats counts in the Prometheus text exposition format.
  *
- * This function calculates the size needed to store all keys (max_keys+1)
- * and any padding required to meet the alignment of the values or child pointers.
+ * Each count becomes a counter named `bptree_<field>_total`, with HELP and TYPE lines.
+ * Like snprintf, the output is truncated to fit @p size bytes (including the terminating
+ * NUL), and the length of the full output is returned.
  *
- * @param max_keys Maximum number of keys per node.
- * @return Size in bytes required for the keys area.
+ * @param counters Counts to format.
+ * @param label Value of a `tree` label added to every sample, or NULL for none.
+ * @param buf Buffer receiving the text (may be NULL if @p size is 0).
+ * @param size Size of @p buf in bytes.
+ * @return Length of the full output, not counting the terminating NUL.
  */
-static size_t bptree_keys_area_size(const int max_keys) {
-    const size_t keys_size = (size_t)(max_keys + 1) * sizeof(bptree_key_t);
-    const size_t req_align =
-        (sizeof(bptree_value_t) > sizeof(bptree_node *) ? sizeof(bptree_value_t)
-                                                        : sizeof(bptree_node *));
-    // Calculate required padding to meet alignment constraints
-    const size_t pad = (req_align - (keys_size % req_align)) % req_align;
-    return keys_size + pad;
-}
+BPTREE_API size_t bptree_counters_format(const bptree_counters *counters, const char *label,
+                                         char *buf, size_t size);
 
 /**
- * @brief Get pointer to keys in a node.
+ * @brief Writes counts to a file in the Prometheus text exposition format.
  *
- * Returns a pointer where the keys are stored in the node's flexible array.
- *
- * @param node Pointer to the node.
- * @return Pointer to the key array.
+ * @param counters Counts to write.
+ * @param label Value of a `tree` label added to every sample, or NULL for none.
+ * @param out File to write to.
+ * @return True if successful, false on a write or allocation error.
  */
-static bptree_key_t *bptree_node_keys(const bptree_node *node) {
-    return (bptree_key_t *)node->data;
-}
+BPTREE_API bool bptree_counters_write(const bptree_counters *counters, const char *label,
+                                      FILE *out);
 
 /**
- * @brief Get pointer to values stored in a leaf node.
+ * @brief Starts, changes, or stops latency sampling.
  *
- * Computes the starting address of the values area within the node.
+ * While sampling is on, one call in @p every to bptree_get, bptree_put, bptree_remove, or
+ * bptree_get_range is timed with the CPU's time-stamp counter (or the clock where there is
+ * none) and counted in the histogram of its operation kind. The other calls only pay for
+ * decrementing a counter. The histograms take about 28 KiB, allocated when sampling starts
+ * and freed when it stops. Sampled lookups update the tree, so concurrent readers need the
+ * same synchronization as writers.
  *
- * @param node Pointer to the node.
- * @param max_keys Maximum keys per node.
- * @return Pointer to the values array.
+ * @param tree Pointer to the B+ tree.
+ * @param every Time one operation in this many (1 times every operation), or 0 to stop
+ *        sampling and drop the histograms.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE, or BPTREE_INVALID_ARGUMENT
+ *         (also when @p every is not 0 and BPTREE_ENABLE_LATENCY is not defined).
  */
-static bptree_value_t *bptree_node_values(bptree_node *node, const int max_keys) {
-    const size_t offset = bptree_keys_area_size(max_keys);
-    return (bptree_value_t *)(node->data + offset);
-}
+BPTREE_API bptree_status bptree_set_latency_sampling(bptree *tree, uint32_t every);
 
 /**
- * @brief Get pointer to child pointers in an internal node.
+ * @brief Copies the latency histograms of the tree.
  *
- * Computes the starting address of the children area within the node.
+ * @param tree Pointer to the B+ tree.
+ * @param out Receives the histograms (all empty while sampling is off).
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_get_latency(const bptree *tree, bptree_latency_snapshot *out);
+
+/**
+ * @brief Empties the latency histograms of the tree, leaving sampling on.
  *
- * @param node Pointer to the node.
- * @param max_keys Maximum keys per node.
- * @return Pointer to the array of child node pointers.
+ * @param tree Pointer to the B+ tree.
  */
-static bptree_node **bptree_node_children(bptree_node *node, const int max_keys) {
-    const size_t offset = bptree_keys_area_size(max_keys);
-    return (bptree_node **)(node->data + offset);
-}
+BPTREE_API void bptree_reset_latency(bptree *tree);
 
-#ifdef BPTREE_KEY_TYPE_STRING
 /**
- * @brief Default key comparison for string keys.
+ * @brief Estimates a latency quantile from a snapshot.
  *
- * Compares two keys as fixed-size strings.
+ * Returns the upper bound of the bucket holding the quantile (capped at the longest
+ * duration seen), so the estimate is high by at most one bucket width.
  *
- * @param a Pointer to the first key.
- * @param b Pointer to the second key.
- * @return Comparison result similar to memcmp.
+ * @param snapshot Snapshot from bptree_get_latency.
+ * @param op Operation kind.
+ * @param q Quantile in [0, 1] (for example 0.99 for the 99th percentile).
+ * @return The latency in nanoseconds, or 0 if nothing of that kind was timed.
  */
-static inline int bptree_default_compare(const bptree_key_t *a, const bptree_key_t *b) {
-    return memcmp(a->data, b->data, BPTREE_KEY_SIZE);
-}
-#else
+BPTREE_API double bptree_latency_quantile(const bptree_latency_snapshot *snapshot,
+                                          bptree_op_kind op, double q);
+
 /**
- * @brief Default key comparison for numeric keys.
+ * @brief Starts, resizes, or stops recording structural events in a ring buffer.
  *
- * Compares two numeric keys.
+ * While tracing is on, splits, merges, borrows, root changes, node allocations, and range
+ * scans append a fixed-size bptree_trace_record to a ring of the tree; once it is full, the
+ * oldest records are overwritten. Recording takes a timer read and a few stores, so the
+ * ring can stay on in production as a flight recorder. Changing the capacity drops the
+ * recorded events.
  *
- * @param a Pointer to the first key.
- * @param b Pointer to the second key.
- * @return -1 if *a < *b, 1 if *a > *b, or 0 if equal.
+ * Resizing or stopping the trace frees the old ring at once, so it needs exclusive access:
+ * no other thread may be in bptree_trace_read, bptree_trace_write, or an operation on the
+ * tree during the call.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param capacity Number of records to keep (rounded up to a power of two), or 0 to stop
+ *        tracing and free the ring.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE, or BPTREE_INVALID_ARGUMENT
+ *         (also when @p capacity is not 0 and BPTREE_ENABLE_TRACE is not defined).
  */
-static int bptree_default_compare(const bptree_key_t *a, const bptree_key_t *b) {
-    return (*a < *b) ? -1 : ((*a > *b) ? 1 : 0);
-}
-#endif
+BPTREE_API bptree_status bptree_set_trace(bptree *tree, size_t capacity);
 
 /**
- * @brief Find the smallest key in a subtree.
+ * @brief Copies the newest records of the trace ring, oldest first.
  *
- * Walks down the leftmost branch until a leaf is reached.
+ * Recording claims slots with an atomic increment and never waits, so this may run while
+ * another thread records, and never waits for a writer either. Each slot is read as a
+ * seqlock: a copy that a writer changed, or of a record not published yet, is retried a few
+ * times and then skipped, as are records overwritten by newer ones. Skipped records leave a
+ * gap in the `seq` numbers of the result.
  *
- * @param node Pointer to the current node.
- * @param max_keys Maximum keys per node.
- * @return The smallest key found.
+ * @param tree Pointer to the B+ tree.
+ * @param out Array receiving the records.
+ * @param max Size of @p out.
+ * @return Number of records copied (0 while tracing is off).
  */
-static bptree_key_t bptree_find_smallest_key(bptree_node *node, const int max_keys) {
-    assert(node != NULL);
-    while (!node->is_leaf) {
-        assert(node->num_keys >= 0);
-        node = bptree_node_children(node, max_keys)[0];
-        assert(node != NULL);
-    }
-    assert(node->num_keys > 0);
-    return bptree_node_keys(node)[0];
-}
+BPTREE_API size_t bptree_trace_read(const bptree *tree, bptree_trace_record *out, size_t max);
 
 /**
- * @brief Find the largest key in a subtree.
+ * @brief Writes the trace ring to a file in binary form.
  *
- * Walks down the rightmost branch until a leaf is reached.
+ * The file holds a bptree_trace_header followed by the records, oldest first; decode it
+ * with the `trace_dump` tool.
  *
- * @param node Pointer to the current node.
- * @param max_keys Maximum keys per node.
- * @return The largest key found.
+ * @param tree Pointer to the B+ tree.
+ * @param out File to write to (opened in binary mode).
+ * @return True if successful, false if tracing is off or on a write or allocation error.
  */
-static bptree_key_t bptree_find_largest_key(bptree_node *node, const int max_keys) {
-    assert(node != NULL);
-    while (!node->is_leaf) {
-        assert(node->num_keys >= 0);
-        node = bptree_node_children(node, max_keys)[node->num_keys];
-        assert(node != NULL);
-    }
-    assert(node->num_keys > 0);
-    return bptree_node_keys(node)[node->num_keys - 1];
-}
+BPTREE_API bool bptree_trace_write(const bptree *tree, FILE *out);
 
 /**
- * @brief Count the total number of nodes in the subtree.
- *
- * Recursively traverses the subtree to count each node.
+ * @brief Gets the name of an event kind.
  *
- * @param node Pointer to the current node.
- * @param tree Pointer to the tree (for configuration values).
- * @return Total count of nodes.
+ * @param event Event kind.
+ * @return Name such as "leaf_split", or "unknown".
  */
-static int bptree_count_nodes(const bptree_node *node, const bptree *tree) {
-    if (!node) return 0;
-    if (node->is_leaf) return 1;
-    int count = 1;  // Count the current internal node
-    bptree_node **children = bptree_node_children((bptree_node *)node, tree->max_keys);
-    for (int i = 0; i <= node->num_keys; i++) {
-        count += bptree_count_nodes(children[i], tree);
-    }
-    return count;
-}
+BPTREE_API const char *bptree_trace_event_name(bptree_trace_event event);
 
 /**
- * @brief Recursively check internal invariants of the tree.
+ * @brief Sets how fast the access heat of the leaves fades.
  *
- * Verifies ordering, occupancy limits, and structural consistency.
+ * With BPTREE_ENABLE_HEATMAP defined, every get, put, and range query adds one to the heat
+ * of each leaf it reaches. After every @p half_life of those accesses, the heat of every
+ * leaf is halved, so the counts follow the recent workload. Halving is lazy: it costs O(1)
+ * and each leaf catches up the next time it is touched or reported. Lookups update the
+ * heat, so concurrent readers need the same synchronization as writers.
  *
- * @param node Pointer to the current node.
- * @param tree Pointer to the tree.
- * @param depth Current depth in the tree.
- * @param leaf_depth Pointer to store the expected depth of leaves.
- * @return True if the invariants pass, false if any check fails.
+ * @param tree Pointer to the B+ tree.
+ * @param half_life Accesses between halvings, or 0 to halve only in bptree_decay_heat.
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT (also when @p half_life is
+ *         not 0 and BPTREE_ENABLE_HEATMAP is not defined).
  */
-static bool bptree_check_invariants_node(bptree_node *node, const bptree *tree, const int depth,
-                                         int *leaf_depth) {
-    if (!node) return false;
-    const bptree_key_t *keys = bptree_node_keys(node);
-    const bool is_root = (tree->root == node);
+BPTREE_API bptree_status bptree_set_heat_half_life(bptree *tree, uint64_t half_life);
+
+/**
+ * @brief Halves the access heat of every leaf in O(1), for example from a timer.
+ *
+ * @param tree Pointer to the B+ tree.
+ */
+BPTREE_API void bptree_decay_heat(bptree *tree);
+
+/**
+ * @brief Reports the hottest leaf ranges and the heat of the nodes on each level.
+ *
+ * Visits every node once and keeps the @p k hottest leaves in a heap inside @p hot, so
+ * the cost is O(nodes + leaves * log k) and nothing is allocated. Leaves without heat are
+ * never reported. Leaves rebuilt by compaction start without heat.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param hot Receives up to @p k ranges, hottest first (may be NULL if @p k is 0).
+ * @param k Capacity of @p hot.
+ * @param out Receives the totals and the per-level histograms (all zero without
+ *        BPTREE_ENABLE_HEATMAP).
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_get_heatmap(const bptree *tree, bptree_hot_range *hot, int k,
+                                            bptree_heatmap *out);
+
+/**
+ * @brief Checks the internal invariants of the tree.
+ *
+ * Verifies that the tree's properties (key order, occupancy, etc.) are maintained, that the
+ * leaf chain visits every leaf in key order, and that the entry and per-level node counts
+ * match. Every node is visited once, so the check takes O(n) time.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @return True if all invariants hold, false otherwise.
+ */
+BPTREE_API bool bptree_check_invariants(const bptree *tree);
+
+/**
+ * @brief Checks the internal invariants of the tree on several threads.
+ *
+ * Does the same checks as bptree_check_invariants. The subtrees below the top levels are
+ * split into @p num_threads runs of neighboring subtrees, each checked on its own thread,
+ * and the leaf chain is then checked where the runs meet. The tree must not be modified
+ * during the check.
+ *
+ * Without BPTREE_ENABLE_THREADS, or if a thread cannot be started, the work is done on the
+ * calling thread.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param num_threads Number of threads to check the tree with (at least 1).
+ * @return True if all invariants hold, false otherwise.
+ */
+BPTREE_API bool bptree_check_invariants_parallel(const bptree *tree, int num_threads);
+
+/**
+ * @brief Checks if a key exists in the tree.
+ *
+ * Searches for the key and returns true if found.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the key to check.
+ * @return True if found, false otherwise.
+ */
+BPTREE_API bool bptree_contains(const bptree *tree, const bptree_key_t *key);
+
+/**
+ * @brief Gets the smallest key in the tree and its value.
+ *
+ * Reads the cached leftmost leaf, so no descent is needed.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param out_key Pointer to store the key (may be NULL).
+ * @param out_value Pointer to store the value (may be NULL).
+ * @return BPTREE_OK if found, BPTREE_KEY_NOT_FOUND if the tree is empty.
+ */
+BPTREE_API bptree_status bptree_min(const bptree *tree, bptree_key_t *out_key,
+                                    bptree_value_t *out_value);
+
+/**
+ * @brief Gets the largest key in the tree and its value.
+ *
+ * Reads the cached rightmost leaf, so no descent is needed.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param out_key Pointer to store the key (may be NULL).
+ * @param out_value Pointer to store the value (may be NULL).
+ * @return BPTREE_OK if found, BPTREE_KEY_NOT_FOUND if the tree is empty.
+ */
+BPTREE_API bptree_status bptree_max(const bptree *tree, bptree_key_t *out_key,
+                                    bptree_value_t *out_value);
+
+/**
+ * @brief Removes the smallest key from the tree and returns it with its value.
+ *
+ * If the leftmost leaf stays above its minimum occupancy, the entry is removed in place
+ * without a descent. Otherwise, it falls back to bptree_remove for rebalancing.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param out_key Pointer to store the removed key (may be NULL).
+ * @param out_value Pointer to store the removed value (may be NULL).
+ * @return BPTREE_OK if an entry was removed, BPTREE_KEY_NOT_FOUND if the tree is empty.
+ */
+BPTREE_API bptree_status bptree_pop_min(bptree *tree, bptree_key_t *out_key,
+                                        bptree_value_t *out_value);
+
+/**
+ * @brief Removes the largest key from the tree and returns it with its value.
+ *
+ * If the rightmost leaf stays above its minimum occupancy, the entry is removed in place
+ * without a descent. Otherwise, it falls back to bptree_remove for rebalancing.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param out_key Pointer to store the removed key (may be NULL).
+ * @param out_value Pointer to store the removed value (may be NULL).
+ * @return BPTREE_OK if an entry was removed, BPTREE_KEY_NOT_FOUND if the tree is empty.
+ */
+BPTREE_API bptree_status bptree_pop_max(bptree *tree, bptree_key_t *out_key,
+                                        bptree_value_t *out_value);
+
+/**
+ * @brief Finds the largest key that is less than or equal to @p key.
+ *
+ * Takes a single descent. If the answer lies in the previous leaf, it is reached through
+ * the left neighbor subtree recorded on the way down instead of a second descent from
+ * the root.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the search key.
+ * @param out_key Pointer to store the key found (may be NULL).
+ * @param out_value Pointer to store the value found (may be NULL).
+ * @return BPTREE_OK if such a key exists, otherwise BPTREE_KEY_NOT_FOUND.
+ */
+BPTREE_API bptree_status bptree_floor(const bptree *tree, const bptree_key_t *key,
+                                      bptree_key_t *out_key, bptree_value_t *out_value);
+
+/**
+ * @brief Finds the smallest key that is greater than or equal to @p key.
+ *
+ * Takes a single descent. If the answer lies in the next leaf, it is reached through the
+ * leaf's `next` pointer.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the search key.
+ * @param out_key Pointer to store the key found (may be NULL).
+ * @param out_value Pointer to store the value found (may be NULL).
+ * @return BPTREE_OK if such a key exists, otherwise BPTREE_KEY_NOT_FOUND.
+ */
+BPTREE_API bptree_status bptree_ceiling(const bptree *tree, const bptree_key_t *key,
+                                        bptree_key_t *out_key, bptree_value_t *out_value);
+
+/**
+ * @brief Finds the first key that is not less than @p key.
+ *
+ * Same as bptree_ceiling, named after the C++ standard library convention.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the search key.
+ * @param out_key Pointer to store the key found (may be NULL).
+ * @param out_value Pointer to store the value found (may be NULL).
+ * @return BPTREE_OK if such a key exists, otherwise BPTREE_KEY_NOT_FOUND.
+ */
+BPTREE_API bptree_status bptree_lower_bound(const bptree *tree, const bptree_key_t *key,
+                                            bptree_key_t *out_key, bptree_value_t *out_value);
+
+/**
+ * @brief Finds the first key that is greater than @p key.
+ *
+ * Same as bptree_successor, named after the C++ standard library convention.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the search key.
+ * @param out_key Pointer to store the key found (may be NULL).
+ * @param out_value Pointer to store the value found (may be NULL).
+ * @return BPTREE_OK if such a key exists, otherwise BPTREE_KEY_NOT_FOUND.
+ */
+BPTREE_API bptree_status bptree_upper_bound(const bptree *tree, const bptree_key_t *key,
+                                            bptree_key_t *out_key, bptree_value_t *out_value);
+
+/**
+ * @brief Finds the largest key that is strictly less than @p key.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the search key.
+ * @param out_key Pointer to store the key found (may be NULL).
+ * @param out_value Pointer to store the value found (may be NULL).
+ * @return BPTREE_OK if such a key exists, otherwise BPTREE_KEY_NOT_FOUND.
+ */
+BPTREE_API bptree_status bptree_predecessor(const bptree *tree, const bptree_key_t *key,
+                                            bptree_key_t *out_key, bptree_value_t *out_value);
+
+/**
+ * @brief Finds the smallest key that is strictly greater than @p key.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the search key.
+ * @param out_key Pointer to store the key found (may be NULL).
+ * @param out_value Pointer to store the value found (may be NULL).
+ * @return BPTREE_OK if such a key exists, otherwise BPTREE_KEY_NOT_FOUND.
+ */
+BPTREE_API bptree_status bptree_successor(const bptree *tree, const bptree_key_t *key,
+                                          bptree_key_t *out_key, bptree_value_t *out_value);
+
+#ifdef BPTREE_AGGREGATE_TYPE
+/**
+ * @brief Sets the monoid used for subtree aggregates.
+ *
+ * Every node keeps the aggregate of its subtree, maintained through insertions, removals,
+ * splits, borrows, and merges. Setting a monoid recomputes all aggregates in O(n);
+ * passing NULL turns the maintenance off.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param monoid Pointer to the monoid (copied), or NULL to disable aggregates.
+ * @return BPTREE_OK if successful.
+ */
+BPTREE_API bptree_status bptree_set_monoid(bptree *tree, const bptree_monoid *monoid);
+
+/**
+ * @brief Aggregates the entries with keys between start and end (inclusive).
+ *
+ * Combines the stored aggregates of the subtrees that lie fully inside the range with
+ * partial results along the two boundary paths, which takes O(max_keys * log n).
+ *
+ * @param tree Pointer to the B+ tree (a monoid must be set).
+ * @param start Starting key of the range.
+ * @param end Ending key of the range.
+ * @param out_agg Pointer to store the aggregate (the identity if the range is empty).
+ * @return BPTREE_OK if successful.
+ */
+BPTREE_API bptree_status bptree_aggregate_range(const bptree *tree, const bptree_key_t *start,
+                                                const bptree_key_t *end, bptree_agg_t *out_agg);
+#endif
+
+/**
+ * @brief Builds a new tree holding the union of the keys of two trees.
+ *
+ * Walks the leaf chains of both trees in lockstep and builds the result bottom-up.
+ * If a key is present in both trees, the value from @p a is kept.
+ * Both trees must use the same comparison function.
+ *
+ * @param a Pointer to the first B+ tree.
+ * @param b Pointer to the second B+ tree.
+ * @param out_tree Pointer to store the new tree (created with the configuration of @p a).
+ * @return BPTREE_OK if successful.
+ */
+BPTREE_API bptree_status bptree_union(const bptree *a, const bptree *b, bptree **out_tree);
+
+/**
+ * @brief Builds a new tree holding the keys present in both trees.
+ *
+ * The side that is behind skips ahead through the internal nodes when the gap between
+ * the two trees spans more than a leaf, so skewed inputs cost about O(m log n) where m
+ * is the size of the smaller tree. Values are taken from @p a.
+ *
+ * @param a Pointer to the first B+ tree.
+ * @param b Pointer to the second B+ tree.
+ * @param out_tree Pointer to store the new tree (created with the configuration of @p a).
+ * @return BPTREE_OK if successful.
+ */
+BPTREE_API bptree_status bptree_intersect(const bptree *a, const bptree *b, bptree **out_tree);
+
+/**
+ * @brief Builds a new tree holding the keys of @p a that are not present in @p b.
+ *
+ * @param a Pointer to the first B+ tree.
+ * @param b Pointer to the second B+ tree.
+ * @param out_tree Pointer to store the new tree (created with the configuration of @p a).
+ * @return BPTREE_OK if successful.
+ */
+BPTREE_API bptree_status bptree_difference(const bptree *a, const bptree *b, bptree **out_tree);
+
+/**
+ * @brief Rewrites the tree into contiguous memory at a target fill factor.
+ *
+ * Leaves and internal nodes are rebuilt in key order inside one freshly allocated slab,
+ * with `target_fill * max_keys` entries per leaf, and the old nodes are freed. Freed heap
+ * memory stays with the allocator; with BPTREE_TRIM_AFTER_COMPACT defined on glibc, a
+ * compaction that frees the old nodes right away then calls malloc_trim(0) to hand it back
+ * to the operating system (a process-wide, possibly slow call).
+ * Equivalent to calling bptree_compact_step until it is done.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param target_fill Fraction of each leaf to fill, in (0, 1].
+ * @return BPTREE_OK if successful, BPTREE_INVALID_ARGUMENT, BPTREE_MEMORY_LIMIT (see
+ *         bptree_set_budget), or BPTREE_ALLOCATION_FAILURE.
+ */
+BPTREE_API bptree_status bptree_compact(bptree *tree, double target_fill);
+
+/**
+ * @brief Performs a bounded amount of compaction work.
+ *
+ * Copies at most `max_entries` entries into the new layout per call, so compaction can
+ * be interleaved with other operations. Once every entry is copied, the internal levels
+ * of the new layout are built with the same budget, each node counting as `max_keys`
+ * entries, and the new layout replaces the old one when they are done. Entries written
+ * between two calls after they were copied are copied again before that, so compaction
+ * finishes under steady writes as long as each call copies more entries than are written
+ * between calls. Bulk changes (bptree_remove_if, bptree_set_monoid) discard the partial
+ * copy and compaction starts over.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param target_fill Fraction of each leaf to fill, in (0, 1].
+ * @param max_entries Maximum number of entries to copy in this call (at least 1).
+ * @param out_done Set to true once the compaction has finished (may be NULL).
+ * @return BPTREE_OK if successful, BPTREE_INVALID_ARGUMENT, BPTREE_MEMORY_LIMIT (see
+ *         bptree_set_budget), or BPTREE_ALLOCATION_FAILURE.
+ */
+BPTREE_API bptree_status bptree_compact_step(bptree *tree, double target_fill, int max_entries,
+                                             bool *out_done);
+
+/**
+ * @brief Turns deferred maintenance on or off.
+ *
+ * In deferred mode, structural work that could take more than O(height) is queued
+ * instead of done on the spot, and the caller runs it with bptree_do_work:
+ * - A removal that leaves a leaf underfull (but not empty) queues the leaf for rebalancing.
+ * - bptree_clear hands the old nodes to the queue to be freed a few at a time.
+ * - bptree_compact only starts the compaction; bptree_do_work copies the entries and builds
+ *   the new internal levels. A compaction dropped by bptree_clear or by starting over hands
+ *   its partial copy to the queue as well.
+ * Turning the mode off finishes all queued rebalancing and freeing first.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param enabled True to defer maintenance.
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_set_deferred(bptree *tree, bool enabled);
+
+/**
+ * @brief Runs queued maintenance work for about @p budget_ns nanoseconds.
+ *
+ * Work is done in units of O(height) or O(max_keys) each (one leaf repair, one freed
+ * node, a small batch of compaction copies, or one node of the new internal levels), and
+ * the clock is checked after every unit, so a call overshoots its budget by at most one
+ * unit. At least one unit runs per call if any work is pending. Starting a compaction
+ * costs one slab allocation, whose nodes are carved as the copy needs them, and writes
+ * made while it runs are copied again in later units rather than starting it over.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param budget_ns Time budget in nanoseconds.
+ * @return BPTREE_OK if successful, or an error from a compaction step.
+ */
+BPTREE_API bptree_status bptree_do_work(bptree *tree, int64_t budget_ns);
+
+/**
+ * @brief Gets the number of queued maintenance units.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @return Queued leaf repairs plus nodes waiting to be freed, plus one if a compaction is
+ *         in progress; zero when there is nothing left to do.
+ */
+BPTREE_API int bptree_pending_work(const bptree *tree);
+
+/**
+ * @brief Removes every entry from the tree.
+ *
+ * In deferred mode, the old nodes are freed later by bptree_do_work, so the call itself
+ * takes constant time. Otherwise, they are freed before returning.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @return BPTREE_OK if successful, BPTREE_INVALID_ARGUMENT, or BPTREE_ALLOCATION_FAILURE.
+ */
+BPTREE_API bptree_status bptree_clear(bptree *tree);
+
+/**
+ * @brief Bounds the size of the tree, turning it into an ordered cache.
+ *
+ * Once a limit is set, every bptree_put that takes the tree over it evicts entries
+ * (never the one just inserted) until the tree is back within its limits. Entries already
+ * over a new limit are evicted right away. Each evicted entry is passed to @p on_evict
+ * before it is removed, for example to write back dirty values; the callback must not
+ * modify the tree.
+ *
+ * The byte limit counts the memory of the tree's nodes, which only shrinks when evictions
+ * empty out nodes, so a tree at its byte limit may evict several entries for one
+ * insertion. Nodes inside a compaction slab count one by one, like nodes allocated alone,
+ * even though the slab itself is only freed once all its nodes are. With
+ * BPTREE_EVICT_CLOCK, bptree_get sets a reference bit on the leaf it reads, and eviction
+ * skips (and clears) referenced leaves. Insertions leave the bit alone, so a stream of
+ * new keys that are never read does not push out entries that are.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param max_entries Maximum number of entries, or 0 for no limit.
+ * @param max_bytes Maximum node memory in bytes, or 0 for no limit.
+ * @param policy Which entries to evict first.
+ * @param on_evict Function called with each evicted entry (may be NULL).
+ * @param ctx User context passed to @p on_evict.
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_set_capacity(bptree *tree, int64_t max_entries, size_t max_bytes,
+                                             bptree_eviction_policy policy,
+                                             bptree_entry_callback on_evict, void *ctx);
+
+/**
+ * @brief Gets how much node memory the tree holds, in O(1).
+ *
+ * Leaf and internal bytes count every allocated node, including nodes waiting to be freed
+ * by bptree_do_work. Slack is the part of those nodes holding no entry, key, or child
+ * pointer: free slots, the spare slot used during splits, node headers, and padding.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @return A bptree_memory structure (all zero if @p tree is NULL).
+ */
+BPTREE_API bptree_memory bptree_get_memory(const bptree *tree);
+
+/**
+ * @brief Initializes a memory budget.
+ *
+ * @param budget Pointer to the budget to initialize.
+ * @param limit Most bytes of node memory the attached trees may hold, or 0 for no limit.
+ * @param on_pressure Function called when an insertion would exceed the limit (may be NULL).
+ * @param ctx User context passed to @p on_pressure.
+ */
+BPTREE_API void bptree_budget_init(bptree_budget *budget, size_t limit,
+                                   bptree_pressure_callback on_pressure, void *ctx);
+
+/**
+ * @brief Attaches the tree to a memory budget, or detaches it.
+ *
+ * The tree's node memory is charged to the budget from then on, and is given back when
+ * the tree is detached or freed. Before an insertion allocates, bptree_put works out how
+ * many nodes it would split. If that would take the budget over its limit, `on_pressure`
+ * is called; unless it frees enough memory, the insertion fails with BPTREE_MEMORY_LIMIT
+ * and the tree is left unchanged. Insertions that fit in an existing leaf never fail.
+ *
+ * Besides bptree_put, only compaction enforces the limit: its slab and the nodes of the
+ * new layout are charged as they are allocated, and a compaction whose slab would take
+ * the budget over its limit fails with BPTREE_MEMORY_LIMIT before allocating anything.
+ * Other operations that allocate (builds, set operations) are charged but do not fail on
+ * the budget.
+ *
+ * A budget can be shared by several trees for a common limit, or used by one tree alone.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param budget Budget to attach, or NULL to detach the current one.
+ * @return BPTREE_OK if successful, BPTREE_INVALID_ARGUMENT, or BPTREE_MEMORY_LIMIT if the
+ *         tree alone would take the budget over its limit (the tree is then not attached).
+ */
+BPTREE_API bptree_status bptree_set_budget(bptree *tree, bptree_budget *budget);
+
+#ifdef BPTREE_ENABLE_TTL
+/**
+ * @brief Sets when an entry expires.
+ *
+ * Times are in nanoseconds since the Unix epoch, as returned by `timespec_get` with
+ * `TIME_UTC`. New entries never expire. An expired entry is hidden from bptree_get and
+ * bptree_contains right away, and is removed by the next bptree_expire that reaches it.
+ * Other reads (ranges, iterators, min/max, aggregates) see it until it is removed.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the key of the entry.
+ * @param expires_at Expiration time, or BPTREE_NO_EXPIRY.
+ * @return BPTREE_OK if successful, BPTREE_KEY_NOT_FOUND, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_set_expiry(bptree *tree, const bptree_key_t *key,
+                                           int64_t expires_at);
+
+/**
+ * @brief Inserts a key-value pair that expires at a given time.
+ *
+ * Like bptree_put, this replaces an expired entry that has not been swept yet, and gives
+ * it the new expiration time.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the key to insert.
+ * @param value The value associated with the key.
+ * @param expires_at Expiration time (see bptree_set_expiry).
+ * @return Status code indicating success or error type (as for bptree_put).
+ */
+BPTREE_API bptree_status bptree_put_expiring(bptree *tree, const bptree_key_t *key,
+                                             bptree_value_t value, int64_t expires_at);
+
+/**
+ * @brief Gets when an entry expires.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param key Pointer to the key of the entry.
+ * @param out_expires_at Receives the expiration time, or BPTREE_NO_EXPIRY.
+ * @return BPTREE_OK if successful, BPTREE_KEY_NOT_FOUND, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_get_expiry(const bptree *tree, const bptree_key_t *key,
+                                           int64_t *out_expires_at);
+
+/**
+ * @brief Removes entries that have expired by a given time.
+ *
+ * Every node keeps the earliest expiration time in its subtree, so the sweep descends
+ * only into subtrees holding expired entries. Removing k entries costs O(k log n),
+ * however many entries have not expired.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param now Entries with an expiration time at or before this are removed.
+ * @param max_removals Maximum number of entries to remove in this call (at least 1).
+ * @param out_removed Receives the number of entries removed (may be NULL).
+ * @return BPTREE_OK if successful, or BPTREE_INVALID_ARGUMENT.
+ */
+BPTREE_API bptree_status bptree_expire(bptree *tree, int64_t now, int max_removals,
+                                       int *out_removed);
+#endif
+
+#ifdef BPTREE_IMPLEMENTATION
+
+#if defined(BPTREE_TRIM_AFTER_COMPACT) && defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#ifdef BPTREE_ENABLE_THREADS
+#include <pthread.h>
+#endif
+#if (defined(BPTREE_ENABLE_LATENCY) || defined(BPTREE_ENABLE_TRACE)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define BPTREE_HAVE_TSC
+#endif
+#ifdef BPTREE_ENABLE_TRACE
+#include <stdatomic.h>
+#endif
+#if defined(BPTREE_ENABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BPTREE_HAVE_PROBES
+#endif
+#endif
+
+/*==============================================================================
+ * Internal Functions and Implementation Details
+ *============================================================================*/
+
+#if BPTREE_DEBUG_LEVEL > BPTREE_DEBUG_OFF
+/**
+ * @brief Print a debug message if debugging is enabled.
+ *
+ * This function wraps vprintf to add a timestamp and a tag to the debug output.
+ *
+ * @param enable Debug flag.
+ * @param fmt Format string.
+ * @param ... Additional arguments.
+ */
+static void bptree_debug_print(const bool enable, const char *fmt, ...) {
+    if (!enable) return;  // Skip if debugging is turned off
+    char time_buf[64];
+    const time_t now = time(NULL);
+    const struct tm *tm_info = localtime(&now);
+    // Format the timestamp as "YYYY-MM-DD HH:MM:SS"
+    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm_info);
+    printf("[%s] [BPTREE DEBUG] ", time_buf);
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+#endif
+
+#if BPTREE_DEBUG_LEVEL >= BPTREE_DEBUG_ERRORS
+/** @brief Print a debug message about a failure or a broken invariant. */
+#define BPTREE_LOG_ERROR(...) bptree_debug_print(__VA_ARGS__)
+#else
+#define BPTREE_LOG_ERROR(...) ((void)0)
+#endif
+#if BPTREE_DEBUG_LEVEL >= BPTREE_DEBUG_EVENTS
+/** @brief Print a debug message about a structural event (split, merge, new root, ...). */
+#define BPTREE_LOG_EVENT(...) bptree_debug_print(__VA_ARGS__)
+#else
+#define BPTREE_LOG_EVENT(...) ((void)0)
+#endif
+#if BPTREE_DEBUG_LEVEL >= BPTREE_DEBUG_STEPS
+/** @brief Print a debug message about a single step of an operation. */
+#define BPTREE_LOG_STEP(...) bptree_debug_print(__VA_ARGS__)
+#else
+#define BPTREE_LOG_STEP(...) ((void)0)
+#endif
+
+/**
+ * @brief Read the clock used for work budgets and expiration times.
+ *
+ * @return Nanoseconds since the Unix epoch.
+ */
+static int64_t bptree_now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef BPTREE_ENABLE_COUNTERS
+/** @brief Add to a counter of the tree (lookups count too, so constness is cast away). */
+#define BPTREE_COUNT(tree, field, n) ((void)(((bptree *)(tree))->counters.field += (uint64_t)(n)))
+#else
+#define BPTREE_COUNT(tree, field, n) ((void)(tree))
+#endif
+
+/*
+ * Structural events, reported as USDT probes (provider `bptree`, for example
+ * `bpftrace -e 'usdt:./app:bptree:merge { ... }'`) and to the trace ring of the tree (see
+ * bptree_set_trace). Every probe passes (tree, node, other, keys, other_keys, depth), with
+ * the fields described at bptree_trace_event. Without BPTREE_ENABLE_PROBES (or without
+ * <sys/sdt.h>) and BPTREE_ENABLE_TRACE, events compile to nothing.
+ *
+ *   Probe             Event
+ *   leaf__split       BPTREE_TRACE_LEAF_SPLIT
+ *   internal__split   BPTREE_TRACE_INTERNAL_SPLIT
+ *   root__split       BPTREE_TRACE_ROOT_SPLIT
+ *   borrow            BPTREE_TRACE_BORROW
+ *   merge             BPTREE_TRACE_MERGE
+ *   root__collapse    BPTREE_TRACE_ROOT_COLLAPSE
+ *   node__alloc       BPTREE_TRACE_NODE_ALLOC
+ *   node__free        BPTREE_TRACE_NODE_FREE
+ *   range__start      BPTREE_TRACE_RANGE_START
+ *   range__end        BPTREE_TRACE_RANGE_END
+ */
+#ifdef BPTREE_HAVE_PROBES
+#define BPTREE_PROBE(probe, ...) DTRACE_PROBE6(bptree, probe, __VA_ARGS__)
+#else
+#define BPTREE_PROBE(probe, ...) ((void)0)
+#endif
+#ifdef BPTREE_ENABLE_TRACE
+#define BPTREE_TRACE(...) bptree_trace_emit(__VA_ARGS__)
+#else
+#define BPTREE_TRACE(...) ((void)0)
+#endif
+/** @brief Report a structural event (see the list above). */
+#define BPTREE_EVENT(tree, event, probe, node, other, keys, other_keys, depth)          \
+    do {                                                                                \
+        BPTREE_PROBE(probe, tree, node, other, keys, other_keys, depth);                \
+        BPTREE_TRACE(tree, BPTREE_TRACE_##event, node, other, keys, other_keys, depth); \
+    } while (0)
+
+#ifdef BPTREE_ENABLE_LATENCY
+/**
+ * @brief Latency sampling state of a tree.
+ */
+struct bptree_latency {
+    uint32_t every;       /**< Sampling period */
+    uint32_t countdown;   /**< Operations left until the next sample */
+    uint64_t start_ticks; /**< Timer reading when sampling started (for calibration) */
+    int64_t start_ns;     /**< Clock reading when sampling started */
+    bool in_call;         /**< Set during a public call; the calls it makes are not sampled */
+    bool timing;          /**< Set while the running call is being timed */
+    bool leaf_split;      /**< Set when the timed operation splits a leaf */
+    bool rebalanced;      /**< Set when the timed operation rebalances after a removal */
+    bptree_latency_histogram ops[BPTREE_OP_KINDS]; /**< Histogram per operation kind */
+};
+
+/** @brief Record that an operation restructured the tree, for its latency outcome. */
+#define BPTREE_LATENCY_NOTE(tree, event) \
+    ((void)((tree)->latency && ((tree)->latency->event = true)))
+#else
+#define BPTREE_LATENCY_NOTE(tree, event) ((void)(tree))
+#endif
+
+#ifdef BPTREE_ENABLE_HEATMAP
+/**
+ * @brief Heat of a leaf, with the halvings it has missed applied.
+ *
+ * @param tree Pointer to the tree.
+ * @param leaf Pointer to the leaf.
+ * @return The current heat of the leaf.
+ */
+static uint32_t bptree_heat_of(const bptree *tree, const bptree_node *leaf) {
+    const uint32_t age = tree->heat_epoch - leaf->heat_epoch;
+    return age >= 32 ? 0 : leaf->heat >> age;
+}
+
+/**
+ * @brief Count an access to a leaf, and halve every heat when the half-life is reached.
+ *
+ * @param tree Pointer to the tree.
+ * @param leaf Pointer to the leaf.
+ */
+static void bptree_heat_touch(const bptree *tree, bptree_node *leaf) {
+    bptree *mutable_tree = (bptree *)tree;
+    const uint32_t heat = bptree_heat_of(tree, leaf);
+    leaf->heat = heat < UINT32_MAX ? heat + 1 : heat;
+    leaf->heat_epoch = tree->heat_epoch;
+    if (tree->heat_half_life > 0 && ++mutable_tree->heat_accesses >= tree->heat_half_life) {
+        mutable_tree->heat_accesses = 0;
+        mutable_tree->heat_epoch++;
+    }
+}
+
+/**
+ * @brief Share the heat of a leaf that was just split with its new right half.
+ *
+ * @param tree Pointer to the tree.
+ * @param leaf Pointer to the left half.
+ * @param new_leaf Pointer to the right half.
+ */
+static void bptree_heat_split(const bptree *tree, bptree_node *leaf, bptree_node *new_leaf) {
+    const uint32_t heat = bptree_heat_of(tree, leaf);
+    new_leaf->heat = heat / 2;
+    leaf->heat = heat - new_leaf->heat;
+    leaf->heat_epoch = new_leaf->heat_epoch = tree->heat_epoch;
+}
+
+/**
+ * @brief Add the heat of a leaf to the leaf it is merged into.
+ *
+ * @param tree Pointer to the tree.
+ * @param into Pointer to the leaf that is kept.
+ * @param from Pointer to the leaf that is merged away.
+ */
+static void bptree_heat_merge(const bptree *tree, bptree_node *into, const bptree_node *from) {
+    const uint64_t heat = (uint64_t)bptree_heat_of(tree, into) + bptree_heat_of(tree, from);
+    into->heat = heat < UINT32_MAX ? (uint32_t)heat : UINT32_MAX;
+    into->heat_epoch = tree->heat_epoch;
+}
+
+#define BPTREE_HEAT_TOUCH(tree, leaf) bptree_heat_touch(tree, leaf)
+#define BPTREE_HEAT_SPLIT(tree, leaf, new_leaf) bptree_heat_split(tree, leaf, new_leaf)
+#define BPTREE_HEAT_MERGE(tree, into, from) bptree_heat_merge(tree, into, from)
+#else
+#define BPTREE_HEAT_TOUCH(tree, leaf) ((void)0)
+#define BPTREE_HEAT_SPLIT(tree, leaf, new_leaf) ((void)0)
+#define BPTREE_HEAT_MERGE(tree, into, from) ((void)0)
+#endif
+
+#if defined(BPTREE_ENABLE_LATENCY) || defined(BPTREE_ENABLE_TRACE)
+/**
+ * @brief Read the timer used for latencies and trace records.
+ *
+ * @return The time-stamp counter where there is one, otherwise nanoseconds.
+ */
+static uint64_t bptree_ticks(void) {
+#ifdef BPTREE_HAVE_TSC
+    return (uint64_t)__rdtsc();
+#else
+    return (uint64_t)bptree_now_ns();
+#endif
+}
+
+/**
+ * @brief Measure the length of a timer tick against the clock.
+ *
+ * @param start_ticks Timer reading at the start of the measurement.
+ * @param start_ns Clock reading taken with @p start_ticks.
+ * @return Nanoseconds per tick (0 if no time has passed yet).
+ */
+static double bptree_ns_per_tick(const uint64_t start_ticks, const int64_t start_ns) {
+#ifdef BPTREE_HAVE_TSC
+    const uint64_t ticks = bptree_ticks() - start_ticks;
+    const int64_t ns = bptree_now_ns() - start_ns;
+    return ticks > 0 && ns > 0 ? (double)ns / (double)ticks : 0.0;
+#else
+    (void)start_ticks;
+    (void)start_ns;
+    return 1.0;
+#endif
+}
+#endif
+
+#ifdef BPTREE_ENABLE_TRACE
+/** @brief Attempts bptree_trace_read makes at a slot a writer is filling before skipping it. */
+#define BPTREE_TRACE_READ_TRIES 4
+
+/** @brief Number of 64-bit words in a trace record. */
+#define BPTREE_TRACE_WORDS (sizeof(bptree_trace_record) / sizeof(uint64_t))
+_Static_assert(sizeof(bptree_trace_record) % sizeof(uint64_t) == 0,
+               "Trace records must be a whole number of words");
+
+/**
+ * @brief Slot of a trace ring.
+ *
+ * The slot works as a seqlock: the record is stored word by word with atomic stores, so a
+ * reader copying it while a writer fills it sees a changed `seq` instead of racing.
+ */
+typedef struct bptree_trace_slot {
+    _Atomic uint64_t seq;                       /**< Sequence number plus one (0 while written) */
+    _Atomic uint64_t words[BPTREE_TRACE_WORDS]; /**< The record */
+} bptree_trace_slot;
+
+/**
+ * @brief Trace ring of a tree.
+ */
+struct bptree_trace {
+    _Atomic uint64_t head;     /**< Number of events recorded so far */
+    uint64_t mask;             /**< Capacity minus one (the capacity is a power of two) */
+    uint64_t start_ticks;      /**< Timer reading when tracing started */
+    int64_t start_ns;          /**< Clock reading when tracing started */
+    bptree_trace_slot slots[]; /**< Records, indexed by sequence number modulo capacity */
+};
+
+/**
+ * @brief Append an event to the trace ring of a tree, if it has one.
+ *
+ * @param tree Pointer to the tree.
+ * @param event Event kind.
+ * @param node Node the event is about.
+ * @param other Second node, or NULL.
+ * @param keys Keys in @p node.
+ * @param other_keys Keys in @p other.
+ * @param depth Depth of @p node, or -1.
+ */
+static void bptree_trace_emit(const bptree *tree, const bptree_trace_event event,
+                              const void *node, const void *other, const int keys,
+                              const int other_keys, const int depth) {
+    bptree_trace *trace = tree->trace;
+    if (!trace) return;
+    const uint64_t seq = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed);
+    bptree_trace_slot *slot = &trace->slots[seq & trace->mask];
+    // Readers skip the slot until the new sequence number is published.
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    bptree_trace_record record;
+    record.seq = seq;
+    record.ticks = bptree_ticks();
+    record.node = (uint64_t)(uintptr_t)node;
+    record.other = (uint64_t)(uintptr_t)other;
+    record.keys = keys;
+    record.other_keys = other_keys;
+    record.depth = (int16_t)depth;
+    record.event = (uint16_t)event;
+    record.reserved = 0;
+    uint64_t words[BPTREE_TRACE_WORDS];
+    memcpy(words, &record, sizeof(record));
+    for (size_t i = 0; i < BPTREE_TRACE_WORDS; i++) {
+        atomic_store_explicit(&slot->words[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+#endif
+
+#ifdef BPTREE_ENABLE_LATENCY
+/**
+ * @brief Start a public call and decide whether to time it.
+ *
+ * Only the outermost call counts: a removal made by an eviction or a repair inside
+ * another call is part of that call, so it neither takes a sample nor clears the
+ * outcome flags of the call being timed.
+ *
+ * @param tree Pointer to the tree (may be NULL).
+ * @param start Receives the timer reading if the operation is timed.
+ * @return True if this is the outermost call and sampling is on; bptree_latency_end
+ *         must then be called when the operation is done.
+ */
+static bool bptree_latency_begin(const bptree *tree, uint64_t *start) {
+    bptree_latency *latency = tree ? tree->latency : NULL;
+    if (!latency || latency->in_call) return false;
+    latency->in_call = true;
+    *start = 0;
+    latency->timing = --latency->countdown == 0;
+    if (!latency->timing) return true;
+    latency->countdown = latency->every;
+    latency->leaf_split = false;
+    latency->rebalanced = false;
+    *start = bptree_ticks();
+    return true;
+}
+
+/**
+ * @brief Find the histogram bucket of a duration.
+ *
+ * @param ticks Duration in timer ticks.
+ * @return Bucket index.
+ */
+static int bptree_latency_bucket(const uint64_t ticks) {
+    if (ticks < (1u << BPTREE_LATENCY_SUB_BITS)) return (int)ticks;
+    int msb = 63;
+    while (!(ticks >> msb)) msb--;
+    const int shift = msb - BPTREE_LATENCY_SUB_BITS;
+    const uint64_t sub = (ticks >> shift) & ((1u << BPTREE_LATENCY_SUB_BITS) - 1);
+    return ((shift + 1) << BPTREE_LATENCY_SUB_BITS) + (int)sub;
+}
+
+/**
+ * @brief Finish a call started with bptree_latency_begin, counting it in the histogram of
+ * its kind if it was timed.
+ *
+ * @param tree Pointer to the tree.
+ * @param op Operation kind.
+ * @param start Timer reading from bptree_latency_begin.
+ */
+static void bptree_latency_end(const bptree *tree, const bptree_op_kind op, const uint64_t start) {
+    bptree_latency *latency = tree->latency;
+    latency->in_call = false;
+    if (!latency->timing) return;
+    const uint64_t end = bptree_ticks();
+    // The time-stamp counters of different cores may disagree slightly.
+    const uint64_t ticks = end > start ? end - start : 0;
+    bptree_latency_histogram *hist = &latency->ops[op];
+    hist->samples++;
+    hist->total_ticks += ticks;
+    if (ticks > hist->max_ticks) hist->max_ticks = ticks;
+    hist->buckets[bptree_latency_bucket(ticks)]++;
+}
+#endif
+
+/**
+ * @brief Find the longest duration a histogram bucket holds.
+ *
+ * @param bucket Bucket index.
+ * @return Duration in timer ticks.
+ */
+static uint64_t bptree_latency_bucket_max(const int bucket) {
+    if (bucket < (1 << BPTREE_LATENCY_SUB_BITS)) return (uint64_t)bucket;
+    const int shift = (bucket >> BPTREE_LATENCY_SUB_BITS) - 1;
+    const uint64_t top = (uint64_t)(bucket & ((1 << BPTREE_LATENCY_SUB_BITS) - 1)) +
+                         (1u << BPTREE_LATENCY_SUB_BITS) + 1;
+    // Wraps around to the largest duration for the last bucket.
+    return (top << shift) - 1;
+}
+
+/**
+ * @brief Shift bytes within a node (memmove), adding them to the tree's counters.
+ *
+ * @param tree Pointer to the tree.
+ * @param dst Destination.
+ * @param src Source, which may overlap @p dst.
+ * @param bytes Number of bytes.
+ */
+static void bptree_move_bytes(const bptree *tree, void *dst, const void *src, const size_t bytes) {
+    BPTREE_COUNT(tree, bytes_moved, bytes);
+    memmove(dst, src, bytes);
+}
+
+/**
+ * @brief Copy bytes between nodes (memcpy), adding them to the tree's counters.
+ *
+ * @param tree Pointer to the tree.
+ * @param dst Destination.
+ * @param src Source, which must not overlap @p dst.
+ * @param bytes Number of bytes.
+ */
+static void bptree_copy_bytes(const bptree *tree, void *dst, const void *src, const size_t bytes) {
+    BPTREE_COUNT(tree, bytes_moved, bytes);
+    memcpy(dst, src, bytes);
+}
+
+/**
+ * @brief Compute the size of the keys area within a node.
+ *
+ * This function calculates the size needed to store all keys (max_keys+1)
+ * and any padding required to meet the alignment of the values or child pointers.
+ *
+ * @param max_keys Maximum number of keys per node.
+ * @return Size in bytes required for the keys area.
+ */
+static size_t bptree_keys_area_size(const int max_keys) {
+    const size_t keys_size = (size_t)(max_keys + 1) * sizeof(bptree_key_t);
+    const size_t req_align =
+        (sizeof(bptree_value_t) > sizeof(bptree_node *) ? sizeof(bptree_value_t)
+                                                        : sizeof(bptree_node *));
+    // Calculate required padding to meet alignment constraints
+    const size_t pad = (req_align - (keys_size % req_align)) % req_align;
+    return keys_size + pad;
+}
+
+/**
+ * @brief Get pointer to keys in a node.
+ *
+ * Returns a pointer where the keys are stored in the node's flexible array.
+ *
+ * @param node Pointer to the node.
+ * @return Pointer to the key array.
+ */
+static bptree_key_t *bptree_node_keys(const bptree_node *node) {
+    return (bptree_key_t *)node->data;
+}
+
+/**
+ * @brief Get pointer to values stored in a leaf node.
+ *
+ * Computes the starting address of the values area within the node.
+ *
+ * @param node Pointer to the node.
+ * @param max_keys Maximum keys per node.
+ * @return Pointer to the values array.
+ */
+static bptree_value_t *bptree_node_values(bptree_node *node, const int max_keys) {
+    const size_t offset = bptree_keys_area_size(max_keys);
+    return (bptree_value_t *)(node->data + offset);
+}
+
+/**
+ * @brief Get pointer to child pointers in an internal node.
+ *
+ * Computes the starting address of the children area within the node.
+ *
+ * @param node Pointer to the node.
+ * @param max_keys Maximum keys per node.
+ * @return Pointer to the array of child node pointers.
+ */
+static bptree_node **bptree_node_children(bptree_node *node, const int max_keys) {
+    const size_t offset = bptree_keys_area_size(max_keys);
+    return (bptree_node **)(node->data + offset);
+}
+
+#ifdef BPTREE_ENABLE_TTL
+/**
+ * @brief Compute the offset of the expiration times within a leaf's data area.
+ *
+ * @param max_keys Maximum keys per node.
+ * @return Offset in bytes, aligned for int64_t.
+ */
+static size_t bptree_expiries_offset(const int max_keys) {
+    const size_t end = bptree_keys_area_size(max_keys) +
+                       (size_t)(max_keys + 1) * sizeof(bptree_value_t);
+    return (end + alignof(int64_t) - 1) & ~(alignof(int64_t) - 1);
+}
+
+/**
+ * @brief Get pointer to the expiration times stored in a leaf node (after the values).
+ *
+ * @param node Pointer to the leaf.
+ * @param max_keys Maximum keys per node.
+ * @return Pointer to the expiration time array.
+ */
+static int64_t *bptree_node_expiries(bptree_node *node, const int max_keys) {
+    return (int64_t *)(node->data + bptree_expiries_offset(max_keys));
+}
+#endif
+
+/**
+ * @brief Copy the per-entry data kept beside keys and values between leaves.
+ *
+ * With BPTREE_ENABLE_TTL defined, this moves expiration times (overlapping ranges are
+ * fine). Otherwise it does nothing. Call it wherever leaf entries are moved.
+ *
+ * @param tree Pointer to the tree.
+ * @param dst Destination leaf.
+ * @param dst_idx First entry index in the destination.
+ * @param src Source leaf.
+ * @param src_idx First entry index in the source.
+ * @param n Number of entries.
+ */
+static void bptree_leaf_move_extras(const bptree *tree, bptree_node *dst, const int dst_idx,
+                                    bptree_node *src, const int src_idx, const int n) {
+#ifdef BPTREE_ENABLE_TTL
+    if (n <= 0) return;
+    bptree_move_bytes(tree, bptree_node_expiries(dst, tree->max_keys) + dst_idx,
+                      bptree_node_expiries(src, tree->max_keys) + src_idx,
+                      (size_t)n * sizeof(int64_t));
+#else
+    (void)tree;
+    (void)dst;
+    (void)dst_idx;
+    (void)src;
+    (void)src_idx;
+    (void)n;
+#endif
+}
+
+/**
+ * @brief Reset the per-entry data of a new leaf entry (it never expires).
+ *
+ * @param tree Pointer to the tree.
+ * @param leaf Pointer to the leaf.
+ * @param idx Index of the new entry.
+ */
+static void bptree_leaf_init_extras(const bptree *tree, bptree_node *leaf, const int idx) {
+#ifdef BPTREE_ENABLE_TTL
+    bptree_node_expiries(leaf, tree->max_keys)[idx] = BPTREE_NO_EXPIRY;
+#else
+    (void)tree;
+    (void)leaf;
+    (void)idx;
+#endif
+}
+
+#ifdef BPTREE_KEY_TYPE_STRING
+/**
+ * @brief Default key comparison for string keys.
+ *
+ * Compares two keys as fixed-size strings.
+ *
+ * @param a Pointer to the first key.
+ * @param b Pointer to the second key.
+ * @return Comparison result similar to memcmp.
+ */
+static inline int bptree_default_compare(const bptree_key_t *a, const bptree_key_t *b) {
+    return memcmp(a->data, b->data, BPTREE_KEY_SIZE);
+}
+#else
+/**
+ * @brief Default key comparison for numeric keys.
+ *
+ * Compares two numeric keys.
+ *
+ * @param a Pointer to the first key.
+ * @param b Pointer to the second key.
+ * @return -1 if *a < *b, 1 if *a > *b, or 0 if equal.
+ */
+static int bptree_default_compare(const bptree_key_t *a, const bptree_key_t *b) {
+    return (*a < *b) ? -1 : ((*a > *b) ? 1 : 0);
+}
+#endif
+
+/**
+ * @brief Find the smallest key in a subtree.
+ *
+ * Walks down the leftmost branch until a leaf is reached.
+ *
+ * @param node Pointer to the current node.
+ * @param max_keys Maximum keys per node.
+ * @return The smallest key found.
+ */
+static bptree_key_t bptree_find_smallest_key(bptree_node *node, const int max_keys) {
+    assert(node != NULL);
+    while (!node->is_leaf) {
+        assert(node->num_keys >= 0);
+        node = bptree_node_children(node, max_keys)[0];
+        assert(node != NULL);
+    }
+    assert(node->num_keys > 0);
+    return bptree_node_keys(node)[0];
+}
+
+/**
+ * @brief A node waiting to be checked, with the key range its subtree must stay within.
+ */
+typedef struct bptree_check_frame {
+    bptree_node *node;      /**< Node to check */
+    const bptree_key_t *lo; /**< Inclusive lower bound of the keys below, or NULL */
+    const bptree_key_t *hi; /**< Exclusive upper bound of the keys below, or NULL */
+    int next_child;         /**< Next child to visit, or -1 if the node is not checked yet */
+} bptree_check_frame;
+
+/**
+ * @brief State of an invariant check over a run of consecutive subtrees.
+ */
+typedef struct bptree_check_job {
+    const bptree *tree;                     /**< Tree being checked */
+    const bptree_check_frame *roots;        /**< Subtrees to check, in key order */
+    int num_roots;                          /**< Number of subtrees */
+    int depth;                              /**< Depth of the subtree roots */
+    bool ok;                                /**< False once a check has failed */
+    int64_t entries;                        /**< Entries found in the leaves */
+    int64_t level_nodes[BPTREE_MAX_LEVELS]; /**< Nodes found per level */
+    bptree_node *first_leaf;                /**< Leftmost leaf found */
+    bptree_node *last_leaf;                 /**< Rightmost leaf found so far */
+#ifdef BPTREE_ENABLE_THREADS
+    pthread_t thread; /**< Thread running the job */
+    bool started;     /**< True if the job runs on its own thread */
+#endif
+} bptree_check_job;
+
+/**
+ * @brief Tell whether a queued deferred repair leads to a leaf.
+ *
+ * Descends from the root with each pending repair key. The descent does not add to the
+ * counters, so checking threads may run it at the same time.
+ *
+ * @param tree Pointer to the tree.
+ * @param leaf Pointer to the leaf.
+ * @return True if a pending repair will rebalance @p leaf.
+ */
+static bool bptree_check_repair_pending(const bptree *tree, const bptree_node *leaf) {
+    for (int r = tree->repair_head; r < tree->repair_len; r++) {
+        const bptree_key_t *key = &tree->repair_keys[r];
+        bptree_node *node = tree->root;
+        while (!node->is_leaf) {
+            const bptree_key_t *keys = bptree_node_keys(node);
+            int low = 0, high = node->num_keys;
+            while (low < high) {
+                const int mid = low + (high - low) / 2;
+                if (tree->compare(key, &keys[mid]) < 0) {
+                    high = mid;
+                } else {
+                    low = mid + 1;
+                }
+            }
+            node = bptree_node_children(node, tree->max_keys)[low];
+        }
+        if (node == leaf) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Check the invariants that only involve a single node.
+ *
+ * Verifies the level, key order, occupancy limits, and child pointers of the node.
+ *
+ * @param tree Pointer to the tree.
+ * @param node Pointer to the node.
+ * @param depth Depth of the node in the tree.
+ * @return True if the invariants pass, false if any check fails.
+ */
+static bool bptree_check_node(const bptree *tree, bptree_node *node, const int depth) {
+    if (!node) return false;
+    const bptree_key_t *keys = bptree_node_keys(node);
+    const bool is_root = (tree->root == node);
+    if (depth >= tree->height || node->level != tree->height - 1 - depth) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Node %p has level %d at depth %d\n",
+                         (void *)node, node->level, depth);
+        return false;
+    }
+    if (node->is_leaf != (node->level == 0)) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Leaf depth mismatch for node %p\n",
+                         (void *)node);
+        return false;
+    }
 
     // Check that keys are in sorted order.
     for (int i = 1; i < node->num_keys; i++) {
         if (tree->compare(&keys[i - 1], &keys[i]) >= 0) {
-            bptree_debug_print(tree->enable_debug, "Invariant Fail: Keys not sorted in node %p\n",
-                               (void *)node);
+            BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Keys not sorted in node %p\n",
+                             (void *)node);
+            return false;
+        }
+    }
+
+    if (node->is_leaf) {
+        // Check occupancy bounds for non-root leaf nodes. A leaf queued for repair in
+        // deferred mode may be underfull until bptree_do_work gets to it.
+        int min_keys = tree->min_leaf_keys;
+        if (!is_root && node->num_keys < min_keys && bptree_check_repair_pending(tree, node)) {
+            min_keys = 1;
+        }
+        if (!is_root && (node->num_keys < min_keys || node->num_keys > tree->max_keys)) {
+            BPTREE_LOG_ERROR(
+                tree->enable_debug,
+                "Invariant Fail: Leaf node %p key count out of range [%d, %d] (%d keys)\n",
+                (void *)node, min_keys, tree->max_keys, node->num_keys);
+            return false;
+        }
+        if (is_root && node->num_keys > tree->max_keys) {
+            BPTREE_LOG_ERROR(tree->enable_debug,
+                             "Invariant Fail: Root leaf node %p key count > max_keys (%d > %d)\n",
+                             (void *)node, node->num_keys, tree->max_keys);
+            return false;
+        }
+    } else {
+        // For internal nodes, check occupancy constraints.
+        if (!is_root &&
+            (node->num_keys < tree->min_internal_keys || node->num_keys > tree->max_keys)) {
+            BPTREE_LOG_ERROR(
+                tree->enable_debug,
+                "Invariant Fail: Internal node %p key count out of range [%d, %d] (%d keys)\n",
+                (void *)node, tree->min_internal_keys, tree->max_keys, node->num_keys);
+            return false;
+        }
+        if (is_root && (node->num_keys < 1 || node->num_keys > tree->max_keys)) {
+            BPTREE_LOG_ERROR(tree->enable_debug,
+                             "Invariant Fail: Internal root node %p key count out of range "
+                             "[1, %d] (%d keys)\n",
+                             (void *)node, tree->max_keys, node->num_keys);
             return false;
         }
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            if (!children[i]) {
+                BPTREE_LOG_ERROR(tree->enable_debug,
+                                 "Invariant Fail: Internal node %p missing child[%d]\n",
+                                 (void *)node, i);
+                return false;
+            }
+        }
+    }
+#ifdef BPTREE_ENABLE_TTL
+    // Check that the node's earliest expiration time matches its entries or children.
+    int64_t min_expiry = BPTREE_NO_EXPIRY;
+    for (int i = 0; i < node->num_keys + !node->is_leaf; i++) {
+        const int64_t e = node->is_leaf ? bptree_node_expiries(node, tree->max_keys)[i]
+                                        : bptree_node_children(node, tree->max_keys)[i]->min_expiry;
+        if (e < min_expiry) min_expiry = e;
+    }
+    if (node->min_expiry != min_expiry) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Stale min expiry in node %p\n",
+                         (void *)node);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief Check that one leaf follows another in the leaf chain.
+ *
+ * @param tree Pointer to the tree.
+ * @param prev Pointer to the earlier leaf.
+ * @param leaf Pointer to the leaf that should come right after @p prev.
+ * @return True if @p prev links to @p leaf and all its keys are smaller.
+ */
+static bool bptree_check_link(const bptree *tree, const bptree_node *prev,
+                              const bptree_node *leaf) {
+    if (prev->next != leaf) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Leaf %p links to %p, not %p\n",
+                         (void *)prev, (void *)prev->next, (void *)leaf);
+        return false;
+    }
+    if (prev->num_keys > 0 && leaf->num_keys > 0 &&
+        tree->compare(&bptree_node_keys(prev)[prev->num_keys - 1], &bptree_node_keys(leaf)[0]) >=
+            0) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Leaf chain out of order at %p\n",
+                         (void *)leaf);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Check a leaf against the separators above it and the leaf visited before it.
+ *
+ * @param job Job the leaf belongs to.
+ * @param frame The leaf and the key range given by its ancestors.
+ * @return True if the invariants pass, false if any check fails.
+ */
+static bool bptree_check_leaf(bptree_check_job *job, const bptree_check_frame *frame) {
+    const bptree *tree = job->tree;
+    bptree_node *leaf = frame->node;
+    const bptree_key_t *keys = bptree_node_keys(leaf);
+    if (leaf->num_keys > 0 &&
+        ((frame->lo && tree->compare(&keys[0], frame->lo) < 0) ||
+         (frame->hi && tree->compare(&keys[leaf->num_keys - 1], frame->hi) >= 0))) {
+        BPTREE_LOG_ERROR(tree->enable_debug,
+                         "Invariant Fail: Leaf %p has keys outside its separators\n",
+                         (void *)leaf);
+        return false;
+    }
+    if (!job->last_leaf) {
+        job->first_leaf = leaf;
+    } else if (!bptree_check_link(tree, job->last_leaf, leaf)) {
+        return false;
+    }
+    job->last_leaf = leaf;
+    job->entries += leaf->num_keys;
+    return true;
+}
+
+/**
+ * @brief Check the subtrees of a job in one depth-first pass.
+ *
+ * Each child is given the key range between the separators on either side of it, so every
+ * leaf is checked against all of its ancestors without looking at any node twice.
+ *
+ * @param job Job to run.
+ */
+static void bptree_check_job_walk(bptree_check_job *job) {
+    const bptree *tree = job->tree;
+    bptree_check_frame stack[BPTREE_MAX_LEVELS];
+    for (int r = 0; r < job->num_roots && job->ok; r++) {
+        int top = 0;
+        stack[0] = job->roots[r];
+        stack[0].next_child = -1;
+        while (top >= 0) {
+            bptree_check_frame *frame = &stack[top];
+            bptree_node *node = frame->node;
+            if (frame->next_child < 0) {
+                if (!bptree_check_node(tree, node, job->depth + top)) {
+                    job->ok = false;
+                    return;
+                }
+                job->level_nodes[node->level]++;
+                if (node->is_leaf) {
+                    if (!bptree_check_leaf(job, frame)) {
+                        job->ok = false;
+                        return;
+                    }
+                    top--;
+                    continue;
+                }
+                frame->next_child = 0;
+            }
+            if (frame->next_child > node->num_keys) {
+                top--;
+                continue;
+            }
+            const int i = frame->next_child++;
+            const bptree_key_t *keys = bptree_node_keys(node);
+            stack[top + 1] = (bptree_check_frame){
+                .node = bptree_node_children(node, tree->max_keys)[i],
+                .lo = i > 0 ? &keys[i - 1] : frame->lo,
+                .hi = i < node->num_keys ? &keys[i] : frame->hi,
+                .next_child = -1};
+            top++;
+        }
+    }
+}
+
+#ifdef BPTREE_ENABLE_THREADS
+/**
+ * @brief Thread entry point of a bptree_check_invariants_parallel job.
+ *
+ * @param arg Pointer to the bptree_check_job to run.
+ * @return NULL.
+ */
+static void *bptree_check_job_run(void *arg) {
+    bptree_check_job_walk(arg);
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Calculate the total allocation size needed for a node.
+ *
+ * Determines the memory required for a node including its header,
+ * keys area, and either the child pointers area (for internals) or the values area (for leaves).
+ *
+ * @param tree Pointer to the tree structure.
+ * @param is_leaf True if node is a leaf.
+ * @return Size in bytes required for the node allocation.
+ */
+static size_t bptree_node_alloc_size(const bptree *tree, const bool is_leaf) {
+    const int max_keys = tree->max_keys;
+    const size_t keys_area_sz = bptree_keys_area_size(max_keys);
+    size_t data_payload_size;
+    if (is_leaf) {
+        data_payload_size = (size_t)(max_keys + 1) * sizeof(bptree_value_t);
+#ifdef BPTREE_ENABLE_TTL
+        data_payload_size = bptree_expiries_offset(max_keys) - keys_area_sz +
+                            (size_t)(max_keys + 1) * sizeof(int64_t);
+#endif
+    } else {
+        data_payload_size = (size_t)(max_keys + 2) * sizeof(bptree_node *);
+    }
+    const size_t total_data_size = keys_area_sz + data_payload_size;
+    return sizeof(bptree_node) + total_data_size;
+}
+
+/**
+ * @brief Compute the alignment a node needs.
+ *
+ * @param is_leaf True for a leaf node.
+ * @return Alignment in bytes.
+ */
+static size_t bptree_node_align(const bool is_leaf) {
+    size_t max_align = alignof(bptree_node);
+    max_align = (max_align > alignof(bptree_key_t)) ? max_align : alignof(bptree_key_t);
+    if (is_leaf) {
+        max_align = (max_align > alignof(bptree_value_t)) ? max_align : alignof(bptree_value_t);
+#ifdef BPTREE_ENABLE_TTL
+        max_align = (max_align > alignof(int64_t)) ? max_align : alignof(int64_t);
+#endif
+    } else {
+        max_align = (max_align > alignof(bptree_node *)) ? max_align : alignof(bptree_node *);
+    }
+    return max_align;
+}
+
+/**
+ * @brief Compute the allocation size of a node, rounded up to a multiple of its alignment.
+ *
+ * @param tree Pointer to the tree structure.
+ * @param is_leaf True for a leaf node.
+ * @return Size in bytes.
+ */
+static size_t bptree_node_stride(const bptree *tree, const bool is_leaf) {
+    const size_t max_align = bptree_node_align(is_leaf);
+    const size_t size = bptree_node_alloc_size(tree, is_leaf);
+    return (size + max_align - 1) & ~(max_align - 1);
+}
+
+/**
+ * @brief Compute the memory of a tree's nodes, counting slab nodes one by one.
+ *
+ * @param tree Pointer to the tree.
+ * @return Bytes of all leaves and internal nodes the tree holds.
+ */
+static size_t bptree_live_node_bytes(const bptree *tree) {
+    return (size_t)tree->leaf_nodes * bptree_node_stride(tree, true) +
+           (size_t)tree->internal_nodes * bptree_node_stride(tree, false);
+}
+
+/**
+ * @brief Record node memory taken by a tree, charging its budget if it has one.
+ *
+ * @param tree Pointer to the tree.
+ * @param bytes Number of bytes allocated.
+ */
+static void bptree_charge(bptree *tree, const size_t bytes) {
+    tree->node_bytes += bytes;
+    if (tree->budget) tree->budget->used += bytes;
+}
+
+/**
+ * @brief Record node memory given back by a tree, crediting its budget if it has one.
+ *
+ * @param tree Pointer to the tree.
+ * @param bytes Number of bytes freed.
+ */
+static void bptree_uncharge(bptree *tree, const size_t bytes) {
+    tree->node_bytes -= bytes;
+    if (tree->budget) tree->budget->used -= bytes;
+}
+
+/** @brief Level of nodes not counted in `level_nodes` (slab spares, detached garbage). */
+#define BPTREE_NO_LEVEL UINT8_MAX
+
+/**
+ * @brief Give a node its level in the tree, moving it between the per-level counts.
+ *
+ * @param tree Pointer to the tree.
+ * @param node Pointer to the node.
+ * @param level Height above the leaves.
+ */
+static void bptree_node_set_level(bptree *tree, bptree_node *node, const int level) {
+    assert(level < BPTREE_MAX_LEVELS);
+    if (node->level != BPTREE_NO_LEVEL) tree->level_nodes[node->level]--;
+    node->level = (uint8_t)level;
+    tree->level_nodes[level]++;
+}
+
+/**
+ * @brief Allocate a new node.
+ *
+ * Allocates memory for a node (leaf or internal) with proper alignment.
+ *
+ * @param tree Pointer to the tree.
+ * @param level Height of the node above the leaves (0 for a leaf).
+ * @return Pointer to the allocated node, or NULL on failure.
+ */
+static bptree_node *bptree_node_alloc(bptree *tree, const int level) {
+    const bool is_leaf = level == 0;
+    const size_t max_align = bptree_node_align(is_leaf);
+    const size_t size = bptree_node_stride(tree, is_leaf);
+    bptree_node *node = aligned_alloc(max_align, size);
+    if (node) {
+        bptree_charge(tree, size);
+        if (is_leaf) {
+            tree->leaf_nodes++;
+        } else {
+            tree->internal_nodes++;
+        }
+        node->is_leaf = is_leaf;
+        node->in_slab = false;
+        node->referenced = false;
+        node->level = BPTREE_NO_LEVEL;
+        bptree_node_set_level(tree, node, level);
+        node->num_keys = 0;
+        node->next = NULL;
+#ifdef BPTREE_ENABLE_TTL
+        node->min_expiry = BPTREE_NO_EXPIRY;
+#endif
+#ifdef BPTREE_ENABLE_HEATMAP
+        node->heat = 0;
+        node->heat_epoch = 0;
+#endif
+        BPTREE_EVENT(tree, NODE_ALLOC, node__alloc, node, NULL, is_leaf, 0, -1);
+    } else {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Node allocation failed (size: %zu, align: %zu)\n",
+                         size, max_align);
+    }
+    return node;
+}
+
+/**
+ * @brief Release the memory of a single node.
+ *
+ * Nodes allocated on their own are freed. For nodes carved from a slab, the slab's
+ * count of live nodes drops, and the slab is freed once it reaches zero.
+ *
+ * @param tree Pointer to the tree owning the node.
+ * @param node Pointer to the node to release.
+ */
+static void bptree_node_release(bptree *tree, bptree_node *node) {
+    BPTREE_EVENT(tree, NODE_FREE, node__free, node, NULL, node->is_leaf, 0, -1);
+    if (node->level != BPTREE_NO_LEVEL) tree->level_nodes[node->level]--;
+    if (node->is_leaf) {
+        tree->leaf_nodes--;
+    } else {
+        tree->internal_nodes--;
+    }
+    if (!node->in_slab) {
+        bptree_uncharge(tree, bptree_node_stride(tree, node->is_leaf));
+        free(node);
+        return;
+    }
+    const char *p = (const char *)node;
+    for (int i = 0; i < tree->num_slabs; i++) {
+        bptree_slab *slab = &tree->slabs[i];
+        if (p < slab->base || p >= slab->base + slab->size) continue;
+        if (--slab->live == 0) {
+            BPTREE_LOG_EVENT(tree->enable_debug, "Releasing empty slab of %zu bytes\n", slab->size);
+            free(slab->base);
+            bptree_uncharge(tree, slab->size);
+            tree->slabs[i] = tree->slabs[--tree->num_slabs];
+        }
+        return;
+    }
+    assert(false && "slab node not owned by tree");
+}
+
+/**
+ * @brief Recursively free a node and its children.
+ *
+ * Frees the memory for a node. For internal nodes, it recurses into all child nodes.
+ *
+ * @param node Pointer to the node to free.
+ * @param tree Pointer to the tree.
+ */
+static void bptree_free_node(bptree_node *node, bptree *tree) {
+    if (!node) return;
+    if (!node->is_leaf) {
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            bptree_free_node(children[i], tree);
+        }
+    }
+    bptree_node_release(tree, node);
+}
+
+/**
+ * @brief Recompute the summaries a node keeps about its subtree.
+ *
+ * With BPTREE_AGGREGATE_TYPE defined and a monoid set, this folds the entries of a leaf,
+ * or the aggregates of the children of an internal node. With BPTREE_ENABLE_TTL defined,
+ * it also finds the earliest expiration time. Otherwise it does nothing.
+ *
+ * @param tree Pointer to the tree.
+ * @param node Pointer to the node whose children are already up to date.
+ */
+static void bptree_node_refresh(const bptree *tree, bptree_node *node) {
+#ifdef BPTREE_ENABLE_TTL
+    int64_t min_expiry = BPTREE_NO_EXPIRY;
+    if (node->is_leaf) {
+        const int64_t *expiries = bptree_node_expiries(node, tree->max_keys);
+        for (int i = 0; i < node->num_keys; i++) {
+            if (expiries[i] < min_expiry) min_expiry = expiries[i];
+        }
+    } else {
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            if (children[i]->min_expiry < min_expiry) min_expiry = children[i]->min_expiry;
+        }
+    }
+    node->min_expiry = min_expiry;
+#endif
+#ifdef BPTREE_AGGREGATE_TYPE
+    if (!tree->monoid.combine) return;
+    bptree_agg_t acc = tree->monoid.identity;
+    if (node->is_leaf) {
+        const bptree_key_t *keys = bptree_node_keys(node);
+        const bptree_value_t *values = bptree_node_values(node, tree->max_keys);
+        for (int i = 0; i < node->num_keys; i++) {
+            acc = tree->monoid.combine(acc, tree->monoid.lift(&keys[i], values[i]));
+        }
+    } else {
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            acc = tree->monoid.combine(acc, children[i]->agg);
+        }
+    }
+    node->agg = acc;
+#elif !defined(BPTREE_ENABLE_TTL)
+    (void)tree;
+    (void)node;
+#endif
+}
+
+/**
+ * @brief Queue a leaf for rebalancing by bptree_do_work.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to a key held by the underfull leaf.
+ * @return True if queued, false if the queue could not grow.
+ */
+static bool bptree_queue_repair(bptree *tree, const bptree_key_t *key) {
+    if (tree->repair_head == tree->repair_len) {
+        tree->repair_head = 0;
+        tree->repair_len = 0;
+    }
+    if (tree->repair_len == tree->repair_cap) {
+        const int cap = tree->repair_cap ? tree->repair_cap * 2 : 64;
+        bptree_key_t *keys = realloc(tree->repair_keys, (size_t)cap * sizeof(bptree_key_t));
+        if (!keys) return false;
+        tree->repair_keys = keys;
+        tree->repair_cap = cap;
+    }
+    tree->repair_keys[tree->repair_len++] = *key;
+    return true;
+}
+
+/**
+ * @brief Rebalance the tree upward from a given node.
+ *
+ * After a deletion, this function walks up the node stack and rebalances by borrowing
+ * keys from siblings or merging nodes, if needed. The summaries of every node it touches,
+ * and of the ancestors above them, are refreshed on the way (the leaf itself must already be
+ * up to date).
+ *
+ * @param tree Pointer to the tree.
+ * @param node_stack Array of pointers representing the path from root to the underflowing node.
+ * @param index_stack Array of indexes corresponding to the child position in each parent node.
+ * @param depth Current depth where the underflow occurred.
+ */
+static void bptree_rebalance_up(bptree *tree, bptree_node **node_stack, const int *index_stack,
+                                const int depth) {
+    int d = depth - 1;
+    for (; d >= 0; d--) {
+        bptree_node *parent = node_stack[d];
+        const int child_idx = index_stack[d];
+        bptree_node **children = bptree_node_children(parent, tree->max_keys);
+        bptree_node *child = children[child_idx];
+        const int min_keys = child->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys;
+        // If the node has enough keys, no need for rebalancing.
+        if (child->num_keys >= min_keys) {
+            BPTREE_LOG_STEP(tree->enable_debug,
+                            "Rebalance unnecessary at depth %d, child %d has %d keys (min %d)\n", d,
+                            child_idx, child->num_keys, min_keys);
+            break;
+        }
+        BPTREE_LOG_STEP(tree->enable_debug,
+                        "Rebalance needed at depth %d for child %d (%d keys < min %d)\n", d,
+                        child_idx, child->num_keys, min_keys);
+        // Try borrowing from the left sibling.
+        if (child_idx > 0) {
+            bptree_node *left_sibling = children[child_idx - 1];
+            const int left_min =
+                left_sibling->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys;
+            if (left_sibling->num_keys > left_min) {
+                BPTREE_LOG_STEP(tree->enable_debug,
+                                "Attempting borrow from left sibling (idx %d)\n", child_idx - 1);
+                bptree_key_t *parent_keys = bptree_node_keys(parent);
+                if (child->is_leaf) {
+                    bptree_key_t *child_keys = bptree_node_keys(child);
+                    bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
+                    const bptree_key_t *left_keys = bptree_node_keys(left_sibling);
+                    const bptree_value_t *left_vals =
+                        bptree_node_values(left_sibling, tree->max_keys);
+                    // Shift keys and values right to open space at index 0.
+                    bptree_move_bytes(tree, &child_keys[1], &child_keys[0],
+                                      child->num_keys * sizeof(bptree_key_t));
+                    bptree_move_bytes(tree, &child_vals[1], &child_vals[0],
+                                      child->num_keys * sizeof(bptree_value_t));
+                    bptree_leaf_move_extras(tree, child, 1, child, 0, child->num_keys);
+                    // Move the last key/value from the left sibling.
+                    child_keys[0] = left_keys[left_sibling->num_keys - 1];
+                    child_vals[0] = left_vals[left_sibling->num_keys - 1];
+                    bptree_leaf_move_extras(tree, child, 0, left_sibling,
+                                            left_sibling->num_keys - 1, 1);
+                    child->num_keys++;
+                    left_sibling->num_keys--;
+                    // Update the parent separator.
+                    parent_keys[child_idx - 1] = child_keys[0];
+                    bptree_node_refresh(tree, left_sibling);
+                    bptree_node_refresh(tree, child);
+                    BPTREE_COUNT(tree, leaf_borrows, 1);
+                    BPTREE_EVENT(tree, BORROW, borrow, child, left_sibling, child->num_keys,
+                                 left_sibling->num_keys, d + 1);
+                    BPTREE_LOG_EVENT(tree->enable_debug,
+                                     "Borrowed leaf key from left. Parent key updated.\n");
+                    break;
+                } else {
+                    // Internal node case: shift keys and children to insert the borrowed key.
+                    bptree_key_t *child_keys = bptree_node_keys(child);
+                    bptree_node **child_children = bptree_node_children(child, tree->max_keys);
+                    bptree_key_t *left_keys = bptree_node_keys(left_sibling);
+                    bptree_node **left_children =
+                        bptree_node_children(left_sibling, tree->max_keys);
+                    bptree_move_bytes(tree, &child_keys[1], &child_keys[0],
+                                      child->num_keys * sizeof(bptree_key_t));
+                    bptree_move_bytes(tree, &child_children[1], &child_children[0],
+                                      (child->num_keys + 1) * sizeof(bptree_node *));
+                    child_keys[0] = parent_keys[child_idx - 1];
+                    child_children[0] = left_children[left_sibling->num_keys];
+                    parent_keys[child_idx - 1] = left_keys[left_sibling->num_keys - 1];
+                    child->num_keys++;
+                    left_sibling->num_keys--;
+                    bptree_node_refresh(tree, left_sibling);
+                    bptree_node_refresh(tree, child);
+                    BPTREE_COUNT(tree, internal_borrows, 1);
+                    BPTREE_EVENT(tree, BORROW, borrow, child, left_sibling, child->num_keys,
+                                 left_sibling->num_keys, d + 1);
+                    BPTREE_LOG_EVENT(
+                        tree->enable_debug,
+                        "Borrowed internal key/child from left. Parent key updated.\n");
+                    break;
+                }
+            }
+        }
+        // Try borrowing from the right sibling.
+        if (child_idx < parent->num_keys) {
+            bptree_node *right_sibling = children[child_idx + 1];
+            const int right_min =
+                right_sibling->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys;
+            if (right_sibling->num_keys > right_min) {
+                BPTREE_LOG_STEP(tree->enable_debug,
+                                "Attempting borrow from right sibling (idx %d)\n", child_idx + 1);
+                bptree_key_t *parent_keys = bptree_node_keys(parent);
+                if (child->is_leaf) {
+                    bptree_key_t *child_keys = bptree_node_keys(child);
+                    bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
+                    bptree_key_t *right_keys = bptree_node_keys(right_sibling);
+                    bptree_value_t *right_vals = bptree_node_values(right_sibling, tree->max_keys);
+                    // Borrow the first key/value from the right sibling.
+                    child_keys[child->num_keys] = right_keys[0];
+                    child_vals[child->num_keys] = right_vals[0];
+                    bptree_leaf_move_extras(tree, child, child->num_keys, right_sibling, 0, 1);
+                    child->num_keys++;
+                    right_sibling->num_keys--;
+                    // Shift right sibling's keys/values left.
+                    bptree_move_bytes(tree, &right_keys[0], &right_keys[1],
+                                      right_sibling->num_keys * sizeof(bptree_key_t));
+                    bptree_move_bytes(tree, &right_vals[0], &right_vals[1],
+                                      right_sibling->num_keys * sizeof(bptree_value_t));
+                    bptree_leaf_move_extras(tree, right_sibling, 0, right_sibling, 1,
+                                            right_sibling->num_keys);
+                    parent_keys[child_idx] = right_keys[0];
+                    bptree_node_refresh(tree, right_sibling);
+                    bptree_node_refresh(tree, child);
+                    BPTREE_COUNT(tree, leaf_borrows, 1);
+                    BPTREE_EVENT(tree, BORROW, borrow, child, right_sibling, child->num_keys,
+                                 right_sibling->num_keys, d + 1);
+                    BPTREE_LOG_EVENT(tree->enable_debug,
+                                     "Borrowed leaf key from right. Parent key updated.\n");
+                    break;
+                } else {
+                    // Internal node: borrow key and child pointer from right sibling.
+                    bptree_key_t *child_keys = bptree_node_keys(child);
+                    bptree_node **child_children = bptree_node_children(child, tree->max_keys);
+                    bptree_key_t *right_keys = bptree_node_keys(right_sibling);
+                    bptree_node **right_children =
+                        bptree_node_children(right_sibling, tree->max_keys);
+                    child_keys[child->num_keys] = parent_keys[child_idx];
+                    child_children[child->num_keys + 1] = right_children[0];
+                    parent_keys[child_idx] = right_keys[0];
+                    child->num_keys++;
+                    right_sibling->num_keys--;
+                    bptree_move_bytes(tree, &right_keys[0], &right_keys[1],
+                                      right_sibling->num_keys * sizeof(bptree_key_t));
+                    bptree_move_bytes(tree, &right_children[0], &right_children[1],
+                                      (right_sibling->num_keys + 1) * sizeof(bptree_node *));
+                    bptree_node_refresh(tree, right_sibling);
+                    bptree_node_refresh(tree, child);
+                    BPTREE_COUNT(tree, internal_borrows, 1);
+                    BPTREE_EVENT(tree, BORROW, borrow, child, right_sibling, child->num_keys,
+                                 right_sibling->num_keys, d + 1);
+                    BPTREE_LOG_EVENT(
+                        tree->enable_debug,
+                        "Borrowed internal key/child from right. Parent key updated.\n");
+                    break;
+                }
+            }
+        }
+        // If borrowing failed, attempt a merge.
+        BPTREE_LOG_STEP(tree->enable_debug, "Borrow failed, attempting merge\n");
+        if (child->is_leaf) {
+            BPTREE_COUNT(tree, leaf_merges, 1);
+        } else {
+            BPTREE_COUNT(tree, internal_merges, 1);
+        }
+        if (child_idx > 0) {
+            // Merge with left sibling.
+            bptree_node *left_sibling = children[child_idx - 1];
+            BPTREE_LOG_STEP(tree->enable_debug, "Merging child %d into left sibling %d\n",
+                            child_idx, child_idx - 1);
+            BPTREE_EVENT(tree, MERGE, merge, left_sibling, child, left_sibling->num_keys,
+                         child->num_keys, d + 1);
+            if (child->is_leaf) {
+                bptree_key_t *left_keys = bptree_node_keys(left_sibling);
+                bptree_value_t *left_vals = bptree_node_values(left_sibling, tree->max_keys);
+                const bptree_key_t *child_keys = bptree_node_keys(child);
+                const bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
+                const int combined_keys = left_sibling->num_keys + child->num_keys;
+                if (combined_keys > tree->max_keys) {
+                    fprintf(stderr,
+                            "[BPTree FATAL] Merge-Left (Leaf) Buffer Overflow PREVENTED! Combined "
+                            "keys %d > max_keys %d.\n",
+                            combined_keys, tree->max_keys);
+                    abort();
+                }
+                // Copy all keys and values from child to the left sibling.
+                bptree_copy_bytes(tree, left_keys + left_sibling->num_keys, child_keys,
+                                  child->num_keys * sizeof(bptree_key_t));
+                bptree_copy_bytes(tree, left_vals + left_sibling->num_keys, child_vals,
+                                  child->num_keys * sizeof(bptree_value_t));
+                bptree_leaf_move_extras(tree, left_sibling, left_sibling->num_keys, child, 0,
+                                        child->num_keys);
+                left_sibling->num_keys = combined_keys;
+                left_sibling->next = child->next;
+                left_sibling->referenced |= child->referenced;
+                BPTREE_HEAT_MERGE(tree, left_sibling, child);
+                if (tree->last_leaf == child) tree->last_leaf = left_sibling;
+                bptree_node_release(tree, child);
+                children[child_idx] = NULL;
+            } else {
+                bptree_key_t *left_keys = bptree_node_keys(left_sibling);
+                bptree_node **left_children = bptree_node_children(left_sibling, tree->max_keys);
+                bptree_key_t *child_keys = bptree_node_keys(child);
+                bptree_node **child_children = bptree_node_children(child, tree->max_keys);
+                bptree_key_t *parent_keys = bptree_node_keys(parent);
+                const int combined_keys = left_sibling->num_keys + 1 + child->num_keys;
+                const int combined_children = (left_sibling->num_keys + 1) + (child->num_keys + 1);
+                if (combined_keys > tree->max_keys + 1) {
+                    fprintf(stderr,
+                            "[BPTree FATAL] Merge-Left (Internal) Key Buffer Overflow PREVENTED! "
+                            "Combined keys %d > buffer %d.\n",
+                            combined_keys, tree->max_keys + 1);
+                    abort();
+                }
+                if (combined_children > tree->max_keys + 2) {
+                    fprintf(stderr,
+                            "[BPTree FATAL] Merge-Left (Internal) Children Buffer Overflow "
+                            "PREVENTED! Combined children %d > buffer %d.\n",
+                            combined_children, tree->max_keys + 2);
+                    abort();
+                }
+                left_keys[left_sibling->num_keys] = parent_keys[child_idx - 1];
+                bptree_copy_bytes(tree, left_keys + left_sibling->num_keys + 1, child_keys,
+                                  child->num_keys * sizeof(bptree_key_t));
+                bptree_copy_bytes(tree, left_children + left_sibling->num_keys + 1, child_children,
+                                  (child->num_keys + 1) * sizeof(bptree_node *));
+                left_sibling->num_keys = combined_keys;
+                bptree_node_release(tree, child);
+                children[child_idx] = NULL;
+            }
+            // Remove the parent separator key that pointed to the merged node.
+            bptree_key_t *parent_keys = bptree_node_keys(parent);
+            bptree_move_bytes(tree, &parent_keys[child_idx - 1], &parent_keys[child_idx],
+                              (parent->num_keys - child_idx) * sizeof(bptree_key_t));
+            bptree_move_bytes(tree, &children[child_idx], &children[child_idx + 1],
+                              (parent->num_keys - child_idx) * sizeof(bptree_node *));
+            parent->num_keys--;
+            bptree_node_refresh(tree, left_sibling);
+            BPTREE_LOG_EVENT(tree->enable_debug, "Merge with left complete. Parent updated.\n");
+        } else {
+            // Merge with right sibling if no left sibling is available.
+            bptree_node *right_sibling = children[child_idx + 1];
+            BPTREE_LOG_STEP(tree->enable_debug, "Merging right sibling %d into child %d\n",
+                            child_idx + 1, child_idx);
+            BPTREE_EVENT(tree, MERGE, merge, child, right_sibling, child->num_keys,
+                         right_sibling->num_keys, d + 1);
+            if (child->is_leaf) {
+                bptree_key_t *child_keys = bptree_node_keys(child);
+                bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
+                const bptree_key_t *right_keys = bptree_node_keys(right_sibling);
+                const bptree_value_t *right_vals =
+                    bptree_node_values(right_sibling, tree->max_keys);
+                const int combined_keys = child->num_keys + right_sibling->num_keys;
+                if (combined_keys > tree->max_keys) {
+                    fprintf(stderr,
+                            "[BPTree FATAL] Merge-Right (Leaf) Buffer Overflow PREVENTED! Combined "
+                            "keys %d > max_keys %d.\n",
+                            combined_keys, tree->max_keys);
+                    abort();
+                }
+                bptree_copy_bytes(tree, child_keys + child->num_keys, right_keys,
+                                  right_sibling->num_keys * sizeof(bptree_key_t));
+                bptree_copy_bytes(tree, child_vals + child->num_keys, right_vals,
+                                  right_sibling->num_keys * sizeof(bptree_value_t));
+                bptree_leaf_move_extras(tree, child, child->num_keys, right_sibling, 0,
+                                        right_sibling->num_keys);
+                child->num_keys = combined_keys;
+                child->next = right_sibling->next;
+                child->referenced |= right_sibling->referenced;
+                BPTREE_HEAT_MERGE(tree, child, right_sibling);
+                if (tree->last_leaf == right_sibling) tree->last_leaf = child;
+                bptree_node_release(tree, right_sibling);
+                children[child_idx + 1] = NULL;
+            } else {
+                bptree_key_t *child_keys = bptree_node_keys(child);
+                bptree_node **child_children = bptree_node_children(child, tree->max_keys);
+                const bptree_key_t *right_keys = bptree_node_keys(right_sibling);
+                bptree_node **right_children = bptree_node_children(right_sibling, tree->max_keys);
+                const bptree_key_t *parent_keys = bptree_node_keys(parent);
+                const int combined_keys = child->num_keys + 1 + right_sibling->num_keys;
+                const int combined_children = (child->num_keys + 1) + (right_sibling->num_keys + 1);
+                if (combined_keys > tree->max_keys + 1) {
+                    fprintf(stderr,
+                            "[BPTree FATAL] Merge-Right (Internal) Key Buffer Overflow PREVENTED! "
+                            "Combined keys %d > buffer %d.\n",
+                            combined_keys, tree->max_keys + 1);
+                    abort();
+                }
+                if (combined_children > tree->max_keys + 2) {
+                    fprintf(stderr,
+                            "[BPTree FATAL] Merge-Right (Internal) Children Buffer Overflow "
+                            "PREVENTED! Combined children %d > buffer %d.\n",
+                            combined_children, tree->max_keys + 2);
+                    abort();
+                }
+                child_keys[child->num_keys] = parent_keys[child_idx];
+                bptree_copy_bytes(tree, child_keys + child->num_keys + 1, right_keys,
+                                  right_sibling->num_keys * sizeof(bptree_key_t));
+                bptree_copy_bytes(tree, child_children + child->num_keys + 1, right_children,
+                                  (right_sibling->num_keys + 1) * sizeof(bptree_node *));
+                child->num_keys = combined_keys;
+                bptree_node_release(tree, right_sibling);
+                children[child_idx + 1] = NULL;
+            }
+            bptree_key_t *parent_keys = bptree_node_keys(parent);
+            bptree_move_bytes(tree, &parent_keys[child_idx], &parent_keys[child_idx + 1],
+                              (parent->num_keys - child_idx - 1) * sizeof(bptree_key_t));
+            bptree_move_bytes(tree, &children[child_idx + 1], &children[child_idx + 2],
+                              (parent->num_keys - child_idx - 1) * sizeof(bptree_node *));
+            parent->num_keys--;
+            bptree_node_refresh(tree, child);
+            BPTREE_LOG_EVENT(tree->enable_debug, "Merge with right complete. Parent updated.\n");
+        }
+    }
+    // The node where rebalancing stopped (it lost a child to a merge below) and its ancestors
+    // are intact but have changed below.
+    for (d = d + 1 < depth ? d + 1 : depth - 1; d >= 0; d--) {
+        bptree_node_refresh(tree, node_stack[d]);
+    }
+    // Check for the special case where the root becomes empty and the height can be reduced.
+    if (!tree->root->is_leaf && tree->root->num_keys == 0 && tree->count > 0) {
+        BPTREE_LOG_EVENT(tree->enable_debug,
+                         "Root node is internal and empty, shrinking height.\n");
+        bptree_node *old_root = tree->root;
+        tree->root = bptree_node_children(old_root, tree->max_keys)[0];
+        tree->height--;
+        BPTREE_COUNT(tree, root_collapses, 1);
+        BPTREE_EVENT(tree, ROOT_COLLAPSE, root__collapse, old_root, tree->root, 0,
+                     tree->root->num_keys, 0);
+        bptree_node_release(tree, old_root);
+    } else if (tree->count == 0 && tree->root && tree->root->num_keys != 0) {
+        BPTREE_LOG_STEP(tree->enable_debug, "Tree empty, ensuring root node is empty.\n");
+        tree->root->num_keys = 0;
+    }
+}
+
+/**
+ * @brief Binary search for a key in a node.
+ *
+ * Searches for the first position in the node's key array where the key could be inserted.
+ *
+ * @param tree Pointer to the tree.
+ * @param node Pointer to the node.
+ * @param key Pointer to the key.
+ * @return The index at which the key is found or should be inserted.
+ */
+static int bptree_node_search(const bptree *tree, const bptree_node *node,
+                              const bptree_key_t *key) {
+    int low = 0, high = node->num_keys;
+    const bptree_key_t *keys = bptree_node_keys(node);
+    // Adjust behavior for leaf and internal nodes
+    if (node->is_leaf) {
+        while (low < high) {
+            const int mid = low + (high - low) / 2;
+            const int cmp = tree->compare(key, &keys[mid]);
+            BPTREE_COUNT(tree, compares, 1);
+            if (cmp <= 0) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+    } else {
+        while (low < high) {
+            const int mid = low + (high - low) / 2;
+            const int cmp = tree->compare(key, &keys[mid]);
+            BPTREE_COUNT(tree, compares, 1);
+            if (cmp < 0) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Recompute node summaries along the search path of a key, bottom-up.
+ *
+ * Used by in-place removals from the first or last leaf, which do not touch separators.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to the key whose path changed.
+ */
+static void bptree_refresh_path(const bptree *tree, const bptree_key_t *key) {
+#if defined(BPTREE_AGGREGATE_TYPE) || defined(BPTREE_ENABLE_TTL)
+#define BPTREE_MAX_HEIGHT_REFRESH 64
+#ifndef BPTREE_ENABLE_TTL
+    if (!tree->monoid.combine) return;
+#endif
+    bptree_node *path[BPTREE_MAX_HEIGHT_REFRESH];
+    int depth = 0;
+    bptree_node *node = tree->root;
+    while (depth < BPTREE_MAX_HEIGHT_REFRESH) {
+        path[depth++] = node;
+        if (node->is_leaf) break;
+        node = bptree_node_children(node, tree->max_keys)[bptree_node_search(tree, node, key)];
+    }
+    while (depth > 0) bptree_node_refresh(tree, path[--depth]);
+#undef BPTREE_MAX_HEIGHT_REFRESH
+#else
+    (void)tree;
+    (void)key;
+#endif
+}
+
+/**
+ * @brief Recursive insertion helper.
+ *
+ * Inserts a key/value pair into the subtree rooted at @p node.
+ * Handles splitting of nodes if necessary and propagates split keys upward.
+ *
+ * @param tree Pointer to the B+ tree.
+ * @param node Current node.
+ * @param key Pointer to the key to insert.
+ * @param value Value to insert.
+ * @param promoted_key Pointer to store the key to be promoted if a split occurs.
+ * @param new_child Pointer to store the new node created from the split.
+ * @return Status code indicating success or failure.
+ */
+static bptree_status bptree_insert_internal(bptree *tree, bptree_node *node,
+                                            const bptree_key_t *key, const bptree_value_t value,
+                                            bptree_key_t *promoted_key, bptree_node **new_child) {
+    const int pos = bptree_node_search(tree, node, key);
+    if (node->is_leaf) {
+        BPTREE_HEAT_TOUCH(tree, node);
+        bptree_key_t *keys = bptree_node_keys(node);
+        bptree_value_t *values = bptree_node_values(node, tree->max_keys);
+        // If key exists, report duplicate.
+        BPTREE_COUNT(tree, compares, pos < node->num_keys);
+        if (pos < node->num_keys && tree->compare(key, &keys[pos]) == 0) {
+            BPTREE_LOG_STEP(tree->enable_debug, "Insert failed: Duplicate key found.\n");
+            return BPTREE_DUPLICATE_KEY;
+        }
+        // Shift keys and values to make room for the new key/value.
+        bptree_move_bytes(tree, &keys[pos + 1], &keys[pos],
+                          (node->num_keys - pos) * sizeof(bptree_key_t));
+        bptree_move_bytes(tree, &values[pos + 1], &values[pos],
+                          (node->num_keys - pos) * sizeof(bptree_value_t));
+        bptree_leaf_move_extras(tree, node, pos + 1, node, pos, node->num_keys - pos);
+        keys[pos] = *key;
+        values[pos] = value;
+        bptree_leaf_init_extras(tree, node, pos);
+        node->num_keys++;
+        *new_child = NULL;
+        BPTREE_LOG_STEP(tree->enable_debug, "Inserted key in leaf. Node keys: %d\n",
+                        node->num_keys);
+        // Check for overflow and split if needed.
+        if (node->num_keys > tree->max_keys) {
+            BPTREE_LOG_STEP(tree->enable_debug, "Leaf node overflow (%d > %d), splitting.\n",
+                            node->num_keys, tree->max_keys);
+            const int total_keys = node->num_keys;
+            const int split_idx = (total_keys + 1) / 2;
+            const int new_node_keys = total_keys - split_idx;
+            bptree_node *new_leaf = bptree_node_alloc(tree, 0);
+            if (!new_leaf) {
+                node->num_keys--;
+                BPTREE_LOG_ERROR(tree->enable_debug, "Leaf split allocation failed!\n");
+                return BPTREE_ALLOCATION_FAILURE;
+            }
+            BPTREE_COUNT(tree, leaf_splits, 1);
+            BPTREE_LATENCY_NOTE(tree, leaf_split);
+            bptree_key_t *new_keys = bptree_node_keys(new_leaf);
+            bptree_value_t *new_values = bptree_node_values(new_leaf, tree->max_keys);
+            // Move the latter half keys/values to the new leaf.
+            bptree_copy_bytes(tree, new_keys, &keys[split_idx],
+                              new_node_keys * sizeof(bptree_key_t));
+            bptree_copy_bytes(tree, new_values, &values[split_idx],
+                              new_node_keys * sizeof(bptree_value_t));
+            bptree_leaf_move_extras(tree, new_leaf, 0, node, split_idx, new_node_keys);
+            new_leaf->num_keys = new_node_keys;
+            node->num_keys = split_idx;
+            new_leaf->next = node->next;
+            node->next = new_leaf;
+            if (tree->last_leaf == node) tree->last_leaf = new_leaf;
+            BPTREE_HEAT_SPLIT(tree, node, new_leaf);
+            *promoted_key = new_keys[0];
+            *new_child = new_leaf;
+            bptree_node_refresh(tree, new_leaf);
+            BPTREE_EVENT(tree, LEAF_SPLIT, leaf__split, node, new_leaf, node->num_keys,
+                         new_leaf->num_keys, tree->height - 1);
+            BPTREE_LOG_EVENT(tree->enable_debug,
+                             "Leaf split complete. Promoted key. Left keys: %d, Right keys: %d\n",
+                             node->num_keys, new_leaf->num_keys);
+        }
+        bptree_node_refresh(tree, node);
+        return BPTREE_OK;
+    } else {
+        // Recurse into the appropriate child.
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        bptree_key_t child_promoted_key;
+        bptree_node *child_new_node = NULL;
+        const bptree_status status = bptree_insert_internal(tree, children[pos], key, value,
+                                                            &child_promoted_key, &child_new_node);
+        if (status != BPTREE_OK) {
+            return status;
+        }
+        if (child_new_node == NULL) {
+            *new_child = NULL;
+            bptree_node_refresh(tree, node);
+            return BPTREE_OK;
+        }
+        BPTREE_LOG_STEP(tree->enable_debug,
+                        "Child split propagated. Inserting promoted key into internal node.\n");
+        bptree_key_t *keys = bptree_node_keys(node);
+        // Shift parent's keys and child pointers to insert the promoted key.
+        bptree_move_bytes(tree, &keys[pos + 1], &keys[pos],
+                          (node->num_keys - pos) * sizeof(bptree_key_t));
+        bptree_move_bytes(tree, &children[pos + 2], &children[pos + 1],
+                          (node->num_keys - pos) * sizeof(bptree_node *));
+        keys[pos] = child_promoted_key;
+        children[pos + 1] = child_new_node;
+        node->num_keys++;
+        BPTREE_LOG_STEP(tree->enable_debug, "Internal node keys: %d\n", node->num_keys);
+        // Split internal node if it exceeds capacity.
+        if (node->num_keys > tree->max_keys) {
+            BPTREE_LOG_STEP(tree->enable_debug, "Internal node overflow (%d > %d), splitting.\n",
+                            node->num_keys, tree->max_keys);
+            const int total_keys = node->num_keys;
+            const int split_idx = total_keys / 2;
+            const int new_node_keys = total_keys - split_idx - 1;
+            bptree_node *new_internal = bptree_node_alloc(tree, node->level);
+            if (!new_internal) {
+                node->num_keys--;
+                BPTREE_LOG_ERROR(tree->enable_debug, "Internal split allocation failed!\n");
+                return BPTREE_ALLOCATION_FAILURE;
+            }
+            BPTREE_COUNT(tree, internal_splits, 1);
+            bptree_key_t *new_keys = bptree_node_keys(new_internal);
+            bptree_node **new_children = bptree_node_children(new_internal, tree->max_keys);
+            *promoted_key = keys[split_idx];
+            *new_child = new_internal;
+            bptree_copy_bytes(tree, new_keys, &keys[split_idx + 1],
+                              new_node_keys * sizeof(bptree_key_t));
+            bptree_copy_bytes(tree, new_children, &children[split_idx + 1],
+                              (new_node_keys + 1) * sizeof(bptree_node *));
+            new_internal->num_keys = new_node_keys;
+            node->num_keys = split_idx;
+            bptree_node_refresh(tree, new_internal);
+            BPTREE_EVENT(tree, INTERNAL_SPLIT, internal__split, node, new_internal, node->num_keys,
+                         new_internal->num_keys, tree->height - 1 - node->level);
+            BPTREE_LOG_EVENT(
+                tree->enable_debug,
+                "Internal split complete. Promoted key. Left keys: %d, Right keys: %d\n",
+                node->num_keys, new_internal->num_keys);
+        } else {
+            *new_child = NULL;
+        }
+        bptree_node_refresh(tree, node);
+        return BPTREE_OK;
+    }
+}
+
+/**
+ * @brief Find the leaf a key belongs in.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to the key.
+ * @return Pointer to the leaf.
+ */
+static bptree_node *bptree_find_leaf(const bptree *tree, const bptree_key_t *key) {
+    bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        node = bptree_node_children(node, tree->max_keys)[bptree_node_search(tree, node, key)];
+    }
+    return node;
+}
+
+#ifdef BPTREE_ENABLE_TTL
+/**
+ * @brief Find the leaf entry holding a key.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to the key.
+ * @param out_pos Receives the index of the entry in the leaf.
+ * @return Pointer to the leaf, or NULL if the key is not in the tree.
+ */
+static bptree_node *bptree_find_entry(const bptree *tree, const bptree_key_t *key, int *out_pos) {
+    bptree_node *node = bptree_find_leaf(tree, key);
+    const int pos = bptree_node_search(tree, node, key);
+    if (pos >= node->num_keys || tree->compare(key, &bptree_node_keys(node)[pos]) != 0) {
+        return NULL;
+    }
+    *out_pos = pos;
+    return node;
+}
+
+#endif
+
+static void bptree_enforce_capacity(bptree *tree, const bptree_key_t *keep);
+static void bptree_note_write(bptree *tree, const bptree_key_t *key);
+
+/**
+ * @brief Compute the node memory an insertion would allocate.
+ *
+ * Every full node at the bottom of the search path splits, and a new root is added when
+ * the split reaches the root. Inserting an existing key allocates nothing.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to the key to insert.
+ * @return Number of bytes the insertion would allocate.
+ */
+static size_t bptree_put_cost(const bptree *tree, const bptree_key_t *key) {
+    const size_t internal_stride = bptree_node_stride(tree, false);
+    size_t cost = 0;
+    bool splits_root = true;
+    bptree_node *node = tree->root;
+    for (;;) {
+        const int pos = bptree_node_search(tree, node, key);
+        if (node->num_keys < tree->max_keys) {
+            cost = 0;
+            splits_root = false;
+        } else {
+            cost += node->is_leaf ? bptree_node_stride(tree, true) : internal_stride;
+        }
+        if (node->is_leaf) {
+            if (pos < node->num_keys && tree->compare(key, &bptree_node_keys(node)[pos]) == 0) {
+                return 0;
+            }
+            break;
+        }
+        node = bptree_node_children(node, tree->max_keys)[pos];
+    }
+    return splits_root ? cost + internal_stride : cost;
+}
+
+/**
+ * @brief Make sure an insertion fits in the tree's memory budget.
+ *
+ * @param tree Pointer to a tree with a budget.
+ * @param key Pointer to the key to insert.
+ * @return BPTREE_OK if the insertion fits, BPTREE_MEMORY_LIMIT otherwise.
+ */
+static bptree_status bptree_budget_admit(bptree *tree, const bptree_key_t *key) {
+    bptree_budget *budget = tree->budget;
+    if (budget->limit == 0) return BPTREE_OK;
+    for (;;) {
+        // The callback may have removed entries from this tree, so work out the cost again.
+        const size_t cost = bptree_put_cost(tree, key);
+        if (cost == 0 || budget->used + cost <= budget->limit) return BPTREE_OK;
+        const size_t used = budget->used;
+        const size_t needed = budget->used + cost - budget->limit;
+        // Retry only while the callback keeps releasing memory.
+        if (!budget->on_pressure || !budget->on_pressure(budget, needed, budget->ctx) ||
+            budget->used >= used) {
+            BPTREE_LOG_ERROR(tree->enable_debug, "Insertion needs %zu bytes over budget.\n",
+                             needed);
+            return BPTREE_MEMORY_LIMIT;
+        }
+    }
+}
+
+static bptree_status bptree_put_untimed(bptree *tree, const bptree_key_t *key,
+                                        bptree_value_t value) {
+    if (!tree || !key) return BPTREE_INVALID_ARGUMENT;
+    if (!tree->root) return BPTREE_INTERNAL_ERROR;
+    BPTREE_COUNT(tree, puts, 1);
+#ifdef BPTREE_ENABLE_TTL
+    // An expired entry that has not been swept yet is already gone for readers, so it is
+    // replaced (and no longer expires) instead of making the key a duplicate.
+    const int64_t now = tree->root->min_expiry != BPTREE_NO_EXPIRY ? bptree_now_ns() : 0;
+    if (tree->root->min_expiry <= now) {
+        int pos;
+        bptree_node *leaf = bptree_find_entry(tree, key, &pos);
+        int64_t *expiries = leaf ? bptree_node_expiries(leaf, tree->max_keys) : NULL;
+        if (leaf && expiries[pos] <= now) {
+            bptree_node_values(leaf, tree->max_keys)[pos] = value;
+            expiries[pos] = BPTREE_NO_EXPIRY;
+            bptree_note_write(tree, key);
+            bptree_refresh_path(tree, key);
+            BPTREE_LOG_STEP(tree->enable_debug, "Replaced expired entry.\n");
+            return BPTREE_OK;
+        }
+    }
+#endif
+    if (tree->budget) {
+        const bptree_status status = bptree_budget_admit(tree, key);
+        if (status != BPTREE_OK) return status;
+    }
+    bptree_key_t promoted_key;
+    bptree_node *new_node = NULL;
+    const bptree_status status =
+        bptree_insert_internal(tree, tree->root, key, value, &promoted_key, &new_node);
+    if (status == BPTREE_OK) {
+        // If a split occurred at the root, create a new root.
+        if (new_node != NULL) {
+            BPTREE_LOG_EVENT(tree->enable_debug, "Root split occurred. Creating new root.\n");
+            bptree_node *new_root = bptree_node_alloc(tree, tree->root->level + 1);
+            if (!new_root) {
+                bptree_free_node(new_node, tree);
+                return BPTREE_ALLOCATION_FAILURE;
+            }
+            bptree_key_t *root_keys = bptree_node_keys(new_root);
+            bptree_node **root_children = bptree_node_children(new_root, tree->max_keys);
+            root_keys[0] = promoted_key;
+            root_children[0] = tree->root;
+            root_children[1] = new_node;
+            new_root->num_keys = 1;
+            bptree_node_refresh(tree, new_root);
+            tree->root = new_root;
+            tree->height++;
+            BPTREE_COUNT(tree, root_splits, 1);
+            BPTREE_EVENT(tree, ROOT_SPLIT, root__split, new_root, root_children[0], 1,
+                         root_children[0]->num_keys, 0);
+            BPTREE_LOG_EVENT(tree->enable_debug, "New root created. Tree height: %d\n",
+                             tree->height);
+        }
+        tree->count++;
+        bptree_note_write(tree, key);
+        if (tree->max_entries > 0 || tree->max_bytes > 0) bptree_enforce_capacity(tree, key);
+    } else {
+        BPTREE_LOG_ERROR(tree->enable_debug,
+                         "Insertion failed (Status: %d), count not incremented.\n", status);
+    }
+    return status;
+}
+
+static bptree_status bptree_get_untimed(const bptree *tree, const bptree_key_t *key,
+                                        bptree_value_t *out_value) {
+    if (!tree || !tree->root || !key || !out_value) return BPTREE_INVALID_ARGUMENT;
+    BPTREE_COUNT(tree, gets, 1);
+    if (tree->count == 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_node *node = tree->root;
+    // Traverse the tree until a leaf is reached.
+    while (!node->is_leaf) {
+        const int pos = bptree_node_search(tree, node, key);
+        node = bptree_node_children(node, tree->max_keys)[pos];
+        if (!node) return BPTREE_INTERNAL_ERROR;
+    }
+    BPTREE_HEAT_TOUCH(tree, node);
+    int pos = bptree_node_search(tree, node, key);
+    const bptree_key_t *keys = bptree_node_keys(node);
+    BPTREE_COUNT(tree, compares, pos < node->num_keys);
+    if (pos < node->num_keys && tree->compare(key, &keys[pos]) == 0) {
+#ifdef BPTREE_ENABLE_TTL
+        // Expired entries stay in the tree until a sweep removes them, but are not returned.
+        const int64_t expires_at = bptree_node_expiries(node, tree->max_keys)[pos];
+        if (expires_at != BPTREE_NO_EXPIRY && expires_at <= bptree_now_ns()) {
+            return BPTREE_KEY_NOT_FOUND;
+        }
+#endif
+        *out_value = bptree_node_values(node, tree->max_keys)[pos];
+        // Only a CLOCK-bounded tree reads the bit; other lookups leave the leaf untouched,
+        // so readers sharing a tree do not write to (and bounce) its cache lines.
+        const bool clock_bounded = (tree->max_entries > 0 || tree->max_bytes > 0) &&
+                                   tree->eviction == BPTREE_EVICT_CLOCK;
+        if (clock_bounded && !node->referenced) node->referenced = true;
+        return BPTREE_OK;
+    }
+    return BPTREE_KEY_NOT_FOUND;
+}
+
+static bptree_status bptree_remove_untimed(bptree *tree, const bptree_key_t *key) {
+#define BPTREE_MAX_HEIGHT_REMOVE 64
+    bptree_node *node_stack[BPTREE_MAX_HEIGHT_REMOVE];
+    int index_stack[BPTREE_MAX_HEIGHT_REMOVE];
+    int depth = 0;
+    if (!tree || !tree->root || !key) return BPTREE_INVALID_ARGUMENT;
+    BPTREE_COUNT(tree, removes, 1);
+    if (tree->count == 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_node *node = tree->root;
+    // Traverse down the tree and record the path (nodes and child indexes)
+    while (!node->is_leaf) {
+        if (depth >= BPTREE_MAX_HEIGHT_REMOVE) {
+            return BPTREE_INTERNAL_ERROR;
+        }
+        const int pos = bptree_node_search(tree, node, key);
+        node_stack[depth] = node;
+        index_stack[depth] = pos;
+        depth++;
+        node = bptree_node_children(node, tree->max_keys)[pos];
+        if (!node) return BPTREE_INTERNAL_ERROR;
+    }
+    const int pos = bptree_node_search(tree, node, key);
+    bptree_key_t *keys = bptree_node_keys(node);
+    BPTREE_COUNT(tree, compares, pos < node->num_keys);
+    if (pos >= node->num_keys || tree->compare(key, &keys[pos]) != 0) {
+        return BPTREE_KEY_NOT_FOUND;
+    }
+    // Save the key being deleted for potential parent updates.
+    const bptree_key_t deleted_key_copy = keys[pos];
+    bptree_value_t *values = bptree_node_values(node, tree->max_keys);
+    // Remove key and value by shifting remaining entries left.
+    bptree_move_bytes(tree, &keys[pos], &keys[pos + 1],
+                      (node->num_keys - pos - 1) * sizeof(bptree_key_t));
+    bptree_move_bytes(tree, &values[pos], &values[pos + 1],
+                      (node->num_keys - pos - 1) * sizeof(bptree_value_t));
+    bptree_leaf_move_extras(tree, node, pos, node, pos + 1, node->num_keys - pos - 1);
+    node->num_keys--;
+    tree->count--;
+    bptree_note_write(tree, key);
+    BPTREE_LOG_STEP(tree->enable_debug, "Removed key from leaf. Node keys: %d, Tree count: %lld\n",
+                    node->num_keys, (long long)tree->count);
+    // Update parent's separator if the smallest key in the leaf has changed.
+    if (pos == 0 && depth > 0 && node->num_keys > 0) {
+        const int parent_child_idx = index_stack[depth - 1];
+        if (parent_child_idx > 0) {
+            const int separator_idx = parent_child_idx - 1;
+            bptree_node *parent = node_stack[depth - 1];
+            bptree_key_t *parent_keys = bptree_node_keys(parent);
+            if (separator_idx < parent->num_keys &&
+                tree->compare(&parent_keys[separator_idx], &deleted_key_copy) == 0) {
+                BPTREE_LOG_STEP(
+                    tree->enable_debug,
+                    "Updating parent separator key [%d] after deleting smallest leaf key.\n",
+                    separator_idx);
+                parent_keys[separator_idx] = keys[0];
+            }
+        }
+    }
+    const bool root_is_leaf = (depth == 0);
+    bptree_node_refresh(tree, node);
+    // If underflow occurs in a non-root leaf, rebalance upward (or leave it for
+    // bptree_do_work in deferred mode, unless the leaf is now empty).
+    if (!root_is_leaf && node->num_keys < tree->min_leaf_keys &&
+        !(tree->deferred && node->num_keys > 0 && bptree_queue_repair(tree, &keys[0]))) {
+        BPTREE_LOG_STEP(tree->enable_debug, "Leaf underflow (%d < %d), starting rebalance.\n",
+                        node->num_keys, tree->min_leaf_keys);
+        BPTREE_LATENCY_NOTE(tree, rebalanced);
+        bptree_rebalance_up(tree, node_stack, index_stack, depth);
+    } else {
+        for (int d = depth - 1; d >= 0; d--) bptree_node_refresh(tree, node_stack[d]);
+    }
+    if (root_is_leaf && tree->count == 0) {
+        assert(tree->root == node);
+        assert(tree->root->num_keys == 0);
+        BPTREE_LOG_STEP(tree->enable_debug, "Last key removed, root is empty leaf.\n");
+    }
+#undef BPTREE_MAX_HEIGHT_REMOVE
+    return BPTREE_OK;
+}
+
+static bptree_status bptree_get_range_untimed(const bptree *tree, const bptree_key_t *start,
+                                              const bptree_key_t *end,
+                                              bptree_value_t **out_values, int *n_results) {
+    if (!tree || !tree->root || !start || !end || !out_values || !n_results) {
+        return BPTREE_INVALID_ARGUMENT;
+    }
+    *out_values = NULL;
+    *n_results = 0;
+    if (tree->compare(start, end) > 0) {
+        return BPTREE_INVALID_ARGUMENT;
+    }
+    if (tree->count == 0) {
+        return BPTREE_OK;
+    }
+    bptree_node *node = tree->root;
+    // Locate the starting leaf node.
+    while (!node->is_leaf) {
+        const int pos = bptree_node_search(tree, node, start);
+        node = bptree_node_children(node, tree->max_keys)[pos];
+        if (!node) return BPTREE_INTERNAL_ERROR;
+    }
+    BPTREE_EVENT(tree, RANGE_START, range__start, node, NULL, node->num_keys, 0,
+                 tree->height - 1);
+    int count = 0;
+    bptree_node *current_node = node;
+    bool past_end = false;
+    // Count how many keys fall within the range.
+    while (current_node && !past_end) {
+        BPTREE_HEAT_TOUCH(tree, current_node);
+        const bptree_key_t *keys = bptree_node_keys(current_node);
+        for (int i = 0; i < current_node->num_keys; i++) {
+            if (tree->compare(&keys[i], start) >= 0) {
+                if (tree->compare(&keys[i], end) <= 0) {
+                    count++;
+                } else {
+                    past_end = true;
+                    break;
+                }
+            }
+        }
+        if (!past_end) {
+            current_node = current_node->next;
+        }
+    }
+    if (count == 0) {
+        BPTREE_EVENT(tree, RANGE_END, range__end, current_node, NULL, 0, 0, tree->height - 1);
+        return BPTREE_OK;
+    }
+    const size_t alloc_size = (size_t)count * sizeof(bptree_value_t);
+    *out_values = malloc(alloc_size);
+    if (!*out_values) {
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    int index = 0;
+    current_node = node;
+    past_end = false;
+    // Populate the output array with values within the key range.
+    while (current_node && !past_end && index < count) {
+        const bptree_key_t *keys = bptree_node_keys(current_node);
+        const bptree_value_t *values = bptree_node_values(current_node, tree->max_keys);
+        for (int i = 0; i < current_node->num_keys; i++) {
+            if (tree->compare(&keys[i], start) >= 0) {
+                if (tree->compare(&keys[i], end) <= 0) {
+                    if (index < count) {
+                        (*out_values)[index++] = values[i];
+                    } else {
+                        BPTREE_LOG_ERROR(tree->enable_debug,
+                                         "Range Error: Exceeded count during collection.\n");
+                        past_end = true;
+                        break;
+                    }
+                } else {
+                    past_end = true;
+                    break;
+                }
+            }
+        }
+        if (!past_end) {
+            current_node = current_node->next;
+        }
+    }
+    *n_results = index;
+    BPTREE_EVENT(tree, RANGE_END, range__end, current_node, NULL, 0, index, tree->height - 1);
+    if (index != count) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Range Warning: Final index %d != counted %d\n", index,
+                         count);
+    }
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_put(bptree *tree, const bptree_key_t *key, bptree_value_t value) {
+#ifdef BPTREE_ENABLE_LATENCY
+    uint64_t start;
+    if (bptree_latency_begin(tree, &start)) {
+        const bptree_status status = bptree_put_untimed(tree, key, value);
+        bptree_latency_end(tree, tree->latency->leaf_split ? BPTREE_OP_PUT_SPLIT : BPTREE_OP_PUT,
+                           start);
+        return status;
+    }
+#endif
+    return bptree_put_untimed(tree, key, value);
+}
+
+BPTREE_API bptree_status bptree_get(const bptree *tree, const bptree_key_t *key,
+                                    bptree_value_t *out_value) {
+#ifdef BPTREE_ENABLE_LATENCY
+    uint64_t start;
+    if (bptree_latency_begin(tree, &start)) {
+        const bptree_status status = bptree_get_untimed(tree, key, out_value);
+        bptree_latency_end(tree, status == BPTREE_OK ? BPTREE_OP_GET_HIT : BPTREE_OP_GET_MISS,
+                           start);
+        return status;
+    }
+#endif
+    return bptree_get_untimed(tree, key, out_value);
+}
+
+BPTREE_API bptree_status bptree_remove(bptree *tree, const bptree_key_t *key) {
+#ifdef BPTREE_ENABLE_LATENCY
+    uint64_t start;
+    if (bptree_latency_begin(tree, &start)) {
+        const bptree_status status = bptree_remove_untimed(tree, key);
+        bptree_latency_end(
+            tree, tree->latency->rebalanced ? BPTREE_OP_REMOVE_REBALANCE : BPTREE_OP_REMOVE, start);
+        return status;
+    }
+#endif
+    return bptree_remove_untimed(tree, key);
+}
+
+BPTREE_API bptree_status bptree_get_range(const bptree *tree, const bptree_key_t *start,
+                                          const bptree_key_t *end, bptree_value_t **out_values,
+                                          int *n_results) {
+#ifdef BPTREE_ENABLE_LATENCY
+    uint64_t started;
+    if (bptree_latency_begin(tree, &started)) {
+        const bptree_status status =
+            bptree_get_range_untimed(tree, start, end, out_values, n_results);
+        bptree_latency_end(tree, BPTREE_OP_RANGE, started);
+        return status;
+    }
+#endif
+    return bptree_get_range_untimed(tree, start, end, out_values, n_results);
+}
+
+BPTREE_API void bptree_free_range_results(bptree_value_t *results) { free(results); }
+
+BPTREE_API bptree_stats bptree_get_stats(const bptree *tree) {
+    bptree_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (!tree) return stats;
+    stats.count = tree->count > INT_MAX ? INT_MAX : (int)tree->count;
+    stats.height = tree->height;
+    stats.entries = tree->count;
+    int64_t internal_keys = 0;
+    for (int level = 0; level < tree->height && level < BPTREE_MAX_LEVELS; level++) {
+        const int64_t nodes = tree->level_nodes[level];
+        // Every node on a level is a child of one on the level above, and an internal
+        // node holds one key fewer than it has children.
+        const int64_t keys = level == 0 ? tree->count : tree->level_nodes[level - 1] - nodes;
+        stats.level_nodes[level] = nodes;
+        stats.level_fill[level] = nodes > 0 ? (double)keys / ((double)nodes * tree->max_keys) : 0;
+        if (level == 0) {
+            stats.leaf_nodes = nodes;
+        } else {
+            stats.internal_nodes += nodes;
+            internal_keys += keys;
+        }
+    }
+    const int64_t nodes = stats.leaf_nodes + stats.internal_nodes;
+    stats.node_count = nodes > INT_MAX ? INT_MAX : (int)nodes;
+    stats.avg_leaf_fill = stats.level_fill[0];
+    if (stats.internal_nodes > 0) {
+        stats.avg_internal_fill =
+            (double)internal_keys / ((double)stats.internal_nodes * tree->max_keys);
+    }
+    return stats;
+}
+
+/**
+ * @brief Add the nodes of a subtree to a fill histogram.
+ *
+ * @param node Pointer to the subtree root.
+ * @param tree Pointer to the tree.
+ * @param out Pointer to the histogram.
+ */
+static void bptree_scan_fill_node(const bptree_node *node, const bptree *tree,
+                                  bptree_fill_histogram *out) {
+    const double fill = (double)node->num_keys / tree->max_keys;
+    int bucket = (int)(fill * BPTREE_FILL_BUCKETS);
+    if (bucket >= BPTREE_FILL_BUCKETS) bucket = BPTREE_FILL_BUCKETS - 1;
+    const bool is_root = node == tree->root;
+    if (node->is_leaf) {
+        out->leaves[bucket]++;
+        if (!is_root && fill < out->min_leaf_fill) out->min_leaf_fill = fill;
+        return;
+    }
+    out->internals[bucket]++;
+    if (!is_root && fill < out->min_internal_fill) out->min_internal_fill = fill;
+    bptree_node **children = bptree_node_children((bptree_node *)node, tree->max_keys);
+    for (int i = 0; i <= node->num_keys; i++) bptree_scan_fill_node(children[i], tree, out);
+}
+
+BPTREE_API bptree_status bptree_scan_fill(const bptree *tree, bptree_fill_histogram *out) {
+    if (!tree || !tree->root || !out) return BPTREE_INVALID_ARGUMENT;
+    memset(out, 0, sizeof(*out));
+    out->min_leaf_fill = 1.0;
+    out->min_internal_fill = 1.0;
+    bptree_scan_fill_node(tree->root, tree, out);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_counters bptree_get_counters(const bptree *tree) {
+    bptree_counters counters;
+    memset(&counters, 0, sizeof(counters));
+#ifdef BPTREE_ENABLE_COUNTERS
+    if (tree) counters = tree->counters;
+#else
+    (void)tree;
+#endif
+    return counters;
+}
+
+BPTREE_API void bptree_reset_counters(bptree *tree) {
+#ifdef BPTREE_ENABLE_COUNTERS
+    if (tree) memset(&tree->counters, 0, sizeof(tree->counters));
+#else
+    (void)tree;
+#endif
+}
+
+/**
+ * @brief Name, help text, and position of each field of bptree_counters.
+ */
+static const struct {
+    const char *name; /**< Metric name without the `bptree_` prefix and `_total` suffix */
+    const char *help; /**< HELP text */
+    size_t offset;    /**< Offset of the field in bptree_counters */
+} bptree_counter_fields[] = {
+    {"gets", "Lookups.", offsetof(bptree_counters, gets)},
+    {"puts", "Insertions.", offsetof(bptree_counters, puts)},
+    {"removes", "Removals.", offsetof(bptree_counters, removes)},
+    {"compares", "Comparator calls.", offsetof(bptree_counters, compares)},
+    {"bytes_moved", "Bytes shifted or copied in nodes.", offsetof(bptree_counters, bytes_moved)},
+    {"leaf_splits", "Leaf splits.", offsetof(bptree_counters, leaf_splits)},
+    {"internal_splits", "Internal node splits.", offsetof(bptree_counters, internal_splits)},
+    {"root_splits", "Root splits.", offsetof(bptree_counters, root_splits)},
+    {"root_collapses", "Root collapses.", offsetof(bptree_counters, root_collapses)},
+    {"leaf_borrows", "Leaf borrows from a sibling.", offsetof(bptree_counters, leaf_borrows)},
+    {"internal_borrows", "Internal node borrows from a sibling.",
+     offsetof(bptree_counters, internal_borrows)},
+    {"leaf_merges", "Leaf merges.", offsetof(bptree_counters, leaf_merges)},
+    {"internal_merges", "Internal node merges.", offsetof(bptree_counters, internal_merges)},
+};
+
+/**
+ * @brief Read a field of bptree_counters by offset.
+ *
+ * @param counters Pointer to the counts.
+ * @param offset Offset of the field.
+ * @return Value of the field.
+ */
+static uint64_t bptree_counter_at(const bptree_counters *counters, const size_t offset) {
+    uint64_t value;
+    memcpy(&value, (const char *)counters + offset, sizeof(value));
+    return value;
+}
+
+BPTREE_API void bptree_counters_add(bptree_counters *sum, const bptree_counters *counters) {
+    if (!sum || !counters) return;
+    for (size_t i = 0; i < sizeof(bptree_counter_fields) / sizeof(bptree_counter_fields[0]); i++) {
+        const size_t offset = bptree_counter_fields[i].offset;
+        const uint64_t value = bptree_counter_at(sum, offset) + bptree_counter_at(counters, offset);
+        memcpy((char *)sum + offset, &value, sizeof(value));
+    }
+}
+
+/**
+ * @brief Append formatted text to a buffer, snprintf style.
+ *
+ * @param buf Buffer (may be NULL if @p size is 0).
+ * @param size Size of @p buf in bytes.
+ * @param len Length of the full output so far; the text is added at this offset.
+ * @param fmt Format string.
+ * @param ... Additional arguments.
+ */
+static void bptree_appendf(char *buf, const size_t size, size_t *len, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const int n = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0,
+                            fmt, args);
+    va_end(args);
+    if (n > 0) *len += (size_t)n;
+}
+
+BPTREE_API size_t bptree_counters_format(const bptree_counters *counters, const char *label,
+                                         char *buf, const size_t size) {
+    size_t len = 0;
+    if (buf && size > 0) buf[0] = '\0';
+    if (!counters) return 0;
+    for (size_t i = 0; i < sizeof(bptree_counter_fields) / sizeof(bptree_counter_fields[0]); i++) {
+        const char *name = bptree_counter_fields[i].name;
+        bptree_appendf(buf, size, &len, "# HELP bptree_%s_total %s\n", name,
+                       bptree_counter_fields[i].help);
+        bptree_appendf(buf, size, &len, "# TYPE bptree_%s_total counter\n", name);
+        bptree_appendf(buf, size, &len, "bptree_%s_total", name);
+        if (label) {
+            // Label values escape backslashes, double quotes, and newlines.
+            bptree_appendf(buf, size, &len, "{tree=\"");
+            for (const char *c = label; *c; c++) {
+                if (*c == '\n') {
+                    bptree_appendf(buf, size, &len, "\\n");
+                } else if (*c == '\\' || *c == '"') {
+                    bptree_appendf(buf, size, &len, "\\%c", *c);
+                } else {
+                    bptree_appendf(buf, size, &len, "%c", *c);
+                }
+            }
+            bptree_appendf(buf, size, &len, "\"}");
+        }
+        const uint64_t value = bptree_counter_at(counters, bptree_counter_fields[i].offset);
+        bptree_appendf(buf, size, &len, " %llu\n", (unsigned long long)value);
+    }
+    return len;
+}
+
+BPTREE_API bool bptree_counters_write(const bptree_counters *counters, const char *label,
+                                      FILE *out) {
+    if (!counters || !out) return false;
+    const size_t len = bptree_counters_format(counters, label, NULL, 0);
+    char *text = malloc(len + 1);
+    if (!text) return false;
+    bptree_counters_format(counters, label, text, len + 1);
+    const bool ok = fwrite(text, 1, len, out) == len;
+    free(text);
+    return ok;
+}
+
+BPTREE_API bptree_status bptree_set_latency_sampling(bptree *tree, const uint32_t every) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+#ifdef BPTREE_ENABLE_LATENCY
+    if (every == 0) {
+        free(tree->latency);
+        tree->latency = NULL;
+        return BPTREE_OK;
+    }
+    if (!tree->latency) {
+        tree->latency = calloc(1, sizeof(*tree->latency));
+        if (!tree->latency) return BPTREE_ALLOCATION_FAILURE;
+        tree->latency->start_ns = bptree_now_ns();
+        tree->latency->start_ticks = bptree_ticks();
+    }
+    tree->latency->every = every;
+    tree->latency->countdown = every;
+    return BPTREE_OK;
+#else
+    return every == 0 ? BPTREE_OK : BPTREE_INVALID_ARGUMENT;
+#endif
+}
+
+BPTREE_API bptree_status bptree_get_latency(const bptree *tree, bptree_latency_snapshot *out) {
+    if (!tree || !out) return BPTREE_INVALID_ARGUMENT;
+    memset(out, 0, sizeof(*out));
+#ifdef BPTREE_ENABLE_LATENCY
+    const bptree_latency *latency = tree->latency;
+    if (!latency) return BPTREE_OK;
+    out->sample_every = latency->every;
+    memcpy(out->ops, latency->ops, sizeof(out->ops));
+    // Measure the counter's rate over the whole time sampling has been on.
+    out->ns_per_tick = bptree_ns_per_tick(latency->start_ticks, latency->start_ns);
+#endif
+    return BPTREE_OK;
+}
+
+BPTREE_API void bptree_reset_latency(bptree *tree) {
+#ifdef BPTREE_ENABLE_LATENCY
+    if (tree && tree->latency) memset(tree->latency->ops, 0, sizeof(tree->latency->ops));
+#else
+    (void)tree;
+#endif
+}
+
+BPTREE_API double bptree_latency_quantile(const bptree_latency_snapshot *snapshot,
+                                          const bptree_op_kind op, const double q) {
+    if (!snapshot || (int)op < 0 || op >= BPTREE_OP_KINDS) return 0.0;
+    const bptree_latency_histogram *hist = &snapshot->ops[op];
+    if (hist->samples == 0) return 0.0;
+    // Rank of the quantile among the samples, counting from 1.
+    uint64_t rank = 1;
+    if (q > 0) rank = q >= 1 ? hist->samples : (uint64_t)(q * (double)hist->samples + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    uint64_t ticks = hist->max_ticks;
+    for (int i = 0; i < BPTREE_LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            const uint64_t bound = bptree_latency_bucket_max(i);
+            if (bound < ticks) ticks = bound;
+            break;
+        }
+    }
+    return (double)ticks * snapshot->ns_per_tick;
+}
+
+BPTREE_API bptree_status bptree_set_trace(bptree *tree, const size_t capacity) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+#ifdef BPTREE_ENABLE_TRACE
+    free(tree->trace);
+    tree->trace = NULL;
+    if (capacity == 0) return BPTREE_OK;
+    size_t slots = 1;
+    while (slots < capacity) {
+        if (slots > (SIZE_MAX - sizeof(bptree_trace)) / sizeof(bptree_trace_slot) / 2) {
+            return BPTREE_INVALID_ARGUMENT;
+        }
+        slots *= 2;
+    }
+    bptree_trace *trace = malloc(sizeof(bptree_trace) + slots * sizeof(bptree_trace_slot));
+    if (!trace) return BPTREE_ALLOCATION_FAILURE;
+    atomic_init(&trace->head, 0);
+    trace->mask = slots - 1;
+    for (size_t i = 0; i < slots; i++) atomic_init(&trace->slots[i].seq, 0);
+    trace->start_ns = bptree_now_ns();
+    trace->start_ticks = bptree_ticks();
+    tree->trace = trace;
+    return BPTREE_OK;
+#else
+    return capacity == 0 ? BPTREE_OK : BPTREE_INVALID_ARGUMENT;
+#endif
+}
+
+BPTREE_API size_t bptree_trace_read(const bptree *tree, bptree_trace_record *out,
+                                    const size_t max) {
+#ifdef BPTREE_ENABLE_TRACE
+    if (!tree || !tree->trace || !out) return 0;
+    bptree_trace *trace = tree->trace;
+    const uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    uint64_t first = head > trace->mask ? head - trace->mask - 1 : 0;
+    if (head - first > max) first = head - max;
+    size_t n = 0;
+    for (uint64_t seq = first; seq < head; seq++) {
+        bptree_trace_slot *slot = &trace->slots[seq & trace->mask];
+        uint64_t words[BPTREE_TRACE_WORDS];
+        bool copied = false;
+        // Retry a few times while the record is not published yet (its writer claimed the
+        // slot but has not finished) or a writer changed the slot during the copy, then skip
+        // it rather than wait for the writer.
+        for (int attempt = 0; attempt < BPTREE_TRACE_READ_TRIES && !copied; attempt++) {
+            const uint64_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (before > seq + 1) break;  // A newer record replaced it
+            if (before != seq + 1) continue;  // Not published yet
+            for (size_t i = 0; i < BPTREE_TRACE_WORDS; i++) {
+                words[i] = atomic_load_explicit(&slot->words[i], memory_order_relaxed);
+            }
+            atomic_thread_fence(memory_order_acquire);
+            copied = atomic_load_explicit(&slot->seq, memory_order_relaxed) == before;
+        }
+        if (copied) memcpy(&out[n++], words, sizeof(words));
+    }
+    return n;
+#else
+    (void)tree;
+    (void)out;
+    (void)max;
+    return 0;
+#endif
+}
+
+BPTREE_API bool bptree_trace_write(const bptree *tree, FILE *out) {
+#ifdef BPTREE_ENABLE_TRACE
+    if (!tree || !tree->trace || !out) return false;
+    const bptree_trace *trace = tree->trace;
+    const size_t capacity = (size_t)trace->mask + 1;
+    bptree_trace_record *records = malloc(capacity * sizeof(bptree_trace_record));
+    if (!records) return false;
+    const size_t n = bptree_trace_read(tree, records, capacity);
+    bptree_trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BPTRACE", sizeof(header.magic));
+    header.version = 1;
+    header.record_size = sizeof(bptree_trace_record);
+    header.records = n;
+    header.dropped = n > 0 ? records[0].seq : 0;
+    header.start_ticks = trace->start_ticks;
+    header.start_ns = trace->start_ns;
+    header.ns_per_tick = bptree_ns_per_tick(trace->start_ticks, trace->start_ns);
+    const bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                    fwrite(records, sizeof(bptree_trace_record), n, out) == n;
+    free(records);
+    return ok;
+#else
+    (void)tree;
+    (void)out;
+    return false;
+#endif
+}
+
+BPTREE_API const char *bptree_trace_event_name(const bptree_trace_event event) {
+    static const char *const names[BPTREE_TRACE_EVENTS] = {
+        "leaf_split", "internal_split", "root_split", "borrow",     "merge",
+        "root_collapse", "node_alloc",  "node_free",  "range_start", "range_end"};
+    if ((int)event < 0 || event >= BPTREE_TRACE_EVENTS) return "unknown";
+    return names[event];
+}
+
+BPTREE_API bptree_status bptree_set_heat_half_life(bptree *tree, const uint64_t half_life) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+#ifdef BPTREE_ENABLE_HEATMAP
+    tree->heat_half_life = half_life;
+    tree->heat_accesses = 0;
+    return BPTREE_OK;
+#else
+    return half_life == 0 ? BPTREE_OK : BPTREE_INVALID_ARGUMENT;
+#endif
+}
+
+BPTREE_API void bptree_decay_heat(bptree *tree) {
+#ifdef BPTREE_ENABLE_HEATMAP
+    if (tree) tree->heat_epoch++;
+#else
+    (void)tree;
+#endif
+}
+
+#ifdef BPTREE_ENABLE_HEATMAP
+/**
+ * @brief Restore the min-heap order of hot ranges below one entry.
+ *
+ * @param heap Ranges ordered as a min-heap on heat, except possibly at @p i.
+ * @param n Number of ranges in the heap.
+ * @param i Index of the entry to move down.
+ */
+static void bptree_heat_sift_down(bptree_hot_range *heap, const int n, int i) {
+    for (;;) {
+        int coolest = i;
+        const int left = 2 * i + 1;
+        const int right = left + 1;
+        if (left < n && heap[left].heat < heap[coolest].heat) coolest = left;
+        if (right < n && heap[right].heat < heap[coolest].heat) coolest = right;
+        if (coolest == i) return;
+        const bptree_hot_range tmp = heap[i];
+        heap[i] = heap[coolest];
+        heap[coolest] = tmp;
+        i = coolest;
+    }
+}
+
+/**
+ * @brief Add the heat of a subtree to a heatmap, offering its leaves to the hot ranges.
+ *
+ * @param tree Pointer to the tree.
+ * @param node Root of the subtree.
+ * @param hot Min-heap of the hottest leaves so far.
+ * @param k Capacity of @p hot.
+ * @param out Heatmap to add to.
+ * @return The heat of the subtree.
+ */
+static uint64_t bptree_heatmap_node(const bptree *tree, bptree_node *node, bptree_hot_range *hot,
+                                    const int k, bptree_heatmap *out) {
+    uint64_t heat = 0;
+    if (node->is_leaf) {
+        heat = bptree_heat_of(tree, node);
+        out->total_heat += heat;
+        if (heat > 0 && node->num_keys > 0 &&
+            (out->num_hot < k || (k > 0 && heat > hot[0].heat))) {
+            const bptree_key_t *keys = bptree_node_keys(node);
+            const bptree_hot_range range = {.min_key = keys[0],
+                                            .max_key = keys[node->num_keys - 1],
+                                            .heat = (uint32_t)heat,
+                                            .entries = node->num_keys};
+            if (out->num_hot < k) {
+                // Append, then move the new range up to its place in the heap.
+                int i = out->num_hot++;
+                while (i > 0 && hot[(i - 1) / 2].heat > range.heat) {
+                    hot[i] = hot[(i - 1) / 2];
+                    i = (i - 1) / 2;
+                }
+                hot[i] = range;
+            } else {
+                hot[0] = range;
+                bptree_heat_sift_down(hot, k, 0);
+            }
+        }
+    } else {
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            heat += bptree_heatmap_node(tree, children[i], hot, k, out);
+        }
+    }
+    int bucket = 0;
+    for (uint64_t h = heat; h > 0 && bucket < BPTREE_HEAT_BUCKETS - 1; h >>= 1) bucket++;
+    if (node->level < BPTREE_MAX_LEVELS) out->levels[node->level][bucket]++;
+    return heat;
+}
+#endif
+
+BPTREE_API bptree_status bptree_get_heatmap(const bptree *tree, bptree_hot_range *hot,
+                                            const int k, bptree_heatmap *out) {
+    if (!tree || !tree->root || !out || k < 0 || (k > 0 && !hot)) {
+        return BPTREE_INVALID_ARGUMENT;
+    }
+    memset(out, 0, sizeof(*out));
+#ifdef BPTREE_ENABLE_HEATMAP
+    out->epoch = tree->heat_epoch;
+    bptree_heatmap_node(tree, tree->root, hot, k, out);
+    // Take the coolest range off the heap until it is empty, leaving the hottest first.
+    for (int n = out->num_hot - 1; n > 0; n--) {
+        const bptree_hot_range tmp = hot[0];
+        hot[0] = hot[n];
+        hot[n] = tmp;
+        bptree_heat_sift_down(hot, n, 0);
+    }
+#endif
+    return BPTREE_OK;
+}
+
+BPTREE_API bool bptree_check_invariants(const bptree *tree) {
+    return bptree_check_invariants_parallel(tree, 1);
+}
+
+BPTREE_API bool bptree_check_invariants_parallel(const bptree *tree, int num_threads) {
+    if (!tree || !tree->root || num_threads < 1) return false;
+    if (tree->count == 0 &&
+        (!tree->root->is_leaf || tree->root->num_keys != 0 || tree->height != 1)) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Empty tree state incorrect.\n");
+        return false;
+    }
+#ifndef BPTREE_ENABLE_THREADS
+    num_threads = 1;
+#endif
+    // The calling thread checks the top levels until there are enough subtrees to split
+    // among the threads.
+    bptree_check_job top = {.tree = tree, .ok = true};
+    bptree_check_frame single = {.node = tree->root, .next_child = -1};
+    bptree_check_frame *level = &single;
+    int n = 1;
+    int depth = 0;
+    while (num_threads > 1 && n < 4 * num_threads && !level[0].node->is_leaf) {
+        bptree_check_frame *below =
+            malloc((size_t)n * (size_t)(tree->max_keys + 1) * sizeof(bptree_check_frame));
+        if (!below) break;  // Go on with fewer, larger subtrees.
+        int total = 0;
+        for (int i = 0; i < n; i++) {
+            bptree_node *node = level[i].node;
+            if (!bptree_check_node(tree, node, depth)) {
+                top.ok = false;
+                break;
+            }
+            top.level_nodes[node->level]++;
+            const bptree_key_t *keys = bptree_node_keys(node);
+            bptree_node **children = bptree_node_children(node, tree->max_keys);
+            for (int j = 0; j <= node->num_keys; j++) {
+                below[total++] = (bptree_check_frame){
+                    .node = children[j],
+                    .lo = j > 0 ? &keys[j - 1] : level[i].lo,
+                    .hi = j < node->num_keys ? &keys[j] : level[i].hi,
+                    .next_child = -1};
+            }
+        }
+        if (level != &single) free(level);
+        level = below;
+        n = total;
+        depth++;
+        if (!top.ok) break;
+    }
+
+    int num_jobs = !top.ok ? 0 : num_threads < n ? num_threads : n;
+    bptree_check_job single_job;
+    bptree_check_job *jobs = num_jobs > 1 ? malloc((size_t)num_jobs * sizeof(bptree_check_job))
+                                          : NULL;
+    if (!jobs) {
+        jobs = &single_job;
+        if (num_jobs > 1) num_jobs = 1;
+    }
+    for (int t = 0; t < num_jobs; t++) {
+        const int first = (int)((int64_t)t * n / num_jobs);
+        const int end = (int)((int64_t)(t + 1) * n / num_jobs);
+        jobs[t] = (bptree_check_job){.tree = tree,
+                                     .roots = level + first,
+                                     .num_roots = end - first,
+                                     .depth = depth,
+                                     .ok = true};
+#ifdef BPTREE_ENABLE_THREADS
+        jobs[t].started = t > 0 && pthread_create(&jobs[t].thread, NULL, bptree_check_job_run,
+                                                  &jobs[t]) == 0;
+#endif
+    }
+    // The calling thread takes the first job and any job whose thread failed to start.
+    for (int t = 0; t < num_jobs; t++) {
+#ifdef BPTREE_ENABLE_THREADS
+        if (jobs[t].started) continue;
+#endif
+        bptree_check_job_walk(&jobs[t]);
+    }
+#ifdef BPTREE_ENABLE_THREADS
+    for (int t = 0; t < num_jobs; t++) {
+        if (jobs[t].started) pthread_join(jobs[t].thread, NULL);
+    }
+#endif
+
+    // Stitch the jobs together: their leaf runs must link up in order.
+    bool ok = top.ok;
+    int64_t entries = 0;
+    for (int t = 0; t < num_jobs && ok; t++) {
+        ok = jobs[t].ok && (t == 0 || bptree_check_link(tree, jobs[t - 1].last_leaf,
+                                                        jobs[t].first_leaf));
+        entries += jobs[t].entries;
+        for (int l = 0; l < BPTREE_MAX_LEVELS; l++) top.level_nodes[l] += jobs[t].level_nodes[l];
+    }
+    if (ok && (tree->first_leaf != jobs[0].first_leaf ||
+               tree->last_leaf != jobs[num_jobs - 1].last_leaf || tree->last_leaf->next)) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Invariant Fail: Cached first/last leaf stale.\n");
+        ok = false;
+    }
+    if (ok && entries != tree->count) {
+        BPTREE_LOG_ERROR(tree->enable_debug,
+                         "Invariant Fail: Tree count is %lld, leaves hold %lld entries\n",
+                         (long long)tree->count, (long long)entries);
+        ok = false;
+    }
+    for (int l = 0; l < BPTREE_MAX_LEVELS && ok; l++) {
+        if (top.level_nodes[l] != tree->level_nodes[l]) {
+            BPTREE_LOG_ERROR(tree->enable_debug,
+                             "Invariant Fail: Level %d has %lld nodes, counted %lld\n", l,
+                             (long long)tree->level_nodes[l], (long long)top.level_nodes[l]);
+            ok = false;
+        }
+    }
+    if (jobs != &single_job) free(jobs);
+    if (level != &single) free(level);
+    return ok;
+}
+
+BPTREE_API bool bptree_contains(const bptree *tree, const bptree_key_t *key) {
+    bptree_value_t dummy_value;
+    return (bptree_get(tree, key, &dummy_value) == BPTREE_OK);
+}
+
+/**
+ * @brief Kinds of nearest-key searches supported by bptree_seek.
+ */
+typedef enum {
+    BPTREE_SEEK_FLOOR,   /**< Largest key <= the search key */
+    BPTREE_SEEK_CEILING, /**< Smallest key >= the search key */
+    BPTREE_SEEK_LOWER,   /**< Largest key < the search key */
+    BPTREE_SEEK_HIGHER   /**< Smallest key > the search key */
+} bptree_seek_mode;
+
+/**
+ * @brief Find the entry nearest to a key in a single descent.
+ *
+ * While descending, the left neighbor of the path at the deepest level is recorded, so
+ * the previous leaf can be reached by following that subtree's right spine. The next leaf
+ * is reached through the leaf chain.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to the search key.
+ * @param mode Which neighbor of the key to look for.
+ * @param out_key Pointer to store the key found (may be NULL).
+ * @param out_value Pointer to store the value found (may be NULL).
+ * @return BPTREE_OK if found, otherwise BPTREE_KEY_NOT_FOUND.
+ */
+static bptree_status bptree_seek(const bptree *tree, const bptree_key_t *key,
+                                 const bptree_seek_mode mode, bptree_key_t *out_key,
+                                 bptree_value_t *out_value) {
+    if (!tree || !tree->root || !key) return BPTREE_INVALID_ARGUMENT;
+    if (tree->count == 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_node *node = tree->root;
+    bptree_node *left = NULL;  // Subtree holding the keys just before the descent path
+    while (!node->is_leaf) {
+        const int pos = bptree_node_search(tree, node, key);
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        if (pos > 0) left = children[pos - 1];
+        node = children[pos];
+    }
+    const int pos = bptree_node_search(tree, node, key);
+    const bool exact =
+        pos < node->num_keys && tree->compare(key, &bptree_node_keys(node)[pos]) == 0;
+    int idx;
+    switch (mode) {
+        case BPTREE_SEEK_FLOOR:
+            idx = exact ? pos : pos - 1;
+            break;
+        case BPTREE_SEEK_CEILING:
+            idx = pos;
+            break;
+        case BPTREE_SEEK_LOWER:
+            idx = pos - 1;
+            break;
+        default:
+            idx = exact ? pos + 1 : pos;
+            break;
+    }
+    if (idx >= node->num_keys) {
+        // Every key in this leaf is on the wrong side; the answer starts the next leaf.
+        do {
+            node = node->next;
+        } while (node && node->num_keys == 0);
+        idx = 0;
+    } else if (idx < 0) {
+        // The answer ends the previous leaf, which is the rightmost leaf of `left`.
+        node = left;
+        while (node && !node->is_leaf) {
+            node = bptree_node_children(node, tree->max_keys)[node->num_keys];
+        }
+        if (node) idx = node->num_keys - 1;
+    }
+    if (!node || idx < 0) return BPTREE_KEY_NOT_FOUND;
+    if (out_key) *out_key = bptree_node_keys(node)[idx];
+    if (out_value) *out_value = bptree_node_values(node, tree->max_keys)[idx];
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_floor(const bptree *tree, const bptree_key_t *key,
+                                      bptree_key_t *out_key, bptree_value_t *out_value) {
+    return bptree_seek(tree, key, BPTREE_SEEK_FLOOR, out_key, out_value);
+}
+
+BPTREE_API bptree_status bptree_ceiling(const bptree *tree, const bptree_key_t *key,
+                                        bptree_key_t *out_key, bptree_value_t *out_value) {
+    return bptree_seek(tree, key, BPTREE_SEEK_CEILING, out_key, out_value);
+}
+
+BPTREE_API bptree_status bptree_lower_bound(const bptree *tree, const bptree_key_t *key,
+                                            bptree_key_t *out_key, bptree_value_t *out_value) {
+    return bptree_seek(tree, key, BPTREE_SEEK_CEILING, out_key, out_value);
+}
+
+BPTREE_API bptree_status bptree_upper_bound(const bptree *tree, const bptree_key_t *key,
+                                            bptree_key_t *out_key, bptree_value_t *out_value) {
+    return bptree_seek(tree, key, BPTREE_SEEK_HIGHER, out_key, out_value);
+}
+
+BPTREE_API bptree_status bptree_predecessor(const bptree *tree, const bptree_key_t *key,
+                                            bptree_key_t *out_key, bptree_value_t *out_value) {
+    return bptree_seek(tree, key, BPTREE_SEEK_LOWER, out_key, out_value);
+}
+
+BPTREE_API bptree_status bptree_successor(const bptree *tree, const bptree_key_t *key,
+                                          bptree_key_t *out_key, bptree_value_t *out_value) {
+    return bptree_seek(tree, key, BPTREE_SEEK_HIGHER, out_key, out_value);
+}
+
+#ifdef BPTREE_AGGREGATE_TYPE
+/**
+ * @brief Recompute the aggregates of every node in a subtree (post-order).
+ *
+ * @param tree Pointer to the tree.
+ * @param node Pointer to the subtree root.
+ */
+static void bptree_refresh_subtree(const bptree *tree, bptree_node *node) {
+    if (!node->is_leaf) {
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            bptree_refresh_subtree(tree, children[i]);
+        }
+    }
+    bptree_node_refresh(tree, node);
+}
+
+/**
+ * @brief Aggregate the entries of a subtree that fall within optional bounds.
+ *
+ * Only the children holding a bound are visited; the children in between contribute
+ * their stored aggregate.
+ *
+ * @param tree Pointer to the tree.
+ * @param node Pointer to the subtree root.
+ * @param start Lower bound (inclusive), or NULL if the subtree lies above it.
+ * @param end Upper bound (inclusive), or NULL if the subtree lies below it.
+ * @return The aggregate of the matching entries.
+ */
+static bptree_agg_t bptree_aggregate_node(const bptree *tree, bptree_node *node,
+                                          const bptree_key_t *start, const bptree_key_t *end) {
+    if (!start && !end) return node->agg;
+    const bptree_monoid *monoid = &tree->monoid;
+    bptree_agg_t acc = monoid->identity;
+    if (node->is_leaf) {
+        const bptree_key_t *keys = bptree_node_keys(node);
+        const bptree_value_t *values = bptree_node_values(node, tree->max_keys);
+        int i = start ? bptree_node_search(tree, node, start) : 0;
+        for (; i < node->num_keys && (!end || tree->compare(&keys[i], end) <= 0); i++) {
+            acc = monoid->combine(acc, monoid->lift(&keys[i], values[i]));
+        }
+        return acc;
+    }
+    bptree_node **children = bptree_node_children(node, tree->max_keys);
+    const int lo = start ? bptree_node_search(tree, node, start) : 0;
+    const int hi = end ? bptree_node_search(tree, node, end) : node->num_keys;
+    if (lo == hi) return bptree_aggregate_node(tree, children[lo], start, end);
+    acc = bptree_aggregate_node(tree, children[lo], start, NULL);
+    for (int i = lo + 1; i < hi; i++) {
+        acc = monoid->combine(acc, children[i]->agg);
+    }
+    return monoid->combine(acc, bptree_aggregate_node(tree, children[hi], NULL, end));
+}
+
+BPTREE_API bptree_status bptree_set_monoid(bptree *tree, const bptree_monoid *monoid) {
+    if (!tree || !tree->root) return BPTREE_INVALID_ARGUMENT;
+    if (monoid && (!monoid->lift || !monoid->combine)) return BPTREE_INVALID_ARGUMENT;
+    tree->version++;
+    if (!monoid) {
+        tree->monoid.combine = NULL;
+        return BPTREE_OK;
+    }
+    tree->monoid = *monoid;
+    bptree_refresh_subtree(tree, tree->root);
+    BPTREE_LOG_EVENT(tree->enable_debug, "Monoid set, aggregates recomputed for %lld keys.\n",
+                     (long long)tree->count);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_aggregate_range(const bptree *tree, const bptree_key_t *start,
+                                                const bptree_key_t *end, bptree_agg_t *out_agg) {
+    if (!tree || !tree->root || !start || !end || !out_agg || !tree->monoid.combine) {
+        return BPTREE_INVALID_ARGUMENT;
+    }
+    if (tree->compare(start, end) > 0) return BPTREE_INVALID_ARGUMENT;
+    *out_agg = bptree_aggregate_node(tree, tree->root, start, end);
+    return BPTREE_OK;
+}
+#endif
+
+BPTREE_API bptree_status bptree_min(const bptree *tree, bptree_key_t *out_key,
+                                    bptree_value_t *out_value) {
+    if (!tree || !tree->root) return BPTREE_INVALID_ARGUMENT;
+    if (tree->count == 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_node *leaf = tree->first_leaf;
+    if (out_key) *out_key = bptree_node_keys(leaf)[0];
+    if (out_value) *out_value = bptree_node_values(leaf, tree->max_keys)[0];
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_max(const bptree *tree, bptree_key_t *out_key,
+                                    bptree_value_t *out_value) {
+    if (!tree || !tree->root) return BPTREE_INVALID_ARGUMENT;
+    if (tree->count == 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_node *leaf = tree->last_leaf;
+    const int last = leaf->num_keys - 1;
+    if (out_key) *out_key = bptree_node_keys(leaf)[last];
+    if (out_value) *out_value = bptree_node_values(leaf, tree->max_keys)[last];
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_pop_min(bptree *tree, bptree_key_t *out_key,
+                                        bptree_value_t *out_value) {
+    bptree_key_t key;
+    const bptree_status status = bptree_min(tree, &key, out_value);
+    if (status != BPTREE_OK) return status;
+    if (out_key) *out_key = key;
+    bptree_node *leaf = tree->first_leaf;
+    if (leaf != tree->root && leaf->num_keys <= tree->min_leaf_keys) {
+        return bptree_remove(tree, &key);
+    }
+    // The smallest key of the leftmost leaf is never a separator in any ancestor,
+    // so it can be dropped without touching the internal nodes.
+    bptree_key_t *keys = bptree_node_keys(leaf);
+    bptree_value_t *values = bptree_node_values(leaf, tree->max_keys);
+    BPTREE_COUNT(tree, removes, 1);
+    bptree_move_bytes(tree, &keys[0], &keys[1], (leaf->num_keys - 1) * sizeof(bptree_key_t));
+    bptree_move_bytes(tree, &values[0], &values[1],
+                      (leaf->num_keys - 1) * sizeof(bptree_value_t));
+    bptree_leaf_move_extras(tree, leaf, 0, leaf, 1, leaf->num_keys - 1);
+    leaf->num_keys--;
+    tree->count--;
+    bptree_note_write(tree, &key);
+    bptree_refresh_path(tree, &key);
+    BPTREE_LOG_STEP(tree->enable_debug, "Popped min from leftmost leaf. Tree count: %lld\n",
+                    (long long)tree->count);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_pop_max(bptree *tree, bptree_key_t *out_key,
+                                        bptree_value_t *out_value) {
+    bptree_key_t key;
+    const bptree_status status = bptree_max(tree, &key, out_value);
+    if (status != BPTREE_OK) return status;
+    if (out_key) *out_key = key;
+    bptree_node *leaf = tree->last_leaf;
+    if (leaf != tree->root && leaf->num_keys <= tree->min_leaf_keys) {
+        return bptree_remove(tree, &key);
+    }
+    // With more than one key in the leaf, the last key is not the leaf's separator.
+    BPTREE_COUNT(tree, removes, 1);
+    leaf->num_keys--;
+    tree->count--;
+    bptree_note_write(tree, &key);
+    bptree_refresh_path(tree, &key);
+    BPTREE_LOG_STEP(tree->enable_debug, "Popped max from rightmost leaf. Tree count: %lld\n",
+                    (long long)tree->count);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree *bptree_create(const int max_keys,
+                                 int (*compare)(const bptree_key_t *, const bptree_key_t *),
+                                 const bool enable_debug) {
+    if (max_keys < 3) {
+        fprintf(stderr, "[BPTREE CREATE] Error: max_keys must be at least 3.\n");
+        return NULL;
+    }
+    bptree *tree = malloc(sizeof(bptree));
+    if (!tree) {
+        fprintf(stderr, "[BPTREE CREATE] Error: Failed to allocate memory for tree structure.\n");
+        return NULL;
+    }
+    tree->count = 0;
+    tree->height = 1;
+    tree->enable_debug = enable_debug;
+    tree->max_keys = max_keys;
+    tree->min_internal_keys = ((max_keys + 1) / 2) - 1;
+    if (tree->min_internal_keys < 1) {
+        tree->min_internal_keys = 1;
+    }
+    tree->min_leaf_keys = (max_keys + 1) / 2;
+    if (tree->min_leaf_keys < 1) {
+        tree->min_leaf_keys = 1;
+    }
+    if (tree->min_leaf_keys > tree->max_keys) tree->min_leaf_keys = tree->max_keys;
+    BPTREE_LOG_EVENT(enable_debug, "Creating tree. max_keys=%d, min_internal=%d, min_leaf=%d\n",
+                     tree->max_keys, tree->min_internal_keys, tree->min_leaf_keys);
+    tree->compare = compare ? compare : bptree_default_compare;
+    tree->node_bytes = 0;
+    tree->leaf_nodes = 0;
+    tree->internal_nodes = 0;
+    tree->budget = NULL;
+    memset(tree->level_nodes, 0, sizeof(tree->level_nodes));
+#ifdef BPTREE_ENABLE_TRACE
+    tree->trace = NULL;
+#endif
+    tree->root = bptree_node_alloc(tree, 0);
+    if (!tree->root) {
+        fprintf(stderr, "[BPTREE CREATE] Error: Failed to allocate initial root node.\n");
+        free(tree);
+        return NULL;
+    }
+    tree->first_leaf = tree->root;
+    tree->last_leaf = tree->root;
+    tree->version = 0;
+    tree->slabs = NULL;
+    tree->num_slabs = 0;
+    tree->compaction = NULL;
+    tree->deferred = false;
+    tree->repair_keys = NULL;
+    tree->repair_head = 0;
+    tree->repair_len = 0;
+    tree->repair_cap = 0;
+    tree->garbage = NULL;
+    tree->garbage_count = 0;
+    tree->max_entries = 0;
+    tree->max_bytes = 0;
+    tree->eviction = BPTREE_EVICT_CLOCK;
+    tree->on_evict = NULL;
+    tree->evict_ctx = NULL;
+    tree->clock_hand_set = false;
+#ifdef BPTREE_AGGREGATE_TYPE
+    memset(&tree->monoid, 0, sizeof(tree->monoid));
+#endif
+#ifdef BPTREE_ENABLE_COUNTERS
+    memset(&tree->counters, 0, sizeof(tree->counters));
+#endif
+#ifdef BPTREE_ENABLE_LATENCY
+    tree->latency = NULL;
+#endif
+#ifdef BPTREE_ENABLE_HEATMAP
+    tree->heat_epoch = 0;
+    tree->heat_half_life = 0;
+    tree->heat_accesses = 0;
+#endif
+    BPTREE_LOG_EVENT(enable_debug, "Tree created successfully.\n");
+    return tree;
+}
+
+static void bptree_compaction_discard(bptree *tree);
+
+/**
+ * @brief Free every slab of a tree along with the slab table.
+ *
+ * @param tree Pointer to the tree.
+ */
+static void bptree_free_slabs(bptree *tree) {
+    for (int i = 0; i < tree->num_slabs; i++) {
+        free(tree->slabs[i].base);
+        bptree_uncharge(tree, tree->slabs[i].size);
     }
+    free(tree->slabs);
+    tree->slabs = NULL;
+    tree->num_slabs = 0;
+}
 
-    if (node->is_leaf) {
-        // For leaf nodes, record depth and ensure all leaves have the same depth.
-        if (*leaf_depth == -1) {
-            *leaf_depth = depth;
-        } else if (depth != *leaf_depth) {
-            bptree_debug_print(tree->enable_debug,
-                               "Invariant Fail: Leaf depth mismatch (%d != %d) for node %p\n",
-                               depth, *leaf_depth, (void *)node);
-            return false;
-        }
-        // Check occupancy bounds for non-root leaf nodes.
-        if (!is_root && (node->num_keys < tree->min_leaf_keys || node->num_keys > tree->max_keys)) {
-            bptree_debug_print(
-                tree->enable_debug,
-                "Invariant Fail: Leaf node %p key count out of range [%d, %d] (%d keys)\n",
-                (void *)node, tree->min_leaf_keys, tree->max_keys, node->num_keys);
-            return false;
+/**
+ * @brief Free a subtree that is being thrown away as a whole.
+ *
+ * Unlike bptree_free_node, nodes in slabs are skipped rather than released one by one;
+ * the caller frees the slabs afterwards. Touches no tree state, so several threads can
+ * free disjoint subtrees at once.
+ *
+ * @param node Pointer to the subtree root.
+ * @param max_keys Maximum number of keys per node of the tree.
+ */
+static void bptree_reclaim_subtree(bptree_node *node, const int max_keys) {
+    if (!node->is_leaf) {
+        bptree_node **children = bptree_node_children(node, max_keys);
+        for (int i = 0; i <= node->num_keys; i++) bptree_reclaim_subtree(children[i], max_keys);
+    }
+    if (!node->in_slab) free(node);
+}
+
+#ifdef BPTREE_ENABLE_THREADS
+/**
+ * @brief Share of the subtrees freed by one thread of a parallel reclaim.
+ */
+typedef struct bptree_reclaim_job {
+    bptree_node **roots; /**< Subtree roots of the whole reclaim */
+    int num_roots;       /**< Number of entries in `roots` */
+    int first;           /**< Index of the first subtree of this job */
+    int stride;          /**< Distance between the subtrees of this job */
+    int max_keys;        /**< Maximum number of keys per node of the tree */
+    pthread_t thread;    /**< Thread running the job */
+    bool started;        /**< If true, `thread` was started and must be joined */
+} bptree_reclaim_job;
+
+/**
+ * @brief Thread entry point that frees every `stride`-th subtree starting at `first`.
+ *
+ * @param arg Pointer to a bptree_reclaim_job.
+ * @return NULL.
+ */
+static void *bptree_reclaim_job_run(void *arg) {
+    const bptree_reclaim_job *job = arg;
+    for (int i = job->first; i < job->num_roots; i += job->stride) {
+        bptree_reclaim_subtree(job->roots[i], job->max_keys);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Free the nodes of the tree under the root on several threads.
+ *
+ * Expands the top levels until there are a few subtrees per thread, then hands the
+ * subtrees out round-robin. The expanded top-level nodes are linked via `next` and freed
+ * last.
+ *
+ * @param tree Pointer to the tree whose root is an internal node.
+ * @param num_threads Number of threads to use, including the calling one.
+ * @return True if the nodes were freed, false if nothing was freed (out of memory).
+ */
+static bool bptree_reclaim_parallel(const bptree *tree, const int num_threads) {
+    bptree_node **level = malloc(sizeof(bptree_node *));
+    if (!level) return false;
+    level[0] = tree->root;
+    int n = 1;
+    bptree_node *shells = NULL;
+    while (n < 4 * num_threads && !level[0]->is_leaf) {
+        int total = 0;
+        for (int i = 0; i < n; i++) total += level[i]->num_keys + 1;
+        bptree_node **below = malloc((size_t)total * sizeof(bptree_node *));
+        if (!below) break;  // Go on with fewer, larger subtrees.
+        total = 0;
+        for (int i = 0; i < n; i++) {
+            bptree_node **children = bptree_node_children(level[i], tree->max_keys);
+            for (int j = 0; j <= level[i]->num_keys; j++) below[total++] = children[j];
+            level[i]->next = shells;
+            shells = level[i];
         }
-        if (is_root && (node->num_keys > tree->max_keys && tree->count > 0)) {
-            bptree_debug_print(tree->enable_debug,
-                               "Invariant Fail: Root leaf node %p key count > max_keys (%d > %d)\n",
-                               (void *)node, node->num_keys, tree->max_keys);
-            return false;
+        free(level);
+        level = below;
+        n = total;
+    }
+    bptree_reclaim_job single = {
+        .roots = level, .num_roots = n, .first = 0, .stride = 1, .max_keys = tree->max_keys};
+    int num_jobs = num_threads < n ? num_threads : n;
+    bptree_reclaim_job *jobs = malloc((size_t)num_jobs * sizeof(bptree_reclaim_job));
+    if (!jobs) {
+        jobs = &single;
+        num_jobs = 1;
+    }
+    for (int t = 0; t < num_jobs; t++) {
+        jobs[t] = (bptree_reclaim_job){.roots = level,
+                                       .num_roots = n,
+                                       .first = t,
+                                       .stride = num_jobs,
+                                       .max_keys = tree->max_keys};
+        jobs[t].started = t > 0 && pthread_create(&jobs[t].thread, NULL, bptree_reclaim_job_run,
+                                                  &jobs[t]) == 0;
+    }
+    // The calling thread takes the first job and any job whose thread failed to start.
+    for (int t = 0; t < num_jobs; t++) {
+        if (!jobs[t].started) bptree_reclaim_job_run(&jobs[t]);
+    }
+    for (int t = 0; t < num_jobs; t++) {
+        if (jobs[t].started) pthread_join(jobs[t].thread, NULL);
+    }
+    if (jobs != &single) free(jobs);
+    free(level);
+    while (shells) {
+        bptree_node *next = shells->next;
+        if (!shells->in_slab) free(shells);
+        shells = next;
+    }
+    return true;
+}
+#endif
+
+/**
+ * @brief Free a tree and everything it owns, without per-node slab bookkeeping.
+ *
+ * @param tree Pointer to the tree.
+ * @param num_threads Number of threads to free the nodes with.
+ */
+static void bptree_reclaim(bptree *tree, const int num_threads) {
+    bptree_compaction_discard(tree);
+    bool done = !tree->root;
+#ifdef BPTREE_ENABLE_THREADS
+    if (!done && num_threads > 1 && !tree->root->is_leaf) {
+        done = bptree_reclaim_parallel(tree, num_threads);
+    }
+#else
+    (void)num_threads;
+#endif
+    if (!done) bptree_reclaim_subtree(tree->root, tree->max_keys);
+    while (tree->garbage) {
+        bptree_node *next = tree->garbage->next;
+        bptree_reclaim_subtree(tree->garbage, tree->max_keys);
+        tree->garbage = next;
+    }
+    free(tree->repair_keys);
+#ifdef BPTREE_ENABLE_LATENCY
+    free(tree->latency);
+#endif
+#ifdef BPTREE_ENABLE_TRACE
+    free(tree->trace);
+#endif
+    bptree_free_slabs(tree);
+    free(tree);
+}
+
+BPTREE_API void bptree_free(bptree *tree) {
+    if (!tree) return;
+    bptree_set_budget(tree, NULL);
+    bptree_reclaim(tree, 1);
+}
+
+/**
+ * @brief State of a bptree_free_async call.
+ */
+struct bptree_free_task {
+    bptree *tree;    /**< Tree being freed */
+    int num_threads; /**< Number of threads to free the nodes with */
+    bool detached;   /**< If true, the task frees itself when done */
+#ifdef BPTREE_ENABLE_THREADS
+    pthread_t thread; /**< Background thread doing the work */
+#endif
+};
+
+#ifdef BPTREE_ENABLE_THREADS
+/**
+ * @brief Background thread entry point of bptree_free_async.
+ *
+ * @param arg Pointer to the bptree_free_task.
+ * @return NULL.
+ */
+static void *bptree_free_task_run(void *arg) {
+    bptree_free_task *task = arg;
+    bptree_reclaim(task->tree, task->num_threads);
+    if (task->detached) free(task);
+    return NULL;
+}
+#endif
+
+BPTREE_API bptree_status bptree_free_async(bptree *tree, const int num_threads,
+                                           bptree_free_task **out_task) {
+    if (out_task) *out_task = NULL;
+    if (!tree || num_threads < 1) return BPTREE_INVALID_ARGUMENT;
+    // Give the memory back to the budget now, while still on the caller's thread.
+    bptree_set_budget(tree, NULL);
+#ifdef BPTREE_ENABLE_THREADS
+    bptree_free_task *task = malloc(sizeof(bptree_free_task));
+    if (task) {
+        task->tree = tree;
+        task->num_threads = num_threads;
+        task->detached = !out_task;
+        // A detached task may be freed by its thread at any time once the thread starts,
+        // so the thread id goes to a local and the thread is created detached.
+        pthread_attr_t attr;
+        bool started = false;
+        if (pthread_attr_init(&attr) == 0) {
+            pthread_t thread;
+            if (task->detached) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            started = pthread_create(&thread, &attr, bptree_free_task_run, task) == 0;
+            pthread_attr_destroy(&attr);
+            if (started && out_task) {
+                task->thread = thread;
+                *out_task = task;
+            }
         }
-        if (is_root && tree->count == 0 && node->num_keys != 0) {
-            bptree_debug_print(tree->enable_debug,
-                               "Invariant Fail: Empty tree root leaf %p has keys (%d)\n",
-                               (void *)node, node->num_keys);
-            return false;
+        if (started) return BPTREE_OK;
+        free(task);
+    }
+#endif
+    // No background thread, so do the work here.
+    bptree_reclaim(tree, num_threads);
+    return BPTREE_OK;
+}
+
+BPTREE_API void bptree_free_wait(bptree_free_task *task) {
+    if (!task) return;
+#ifdef BPTREE_ENABLE_THREADS
+    pthread_join(task->thread, NULL);
+#endif
+    free(task);
+}
+
+/**
+ * @brief Position of an entry in the leaf chain, used by the ordered merge walks.
+ */
+typedef struct bptree_cursor {
+    const bptree *tree; /**< Tree being walked */
+    bptree_node *leaf;  /**< Current leaf, or NULL once the walk is past the last entry */
+    int index;          /**< Index of the current entry within the leaf */
+} bptree_cursor;
+
+/**
+ * @brief Move the cursor off the end of exhausted (or empty) leaves.
+ *
+ * @param cur Pointer to the cursor.
+ */
+static void bptree_cursor_normalize(bptree_cursor *cur) {
+    while (cur->leaf && cur->index >= cur->leaf->num_keys) {
+        cur->leaf = cur->leaf->next;
+        cur->index = 0;
+    }
+}
+
+/**
+ * @brief Position a cursor on the smallest entry of a tree.
+ *
+ * @param cur Pointer to the cursor.
+ * @param tree Pointer to the tree to walk.
+ */
+static void bptree_cursor_first(bptree_cursor *cur, const bptree *tree) {
+    cur->tree = tree;
+    cur->leaf = tree->first_leaf;
+    cur->index = 0;
+    bptree_cursor_normalize(cur);
+}
+
+/**
+ * @brief Get the key at the cursor position.
+ *
+ * @param cur Pointer to a cursor positioned on an entry.
+ * @return Pointer to the key stored in the leaf.
+ */
+static const bptree_key_t *bptree_cursor_key(const bptree_cursor *cur) {
+    return &bptree_node_keys(cur->leaf)[cur->index];
+}
+
+/**
+ * @brief Get the value at the cursor position.
+ *
+ * @param cur Pointer to a cursor positioned on an entry.
+ * @return The value stored in the leaf.
+ */
+static bptree_value_t bptree_cursor_value(const bptree_cursor *cur) {
+    return bptree_node_values(cur->leaf, cur->tree->max_keys)[cur->index];
+}
+
+/**
+ * @brief Advance the cursor to the next entry in key order.
+ *
+ * @param cur Pointer to the cursor.
+ */
+static void bptree_cursor_next(bptree_cursor *cur) {
+    cur->index++;
+    bptree_cursor_normalize(cur);
+}
+
+/**
+ * @brief Advance the cursor to the first entry whose key is >= @p key.
+ *
+ * Targets in the current or the next leaf are found with a binary search in that leaf.
+ * Farther targets are reached with a descent from the root, so a skip costs O(log n)
+ * no matter how many leaves lie in between. The cursor never moves backwards.
+ *
+ * @param cur Pointer to the cursor.
+ * @param key Pointer to the target key.
+ */
+static void bptree_cursor_seek(bptree_cursor *cur, const bptree_key_t *key) {
+    const bptree *tree = cur->tree;
+    for (int hop = 0; hop < 2 && cur->leaf; hop++) {
+        const int n = cur->leaf->num_keys;
+        if (n > 0 && tree->compare(key, &bptree_node_keys(cur->leaf)[n - 1]) <= 0) {
+            const int pos = bptree_node_search(tree, cur->leaf, key);
+            if (pos > cur->index) cur->index = pos;
+            return;
         }
-        return true;
+        cur->leaf = cur->leaf->next;
+        cur->index = 0;
+    }
+    if (!cur->leaf) return;
+    // The target is more than a leaf away; skip ahead through the internal nodes.
+    bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        node = bptree_node_children(node, tree->max_keys)[bptree_node_search(tree, node, key)];
+    }
+    cur->leaf = node;
+    cur->index = bptree_node_search(tree, node, key);
+    bptree_cursor_normalize(cur);
+}
+
+/**
+ * @brief Take a node from a list of spare nodes, or allocate one.
+ *
+ * @param tree Pointer to the tree.
+ * @param level Height above the leaves; leaves and internal nodes must not be mixed up
+ *              with the kind of nodes on the list.
+ * @param spare Pointer to a list of nodes linked through `next` (may be NULL).
+ * @return Pointer to an empty node, or NULL on allocation failure.
+ */
+static bptree_node *bptree_node_take(bptree *tree, const int level, bptree_node **spare) {
+    if (!spare || !*spare) return bptree_node_alloc(tree, level);
+    bptree_node *node = *spare;
+    *spare = node->next;
+    bptree_node_set_level(tree, node, level);
+    node->num_keys = 0;
+    node->next = NULL;
+    return node;
+}
+
+/**
+ * @brief Nodes of a slab that have not been handed out yet.
+ *
+ * Nodes are carved one at a time on demand, so setting up a large slab costs no more
+ * than the allocation itself.
+ */
+typedef struct bptree_slab_carver {
+    char *base;     /**< Start of the slab */
+    char *leaf;     /**< Next leaf to carve */
+    char *internal; /**< Next internal node to carve */
+    int leaves;     /**< Number of leaves left to carve */
+    int internals;  /**< Number of internal nodes left to carve */
+} bptree_slab_carver;
+
+/**
+ * @brief Allocate a slab for a number of leaves and internal nodes.
+ *
+ * Leaves come first, followed by the internal nodes. Every node counts as live until it
+ * is released, or dropped with bptree_slab_carver_drop if it is never carved.
+ *
+ * @param tree Pointer to the tree that will own the slab.
+ * @param leaves Number of leaves (at least 1).
+ * @param internals Number of internal nodes.
+ * @param out_carver Pointer to the carver to set up for the slab.
+ * @return BPTREE_OK if successful, BPTREE_MEMORY_LIMIT if the slab would take the tree's
+ *         budget over its limit, or BPTREE_ALLOCATION_FAILURE.
+ */
+static bptree_status bptree_slab_alloc(bptree *tree, const int leaves, const int internals,
+                                       bptree_slab_carver *out_carver) {
+    const size_t leaf_stride = bptree_node_stride(tree, true);
+    const size_t internal_stride = bptree_node_stride(tree, false);
+    const size_t leaf_align = bptree_node_align(true);
+    const size_t internal_align = bptree_node_align(false);
+    const size_t align = leaf_align > internal_align ? leaf_align : internal_align;
+    const size_t internal_offset =
+        ((size_t)leaves * leaf_stride + internal_align - 1) & ~(internal_align - 1);
+    size_t size = internal_offset + (size_t)internals * internal_stride;
+    size = (size + align - 1) & ~(align - 1);
+    const bptree_budget *budget = tree->budget;
+    if (budget && budget->limit > 0 && budget->used + size > budget->limit) {
+        BPTREE_LOG_ERROR(tree->enable_debug, "Slab of %zu bytes does not fit the budget.\n", size);
+        return BPTREE_MEMORY_LIMIT;
+    }
+    bptree_slab *slabs = realloc(tree->slabs, (tree->num_slabs + 1) * sizeof(bptree_slab));
+    if (!slabs) return BPTREE_ALLOCATION_FAILURE;
+    tree->slabs = slabs;
+    char *base = aligned_alloc(align, size);
+    if (!base) return BPTREE_ALLOCATION_FAILURE;
+    tree->slabs[tree->num_slabs++] = (bptree_slab){base, size, leaves + internals};
+    bptree_charge(tree, size);
+    *out_carver = (bptree_slab_carver){base, base, base + internal_offset, leaves, internals};
+    BPTREE_LOG_EVENT(tree->enable_debug, "Allocated slab of %zu bytes (%d leaves, %d internal)\n",
+                     size, leaves, internals);
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Carve the next node of a kind from a slab.
+ *
+ * @param tree Pointer to the tree owning the slab.
+ * @param carver Pointer to the carver of the slab.
+ * @param is_leaf True to carve a leaf, false for an internal node.
+ * @return Pointer to an empty node outside the per-level counts, or NULL if the slab has
+ *         no nodes of that kind left.
+ */
+static bptree_node *bptree_slab_carve(bptree *tree, bptree_slab_carver *carver,
+                                      const bool is_leaf) {
+    int *left = is_leaf ? &carver->leaves : &carver->internals;
+    if (*left == 0) return NULL;
+    char **next = is_leaf ? &carver->leaf : &carver->internal;
+    bptree_node *node = (bptree_node *)*next;
+    *next += bptree_node_stride(tree, is_leaf);
+    (*left)--;
+    if (is_leaf) {
+        tree->leaf_nodes++;
     } else {
-        // For internal nodes, check occupancy constraints.
-        if (!is_root &&
-            (node->num_keys < tree->min_internal_keys || node->num_keys > tree->max_keys)) {
-            bptree_debug_print(
-                tree->enable_debug,
-                "Invariant Fail: Internal node %p key count out of range [%d, %d] (%d keys)\n",
-                (void *)node, tree->min_internal_keys, tree->max_keys, node->num_keys);
-            return false;
+        tree->internal_nodes++;
+    }
+    node->is_leaf = is_leaf;
+    node->in_slab = true;
+    node->referenced = false;
+    node->level = BPTREE_NO_LEVEL;
+    node->num_keys = 0;
+    node->next = NULL;
+#ifdef BPTREE_ENABLE_TTL
+    node->min_expiry = BPTREE_NO_EXPIRY;
+#endif
+#ifdef BPTREE_ENABLE_HEATMAP
+    node->heat = 0;
+    node->heat_epoch = 0;
+#endif
+    BPTREE_EVENT(tree, NODE_ALLOC, node__alloc, node, NULL, is_leaf, 0, -1);
+    return node;
+}
+
+/**
+ * @brief Stop counting the nodes a carver never handed out as live in their slab.
+ *
+ * @param tree Pointer to the tree owning the slab.
+ * @param carver Pointer to the carver of the slab.
+ */
+static void bptree_slab_carver_drop(bptree *tree, bptree_slab_carver *carver) {
+    const int unused = carver->leaves + carver->internals;
+    carver->leaves = 0;
+    carver->internals = 0;
+    if (unused == 0) return;
+    for (int i = 0; i < tree->num_slabs; i++) {
+        bptree_slab *slab = &tree->slabs[i];
+        if (slab->base != carver->base) continue;
+        slab->live -= unused;
+        if (slab->live == 0) {
+            free(slab->base);
+            bptree_uncharge(tree, slab->size);
+            tree->slabs[i] = tree->slabs[--tree->num_slabs];
         }
-        if (is_root && tree->count > 0 && node->num_keys < 1) {
-            bptree_debug_print(
-                tree->enable_debug,
-                "Invariant Fail: Internal root node %p has < 1 key (%d keys) in non-empty tree\n",
-                (void *)node, node->num_keys);
-            return false;
+        return;
+    }
+}
+
+/**
+ * @brief State for building the internal levels on top of a chain of leaves, a node at a time.
+ *
+ * The leaves are refreshed and counted first. Then each level is given parents in order:
+ * the parents built so far are chained through `next`, and so are the nodes of the level
+ * that do not have a parent yet.
+ */
+typedef struct bptree_level_build {
+    bptree_node *level; /**< First node of the level being given parents */
+    bptree_node *last;  /**< Last node of that level */
+    bptree_node *child; /**< Next leaf to refresh, or next node of the level to give a parent */
+    bptree_node *head;  /**< First parent built so far on the level above */
+    bptree_node *tail;  /**< Last parent built so far on the level above */
+    int n;              /**< Number of nodes on the level (leaves refreshed so far, at first) */
+    int parents;        /**< Number of parents built so far on the level above */
+    int taken;          /**< Number of nodes of the level given a parent so far */
+    int height;         /**< Height of the tree up to the level */
+    bool refreshing;    /**< True until every leaf has been refreshed and counted */
+} bptree_level_build;
+
+/**
+ * @brief State for building a tree bottom-up from entries in ascending key order.
+ */
+typedef struct bptree_builder {
+    bptree *tree;      /**< Empty tree being populated */
+    bptree_node *head; /**< First leaf of the new leaf chain */
+    bptree_node *leaf; /**< Leaf receiving appended entries */
+    bptree_node *prev; /**< Leaf before `leaf` in the chain (NULL for the first leaf) */
+    int fill;          /**< Number of entries placed in each leaf before starting a new one */
+    bool sealed;       /**< True once the leaves are complete and `levels` is in use */
+    bptree_node *spare_leaves;    /**< Preallocated leaves to use before allocating */
+    bptree_node *spare_internals; /**< Preallocated internal nodes to use before allocating */
+    bptree_slab_carver carver;    /**< Slab to carve nodes from once the spare lists run out */
+    bptree_level_build levels;    /**< Internal levels being built, once sealed */
+} bptree_builder;
+
+/**
+ * @brief Clamp a number of entries per leaf to what a leaf may hold.
+ *
+ * @param tree Pointer to the tree.
+ * @param fill Requested entries per leaf.
+ * @return The fill, clamped to [min_leaf_keys, max_keys].
+ */
+static int bptree_clamp_fill(const bptree *tree, const int fill) {
+    if (fill > tree->max_keys) return tree->max_keys;
+    if (fill < tree->min_leaf_keys) return tree->min_leaf_keys;
+    return fill;
+}
+
+/**
+ * @brief Start building into an empty tree.
+ *
+ * @param builder Pointer to the builder state.
+ * @param tree Pointer to an empty tree; its root leaf becomes the first leaf.
+ * @param fill Entries per leaf (clamped to [min_leaf_keys, max_keys]).
+ */
+static void bptree_builder_init(bptree_builder *builder, bptree *tree, const int fill) {
+    builder->tree = tree;
+    builder->head = tree->root;
+    builder->leaf = tree->root;
+    builder->prev = NULL;
+    builder->fill = bptree_clamp_fill(tree, fill);
+    builder->sealed = false;
+    builder->spare_leaves = NULL;
+    builder->spare_internals = NULL;
+    builder->carver = (bptree_slab_carver){NULL, NULL, NULL, 0, 0};
+}
+
+/**
+ * @brief Append an entry to the tree being built.
+ *
+ * Keys must be appended in strictly ascending order.
+ *
+ * @param builder Pointer to the builder state.
+ * @param key Pointer to the key.
+ * @param value The value associated with the key.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise.
+ */
+static bptree_status bptree_builder_append(bptree_builder *builder, const bptree_key_t *key,
+                                           const bptree_value_t value) {
+    bptree *tree = builder->tree;
+    if (builder->leaf->num_keys >= builder->fill) {
+        if (!builder->spare_leaves) {
+            builder->spare_leaves = bptree_slab_carve(tree, &builder->carver, true);
         }
-        if (is_root && node->num_keys > tree->max_keys) {
-            bptree_debug_print(tree->enable_debug,
-                               "Invariant Fail: Internal root node %p has > max_keys (%d > %d)\n",
-                               (void *)node, node->num_keys, tree->max_keys);
-            return false;
+        bptree_node *leaf = bptree_node_take(tree, 0, &builder->spare_leaves);
+        if (!leaf) return BPTREE_ALLOCATION_FAILURE;
+        builder->leaf->next = leaf;
+        builder->prev = builder->leaf;
+        builder->leaf = leaf;
+    }
+    bptree_node *leaf = builder->leaf;
+    bptree_node_keys(leaf)[leaf->num_keys] = *key;
+    bptree_node_values(leaf, tree->max_keys)[leaf->num_keys] = value;
+    bptree_leaf_init_extras(tree, leaf, leaf->num_keys);
+    leaf->num_keys++;
+    tree->count++;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Append the entry under a cursor to the tree being built.
+ *
+ * @param builder Pointer to the builder state.
+ * @param cur Pointer to a cursor positioned on an entry.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise.
+ */
+static bptree_status bptree_builder_append_cursor(bptree_builder *builder,
+                                                  const bptree_cursor *cur) {
+    const bptree_status status =
+        bptree_builder_append(builder, bptree_cursor_key(cur), bptree_cursor_value(cur));
+    if (status == BPTREE_OK) {
+        bptree_leaf_move_extras(builder->tree, builder->leaf, builder->leaf->num_keys - 1,
+                                cur->leaf, cur->index, 1);
+    }
+    return status;
+}
+
+/**
+ * @brief Free the internal nodes of a subtree, leaving its leaves alone.
+ *
+ * @param node Pointer to the subtree root.
+ * @param tree Pointer to the tree.
+ */
+static void bptree_free_internal_nodes(bptree_node *node, bptree *tree) {
+    if (!node || node->is_leaf) return;
+    bptree_node **children = bptree_node_children(node, tree->max_keys);
+    for (int i = 0; i <= node->num_keys; i++) {
+        bptree_free_internal_nodes(children[i], tree);
+    }
+    bptree_node_release(tree, node);
+}
+
+/**
+ * @brief Start building the internal levels on top of a chain of leaves.
+ *
+ * @param tree Pointer to the tree.
+ * @param b Pointer to the build state.
+ * @param first_leaf Pointer to the first leaf of a non-empty, properly filled chain.
+ */
+static void bptree_level_build_init(bptree *tree, bptree_level_build *b,
+                                    bptree_node *first_leaf) {
+    tree->first_leaf = first_leaf;
+    b->level = first_leaf;
+    b->last = NULL;
+    b->child = first_leaf;
+    b->head = NULL;
+    b->tail = NULL;
+    b->n = 0;
+    b->parents = 0;
+    b->taken = 0;
+    b->height = 1;
+    b->refreshing = true;
+}
+
+/**
+ * @brief Do one node of an internal level build: refresh a leaf or build a parent.
+ *
+ * Children are spread evenly over the fewest parents that can hold them, which keeps
+ * every node within its occupancy bounds. Parents are taken from @p spare, then carved
+ * from @p carver, and allocated once both run out. Once the root is built, the tree
+ * root, height, and cached first and last leaves are set.
+ *
+ * @param tree Pointer to the tree.
+ * @param b Pointer to the build state.
+ * @param spare Pointer to a list of internal nodes to reuse before allocating (may be NULL).
+ * @param carver Pointer to a slab to carve internal nodes from (may be NULL).
+ * @param out_done Pointer to a flag set once the levels are built.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise (the state is left
+ *         as it was, for bptree_level_build_abort).
+ */
+static bptree_status bptree_level_build_step(bptree *tree, bptree_level_build *b,
+                                             bptree_node **spare, bptree_slab_carver *carver,
+                                             bool *out_done) {
+    *out_done = false;
+    if (b->refreshing) {
+        bptree_node *leaf = b->child;
+        bptree_node_refresh(tree, leaf);
+        tree->last_leaf = leaf;
+        b->last = leaf;
+        b->n++;
+        b->child = leaf->next;
+        if (b->child) return BPTREE_OK;
+        b->refreshing = false;
+        b->child = b->level;
+    } else {
+        const int fanout = tree->max_keys + 1;
+        const int parents = (b->n + fanout - 1) / fanout;
+        const int take = b->n / parents + (b->parents < b->n % parents ? 1 : 0);
+        if (spare && !*spare && carver) *spare = bptree_slab_carve(tree, carver, false);
+        bptree_node *parent = bptree_node_take(tree, b->height, spare);
+        if (!parent) return BPTREE_ALLOCATION_FAILURE;
+        bptree_key_t *keys = bptree_node_keys(parent);
+        bptree_node **children = bptree_node_children(parent, tree->max_keys);
+        for (int j = 0; j < take; j++) {
+            bptree_node *child = b->child;
+            b->child = child->next;
+            children[j] = child;
+            if (j > 0) keys[j - 1] = bptree_find_smallest_key(child, tree->max_keys);
+            if (!child->is_leaf) child->next = NULL;
         }
-        bptree_node **children = bptree_node_children(node, tree->max_keys);
-        // Check child pointers and recursively validate children.
-        if (node->num_keys >= 0) {
-            if (!children[0]) {
-                bptree_debug_print(tree->enable_debug,
-                                   "Invariant Fail: Internal node %p missing child[0]\n",
-                                   (void *)node);
-                return false;
-            }
-            // Validate left child's maximum key relative to parent's key[0].
-            if (node->num_keys > 0 && (children[0]->num_keys > 0 || !children[0]->is_leaf)) {
-                const bptree_key_t max_in_child0 =
-                    bptree_find_largest_key(children[0], tree->max_keys);
-                if (tree->compare(&max_in_child0, &keys[0]) >= 0) {
-                    bptree_debug_print(tree->enable_debug,
-                                       "Invariant Fail: max(child[0]) >= key[0] in node %p -- "
-                                       "MaxChild=%lld Key=%lld\n",
-                                       (void *)node, (long long)max_in_child0, (long long)keys[0]);
-                    return false;
-                }
-            }
-            if (!bptree_check_invariants_node(children[0], tree, depth + 1, leaf_depth))
-                return false;
-            // Loop over remaining children.
-            for (int i = 1; i <= node->num_keys; i++) {
-                if (!children[i]) {
-                    bptree_debug_print(tree->enable_debug,
-                                       "Invariant Fail: Internal node %p missing child[%d]\n",
-                                       (void *)node, i);
-                    return false;
-                }
-                if (children[i]->num_keys > 0 || !children[i]->is_leaf) {
-                    bptree_key_t min_in_child =
-                        bptree_find_smallest_key(children[i], tree->max_keys);
-                    if (tree->compare(&keys[i - 1], &min_in_child) > 0) {
-                        bptree_debug_print(tree->enable_debug,
-                                           "Invariant Fail: key[%d] > min(child[%d]) in node %p\n",
-                                           i - 1, i, (void *)node);
-                        return false;
-                    }
-                    if (i < node->num_keys) {
-                        bptree_key_t max_in_child =
-                            bptree_find_largest_key(children[i], tree->max_keys);
-                        if (tree->compare(&max_in_child, &keys[i]) >= 0) {
-                            bptree_debug_print(
-                                tree->enable_debug,
-                                "Invariant Fail: max(child[%d]) >= key[%d] in node %p\n", i, i,
-                                (void *)node);
-                            return false;
-                        }
-                    }
-                } else if (children[i]->is_leaf && children[i]->num_keys == 0 && tree->count > 0) {
-                    bptree_debug_print(tree->enable_debug,
-                                       "Invariant Fail: Internal node %p points to empty leaf "
-                                       "child[%d] in non-empty tree\n",
-                                       (void *)node, i);
-                    return false;
-                }
-                if (!bptree_check_invariants_node(children[i], tree, depth + 1, leaf_depth))
-                    return false;
-            }
+        parent->num_keys = take - 1;
+        bptree_node_refresh(tree, parent);
+        if (b->tail) {
+            b->tail->next = parent;
         } else {
-            if (!is_root || tree->count > 0) {
-                bptree_debug_print(tree->enable_debug,
-                                   "Invariant Fail: Internal node %p has < 0 keys (%d)\n",
-                                   (void *)node, node->num_keys);
-                return false;
-            }
+            b->head = parent;
         }
-        return true;
+        b->tail = parent;
+        b->parents++;
+        b->taken += take;
+        if (b->parents < parents) return BPTREE_OK;
+        b->level = b->head;
+        b->last = b->tail;
+        b->child = b->head;
+        b->n = parents;
+        b->head = NULL;
+        b->tail = NULL;
+        b->parents = 0;
+        b->taken = 0;
+        b->height++;
     }
+    if (b->n > 1) return BPTREE_OK;
+    tree->root = b->level;
+    tree->height = b->height;
+    b->child = NULL;
+    *out_done = true;
+    BPTREE_LOG_EVENT(tree->enable_debug, "Built internal levels. Tree height: %d\n", b->height);
+    return BPTREE_OK;
 }
 
 /**
- * @brief Calculate the total allocation size needed for a node.
+ * @brief Free the internal nodes of an unfinished level build, leaving the leaves alone.
  *
- * Determines the memory required for a node including its header,
- * keys area, and either the child pointers area (for internals) or the values area (for leaves).
+ * @param tree Pointer to the tree.
+ * @param b Pointer to the build state.
+ */
+static void bptree_level_build_abort(bptree *tree, bptree_level_build *b) {
+    // Subtrees built so far hang off the parents on the level above and the nodes of the
+    // level that have no parent yet.
+    while (b->head) {
+        bptree_node *next = b->head->next;
+        bptree_free_internal_nodes(b->head, tree);
+        b->head = next;
+    }
+    while (b->child && !b->child->is_leaf) {
+        bptree_node *next = b->child->next;
+        bptree_free_internal_nodes(b->child, tree);
+        b->child = next;
+    }
+    b->tail = NULL;
+    b->child = NULL;
+}
+
+/**
+ * @brief Build the internal levels on top of a chain of leaves.
  *
- * @param tree Pointer to the tree structure.
- * @param is_leaf True if node is a leaf.
- * @return Size in bytes required for the node allocation.
+ * On success, the tree root, height, and cached first and last leaves are set.
+ * On failure, the internal nodes created so far are freed and the leaves are untouched.
+ *
+ * @param tree Pointer to the tree.
+ * @param first_leaf Pointer to the first leaf of a non-empty, properly filled chain.
+ * @param spare Pointer to a list of internal nodes to reuse before allocating (may be NULL).
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise.
  */
-static size_t bptree_node_alloc_size(const bptree *tree, const bool is_leaf) {
-    const int max_keys = tree->max_keys;
-    const size_t keys_area_sz = bptree_keys_area_size(max_keys);
-    size_t data_payload_size;
-    if (is_leaf) {
-        data_payload_size = (size_t)(max_keys + 1) * sizeof(bptree_value_t);
-    } else {
-        data_payload_size = (size_t)(max_keys + 2) * sizeof(bptree_node *);
+static bptree_status bptree_build_internal_levels(bptree *tree, bptree_node *first_leaf,
+                                                  bptree_node **spare) {
+    bptree_level_build b;
+    bptree_level_build_init(tree, &b, first_leaf);
+    bool done = false;
+    while (!done) {
+        const bptree_status status = bptree_level_build_step(tree, &b, spare, NULL, &done);
+        if (status != BPTREE_OK) {
+            bptree_level_build_abort(tree, &b);
+            return status;
+        }
     }
-    const size_t total_data_size = keys_area_sz + data_payload_size;
-    return sizeof(bptree_node) + total_data_size;
+    return BPTREE_OK;
 }
 
 /**
- * @brief Allocate a new node.
+ * @brief Fix up two adjacent leaves when either holds fewer entries than a leaf needs.
  *
- * Allocates memory for a node (leaf or internal) with proper alignment.
+ * Merges them into `prev` if the entries fit in one leaf, otherwise splits the entries
+ * evenly between them. Does nothing if both leaves are filled well enough.
  *
  * @param tree Pointer to the tree.
- * @param is_leaf True if the node should be a leaf.
- * @return Pointer to the allocated node, or NULL on failure.
+ * @param prev Pointer to the left leaf.
+ * @param leaf Pointer to the right leaf (`prev->next`); freed when merged.
+ * @return True if `leaf` was merged into `prev` and freed.
  */
-static bptree_node *bptree_node_alloc(const bptree *tree, const bool is_leaf) {
-    size_t max_align = alignof(bptree_node);
-    max_align = (max_align > alignof(bptree_key_t)) ? max_align : alignof(bptree_key_t);
-    if (is_leaf) {
-        max_align = (max_align > alignof(bptree_value_t)) ? max_align : alignof(bptree_value_t);
-    } else {
-        max_align = (max_align > alignof(bptree_node *)) ? max_align : alignof(bptree_node *);
+static bool bptree_leaf_pair_balance(bptree *tree, bptree_node *prev, bptree_node *leaf) {
+    if (prev->num_keys >= tree->min_leaf_keys && leaf->num_keys >= tree->min_leaf_keys) {
+        return false;
     }
-    size_t size = bptree_node_alloc_size(tree, is_leaf);
-    // Adjust size to be a multiple of the required alignment.
-    size = (size + max_align - 1) & ~(max_align - 1);
-    bptree_node *node = aligned_alloc(max_align, size);
-    if (node) {
-        node->is_leaf = is_leaf;
-        node->num_keys = 0;
-        node->next = NULL;
+    bptree_key_t *prev_keys = bptree_node_keys(prev);
+    bptree_value_t *prev_vals = bptree_node_values(prev, tree->max_keys);
+    bptree_key_t *leaf_keys = bptree_node_keys(leaf);
+    bptree_value_t *leaf_vals = bptree_node_values(leaf, tree->max_keys);
+    const int total = prev->num_keys + leaf->num_keys;
+    if (total <= tree->max_keys) {
+        bptree_copy_bytes(tree, prev_keys + prev->num_keys, leaf_keys,
+                          leaf->num_keys * sizeof(bptree_key_t));
+        bptree_copy_bytes(tree, prev_vals + prev->num_keys, leaf_vals,
+                          leaf->num_keys * sizeof(bptree_value_t));
+        bptree_leaf_move_extras(tree, prev, prev->num_keys, leaf, 0, leaf->num_keys);
+        prev->num_keys = total;
+        prev->next = leaf->next;
+        bptree_node_release(tree, leaf);
+        return true;
+    }
+    const int target = total / 2;
+    if (prev->num_keys > target) {
+        // Move the tail of prev to the front of leaf.
+        const int move = prev->num_keys - target;
+        bptree_move_bytes(tree, &leaf_keys[move], &leaf_keys[0],
+                          leaf->num_keys * sizeof(bptree_key_t));
+        bptree_move_bytes(tree, &leaf_vals[move], &leaf_vals[0],
+                          leaf->num_keys * sizeof(bptree_value_t));
+        bptree_leaf_move_extras(tree, leaf, move, leaf, 0, leaf->num_keys);
+        bptree_copy_bytes(tree, leaf_keys, prev_keys + target, move * sizeof(bptree_key_t));
+        bptree_copy_bytes(tree, leaf_vals, prev_vals + target, move * sizeof(bptree_value_t));
+        bptree_leaf_move_extras(tree, leaf, 0, prev, target, move);
+        prev->num_keys -= move;
+        leaf->num_keys += move;
     } else {
-        bptree_debug_print(tree->enable_debug, "Node allocation failed (size: %zu, align: %zu)\n",
-                           size, max_align);
+        // Move the head of leaf to the end of prev.
+        const int move = target - prev->num_keys;
+        bptree_copy_bytes(tree, prev_keys + prev->num_keys, leaf_keys,
+                          move * sizeof(bptree_key_t));
+        bptree_copy_bytes(tree, prev_vals + prev->num_keys, leaf_vals,
+                          move * sizeof(bptree_value_t));
+        bptree_leaf_move_extras(tree, prev, prev->num_keys, leaf, 0, move);
+        bptree_move_bytes(tree, &leaf_keys[0], &leaf_keys[move],
+                          (leaf->num_keys - move) * sizeof(bptree_key_t));
+        bptree_move_bytes(tree, &leaf_vals[0], &leaf_vals[move],
+                          (leaf->num_keys - move) * sizeof(bptree_value_t));
+        bptree_leaf_move_extras(tree, leaf, 0, leaf, move, leaf->num_keys - move);
+        prev->num_keys += move;
+        leaf->num_keys -= move;
     }
-    return node;
+    return false;
 }
 
 /**
- * @brief Recursively free a node and its children.
+ * @brief End the appending of a bottom-up build and start building its internal levels.
  *
- * Frees the memory for a node. For internal nodes, it recurses into all child nodes.
+ * Merges or evens out the last two leaves if the last one is underfull.
  *
- * @param node Pointer to the node to free.
- * @param tree Pointer to the tree.
+ * @param builder Pointer to the builder state.
  */
-static void bptree_free_node(bptree_node *node, bptree *tree) {
-    if (!node) return;
-    if (!node->is_leaf) {
-        bptree_node **children = bptree_node_children(node, tree->max_keys);
-        for (int i = 0; i <= node->num_keys; i++) {
-            bptree_free_node(children[i], tree);
-        }
+static void bptree_builder_seal(bptree_builder *builder) {
+    bptree *tree = builder->tree;
+    if (builder->prev && bptree_leaf_pair_balance(tree, builder->prev, builder->leaf)) {
+        builder->leaf = builder->prev;
     }
-    free(node);
+    bptree_level_build_init(tree, &builder->levels, builder->head);
+    builder->sealed = true;
 }
 
 /**
- * @brief Rebalance the tree upward from a given node.
+ * @brief Do one node of the internal levels of a sealed bottom-up build.
  *
- * After a deletion, this function walks up the node stack and rebalances by borrowing
- * keys from siblings or merging nodes, if needed.
+ * Internal nodes come from the spare list, then from the slab, keeping them in address
+ * order.
  *
- * @param tree Pointer to the tree.
- * @param node_stack Array of pointers representing the path from root to the underflowing node.
- * @param index_stack Array of indexes corresponding to the child position in each parent node.
- * @param depth Current depth where the underflow occurred.
+ * @param builder Pointer to the builder state.
+ * @param out_done Pointer to a flag set once the levels are built.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise.
  */
-static void bptree_rebalance_up(bptree *tree, bptree_node **node_stack, const int *index_stack,
-                                const int depth) {
-    for (int d = depth - 1; d >= 0; d--) {
-        bptree_node *parent = node_stack[d];
-        const int child_idx = index_stack[d];
-        bptree_node **children = bptree_node_children(parent, tree->max_keys);
-        bptree_node *child = children[child_idx];
-        const int min_keys = child->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys;
-        // If the node has enough keys, no need for rebalancing.
-        if (child->num_keys >= min_keys) {
-            bptree_debug_print(tree->enable_debug,
-                               "Rebalance unnecessary at depth %d, child %d has %d keys (min %d)\n",
-                               d, child_idx, child->num_keys, min_keys);
-            break;
-        }
-        bptree_debug_print(tree->enable_debug,
-                           "Rebalance needed at depth %d for child %d (%d keys < min %d)\n", d,
-                           child_idx, child->num_keys, min_keys);
-        // Try borrowing from the left sibling.
-        if (child_idx > 0) {
-            bptree_node *left_sibling = children[child_idx - 1];
-            const int left_min =
-                left_sibling->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys;
-            if (left_sibling->num_keys > left_min) {
-                bptree_debug_print(tree->enable_debug,
-                                   "Attempting borrow from left sibling (idx %d)\n", child_idx - 1);
-                bptree_key_t *parent_keys = bptree_node_keys(parent);
-                if (child->is_leaf) {
-                    bptree_key_t *child_keys = bptree_node_keys(child);
-                    bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
-                    const bptree_key_t *left_keys = bptree_node_keys(left_sibling);
-                    const bptree_value_t *left_vals =
-                        bptree_node_values(left_sibling, tree->max_keys);
-                    // Shift keys and values right to open space at index 0.
-                    memmove(&child_keys[1], &child_keys[0], child->num_keys * sizeof(bptree_key_t));
-                    memmove(&child_vals[1], &child_vals[0],
-                            child->num_keys * sizeof(bptree_value_t));
-                    // Move the last key/value from the left sibling.
-                    child_keys[0] = left_keys[left_sibling->num_keys - 1];
-                    child_vals[0] = left_vals[left_sibling->num_keys - 1];
-                    child->num_keys++;
-                    left_sibling->num_keys--;
-                    // Update the parent separator.
-                    parent_keys[child_idx - 1] = child_keys[0];
-                    bptree_debug_print(tree->enable_debug,
-                                       "Borrowed leaf key from left. Parent key updated.\n");
-                    break;
-                } else {
-                    // Internal node case: shift keys and children to insert the borrowed key.
-                    bptree_key_t *child_keys = bptree_node_keys(child);
-                    bptree_node **child_children = bptree_node_children(child, tree->max_keys);
-                    bptree_key_t *left_keys = bptree_node_keys(left_sibling);
-                    bptree_node **left_children =
-                        bptree_node_children(left_sibling, tree->max_keys);
-                    memmove(&child_keys[1], &child_keys[0], child->num_keys * sizeof(bptree_key_t));
-                    memmove(&child_children[1], &child_children[0],
-                            (child->num_keys + 1) * sizeof(bptree_node *));
-                    child_keys[0] = parent_keys[child_idx - 1];
-                    child_children[0] = left_children[left_sibling->num_keys];
-                    parent_keys[child_idx - 1] = left_keys[left_sibling->num_keys - 1];
-                    child->num_keys++;
-                    left_sibling->num_keys--;
-                    bptree_debug_print(
-                        tree->enable_debug,
-                        "Borrowed internal key/child from left. Parent key updated.\n");
-                    break;
-                }
-            }
-        }
-        // Try borrowing from the right sibling.
-        if (child_idx < parent->num_keys) {
-            bptree_node *right_sibling = children[child_idx + 1];
-            const int right_min =
-                right_sibling->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys;
-            if (right_sibling->num_keys > right_min) {
-                bptree_debug_print(tree->enable_debug,
-                                   "Attempting borrow from right sibling (idx %d)\n",
-                                   child_idx + 1);
-                bptree_key_t *parent_keys = bptree_node_keys(parent);
-                if (child->is_leaf) {
-                    bptree_key_t *child_keys = bptree_node_keys(child);
-                    bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
-                    bptree_key_t *right_keys = bptree_node_keys(right_sibling);
-                    bptree_value_t *right_vals = bptree_node_values(right_sibling, tree->max_keys);
-                    // Borrow the first key/value from the right sibling.
-                    child_keys[child->num_keys] = right_keys[0];
-                    child_vals[child->num_keys] = right_vals[0];
-                    child->num_keys++;
-                    right_sibling->num_keys--;
-                    // Shift right sibling's keys/values left.
-                    memmove(&right_keys[0], &right_keys[1],
-                            right_sibling->num_keys * sizeof(bptree_key_t));
-                    memmove(&right_vals[0], &right_vals[1],
-                            right_sibling->num_keys * sizeof(bptree_value_t));
-                    parent_keys[child_idx] = right_keys[0];
-                    bptree_debug_print(tree->enable_debug,
-                                       "Borrowed leaf key from right. Parent key updated.\n");
-                    break;
-                } else {
-                    // Internal node: borrow key and child pointer from right sibling.
-                    bptree_key_t *child_keys = bptree_node_keys(child);
-                    bptree_node **child_children = bptree_node_children(child, tree->max_keys);
-                    bptree_key_t *right_keys = bptree_node_keys(right_sibling);
-                    bptree_node **right_children =
-                        bptree_node_children(right_sibling, tree->max_keys);
-                    child_keys[child->num_keys] = parent_keys[child_idx];
-                    child_children[child->num_keys + 1] = right_children[0];
-                    parent_keys[child_idx] = right_keys[0];
-                    child->num_keys++;
-                    right_sibling->num_keys--;
-                    memmove(&right_keys[0], &right_keys[1],
-                            right_sibling->num_keys * sizeof(bptree_key_t));
-                    memmove(&right_children[0], &right_children[1],
-                            (right_sibling->num_keys + 1) * sizeof(bptree_node *));
-                    bptree_debug_print(
-                        tree->enable_debug,
-                        "Borrowed internal key/child from right. Parent key updated.\n");
-                    break;
-                }
-            }
-        }
-        // If borrowing failed, attempt a merge.
-        bptree_debug_print(tree->enable_debug, "Borrow failed, attempting merge\n");
-        if (child_idx > 0) {
-            // Merge with left sibling.
-            bptree_node *left_sibling = children[child_idx - 1];
-            bptree_debug_print(tree->enable_debug, "Merging child %d into left sibling %d\n",
-                               child_idx, child_idx - 1);
-            if (child->is_leaf) {
-                bptree_key_t *left_keys = bptree_node_keys(left_sibling);
-                bptree_value_t *left_vals = bptree_node_values(left_sibling, tree->max_keys);
-                const bptree_key_t *child_keys = bptree_node_keys(child);
-                const bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
-                const int combined_keys = left_sibling->num_keys + child->num_keys;
-                if (combined_keys > tree->max_keys) {
-                    fprintf(stderr,
-                            "[BPTree FATAL] Merge-Left (Leaf) Buffer Overflow PREVENTED! Combined "
-                            "keys %d > max_keys %d.\n",
-                            combined_keys, tree->max_keys);
-                    abort();
-                }
-                // Copy all keys and values from child to the left sibling.
-                memcpy(left_keys + left_sibling->num_keys, child_keys,
-                       child->num_keys * sizeof(bptree_key_t));
-                memcpy(left_vals + left_sibling->num_keys, child_vals,
-                       child->num_keys * sizeof(bptree_value_t));
-                left_sibling->num_keys = combined_keys;
-                left_sibling->next = child->next;
-                free(child);
-                children[child_idx] = NULL;
-            } else {
-                bptree_key_t *left_keys = bptree_node_keys(left_sibling);
-                bptree_node **left_children = bptree_node_children(left_sibling, tree->max_keys);
-                bptree_key_t *child_keys = bptree_node_keys(child);
-                bptree_node **child_children = bptree_node_children(child, tree->max_keys);
-                bptree_key_t *parent_keys = bptree_node_keys(parent);
-                const int combined_keys = left_sibling->num_keys + 1 + child->num_keys;
-                const int combined_children = (left_sibling->num_keys + 1) + (child->num_keys + 1);
-                if (combined_keys > tree->max_keys + 1) {
-                    fprintf(stderr,
-                            "[BPTree FATAL] Merge-Left (Internal) Key Buffer Overflow PREVENTED! "
-                            "Combined keys %d > buffer %d.\n",
-                            combined_keys, tree->max_keys + 1);
-                    abort();
-                }
-                if (combined_children > tree->max_keys + 2) {
-                    fprintf(stderr,
-                            "[BPTree FATAL] Merge-Left (Internal) Children Buffer Overflow "
-                            "PREVENTED! Combined children %d > buffer %d.\n",
-                            combined_children, tree->max_keys + 2);
-                    abort();
-                }
-                left_keys[left_sibling->num_keys] = parent_keys[child_idx - 1];
-                memcpy(left_keys + left_sibling->num_keys + 1, child_keys,
-                       child->num_keys * sizeof(bptree_key_t));
-                memcpy(left_children + left_sibling->num_keys + 1, child_children,
-                       (child->num_keys + 1) * sizeof(bptree_node *));
-                left_sibling->num_keys = combined_keys;
-                free(child);
-                children[child_idx] = NULL;
-            }
-            // Remove the parent separator key that pointed to the merged node.
-            bptree_key_t *parent_keys = bptree_node_keys(parent);
-            memmove(&parent_keys[child_idx - 1], &parent_keys[child_idx],
-                    (parent->num_keys - child_idx) * sizeof(bptree_key_t));
-            memmove(&children[child_idx], &children[child_idx + 1],
-                    (parent->num_keys - child_idx) * sizeof(bptree_node *));
-            parent->num_keys--;
-            bptree_debug_print(tree->enable_debug, "Merge with left complete. Parent updated.\n");
-        } else {
-            // Merge with right sibling if no left sibling is available.
-            bptree_node *right_sibling = children[child_idx + 1];
-            bptree_debug_print(tree->enable_debug, "Merging right sibling %d into child %d\n",
-                               child_idx + 1, child_idx);
-            if (child->is_leaf) {
-                bptree_key_t *child_keys = bptree_node_keys(child);
-                bptree_value_t *child_vals = bptree_node_values(child, tree->max_keys);
-                const bptree_key_t *right_keys = bptree_node_keys(right_sibling);
-                const bptree_value_t *right_vals =
-                    bptree_node_values(right_sibling, tree->max_keys);
-                const int combined_keys = child->num_keys + right_sibling->num_keys;
-                if (combined_keys > tree->max_keys) {
-                    fprintf(stderr,
-                            "[BPTree FATAL] Merge-Right (Leaf) Buffer Overflow PREVENTED! Combined "
-                            "keys %d > max_keys %d.\n",
-                            combined_keys, tree->max_keys);
-                    abort();
-                }
-                memcpy(child_keys + child->num_keys, right_keys,
-                       right_sibling->num_keys * sizeof(bptree_key_t));
-                memcpy(child_vals + child->num_keys, right_vals,
-                       right_sibling->num_keys * sizeof(bptree_value_t));
-                child->num_keys = combined_keys;
-                child->next = right_sibling->next;
-                free(right_sibling);
-                children[child_idx + 1] = NULL;
-            } else {
-                bptree_key_t *child_keys = bptree_node_keys(child);
-                bptree_node **child_children = bptree_node_children(child, tree->max_keys);
-                const bptree_key_t *right_keys = bptree_node_keys(right_sibling);
-                bptree_node **right_children = bptree_node_children(right_sibling, tree->max_keys);
-                const bptree_key_t *parent_keys = bptree_node_keys(parent);
-                const int combined_keys = child->num_keys + 1 + right_sibling->num_keys;
-                const int combined_children = (child->num_keys + 1) + (right_sibling->num_keys + 1);
-                if (combined_keys > tree->max_keys + 1) {
-                    fprintf(stderr,
-                            "[BPTree FATAL] Merge-Right (Internal) Key Buffer Overflow PREVENTED! "
-                            "Combined keys %d > buffer %d.\n",
-                            combined_keys, tree->max_keys + 1);
-                    abort();
-                }
-                if (combined_children > tree->max_keys + 2) {
-                    fprintf(stderr,
-                            "[BPTree FATAL] Merge-Right (Internal) Children Buffer Overflow "
-                            "PREVENTED! Combined children %d > buffer %d.\n",
-                            combined_children, tree->max_keys + 2);
-                    abort();
-                }
-                child_keys[child->num_keys] = parent_keys[child_idx];
-                memcpy(child_keys + child->num_keys + 1, right_keys,
-                       right_sibling->num_keys * sizeof(bptree_key_t));
-                memcpy(child_children + child->num_keys + 1, right_children,
-                       (right_sibling->num_keys + 1) * sizeof(bptree_node *));
-                child->num_keys = combined_keys;
-                free(right_sibling);
-                children[child_idx + 1] = NULL;
-            }
-            bptree_key_t *parent_keys = bptree_node_keys(parent);
-            memmove(&parent_keys[child_idx], &parent_keys[child_idx + 1],
-                    (parent->num_keys - child_idx - 1) * sizeof(bptree_key_t));
-            memmove(&children[child_idx + 1], &children[child_idx + 2],
-                    (parent->num_keys - child_idx - 1) * sizeof(bptree_node *));
-            parent->num_keys--;
-            bptree_debug_print(tree->enable_debug, "Merge with right complete. Parent updated.\n");
-        }
+static bptree_status bptree_builder_step(bptree_builder *builder, bool *out_done) {
+    return bptree_level_build_step(builder->tree, &builder->levels, &builder->spare_internals,
+                                   &builder->carver, out_done);
+}
+
+/**
+ * @brief Finish a bottom-up build.
+ *
+ * @param builder Pointer to the builder state.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise (the internal nodes
+ *         built so far are freed by bptree_builder_abort).
+ */
+static bptree_status bptree_builder_finish(bptree_builder *builder) {
+    bptree_builder_seal(builder);
+    bool done = false;
+    while (!done) {
+        const bptree_status status = bptree_builder_step(builder, &done);
+        if (status != BPTREE_OK) return status;
     }
-    // Check for the special case where the root becomes empty and the height can be reduced.
-    if (!tree->root->is_leaf && tree->root->num_keys == 0 && tree->count > 0) {
-        bptree_debug_print(tree->enable_debug,
-                           "Root node is internal and empty, shrinking height.\n");
-        bptree_node *old_root = tree->root;
-        tree->root = bptree_node_children(old_root, tree->max_keys)[0];
-        tree->height--;
-        free(old_root);
-    } else if (tree->count == 0 && tree->root && tree->root->num_keys != 0) {
-        bptree_debug_print(tree->enable_debug, "Tree empty, ensuring root node is empty.\n");
-        tree->root->num_keys = 0;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Release a tree whose bottom-up build did not finish.
+ *
+ * @param builder Pointer to the builder state.
+ */
+static void bptree_builder_abort(bptree_builder *builder) {
+    bptree *tree = builder->tree;
+    if (builder->sealed) bptree_level_build_abort(tree, &builder->levels);
+    bptree_node *leaf = builder->head;
+    while (leaf) {
+        bptree_node *next = leaf->next;
+        bptree_node_release(tree, leaf);
+        leaf = next;
     }
+    bptree_free_slabs(tree);
+    free(tree);
 }
 
 /**
- * @brief Binary search for a key in a node.
+ * @brief Move the internal nodes of a subtree onto a list of spare nodes.
  *
- * Searches for the first position in the node's key array where the key could be inserted.
+ * @param node Pointer to the subtree root.
+ * @param tree Pointer to the tree.
+ * @param spare Pointer to the list, linked through `next`.
+ */
+static void bptree_collect_internal_nodes(bptree_node *node, const bptree *tree,
+                                          bptree_node **spare) {
+    if (node->is_leaf) return;
+    bptree_node **children = bptree_node_children(node, tree->max_keys);
+    for (int i = 0; i <= node->num_keys; i++) {
+        bptree_collect_internal_nodes(children[i], tree, spare);
+    }
+    node->next = *spare;
+    *spare = node;
+}
+
+/**
+ * @brief Count the internal nodes bptree_build_internal_levels creates over a chain of leaves.
  *
  * @param tree Pointer to the tree.
- * @param node Pointer to the node.
- * @param key Pointer to the key.
- * @return The index at which the key is found or should be inserted.
+ * @param leaves Number of leaves in the chain.
+ * @return Number of internal nodes on all levels.
  */
-static int bptree_node_search(const bptree *tree, const bptree_node *node,
-                              const bptree_key_t *key) {
-    int low = 0, high = node->num_keys;
-    const bptree_key_t *keys = bptree_node_keys(node);
-    // Adjust behavior for leaf and internal nodes
-    if (node->is_leaf) {
-        while (low < high) {
-            const int mid = low + (high - low) / 2;
-            const int cmp = tree->compare(key, &keys[mid]);
-            if (cmp <= 0) {
-                high = mid;
-            } else {
-                low = mid + 1;
+static int bptree_internal_nodes_needed(const bptree *tree, int leaves) {
+    const int fanout = tree->max_keys + 1;
+    int needed = 0;
+    while (leaves > 1) {
+        leaves = (leaves + fanout - 1) / fanout;
+        needed += leaves;
+    }
+    return needed;
+}
+
+BPTREE_API bptree_status bptree_remove_if(bptree *tree, const bptree_entry_predicate predicate,
+                                          void *ctx) {
+    if (!tree || !tree->root || !predicate) return BPTREE_INVALID_ARGUMENT;
+    // The rebuild below takes its internal nodes from the current ones. Removal never adds
+    // leaves, so nodes for the current leaf count are enough; any shortfall is allocated
+    // before the first entry goes, which leaves the tree unchanged if allocation fails.
+    bptree_node *spare = NULL;
+    bptree_collect_internal_nodes(tree->root, tree, &spare);
+    int leaves = 0;
+    for (const bptree_node *leaf = tree->first_leaf; leaf; leaf = leaf->next) leaves++;
+    int have = 0;
+    for (const bptree_node *node = spare; node; node = node->next) have++;
+    for (int i = have; i < bptree_internal_nodes_needed(tree, leaves); i++) {
+        bptree_node *node = bptree_node_alloc(tree, 1);
+        if (!node) {
+            // The nodes allocated so far sit in front of the tree's own nodes.
+            for (int added = i - have; spare; added--) {
+                bptree_node *next = spare->next;
+                if (added > 0) {
+                    bptree_node_release(tree, spare);
+                } else {
+                    spare->next = NULL;
+                }
+                spare = next;
             }
+            return BPTREE_ALLOCATION_FAILURE;
         }
-    } else {
-        while (low < high) {
-            const int mid = low + (high - low) / 2;
-            const int cmp = tree->compare(key, &keys[mid]);
-            if (cmp < 0) {
-                high = mid;
-            } else {
-                low = mid + 1;
+        node->next = spare;
+        spare = node;
+    }
+    bptree_node *head = NULL;
+    bptree_node *prev = NULL;
+    int removed = 0;
+    bptree_node *leaf = tree->first_leaf;
+    while (leaf) {
+        bptree_node *next = leaf->next;
+        bptree_key_t *keys = bptree_node_keys(leaf);
+        bptree_value_t *values = bptree_node_values(leaf, tree->max_keys);
+        int kept = 0;
+        for (int i = 0; i < leaf->num_keys; i++) {
+            if (predicate(&keys[i], values[i], ctx)) continue;
+            if (kept != i) {
+                keys[kept] = keys[i];
+                values[kept] = values[i];
+                bptree_leaf_move_extras(tree, leaf, kept, leaf, i, 1);
             }
+            kept++;
+        }
+        removed += leaf->num_keys - kept;
+        leaf->num_keys = kept;
+        if (kept == 0 && (head || next)) {
+            // Empty leaves are dropped, except the last one when nothing survives at all.
+            bptree_node_release(tree, leaf);
+        } else if (!prev) {
+            head = leaf;
+            prev = leaf;
+        } else {
+            prev->next = leaf;
+            if (!bptree_leaf_pair_balance(tree, prev, leaf)) prev = leaf;
         }
+        leaf = next;
     }
-    return low;
+    prev->next = NULL;
+    tree->count -= removed;
+    tree->version++;
+    const bptree_status status = bptree_build_internal_levels(tree, head, &spare);
+    while (spare) {
+        bptree_node *next = spare->next;
+        bptree_node_release(tree, spare);
+        spare = next;
+    }
+    BPTREE_LOG_EVENT(tree->enable_debug, "Removed %d keys by predicate. Tree count: %lld\n",
+                     removed, (long long)tree->count);
+    return status;
 }
 
 /**
- * @brief Recursive insertion helper.
- *
- * Inserts a key/value pair into the subtree rooted at @p node.
- * Handles splitting of nodes if necessary and propagates split keys upward.
+ * @brief Kinds of set operations supported by bptree_set_operation.
+ */
+typedef enum {
+    BPTREE_SET_UNION,
+    BPTREE_SET_INTERSECT,
+    BPTREE_SET_DIFFERENCE
+} bptree_set_op;
+
+/**
+ * @brief Merge the leaf chains of two trees into a new tree.
  *
- * @param tree Pointer to the B+ tree.
- * @param node Current node.
- * @param key Pointer to the key to insert.
- * @param value Value to insert.
- * @param promoted_key Pointer to store the key to be promoted if a split occurs.
- * @param new_child Pointer to store the new node created from the split.
- * @return Status code indicating success or failure.
+ * @param a Pointer to the first tree (values are taken from it for shared keys).
+ * @param b Pointer to the second tree.
+ * @param op The set operation to perform.
+ * @param out_tree Pointer to store the new tree.
+ * @return Status code indicating success or error type.
  */
-static bptree_status bptree_insert_internal(bptree *tree, bptree_node *node,
-                                            const bptree_key_t *key, const bptree_value_t value,
-                                            bptree_key_t *promoted_key, bptree_node **new_child) {
-    const int pos = bptree_node_search(tree, node, key);
-    if (node->is_leaf) {
-        bptree_key_t *keys = bptree_node_keys(node);
-        bptree_value_t *values = bptree_node_values(node, tree->max_keys);
-        // If key exists, report duplicate.
-        if (pos < node->num_keys && tree->compare(key, &keys[pos]) == 0) {
-            bptree_debug_print(tree->enable_debug, "Insert failed: Duplicate key found.\n");
-            return BPTREE_DUPLICATE_KEY;
+static bptree_status bptree_set_operation(const bptree *a, const bptree *b, const bptree_set_op op,
+                                          bptree **out_tree) {
+    if (!a || !b || !a->root || !b->root || !out_tree) return BPTREE_INVALID_ARGUMENT;
+    *out_tree = NULL;
+    if (a->compare != b->compare) return BPTREE_INVALID_ARGUMENT;
+    bptree *result = bptree_create(a->max_keys, a->compare, a->enable_debug);
+    if (!result) return BPTREE_ALLOCATION_FAILURE;
+    bptree_builder builder;
+    bptree_builder_init(&builder, result, result->max_keys);
+    bptree_cursor ca, cb;
+    bptree_cursor_first(&ca, a);
+    bptree_cursor_first(&cb, b);
+    bptree_status status = BPTREE_OK;
+    while (status == BPTREE_OK && ca.leaf) {
+        if (!cb.leaf) {
+            if (op == BPTREE_SET_INTERSECT) break;
+            status = bptree_builder_append_cursor(&builder, &ca);
+            bptree_cursor_next(&ca);
+            continue;
         }
-        // Shift keys and values to make room for the new key/value.
-        memmove(&keys[pos + 1], &keys[pos], (node->num_keys - pos) * sizeof(bptree_key_t));
-        memmove(&values[pos + 1], &values[pos], (node->num_keys - pos) * sizeof(bptree_value_t));
-        keys[pos] = *key;
-        values[pos] = value;
-        node->num_keys++;
-        *new_child = NULL;
-        bptree_debug_print(tree->enable_debug, "Inserted key in leaf. Node keys: %d\n",
-                           node->num_keys);
-        // Check for overflow and split if needed.
-        if (node->num_keys > tree->max_keys) {
-            bptree_debug_print(tree->enable_debug, "Leaf node overflow (%d > %d), splitting.\n",
-                               node->num_keys, tree->max_keys);
-            const int total_keys = node->num_keys;
-            const int split_idx = (total_keys + 1) / 2;
-            const int new_node_keys = total_keys - split_idx;
-            bptree_node *new_leaf = bptree_node_alloc(tree, true);
-            if (!new_leaf) {
-                node->num_keys--;
-                bptree_debug_print(tree->enable_debug, "Leaf split allocation failed!\n");
-                return BPTREE_ALLOCATION_FAILURE;
+        const int cmp = a->compare(bptree_cursor_key(&ca), bptree_cursor_key(&cb));
+        if (cmp < 0) {
+            if (op == BPTREE_SET_INTERSECT) {
+                bptree_cursor_seek(&ca, bptree_cursor_key(&cb));
+            } else {
+                status = bptree_builder_append_cursor(&builder, &ca);
+                bptree_cursor_next(&ca);
             }
-            bptree_key_t *new_keys = bptree_node_keys(new_leaf);
-            bptree_value_t *new_values = bptree_node_values(new_leaf, tree->max_keys);
-            // Move the latter half keys/values to the new leaf.
-            memcpy(new_keys, &keys[split_idx], new_node_keys * sizeof(bptree_key_t));
-            memcpy(new_values, &values[split_idx], new_node_keys * sizeof(bptree_value_t));
-            new_leaf->num_keys = new_node_keys;
-            node->num_keys = split_idx;
-            new_leaf->next = node->next;
-            node->next = new_leaf;
-            *promoted_key = new_keys[0];
-            *new_child = new_leaf;
-            bptree_debug_print(tree->enable_debug,
-                               "Leaf split complete. Promoted key. Left keys: %d, Right keys: %d\n",
-                               node->num_keys, new_leaf->num_keys);
-        }
-        return BPTREE_OK;
-    } else {
-        // Recurse into the appropriate child.
-        bptree_node **children = bptree_node_children(node, tree->max_keys);
-        bptree_key_t child_promoted_key;
-        bptree_node *child_new_node = NULL;
-        const bptree_status status = bptree_insert_internal(tree, children[pos], key, value,
-                                                            &child_promoted_key, &child_new_node);
-        if (status != BPTREE_OK || child_new_node == NULL) {
-            return status;
-        }
-        bptree_debug_print(tree->enable_debug,
-                           "Child split propagated. Inserting promoted key into internal node.\n");
-        bptree_key_t *keys = bptree_node_keys(node);
-        // Shift parent's keys and child pointers to insert the promoted key.
-        memmove(&keys[pos + 1], &keys[pos], (node->num_keys - pos) * sizeof(bptree_key_t));
-        memmove(&children[pos + 2], &children[pos + 1],
-                (node->num_keys - pos) * sizeof(bptree_node *));
-        keys[pos] = child_promoted_key;
-        children[pos + 1] = child_new_node;
-        node->num_keys++;
-        bptree_debug_print(tree->enable_debug, "Internal node keys: %d\n", node->num_keys);
-        // Split internal node if it exceeds capacity.
-        if (node->num_keys > tree->max_keys) {
-            bptree_debug_print(tree->enable_debug, "Internal node overflow (%d > %d), splitting.\n",
-                               node->num_keys, tree->max_keys);
-            const int total_keys = node->num_keys;
-            const int split_idx = total_keys / 2;
-            const int new_node_keys = total_keys - split_idx - 1;
-            bptree_node *new_internal = bptree_node_alloc(tree, false);
-            if (!new_internal) {
-                node->num_keys--;
-                bptree_debug_print(tree->enable_debug, "Internal split allocation failed!\n");
-                return BPTREE_ALLOCATION_FAILURE;
+        } else if (cmp > 0) {
+            if (op == BPTREE_SET_UNION) {
+                status = bptree_builder_append_cursor(&builder, &cb);
+                bptree_cursor_next(&cb);
+            } else {
+                bptree_cursor_seek(&cb, bptree_cursor_key(&ca));
             }
-            bptree_key_t *new_keys = bptree_node_keys(new_internal);
-            bptree_node **new_children = bptree_node_children(new_internal, tree->max_keys);
-            *promoted_key = keys[split_idx];
-            *new_child = new_internal;
-            memcpy(new_keys, &keys[split_idx + 1], new_node_keys * sizeof(bptree_key_t));
-            memcpy(new_children, &children[split_idx + 1],
-                   (new_node_keys + 1) * sizeof(bptree_node *));
-            new_internal->num_keys = new_node_keys;
-            node->num_keys = split_idx;
-            bptree_debug_print(
-                tree->enable_debug,
-                "Internal split complete. Promoted key. Left keys: %d, Right keys: %d\n",
-                node->num_keys, new_internal->num_keys);
         } else {
-            *new_child = NULL;
+            if (op != BPTREE_SET_DIFFERENCE) {
+                status = bptree_builder_append_cursor(&builder, &ca);
+            }
+            bptree_cursor_next(&ca);
+            bptree_cursor_next(&cb);
         }
-        return BPTREE_OK;
     }
+    while (status == BPTREE_OK && op == BPTREE_SET_UNION && cb.leaf) {
+        status = bptree_builder_append_cursor(&builder, &cb);
+        bptree_cursor_next(&cb);
+    }
+    if (status == BPTREE_OK) status = bptree_builder_finish(&builder);
+    if (status != BPTREE_OK) {
+        bptree_builder_abort(&builder);
+        return status;
+    }
+    BPTREE_LOG_EVENT(a->enable_debug, "Set operation %d produced %lld keys.\n", (int)op,
+                     (long long)result->count);
+    *out_tree = result;
+    return BPTREE_OK;
 }
 
-BPTREE_API bptree_status bptree_put(bptree *tree, const bptree_key_t *key, bptree_value_t value) {
-    if (!tree || !key) return BPTREE_INVALID_ARGUMENT;
-    if (!tree->root) return BPTREE_INTERNAL_ERROR;
-    bptree_key_t promoted_key;
-    bptree_node *new_node = NULL;
-    const bptree_status status =
-        bptree_insert_internal(tree, tree->root, key, value, &promoted_key, &new_node);
-    if (status == BPTREE_OK) {
-        // If a split occurred at the root, create a new root.
-        if (new_node != NULL) {
-            bptree_debug_print(tree->enable_debug, "Root split occurred. Creating new root.\n");
-            bptree_node *new_root = bptree_node_alloc(tree, false);
-            if (!new_root) {
-                bptree_free_node(new_node, tree);
-                return BPTREE_ALLOCATION_FAILURE;
-            }
-            bptree_key_t *root_keys = bptree_node_keys(new_root);
-            bptree_node **root_children = bptree_node_children(new_root, tree->max_keys);
-            root_keys[0] = promoted_key;
-            root_children[0] = tree->root;
-            root_children[1] = new_node;
-            new_root->num_keys = 1;
-            tree->root = new_root;
-            tree->height++;
-            bptree_debug_print(tree->enable_debug, "New root created. Tree height: %d\n",
-                               tree->height);
+BPTREE_API bptree_status bptree_union(const bptree *a, const bptree *b, bptree **out_tree) {
+    return bptree_set_operation(a, b, BPTREE_SET_UNION, out_tree);
+}
+
+BPTREE_API bptree_status bptree_intersect(const bptree *a, const bptree *b, bptree **out_tree) {
+    return bptree_set_operation(a, b, BPTREE_SET_INTERSECT, out_tree);
+}
+
+BPTREE_API bptree_status bptree_difference(const bptree *a, const bptree *b, bptree **out_tree) {
+    return bptree_set_operation(a, b, BPTREE_SET_DIFFERENCE, out_tree);
+}
+
+/**
+ * @brief Hand a detached subtree to bptree_do_work to be freed.
+ *
+ * @param tree Pointer to the tree.
+ * @param node Pointer to the subtree root.
+ */
+static void bptree_push_garbage(bptree *tree, bptree_node *node) {
+    node->next = tree->garbage;
+    tree->garbage = node;
+    tree->garbage_count++;
+}
+
+/**
+ * @brief Hand detached subtrees that are already chained through `next` to bptree_do_work.
+ *
+ * @param tree Pointer to the tree.
+ * @param first Pointer to the first subtree root of the chain.
+ * @param last Pointer to the last subtree root of the chain.
+ * @param count Number of subtrees in the chain.
+ */
+static void bptree_push_garbage_chain(bptree *tree, bptree_node *first, bptree_node *last,
+                                      const int count) {
+    last->next = tree->garbage;
+    tree->garbage = first;
+    tree->garbage_count += count;
+}
+
+/**
+ * @brief Free one node from the garbage list, queueing its children in its place.
+ *
+ * @param tree Pointer to the tree with a non-empty garbage list.
+ */
+static void bptree_free_garbage_node(bptree *tree) {
+    bptree_node *node = tree->garbage;
+    tree->garbage = node->next;
+    tree->garbage_count--;
+    if (!node->is_leaf) {
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) bptree_push_garbage(tree, children[i]);
+    }
+    // Garbage left the per-level counts when it was detached from the tree.
+    node->level = BPTREE_NO_LEVEL;
+    bptree_node_release(tree, node);
+}
+
+/**
+ * @brief State of an incremental compaction.
+ *
+ * The new layout is built into a separate tree, which takes over the nodes of the
+ * source tree once every entry has been copied and its internal levels are built. Keys
+ * written after they were copied are logged and copied again before that happens.
+ */
+struct bptree_compaction {
+    bptree_builder builder; /**< Bottom-up build into a shadow tree with its own slab */
+    uint64_t version;       /**< Version of the source tree that the copy and log match */
+    int fill;               /**< Entries per leaf */
+    bool started;           /**< True once `resume` holds a key */
+    bool built;             /**< True once every entry is copied and the levels are built */
+    bptree_key_t resume;    /**< Smallest key that has not been copied yet */
+    bptree_key_t *log;      /**< Keys written after they were copied */
+    int log_len;            /**< Number of keys in `log` */
+    int log_cap;            /**< Capacity of `log` */
+    int log_head;           /**< Number of keys in `log` already copied again */
+};
+
+/**
+ * @brief Release the spare nodes of a compaction's builder and the slab space never carved.
+ *
+ * @param c Pointer to the compaction.
+ */
+static void bptree_compaction_release_spares(bptree_compaction *c) {
+    bptree *shadow = c->builder.tree;
+    bptree_node *lists[2] = {c->builder.spare_leaves, c->builder.spare_internals};
+    for (int i = 0; i < 2; i++) {
+        while (lists[i]) {
+            bptree_node *next = lists[i]->next;
+            bptree_node_release(shadow, lists[i]);
+            lists[i] = next;
         }
-        tree->count++;
+    }
+    c->builder.spare_leaves = NULL;
+    c->builder.spare_internals = NULL;
+    bptree_slab_carver_drop(shadow, &c->builder.carver);
+}
+
+/**
+ * @brief Move the slabs and node counts of a compaction's shadow tree into the tree.
+ *
+ * Afterwards the shadow tree's nodes are released through the tree.
+ *
+ * @param tree Pointer to the tree.
+ * @param shadow Pointer to the shadow tree; its slab table is freed.
+ * @return True if successful, false if the tree's slab table could not grow.
+ */
+static bool bptree_adopt_nodes(bptree *tree, bptree *shadow) {
+    bptree_slab *slabs =
+        realloc(tree->slabs, (tree->num_slabs + shadow->num_slabs) * sizeof(bptree_slab));
+    if (!slabs) return false;
+    tree->slabs = slabs;
+    memcpy(tree->slabs + tree->num_slabs, shadow->slabs, shadow->num_slabs * sizeof(bptree_slab));
+    tree->num_slabs += shadow->num_slabs;
+    // The budget was charged for the shadow tree's nodes as they were allocated.
+    tree->node_bytes += shadow->node_bytes;
+    tree->leaf_nodes += shadow->leaf_nodes;
+    tree->internal_nodes += shadow->internal_nodes;
+    free(shadow->slabs);
+    shadow->slabs = NULL;
+    shadow->num_slabs = 0;
+    return true;
+}
+
+/**
+ * @brief Drop an unfinished compaction, if any, along with its partial copy.
+ *
+ * In deferred mode, the nodes of the partial copy are handed to bptree_do_work, like the
+ * nodes of a cleared tree.
+ *
+ * @param tree Pointer to the tree.
+ */
+static void bptree_compaction_discard(bptree *tree) {
+    bptree_compaction *c = tree->compaction;
+    if (!c) return;
+    bptree *shadow = c->builder.tree;
+    const bptree_level_build *b = &c->builder.levels;
+    if (!c->built) bptree_compaction_release_spares(c);
+    const int leaves = shadow->leaf_nodes;
+    if (tree->deferred && bptree_adopt_nodes(tree, shadow)) {
+        if (c->built) {
+            bptree_push_garbage(tree, shadow->root);
+        } else if (!c->builder.sealed || b->refreshing) {
+            // Only the leaves exist, chained in key order.
+            bptree_push_garbage_chain(tree, c->builder.head, c->builder.leaf, leaves);
+        } else {
+            // Every node hangs off a parent built so far or a node still waiting for one.
+            if (b->head) bptree_push_garbage_chain(tree, b->head, b->tail, b->parents);
+            if (b->child) bptree_push_garbage_chain(tree, b->child, b->last, b->n - b->taken);
+        }
+        free(shadow);
+    } else if (c->built) {
+        bptree_free(shadow);
     } else {
-        bptree_debug_print(tree->enable_debug,
-                           "Insertion failed (Status: %d), count not incremented.\n", status);
+        bptree_builder_abort(&c->builder);
     }
-    return status;
+    free(c->log);
+    free(c);
+    tree->compaction = NULL;
 }
 
-BPTREE_API bptree_status bptree_get(const bptree *tree, const bptree_key_t *key,
-                                    bptree_value_t *out_value) {
-    if (!tree || !tree->root || !key || !out_value) return BPTREE_INVALID_ARGUMENT;
-    if (tree->count == 0) return BPTREE_KEY_NOT_FOUND;
-    bptree_node *node = tree->root;
-    // Traverse the tree until a leaf is reached.
-    while (!node->is_leaf) {
-        const int pos = bptree_node_search(tree, node, key);
-        node = bptree_node_children(node, tree->max_keys)[pos];
-        if (!node) return BPTREE_INTERNAL_ERROR;
+/**
+ * @brief Set up a compaction: a shadow tree and a slab sized for the current entries.
+ *
+ * @param tree Pointer to a non-empty tree.
+ * @param fill Entries per leaf (already clamped).
+ * @return BPTREE_OK if successful, BPTREE_MEMORY_LIMIT, or BPTREE_ALLOCATION_FAILURE.
+ */
+static bptree_status bptree_compaction_start(bptree *tree, const int fill) {
+    bptree_compaction *c = malloc(sizeof(bptree_compaction));
+    if (!c) return BPTREE_ALLOCATION_FAILURE;
+    bptree *shadow = bptree_create(tree->max_keys, tree->compare, tree->enable_debug);
+    if (!shadow) {
+        free(c);
+        return BPTREE_ALLOCATION_FAILURE;
     }
-    int pos = bptree_node_search(tree, node, key);
-    const bptree_key_t *keys = bptree_node_keys(node);
-    if (pos < node->num_keys && tree->compare(key, &keys[pos]) == 0) {
-        *out_value = bptree_node_values(node, tree->max_keys)[pos];
+    // The new layout counts against the budget while it is built, not just once it is done.
+    shadow->budget = tree->budget;
+    if (shadow->budget) shadow->budget->used += shadow->node_bytes;
+#ifdef BPTREE_AGGREGATE_TYPE
+    shadow->monoid = tree->monoid;
+#endif
+    const int fanout = tree->max_keys + 1;
+    const int leaves = (tree->count + fill - 1) / fill;
+    int internals = 0;
+    for (int n = leaves; n > 1; n = (n + fanout - 1) / fanout) {
+        internals += (n + fanout - 1) / fanout;
+    }
+    bptree_slab_carver carver;
+    const bptree_status status = bptree_slab_alloc(shadow, leaves, internals, &carver);
+    if (status != BPTREE_OK) {
+        bptree_free(shadow);
+        free(c);
+        return status;
+    }
+    // Replace the root leaf from bptree_create with the first leaf of the slab.
+    bptree_node_release(shadow, shadow->root);
+    shadow->root = bptree_slab_carve(shadow, &carver, true);
+    bptree_node_set_level(shadow, shadow->root, 0);
+    shadow->first_leaf = shadow->root;
+    shadow->last_leaf = shadow->root;
+    bptree_builder_init(&c->builder, shadow, fill);
+    c->builder.carver = carver;
+    c->version = tree->version;
+    c->fill = fill;
+    c->started = false;
+    c->built = false;
+    c->log = NULL;
+    c->log_len = 0;
+    c->log_cap = 0;
+    c->log_head = 0;
+    tree->compaction = c;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Keep an unfinished compaction in step with a write to a single key.
+ *
+ * Bumps the tree version. If the key has already been copied (every key has, once the
+ * builder is sealed), it is logged to be copied again. A compaction that was already out
+ * of step, whose log cannot grow, or whose log would hold more keys than the tree is left
+ * out of step and starts over.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to the key that was inserted, removed, or changed.
+ */
+static void bptree_note_write(bptree *tree, const bptree_key_t *key) {
+    bptree_compaction *c = tree->compaction;
+    const bool in_step = c && c->version == tree->version;
+    tree->version++;
+    if (!in_step) return;
+    if (c->builder.sealed || (c->started && tree->compare(key, &c->resume) < 0)) {
+        if (c->log_len - c->log_head >= tree->count) return;
+        if (c->log_len == c->log_cap) {
+            const int cap = c->log_cap ? 2 * c->log_cap : 64;
+            bptree_key_t *log = realloc(c->log, (size_t)cap * sizeof(bptree_key_t));
+            if (!log) return;
+            c->log = log;
+            c->log_cap = cap;
+        }
+        c->log[c->log_len++] = *key;
+    }
+    c->version = tree->version;
+}
+
+/**
+ * @brief Copy a logged key into the shadow tree again, with its current value.
+ *
+ * @param tree Pointer to the tree.
+ * @param key Pointer to the key.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise.
+ */
+static bptree_status bptree_compaction_replay(bptree *tree, const bptree_key_t *key) {
+    bptree *shadow = tree->compaction->builder.tree;
+    bptree_status status = bptree_remove_untimed(shadow, key);
+    if (status != BPTREE_OK && status != BPTREE_KEY_NOT_FOUND) return status;
+    bptree_node *leaf = bptree_find_leaf(tree, key);
+    const int pos = bptree_node_search(tree, leaf, key);
+    if (pos >= leaf->num_keys || tree->compare(key, &bptree_node_keys(leaf)[pos]) != 0) {
         return BPTREE_OK;
     }
-    return BPTREE_KEY_NOT_FOUND;
+    status = bptree_put_untimed(shadow, key, bptree_node_values(leaf, tree->max_keys)[pos]);
+    if (status != BPTREE_OK) return status;
+#ifdef BPTREE_ENABLE_TTL
+    const int64_t expires_at = bptree_node_expiries(leaf, tree->max_keys)[pos];
+    if (expires_at != BPTREE_NO_EXPIRY) {
+        bptree_node *copy = bptree_find_leaf(shadow, key);
+        bptree_node_expiries(copy, shadow->max_keys)[bptree_node_search(shadow, copy, key)] =
+            expires_at;
+        bptree_refresh_path(shadow, key);
+    }
+#endif
+    return BPTREE_OK;
 }
 
-BPTREE_API bptree_status bptree_remove(bptree *tree, const bptree_key_t *key) {
-#define BPTREE_MAX_HEIGHT_REMOVE 64
-    bptree_node *node_stack[BPTREE_MAX_HEIGHT_REMOVE];
-    int index_stack[BPTREE_MAX_HEIGHT_REMOVE];
-    int depth = 0;
-    if (!tree || !tree->root || !key) return BPTREE_INVALID_ARGUMENT;
-    if (tree->count == 0) return BPTREE_KEY_NOT_FOUND;
-    bptree_node *node = tree->root;
-    // Traverse down the tree and record the path (nodes and child indexes)
-    while (!node->is_leaf) {
-        if (depth >= BPTREE_MAX_HEIGHT_REMOVE) {
-            return BPTREE_INTERNAL_ERROR;
+/**
+ * @brief Build the internal levels of a shadow tree whose entries have all been copied.
+ *
+ * Each leaf refreshed or parent built touches up to a node's worth of entries, so it
+ * counts as max_keys copies against @p max_entries.
+ *
+ * @param tree Pointer to the tree.
+ * @param max_entries Maximum number of entries to copy.
+ * @param copied Pointer to the number of entries copied so far, advanced by the build.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise (the compaction is
+ *         dropped).
+ */
+static bptree_status bptree_compaction_build(bptree *tree, const int max_entries, int *copied) {
+    bptree_compaction *c = tree->compaction;
+    bool done = false;
+    for (; !done && *copied < max_entries; *copied += tree->max_keys) {
+        const bptree_status status = bptree_builder_step(&c->builder, &done);
+        if (status != BPTREE_OK) {
+            bptree_compaction_discard(tree);
+            return status;
         }
-        const int pos = bptree_node_search(tree, node, key);
-        node_stack[depth] = node;
-        index_stack[depth] = pos;
-        depth++;
-        node = bptree_node_children(node, tree->max_keys)[pos];
-        if (!node) return BPTREE_INTERNAL_ERROR;
-    }
-    const int pos = bptree_node_search(tree, node, key);
-    bptree_key_t *keys = bptree_node_keys(node);
-    if (pos >= node->num_keys || tree->compare(key, &keys[pos]) != 0) {
-        return BPTREE_KEY_NOT_FOUND;
     }
-    // Save the key being deleted for potential parent updates.
-    const bptree_key_t deleted_key_copy = keys[pos];
-    bptree_value_t *values = bptree_node_values(node, tree->max_keys);
-    // Remove key and value by shifting remaining entries left.
-    memmove(&keys[pos], &keys[pos + 1], (node->num_keys - pos - 1) * sizeof(bptree_key_t));
-    memmove(&values[pos], &values[pos + 1], (node->num_keys - pos - 1) * sizeof(bptree_value_t));
-    node->num_keys--;
-    tree->count--;
-    bptree_debug_print(tree->enable_debug, "Removed key from leaf. Node keys: %d, Tree count: %d\n",
-                       node->num_keys, tree->count);
-    // Update parent's separator if the smallest key in the leaf has changed.
-    if (pos == 0 && depth > 0 && node->num_keys > 0) {
-        const int parent_child_idx = index_stack[depth - 1];
-        if (parent_child_idx > 0) {
-            const int separator_idx = parent_child_idx - 1;
-            bptree_node *parent = node_stack[depth - 1];
-            bptree_key_t *parent_keys = bptree_node_keys(parent);
-            if (separator_idx < parent->num_keys &&
-                tree->compare(&parent_keys[separator_idx], &deleted_key_copy) == 0) {
-                bptree_debug_print(
-                    tree->enable_debug,
-                    "Updating parent separator key [%d] after deleting smallest leaf key.\n",
-                    separator_idx);
-                parent_keys[separator_idx] = keys[0];
-            }
-        }
+    if (!done) return BPTREE_OK;
+    // Nodes the build did not need still count as live in the slab.
+    bptree_compaction_release_spares(c);
+    c->built = true;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Complete a compaction whose shadow tree is built and up to date.
+ *
+ * Frees the old nodes and moves the shadow tree's nodes and slab into the tree.
+ *
+ * @param tree Pointer to the tree.
+ * @return BPTREE_OK if successful, BPTREE_ALLOCATION_FAILURE otherwise.
+ */
+static bptree_status bptree_compaction_finish(bptree *tree) {
+    bptree_compaction *c = tree->compaction;
+    bptree *shadow = c->builder.tree;
+    if (!bptree_adopt_nodes(tree, shadow)) {
+        bptree_compaction_discard(tree);
+        return BPTREE_ALLOCATION_FAILURE;
     }
-    const bool root_is_leaf = (depth == 0);
-    // If underflow occurs in a non-root leaf, rebalance upward.
-    if (!root_is_leaf && node->num_keys < tree->min_leaf_keys) {
-        bptree_debug_print(tree->enable_debug, "Leaf underflow (%d < %d), starting rebalance.\n",
-                           node->num_keys, tree->min_leaf_keys);
-        bptree_rebalance_up(tree, node_stack, index_stack, depth);
-    } else if (root_is_leaf && tree->count == 0) {
-        assert(tree->root == node);
-        assert(tree->root->num_keys == 0);
-        bptree_debug_print(tree->enable_debug, "Last key removed, root is empty leaf.\n");
+    assert(shadow->count == tree->count);
+    if (tree->deferred) {
+        bptree_push_garbage(tree, tree->root);
+    } else {
+        bptree_free_node(tree->root, tree);
     }
-#undef BPTREE_MAX_HEIGHT_REMOVE
+    memcpy(tree->level_nodes, shadow->level_nodes, sizeof(tree->level_nodes));
+    tree->root = shadow->root;
+    tree->first_leaf = shadow->first_leaf;
+    tree->last_leaf = shadow->last_leaf;
+    tree->height = shadow->height;
+    tree->version++;
+    free(shadow);
+    free(c->log);
+    free(c);
+    tree->compaction = NULL;
+#if defined(BPTREE_TRIM_AFTER_COMPACT) && defined(__GLIBC__)
+    // Hand the pages of the freed nodes back to the operating system (asked for by the caller).
+    if (!tree->deferred) malloc_trim(0);
+#endif
+    BPTREE_LOG_EVENT(tree->enable_debug, "Compaction finished. Tree height: %d\n", tree->height);
     return BPTREE_OK;
 }
 
-BPTREE_API bptree_status bptree_get_range(const bptree *tree, const bptree_key_t *start,
-                                          const bptree_key_t *end, bptree_value_t **out_values,
-                                          int *n_results) {
-    if (!tree || !tree->root || !start || !end || !out_values || !n_results) {
-        return BPTREE_INVALID_ARGUMENT;
-    }
-    *out_values = NULL;
-    *n_results = 0;
-    if (tree->compare(start, end) > 0) {
-        return BPTREE_INVALID_ARGUMENT;
+/**
+ * @brief Copy up to @p max_entries entries into the new layout, starting a compaction or
+ * starting over if needed, and finish the compaction once everything is copied.
+ *
+ * Entries are copied in key order first, then the internal levels of the shadow tree are
+ * built a node at a time, and then logged keys are copied again. Each copy counts against
+ * @p max_entries, and so does each node built (as max_keys copies).
+ *
+ * @param tree Pointer to the tree.
+ * @param fill Entries per leaf (already clamped).
+ * @param max_entries Maximum number of entries to copy.
+ * @param out_done Pointer to a flag set once the compaction has finished.
+ * @return BPTREE_OK if successful, BPTREE_MEMORY_LIMIT, or BPTREE_ALLOCATION_FAILURE.
+ */
+static bptree_status bptree_compaction_advance(bptree *tree, const int fill,
+                                               const int max_entries, bool *out_done) {
+    bptree_compaction *c = tree->compaction;
+    if (c && (c->version != tree->version || c->fill != fill)) {
+        BPTREE_LOG_EVENT(tree->enable_debug, "Tree changed during compaction, starting over.\n");
+        bptree_compaction_discard(tree);
+        c = NULL;
     }
     if (tree->count == 0) {
+        bptree_compaction_discard(tree);
+        if (out_done) *out_done = true;
         return BPTREE_OK;
     }
-    bptree_node *node = tree->root;
-    // Locate the starting leaf node.
-    while (!node->is_leaf) {
-        const int pos = bptree_node_search(tree, node, start);
-        node = bptree_node_children(node, tree->max_keys)[pos];
-        if (!node) return BPTREE_INTERNAL_ERROR;
+    if (!c) {
+        const bptree_status status = bptree_compaction_start(tree, fill);
+        if (status != BPTREE_OK) return status;
+        c = tree->compaction;
     }
-    int count = 0;
-    bptree_node *current_node = node;
-    bool past_end = false;
-    // Count how many keys fall within the range.
-    while (current_node && !past_end) {
-        const bptree_key_t *keys = bptree_node_keys(current_node);
-        for (int i = 0; i < current_node->num_keys; i++) {
-            if (tree->compare(&keys[i], start) >= 0) {
-                if (tree->compare(&keys[i], end) <= 0) {
-                    count++;
-                } else {
-                    past_end = true;
-                    break;
-                }
+    int copied = 0;
+    if (!c->builder.sealed) {
+        bptree_cursor cur;
+        bptree_cursor_first(&cur, tree);
+        if (c->started) bptree_cursor_seek(&cur, &c->resume);
+        for (; cur.leaf && copied < max_entries; copied++) {
+            const bptree_status status = bptree_builder_append_cursor(&c->builder, &cur);
+            if (status != BPTREE_OK) {
+                bptree_compaction_discard(tree);
+                return status;
             }
+            bptree_cursor_next(&cur);
         }
-        if (!past_end) {
-            current_node = current_node->next;
+        if (cur.leaf) {
+            c->resume = *bptree_cursor_key(&cur);
+            c->started = true;
+            return BPTREE_OK;
         }
+        bptree_builder_seal(&c->builder);
     }
-    if (count == 0) {
-        return BPTREE_OK;
-    }
-    const size_t alloc_size = (size_t)count * sizeof(bptree_value_t);
-    *out_values = malloc(alloc_size);
-    if (!*out_values) {
-        return BPTREE_ALLOCATION_FAILURE;
+    if (!c->built) {
+        const bptree_status status = bptree_compaction_build(tree, max_entries, &copied);
+        if (status != BPTREE_OK || !c->built) return status;
     }
-    int index = 0;
-    current_node = node;
-    past_end = false;
-    // Populate the output array with values within the key range.
-    while (current_node && !past_end && index < count) {
-        const bptree_key_t *keys = bptree_node_keys(current_node);
-        const bptree_value_t *values = bptree_node_values(current_node, tree->max_keys);
-        for (int i = 0; i < current_node->num_keys; i++) {
-            if (tree->compare(&keys[i], start) >= 0) {
-                if (tree->compare(&keys[i], end) <= 0) {
-                    if (index < count) {
-                        (*out_values)[index++] = values[i];
-                    } else {
-                        bptree_debug_print(tree->enable_debug,
-                                           "Range Error: Exceeded count during collection.\n");
-                        past_end = true;
-                        break;
-                    }
-                } else {
-                    past_end = true;
-                    break;
-                }
-            }
-        }
-        if (!past_end) {
-            current_node = current_node->next;
+    for (; c->log_head < c->log_len && copied < max_entries; copied++) {
+        const bptree_status status = bptree_compaction_replay(tree, &c->log[c->log_head++]);
+        if (status != BPTREE_OK) {
+            bptree_compaction_discard(tree);
+            return status;
         }
     }
-    *n_results = index;
-    if (index != count) {
-        bptree_debug_print(tree->enable_debug, "Range Warning: Final index %d != counted %d\n",
-                           index, count);
+    if (c->log_head < c->log_len) return BPTREE_OK;
+    const bptree_status status = bptree_compaction_finish(tree);
+    if (status == BPTREE_OK && out_done) *out_done = true;
+    return status;
+}
+
+BPTREE_API bptree_status bptree_compact_step(bptree *tree, const double target_fill,
+                                             const int max_entries, bool *out_done) {
+    if (out_done) *out_done = false;
+    if (!tree || !tree->root || !(target_fill > 0.0 && target_fill <= 1.0) || max_entries < 1) {
+        return BPTREE_INVALID_ARGUMENT;
+    }
+    const int fill = bptree_clamp_fill(tree, (int)(target_fill * tree->max_keys + 0.5));
+    return bptree_compaction_advance(tree, fill, max_entries, out_done);
+}
+
+BPTREE_API bptree_status bptree_compact(bptree *tree, const double target_fill) {
+    // In deferred mode, only start the compaction and leave the copying to bptree_do_work.
+    if (tree && tree->deferred) return bptree_compact_step(tree, target_fill, 1, NULL);
+    bool done = false;
+    while (!done) {
+        const int budget = tree && tree->count > 0 ? tree->count : 1;
+        const bptree_status status = bptree_compact_step(tree, target_fill, budget, &done);
+        if (status != BPTREE_OK) return status;
     }
     return BPTREE_OK;
 }
 
-BPTREE_API void bptree_free_range_results(bptree_value_t *results) { free(results); }
+/**
+ * @brief Rebalance the leaf that the next queued repair key leads to, if still underfull.
+ *
+ * The leaf may have been refilled or merged since it was queued, so it is located
+ * again with a fresh descent.
+ *
+ * @param tree Pointer to the tree with a non-empty repair queue.
+ */
+static void bptree_repair_next(bptree *tree) {
+#define BPTREE_MAX_HEIGHT_REPAIR 64
+    bptree_node *node_stack[BPTREE_MAX_HEIGHT_REPAIR];
+    int index_stack[BPTREE_MAX_HEIGHT_REPAIR];
+    const bptree_key_t key = tree->repair_keys[tree->repair_head++];
+    // A borrow moves a single entry, so a leaf that lost several may need more than one pass.
+    for (;;) {
+        int depth = 0;
+        bptree_node *node = tree->root;
+        while (!node->is_leaf && depth < BPTREE_MAX_HEIGHT_REPAIR) {
+            const int pos = bptree_node_search(tree, node, &key);
+            node_stack[depth] = node;
+            index_stack[depth] = pos;
+            depth++;
+            node = bptree_node_children(node, tree->max_keys)[pos];
+        }
+        if (!node->is_leaf || depth == 0 || node->num_keys >= tree->min_leaf_keys) break;
+        BPTREE_LOG_EVENT(tree->enable_debug, "Repairing deferred leaf underflow (%d keys)\n",
+                         node->num_keys);
+        bptree_rebalance_up(tree, node_stack, index_stack, depth);
+    }
+#undef BPTREE_MAX_HEIGHT_REPAIR
+}
 
-BPTREE_API bptree_stats bptree_get_stats(const bptree *tree) {
-    bptree_stats stats;
-    if (!tree) {
-        stats.count = 0;
-        stats.height = 0;
-        stats.node_count = 0;
-    } else {
-        stats.count = tree->count;
-        stats.height = tree->height;
-        stats.node_count = bptree_count_nodes(tree->root, tree);
+BPTREE_API bptree_status bptree_set_deferred(bptree *tree, const bool enabled) {
+    if (!tree || !tree->root) return BPTREE_INVALID_ARGUMENT;
+    if (!enabled) {
+        while (tree->garbage) bptree_free_garbage_node(tree);
+        while (tree->repair_head < tree->repair_len) bptree_repair_next(tree);
     }
-    return stats;
+    tree->deferred = enabled;
+    return BPTREE_OK;
 }
 
-BPTREE_API bool bptree_check_invariants(const bptree *tree) {
-    if (!tree || !tree->root) return false;
-    if (tree->count == 0) {
-        if (tree->root->is_leaf && tree->root->num_keys == 0 && tree->height == 1) {
-            return true;
+BPTREE_API bptree_status bptree_do_work(bptree *tree, const int64_t budget_ns) {
+    if (!tree || !tree->root) return BPTREE_INVALID_ARGUMENT;
+    const int64_t start = bptree_now_ns();
+    do {
+        if (tree->garbage) {
+            bptree_free_garbage_node(tree);
+        } else if (tree->repair_head < tree->repair_len) {
+            bptree_repair_next(tree);
+        } else if (tree->compaction) {
+            // Copy one leaf's worth of entries, or build one node, per unit.
+            bool done;
+            const bptree_status status = bptree_compaction_advance(
+                tree, tree->compaction->fill, tree->max_keys, &done);
+            if (status != BPTREE_OK) return status;
         } else {
-            bptree_debug_print(tree->enable_debug, "Invariant Fail: Empty tree state incorrect.\n");
-            return false;
+            break;
         }
-    }
-    int leaf_depth = -1;
-    return bptree_check_invariants_node(tree->root, tree, 0, &leaf_depth);
+    } while (bptree_now_ns() - start < budget_ns);
+    return BPTREE_OK;
 }
 
-BPTREE_API bool bptree_contains(const bptree *tree, const bptree_key_t *key) {
-    bptree_value_t dummy_value;
-    return (bptree_get(tree, key, &dummy_value) == BPTREE_OK);
+BPTREE_API int bptree_pending_work(const bptree *tree) {
+    if (!tree) return 0;
+    return (tree->repair_len - tree->repair_head) + tree->garbage_count +
+           (tree->compaction ? 1 : 0);
 }
 
-BPTREE_API bptree *bptree_create(const int max_keys,
-                                 int (*compare)(const bptree_key_t *, const bptree_key_t *),
-                                 const bool enable_debug) {
-    if (max_keys < 3) {
-        fprintf(stderr, "[BPTREE CREATE] Error: max_keys must be at least 3.\n");
-        return NULL;
-    }
-    bptree *tree = malloc(sizeof(bptree));
-    if (!tree) {
-        fprintf(stderr, "[BPTREE CREATE] Error: Failed to allocate memory for tree structure.\n");
-        return NULL;
+BPTREE_API bptree_status bptree_clear(bptree *tree) {
+    if (!tree || !tree->root) return BPTREE_INVALID_ARGUMENT;
+    bptree_node *root = bptree_node_alloc(tree, 0);
+    if (!root) return BPTREE_ALLOCATION_FAILURE;
+    bptree_compaction_discard(tree);
+    if (tree->deferred) {
+        bptree_push_garbage(tree, tree->root);
+    } else {
+        bptree_free_node(tree->root, tree);
     }
-    tree->count = 0;
+    bptree_node_refresh(tree, root);
+    // In deferred mode, the old nodes are still allocated but no longer in the tree.
+    memset(tree->level_nodes, 0, sizeof(tree->level_nodes));
+    tree->level_nodes[0] = 1;
+    tree->root = root;
+    tree->first_leaf = root;
+    tree->last_leaf = root;
     tree->height = 1;
-    tree->enable_debug = enable_debug;
-    tree->max_keys = max_keys;
-    tree->min_internal_keys = ((max_keys + 1) / 2) - 1;
-    if (tree->min_internal_keys < 1) {
-        tree->min_internal_keys = 1;
+    tree->count = 0;
+    tree->repair_head = 0;
+    tree->repair_len = 0;
+    tree->clock_hand_set = false;
+    tree->version++;
+    BPTREE_LOG_EVENT(tree->enable_debug, "Tree cleared (%d nodes queued for freeing).\n",
+                     tree->garbage_count);
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Choose the next entry to evict, skipping the one that must stay.
+ *
+ * For CLOCK, the hand walks the leaf chain (wrapping around), clearing reference bits,
+ * and stops at the first leaf that was not referenced since the last pass. It resumes
+ * from the evicted key next time.
+ *
+ * @param tree Pointer to the tree, holding at least one entry other than @p keep.
+ * @param keep Pointer to the key that must not be chosen (may be NULL).
+ * @param out_key Receives the key of the entry to evict.
+ * @param out_value Receives the value of the entry to evict.
+ * @return True if an entry was chosen.
+ */
+static bool bptree_pick_victim(bptree *tree, const bptree_key_t *keep, bptree_key_t *out_key,
+                               bptree_value_t *out_value) {
+    if (tree->eviction == BPTREE_EVICT_SMALLEST || tree->eviction == BPTREE_EVICT_LARGEST) {
+        const bool smallest = tree->eviction == BPTREE_EVICT_SMALLEST;
+        bptree_status status = smallest ? bptree_min(tree, out_key, out_value)
+                                        : bptree_max(tree, out_key, out_value);
+        if (status == BPTREE_OK && keep && tree->compare(out_key, keep) == 0) {
+            status = smallest ? bptree_successor(tree, keep, out_key, out_value)
+                              : bptree_predecessor(tree, keep, out_key, out_value);
+        }
+        return status == BPTREE_OK;
     }
-    tree->min_leaf_keys = (max_keys + 1) / 2;
-    if (tree->min_leaf_keys < 1) {
-        tree->min_leaf_keys = 1;
+    bptree_node *leaf =
+        tree->clock_hand_set ? bptree_find_leaf(tree, &tree->clock_hand) : tree->first_leaf;
+    // Two passes suffice: the first clears every reference bit.
+    for (int64_t visited = 0; visited <= 2 * (int64_t)tree->count; visited++) {
+        if (leaf->referenced) {
+            leaf->referenced = false;
+        } else {
+            const bptree_key_t *keys = bptree_node_keys(leaf);
+            int idx = 0;
+            if (keep && idx < leaf->num_keys && tree->compare(&keys[idx], keep) == 0) idx++;
+            if (idx < leaf->num_keys) {
+                *out_key = keys[idx];
+                *out_value = bptree_node_values(leaf, tree->max_keys)[idx];
+                tree->clock_hand = keys[idx];
+                tree->clock_hand_set = true;
+                return true;
+            }
+        }
+        leaf = leaf->next ? leaf->next : tree->first_leaf;
     }
-    if (tree->min_leaf_keys > tree->max_keys) tree->min_leaf_keys = tree->max_keys;
-    bptree_debug_print(enable_debug, "Creating tree. max_keys=%d, min_internal=%d, min_leaf=%d\n",
-                       tree->max_keys, tree->min_internal_keys, tree->min_leaf_keys);
-    tree->compare = compare ? compare : bptree_default_compare;
-    tree->root = bptree_node_alloc(tree, true);
-    if (!tree->root) {
-        fprintf(stderr, "[BPTREE CREATE] Error: Failed to allocate initial root node.\n");
-        free(tree);
-        return NULL;
+    return false;
+}
+
+/**
+ * @brief Evict entries until the tree is within its capacity.
+ *
+ * @param tree Pointer to the tree.
+ * @param keep Pointer to the key that must not be evicted (may be NULL).
+ */
+static void bptree_enforce_capacity(bptree *tree, const bptree_key_t *keep) {
+    const int floor = keep ? 1 : 0;
+    while (tree->count > floor) {
+        const bool over_entries = tree->max_entries > 0 && tree->count > tree->max_entries;
+        // Slabs are only freed when empty, so count their nodes one by one; otherwise the
+        // nodes of a compacted tree would give back nothing until most of it was evicted.
+        const bool over_bytes =
+            tree->max_bytes > 0 && bptree_live_node_bytes(tree) > tree->max_bytes;
+        if (!over_entries && !over_bytes) break;
+        if (!over_entries && (tree->garbage || tree->repair_head < tree->repair_len)) {
+            // Queued frees and merges give memory back without evicting anything.
+            bptree_do_work(tree, 0);
+            continue;
+        }
+        bptree_key_t key;
+        bptree_value_t value;
+        if (!bptree_pick_victim(tree, keep, &key, &value)) break;
+        if (tree->on_evict) tree->on_evict(&key, value, tree->evict_ctx);
+        bptree_remove(tree, &key);
     }
-    bptree_debug_print(enable_debug, "Tree created successfully.\n");
-    return tree;
 }
 
-BPTREE_API void bptree_free(bptree *tree) {
-    if (!tree) return;
-    if (tree->root) {
-        bptree_free_node(tree->root, tree);
+BPTREE_API bptree_status bptree_set_capacity(bptree *tree, const int64_t max_entries,
+                                             const size_t max_bytes,
+                                             const bptree_eviction_policy policy,
+                                             const bptree_entry_callback on_evict, void *ctx) {
+    if (!tree || !tree->root || max_entries < 0) return BPTREE_INVALID_ARGUMENT;
+    if (policy != BPTREE_EVICT_CLOCK && policy != BPTREE_EVICT_SMALLEST &&
+        policy != BPTREE_EVICT_LARGEST) {
+        return BPTREE_INVALID_ARGUMENT;
     }
-    free(tree);
+    tree->max_entries = max_entries;
+    tree->max_bytes = max_bytes;
+    tree->eviction = policy;
+    tree->on_evict = on_evict;
+    tree->evict_ctx = ctx;
+    bptree_enforce_capacity(tree, NULL);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_memory bptree_get_memory(const bptree *tree) {
+    bptree_memory memory = {0, 0, 0, 0};
+    if (!tree) return memory;
+    memory.total_bytes = tree->node_bytes;
+    memory.leaf_bytes = (size_t)tree->leaf_nodes * bptree_node_stride(tree, true);
+    memory.internal_bytes = (size_t)tree->internal_nodes * bptree_node_stride(tree, false);
+    size_t entry_size = sizeof(bptree_key_t) + sizeof(bptree_value_t);
+#ifdef BPTREE_ENABLE_TTL
+    entry_size += sizeof(int64_t);
+#endif
+    // In a tree, every node but the root is a child, and an internal node has one more
+    // child than keys, so the internal levels hold leaf_nodes - 1 keys in total.
+    const size_t children =
+        tree->internal_nodes > 0 ? (size_t)(tree->leaf_nodes + tree->internal_nodes - 1) : 0;
+    const size_t separators = tree->internal_nodes > 0 ? (size_t)(tree->leaf_nodes - 1) : 0;
+    const size_t used = (size_t)(tree->leaf_nodes + tree->internal_nodes) * sizeof(bptree_node) +
+                        (size_t)tree->count * entry_size + separators * sizeof(bptree_key_t) +
+                        children * sizeof(bptree_node *);
+    const size_t held = memory.leaf_bytes + memory.internal_bytes;
+    // Nodes waiting to be freed hold entries that no longer count, so clamp the estimate.
+    memory.slack_bytes = held > used ? held - used : 0;
+    return memory;
+}
+
+BPTREE_API void bptree_budget_init(bptree_budget *budget, const size_t limit,
+                                   const bptree_pressure_callback on_pressure, void *ctx) {
+    if (!budget) return;
+    budget->limit = limit;
+    budget->used = 0;
+    budget->on_pressure = on_pressure;
+    budget->ctx = ctx;
+}
+
+BPTREE_API bptree_status bptree_set_budget(bptree *tree, bptree_budget *budget) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+    if (budget == tree->budget) return BPTREE_OK;
+    // The new layout of a compaction in progress moves along with the tree.
+    bptree *shadow = tree->compaction ? tree->compaction->builder.tree : NULL;
+    const size_t bytes = tree->node_bytes + (shadow ? shadow->node_bytes : 0);
+    if (budget && budget->limit > 0 && budget->used + bytes > budget->limit) {
+        return BPTREE_MEMORY_LIMIT;
+    }
+    if (tree->budget) tree->budget->used -= bytes;
+    tree->budget = budget;
+    if (shadow) shadow->budget = budget;
+    if (budget) budget->used += bytes;
+    return BPTREE_OK;
+}
+
+#ifdef BPTREE_ENABLE_TTL
+BPTREE_API bptree_status bptree_set_expiry(bptree *tree, const bptree_key_t *key,
+                                           const int64_t expires_at) {
+    if (!tree || !tree->root || !key) return BPTREE_INVALID_ARGUMENT;
+    int pos;
+    bptree_node *leaf = bptree_find_entry(tree, key, &pos);
+    if (!leaf) return BPTREE_KEY_NOT_FOUND;
+    bptree_node_expiries(leaf, tree->max_keys)[pos] = expires_at;
+    bptree_note_write(tree, key);
+    bptree_refresh_path(tree, key);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_put_expiring(bptree *tree, const bptree_key_t *key,
+                                             const bptree_value_t value,
+                                             const int64_t expires_at) {
+    const bptree_status status = bptree_put(tree, key, value);
+    if (status != BPTREE_OK) return status;
+    return bptree_set_expiry(tree, key, expires_at);
+}
+
+BPTREE_API bptree_status bptree_get_expiry(const bptree *tree, const bptree_key_t *key,
+                                           int64_t *out_expires_at) {
+    if (!tree || !tree->root || !key || !out_expires_at) return BPTREE_INVALID_ARGUMENT;
+    int pos;
+    bptree_node *leaf = bptree_find_entry(tree, key, &pos);
+    if (!leaf) return BPTREE_KEY_NOT_FOUND;
+    *out_expires_at = bptree_node_expiries(leaf, tree->max_keys)[pos];
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_expire(bptree *tree, const int64_t now, const int max_removals,
+                                       int *out_removed) {
+    if (out_removed) *out_removed = 0;
+    if (!tree || !tree->root || max_removals < 1) return BPTREE_INVALID_ARGUMENT;
+    int removed = 0;
+    while (removed < max_removals && tree->root->min_expiry <= now) {
+        // Follow the leftmost child whose subtree holds an expired entry.
+        bptree_node *node = tree->root;
+        while (!node->is_leaf) {
+            bptree_node **children = bptree_node_children(node, tree->max_keys);
+            int i = 0;
+            while (children[i]->min_expiry > now) i++;
+            node = children[i];
+        }
+        const int64_t *expiries = bptree_node_expiries(node, tree->max_keys);
+        int pos = 0;
+        while (expiries[pos] > now) pos++;
+        const bptree_key_t key = bptree_node_keys(node)[pos];
+        const bptree_status status = bptree_remove(tree, &key);
+        if (status != BPTREE_OK) return status;
+        removed++;
+    }
+    if (out_removed) *out_removed = removed;
+    BPTREE_LOG_EVENT(tree->enable_debug, "Expired %d entries. Tree count: %lld\n", removed,
+                     (long long)tree->count);
+    return BPTREE_OK;
 }
+#endif
 
 #endif
 
@@ -0,0 +1,840 @@
+/**
+ * @file bench_common.h
+ * @brief Timing, statistics, and result output shared by the benchmark programs.
+ *
+ * Each benchmark case runs its operations WARMUP + REPS times. Every run is timed as a
+ * whole with CLOCK_MONOTONIC, and the case reports the median, mean, standard deviation,
+ * and fastest of the timed runs, plus operations per second at the median. One extra run
+ * times every operation on its own to get latency percentiles (these include the cost of
+ * reading the clock, about 20 ns on most systems). Results are printed as text as each
+ * case finishes, or all at once at the end as JSON or CSV, with progress messages going
+ * to stderr so that stdout holds only the results.
+ *
+ * On Linux, the timed runs of each case are also measured with hardware counters (through
+ * perf_event_open, in user mode, including threads the runs start): cycles, instructions,
+ * L1 data cache, last-level cache, and data TLB read misses, and branch misses, reported
+ * per operation. Counters the machine or kernel does not provide (for example under a
+ * hypervisor without a virtual PMU, or with kernel.perf_event_paranoid above 2) are left
+ * out, and without any of them the results are the same as without counters. Counters
+ * that had to share the hardware with others are scaled by the time they ran.
+ *
+ * Settings come from environment variables:
+ * - N: number of items (and operations per case), 1000000 by default.
+ * - MAX_ITEMS: max_keys of the trees, 32 by default.
+ * - SEED: random seed, taken from the clock by default (the value used is reported).
+ * - WARMUP: untimed runs before the timed ones, 1 by default.
+ * - REPS: timed runs, 5 by default.
+ * - LATENCY: 0 to skip the per-operation latency run, 1 (the default) to do it.
+ * - FORMAT: `text` (the default), `json`, or `csv`.
+ * - COUNTERS: 0 to skip the hardware counters, 1 (the default) to read them if possible.
+ *
+ * Include this header before any system header, since it asks for POSIX clocks. It
+ * includes bptree.h, so a program that holds the implementation defines
+ * BPTREE_IMPLEMENTATION first. It also compiles as C++.
+ *
+ * @version 0.4.1-beta
+ */
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  // For syscall and ioctl, to read the hardware counters
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "bptree.h"  // Key type and comparator of the trees under test
+
+/** @brief Output format of the results. */
+typedef enum {
+    BENCH_TEXT, /**< One human-readable line per case, printed as it finishes */
+    BENCH_JSON, /**< One JSON document with the settings and every case */
+    BENCH_CSV   /**< A header row and one row per case */
+} bench_format;
+
+/** @brief Settings of a benchmark program, read from the environment by bench_init. */
+typedef struct bench_config {
+    const char *program; /**< Name of the benchmark program */
+    int n;               /**< Number of items (N) */
+    int max_keys;        /**< max_keys of the trees (MAX_ITEMS) */
+    unsigned seed;       /**< Random seed (SEED) */
+    int warmup;          /**< Untimed runs per case (WARMUP) */
+    int reps;            /**< Timed runs per case (REPS) */
+    bool latency;        /**< If true, time every operation in one extra run (LATENCY) */
+    bool counters;       /**< If true, read the hardware counters if possible (COUNTERS) */
+    bench_format format; /**< Output format (FORMAT) */
+} bench_config;
+
+/** @brief Number of latency percentiles reported per case. */
+#define BENCH_PERCENTILES 5
+
+/** @brief Latency percentiles reported per case (100 is the slowest operation). */
+static const double bench_percentiles[BENCH_PERCENTILES] = {50.0, 90.0, 99.0, 99.9, 100.0};
+
+/** @brief Names of the latency percentiles, as used in JSON and CSV output. */
+static const char *const bench_percentile_names[BENCH_PERCENTILES] = {"p50_ns", "p90_ns",
+                                                                      "p99_ns", "p999_ns",
+                                                                      "max_ns"};
+
+/** @brief Number of hardware counters read per case. */
+#define BENCH_COUNTERS 6
+
+/** @brief Names of the hardware counters, as used (with `_per_op`) in JSON and CSV output. */
+static const char *const bench_counter_names[BENCH_COUNTERS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "branch_misses"};
+
+/** @brief Names of the hardware counters in text output. */
+static const char *const bench_counter_labels[BENCH_COUNTERS] = {
+    "cycles", "instructions", "L1D misses", "LLC misses", "dTLB misses", "branch misses"};
+
+/** @brief Summary of one benchmark case. */
+typedef struct bench_result {
+    char name[64];      /**< Case name */
+    int ops;            /**< Operations per run */
+    int reps;           /**< Number of timed runs */
+    double median_s;    /**< Median run time in seconds */
+    double mean_s;      /**< Mean run time in seconds */
+    double stddev_s;    /**< Sample standard deviation of the run times in seconds */
+    double min_s;       /**< Fastest run time in seconds */
+    double ops_per_sec; /**< Operations per second at the median run time */
+    bool has_latency;   /**< True if the latency percentiles were measured */
+    double latency_ns[BENCH_PERCENTILES]; /**< Per-operation latency percentiles */
+    bool has_memory;                      /**< True if the memory use was measured */
+    double bytes_per_key;                 /**< Memory of the structure divided by its entries */
+    bool has_counters;                    /**< True if any hardware counter was read */
+    double per_op[BENCH_COUNTERS];        /**< Counts per operation (NAN if not available) */
+} bench_result;
+
+/** @brief Hardware counters of a benchmark program. */
+typedef struct bench_counters {
+    int fd[BENCH_COUNTERS];            /**< File descriptors (-1 if not available) */
+    int available;                     /**< Number of counters available */
+    uint64_t start[BENCH_COUNTERS][3]; /**< Count, time enabled, and time running at run start */
+    double sum[BENCH_COUNTERS];        /**< Scaled counts of the timed runs of the current case */
+} bench_counters;
+
+/** @brief State of a benchmark program. */
+typedef struct bench_harness {
+    bench_config config;     /**< Settings */
+    bench_result *results;   /**< Finished cases */
+    int num_results;         /**< Number of finished cases */
+    int cap_results;         /**< Capacity of `results` */
+    double *run_s;           /**< Times of the timed runs of the current case */
+    uint64_t *latency;       /**< Per-operation times of the current case (NULL if not kept) */
+    int latency_cap;         /**< Capacity of `latency` */
+    bench_counters counters; /**< Hardware counters */
+} bench_harness;
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return Nanoseconds since an arbitrary starting point.
+ */
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Read an integer setting from the environment.
+ *
+ * @param name Name of the environment variable.
+ * @param fallback Value to use if the variable is not set.
+ * @param min Smallest valid value; smaller values are replaced by @p fallback.
+ * @return The setting.
+ */
+static inline int bench_env_int(const char *name, const int fallback, const int min) {
+    const char *text = getenv(name);
+    if (!text || !*text) return fallback;
+    const int value = atoi(text);
+    if (value < min) {
+        fprintf(stderr, "Invalid %s value (%d); defaulting to %d\n", name, value, fallback);
+        return fallback;
+    }
+    return value;
+}
+
+/**
+ * @brief Read a floating-point setting from the environment.
+ *
+ * @param name Name of the environment variable.
+ * @param fallback Value to use if the variable is not set.
+ * @param min Smallest valid value.
+ * @param max Largest valid value.
+ * @return The setting, or @p fallback if it is out of range.
+ */
+static inline double bench_env_double(const char *name, const double fallback,
+                                      const double min, const double max) {
+    const char *text = getenv(name);
+    if (!text || !*text) return fallback;
+    const double value = atof(text);
+    if (!(value >= min && value <= max)) {
+        fprintf(stderr, "Invalid %s value (%g); defaulting to %g\n", name, value, fallback);
+        return fallback;
+    }
+    return value;
+}
+
+/** @brief Most values in a list setting (see bench_env_list). */
+#define BENCH_MAX_LIST 32
+
+/** @brief max_keys values used when ORDERS is not set. */
+#define BENCH_DEFAULT_ORDERS "4,8,16,32,64,128,256,512,1024"
+
+/**
+ * @brief Parse a comma-separated list of positive numbers.
+ *
+ * @param text The list.
+ * @param out Array of BENCH_MAX_LIST numbers to fill.
+ * @return Number of values read, or 0 if the list is not valid.
+ */
+static inline int bench_parse_list(const char *text, double *out) {
+    int count = 0;
+    while (*text && count < BENCH_MAX_LIST) {
+        char *end = NULL;
+        const double value = strtod(text, &end);
+        if (end == text || !(value > 0) || (*end && *end != ',')) return 0;
+        out[count++] = value;
+        text = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+/**
+ * @brief Read a comma-separated list of positive numbers from the environment.
+ *
+ * @param name Name of the environment variable.
+ * @param fallback List to use if the variable is not set or not valid.
+ * @param out Array of BENCH_MAX_LIST numbers to fill.
+ * @return Number of values read.
+ */
+static inline int bench_env_list(const char *name, const char *fallback, double *out) {
+    const char *text = getenv(name);
+    if (text && *text) {
+        const int count = bench_parse_list(text, out);
+        if (count > 0) return count;
+        fprintf(stderr, "Invalid %s '%s'; defaulting to %s\n", name, text, fallback);
+    }
+    return bench_parse_list(fallback, out);
+}
+
+/**
+ * @brief Read the max_keys values to measure from ORDERS.
+ *
+ * @param out Array of BENCH_MAX_LIST values to fill.
+ * @return Number of values read (BENCH_DEFAULT_ORDERS unless ORDERS holds whole numbers of
+ *         at least 3).
+ */
+static inline int bench_env_orders(int *out) {
+    double values[BENCH_MAX_LIST];
+    int count = bench_env_list("ORDERS", BENCH_DEFAULT_ORDERS, values);
+    for (int i = 0; i < count; i++) {
+        if (values[i] < 3 || values[i] > INT_MAX || values[i] != floor(values[i])) {
+            fprintf(stderr, "Invalid ORDERS (max_keys values must be whole numbers of at least "
+                            "3); defaulting to %s\n",
+                    BENCH_DEFAULT_ORDERS);
+            count = bench_parse_list(BENCH_DEFAULT_ORDERS, values);
+            break;
+        }
+    }
+    for (int i = 0; i < count; i++) out[i] = (int)values[i];
+    return count;
+}
+
+/**
+ * @brief Write a number in decimal, padded with leading zeros to a fixed width.
+ *
+ * @param number The number.
+ * @param out Buffer of @p width characters (not NUL-terminated).
+ * @param width Number of digits.
+ */
+static inline void bench_decimal(uint64_t number, char *out, const int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        out[i] = (char)('0' + number % 10);
+        number /= 10;
+    }
+}
+
+/**
+ * @brief Make the key with a given rank, for programs built for one key configuration.
+ *
+ * Integer keys are the rank itself. String keys are the rank in decimal, padded with
+ * leading zeros to the full key size, so they sort like the ranks.
+ *
+ * @param rank The rank.
+ * @param out The key.
+ */
+static inline void bench_make_key(const uint64_t rank, bptree_key_t *out) {
+#ifdef BPTREE_KEY_TYPE_STRING
+    bench_decimal(rank, out->data, BPTREE_KEY_SIZE);
+#else
+    *out = (bptree_key_t)rank;
+#endif
+}
+
+#ifndef BPTREE_KEY_TYPE_STRING
+/**
+ * @brief Compare two integer keys, for bptree_create.
+ *
+ * @param a First key.
+ * @param b Second key.
+ * @return -1, 0, or 1 as @p a is less than, equal to, or greater than @p b.
+ */
+static inline int bench_compare_keys(const bptree_key_t *a, const bptree_key_t *b) {
+    return (*a < *b) ? -1 : ((*a > *b) ? 1 : 0);
+}
+#endif
+
+/**
+ * @brief Draw the next number of an xorshift64* generator.
+ *
+ * @param state Generator state (nonzero).
+ * @return A uniformly distributed 64-bit number.
+ */
+static inline uint64_t bench_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief Shuffle numbers (Fisher-Yates), drawing from rand().
+ *
+ * Each index is drawn from two rand() calls, so that arrays longer than RAND_MAX are
+ * shuffled evenly too.
+ *
+ * @param values The numbers.
+ * @param n Number of numbers.
+ */
+static inline void bench_shuffle(uint32_t *values, const int n) {
+    for (int i = n - 1; i > 0; i--) {
+        const int j = (int)(((uint64_t)rand() * ((uint64_t)RAND_MAX + 1) + (uint64_t)rand()) %
+                            (uint64_t)(i + 1));
+        const uint32_t tmp = values[i];
+        values[i] = values[j];
+        values[j] = tmp;
+    }
+}
+
+/**
+ * @brief Print a progress message: to stdout for text output, to stderr otherwise.
+ *
+ * @param h Benchmark state.
+ * @param format printf-style format of the message.
+ */
+static inline void bench_note(const bench_harness *h, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(h->config.format == BENCH_TEXT ? stdout : stderr, format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Open the hardware counters, leaving out those that are not available.
+ *
+ * @param h Benchmark state (with its settings read).
+ */
+static inline void bench_counters_open(bench_harness *h) {
+    bench_counters *c = &h->counters;
+    for (int i = 0; i < BENCH_COUNTERS; i++) c->fd[i] = -1;
+    c->available = 0;
+    if (!h->config.counters) return;
+#ifdef __linux__
+    // Cache events are encoded as cache | (operation << 8) | (result << 16).
+    const uint64_t read_miss = ((uint64_t)PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint32_t types[BENCH_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                            PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+                                            PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    const uint64_t configs[BENCH_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,           PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | read_miss, PERF_COUNT_HW_CACHE_LL | read_miss,
+        PERF_COUNT_HW_CACHE_DTLB | read_miss, PERF_COUNT_HW_BRANCH_MISSES};
+    int error = 0;
+    for (int i = 0; i < BENCH_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = types[i];
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;  // Also count the threads that runs start
+        c->fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (c->fd[i] >= 0) {
+            c->available++;
+        } else {
+            error = errno;
+        }
+    }
+    if (c->available < BENCH_COUNTERS) {
+        bench_note(h, "Hardware counters: %d of %d available (%s%s)\n", c->available,
+                   BENCH_COUNTERS, strerror(error),
+                   error == EACCES || error == EPERM ? "; see kernel.perf_event_paranoid" : "");
+    }
+#else
+    bench_note(h, "Hardware counters: not available on this platform\n");
+#endif
+}
+
+/**
+ * @brief Read a hardware counter.
+ *
+ * @param fd File descriptor of the counter.
+ * @param out Receives the count, the time the counter was enabled, and the time it ran.
+ * @return True if the counter was read.
+ */
+static inline bool bench_counter_read(const int fd, uint64_t out[3]) {
+#ifdef __linux__
+    return read(fd, out, 3 * sizeof(uint64_t)) == (ssize_t)(3 * sizeof(uint64_t));
+#else
+    (void)fd;
+    (void)out;
+    return false;
+#endif
+}
+
+/**
+ * @brief Read the settings from the environment and seed the random number generator.
+ *
+ * @param h Benchmark state to set up.
+ * @param program Name of the benchmark program.
+ */
+static inline void bench_init(bench_harness *h, const char *program) {
+    memset(h, 0, sizeof(*h));
+    bench_config *c = &h->config;
+    c->program = program;
+    c->n = bench_env_int("N", 1000000, 1);
+    c->max_keys = bench_env_int("MAX_ITEMS", 32, 3);
+    c->seed = (unsigned)bench_env_int("SEED", (int)(time(NULL) & 0x7fffffff), 0);
+    c->warmup = bench_env_int("WARMUP", 1, 0);
+    c->reps = bench_env_int("REPS", 5, 1);
+    c->latency = bench_env_int("LATENCY", 1, 0) != 0;
+    c->counters = bench_env_int("COUNTERS", 1, 0) != 0;
+    const char *format = getenv("FORMAT");
+    c->format = BENCH_TEXT;
+    if (format && strcmp(format, "json") == 0) {
+        c->format = BENCH_JSON;
+    } else if (format && strcmp(format, "csv") == 0) {
+        c->format = BENCH_CSV;
+    } else if (format && *format && strcmp(format, "text") != 0) {
+        fprintf(stderr, "Unknown FORMAT '%s'; defaulting to text\n", format);
+    }
+    h->run_s = (double *)malloc((size_t)c->reps * sizeof(double));
+    if (!h->run_s) {
+        perror("Allocation failed for run times");
+        exit(EXIT_FAILURE);
+    }
+    srand(c->seed);
+    bench_note(h, "SEED=%u, MAX_ITEMS=%d, N=%d, WARMUP=%d, REPS=%d\n", c->seed, c->max_keys,
+               c->n, c->warmup, c->reps);
+    bench_counters_open(h);
+}
+
+/**
+ * @brief Start a case.
+ *
+ * @param h Benchmark state.
+ * @param ops Operations per run.
+ * @return Number of runs to do: warmup, timed, and (if there is room to record it) one run
+ *         with per-operation timing.
+ */
+static inline int bench_begin(bench_harness *h, const int ops) {
+    const int runs = h->config.warmup + h->config.reps;
+    for (int i = 0; i < BENCH_COUNTERS; i++) h->counters.sum[i] = 0.0;
+    if (!h->config.latency || ops <= 0) return runs;
+    if (ops > h->latency_cap) {
+        free(h->latency);
+        h->latency = (uint64_t *)malloc((size_t)ops * sizeof(uint64_t));
+        h->latency_cap = h->latency ? ops : 0;
+    }
+    return h->latency ? runs + 1 : runs;
+}
+
+/**
+ * @brief Tell whether a run of the current case times every operation on its own.
+ *
+ * @param h Benchmark state.
+ * @param run Index of the run.
+ * @return True for the run after the timed ones.
+ */
+static inline bool bench_latency_run(const bench_harness *h, const int run) {
+    return run == h->config.warmup + h->config.reps;
+}
+
+/**
+ * @brief Start a warmup or timed run of the current case.
+ *
+ * @param h Benchmark state.
+ * @param run Index of the run.
+ * @return The monotonic clock (see bench_now_ns), read after the counters.
+ */
+static inline uint64_t bench_run_start(bench_harness *h, const int run) {
+    bench_counters *c = &h->counters;
+    for (int i = 0; i < BENCH_COUNTERS && c->available && run >= h->config.warmup; i++) {
+        if (c->fd[i] >= 0 && !bench_counter_read(c->fd[i], c->start[i])) {
+            memset(c->start[i], 0, sizeof(c->start[i]));
+        }
+    }
+    return bench_now_ns();
+}
+
+/**
+ * @brief Record the time and counts of a run of the current case (warmup runs are dropped).
+ *
+ * @param h Benchmark state.
+ * @param run Index of the run.
+ * @param ns Time the run took.
+ */
+static inline void bench_run_done(bench_harness *h, const int run, const uint64_t ns) {
+    if (run < h->config.warmup) return;
+    h->run_s[run - h->config.warmup] = (double)ns / 1e9;
+    bench_counters *c = &h->counters;
+    for (int i = 0; i < BENCH_COUNTERS && c->available; i++) {
+        uint64_t end[3];
+        if (c->fd[i] < 0) continue;
+        if (!bench_counter_read(c->fd[i], end) || c->start[i][1] == 0) {
+            c->sum[i] = NAN;
+            continue;
+        }
+        // A counter that shared the hardware is scaled up to the whole run (NAN if it never ran).
+        const double count = (double)(end[0] - c->start[i][0]);
+        const double enabled = (double)(end[1] - c->start[i][1]);
+        const double running = (double)(end[2] - c->start[i][2]);
+        c->sum[i] += running > 0 ? count * enabled / running : NAN;
+    }
+}
+
+/**
+ * @brief qsort comparison for doubles.
+ *
+ * @param a Pointer to the first value.
+ * @param b Pointer to the second value.
+ * @return Negative, zero, or positive as in strcmp.
+ */
+static inline int bench_compare_double(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief qsort comparison for 64-bit unsigned integers.
+ *
+ * @param a Pointer to the first value.
+ * @param b Pointer to the second value.
+ * @return Negative, zero, or positive as in strcmp.
+ */
+static inline int bench_compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Write a string as a JSON string literal.
+ *
+ * @param out Stream to write to.
+ * @param text String to write.
+ */
+static inline void bench_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const char *p = text; *p; p++) {
+        if (*p == '"' || *p == '\\') fputc('\\', out);
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+/**
+ * @brief Print one case as text.
+ *
+ * @param r The case.
+ */
+static inline void bench_print_text(const bench_result *r) {
+    printf("%s: %d ops, median %.6f s (%.0f ops/sec), mean %.6f s, stddev %.6f s, min %.6f s",
+           r->name, r->ops, r->median_s, r->ops_per_sec, r->mean_s, r->stddev_s, r->min_s);
+    if (r->has_latency) {
+        printf(", latency p50 %.0f ns, p99 %.0f ns, max %.0f ns", r->latency_ns[0],
+               r->latency_ns[2], r->latency_ns[4]);
+    }
+    printf("\n");
+    if (r->has_counters) {
+        printf("%s: per op", r->name);
+        const char *separator = "";
+        for (int i = 0; i < BENCH_COUNTERS; i++) {
+            if (isnan(r->per_op[i])) continue;
+            printf("%s %.2f %s", separator, r->per_op[i], bench_counter_labels[i]);
+            separator = ",";
+        }
+        if (!isnan(r->per_op[0]) && !isnan(r->per_op[1]) && r->per_op[0] > 0) {
+            printf(", IPC %.2f", r->per_op[1] / r->per_op[0]);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * @brief Add an empty result to the finished cases.
+ *
+ * @param h Benchmark state.
+ * @param name Case name.
+ * @param ops Operations per run.
+ * @return The new result, zeroed except for its name and operation count.
+ */
+static inline bench_result *bench_add_result(bench_harness *h, const char *name,
+                                             const int ops) {
+    if (h->num_results == h->cap_results) {
+        const int cap = h->cap_results ? 2 * h->cap_results : 16;
+        bench_result *results =
+            (bench_result *)realloc(h->results, (size_t)cap * sizeof(bench_result));
+        if (!results) {
+            perror("Allocation failed for results");
+            exit(EXIT_FAILURE);
+        }
+        h->results = results;
+        h->cap_results = cap;
+    }
+    bench_result *r = &h->results[h->num_results++];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ops = ops;
+    return r;
+}
+
+/**
+ * @brief Fill in the latency percentiles of a result.
+ *
+ * @param r The result.
+ * @param samples Per-operation times in nanoseconds (sorted in place).
+ * @param count Number of samples (nothing is filled in if 0).
+ */
+static inline void bench_set_latency(bench_result *r, uint64_t *samples, const int count) {
+    if (count <= 0) return;
+    qsort(samples, (size_t)count, sizeof(uint64_t), bench_compare_u64);
+    for (int p = 0; p < BENCH_PERCENTILES; p++) {
+        int rank = (int)ceil(bench_percentiles[p] / 100.0 * count) - 1;
+        if (rank < 0) rank = 0;
+        if (rank >= count) rank = count - 1;
+        r->latency_ns[p] = (double)samples[rank];
+    }
+    r->has_latency = true;
+}
+
+/**
+ * @brief Finish a case: summarize its runs and store (and, for text output, print) it.
+ *
+ * @param h Benchmark state.
+ * @param name Case name.
+ * @param ops Operations per run.
+ * @param timed_latency True if the per-operation run was done.
+ */
+static inline void bench_end(bench_harness *h, const char *name, const int ops,
+                             const bool timed_latency) {
+    bench_result *r = bench_add_result(h, name, ops);
+    const int reps = h->config.reps;
+    r->reps = reps;
+    double sum = 0.0;
+    for (int i = 0; i < reps; i++) sum += h->run_s[i];
+    r->mean_s = sum / reps;
+    double squares = 0.0;
+    for (int i = 0; i < reps; i++) squares += (h->run_s[i] - r->mean_s) * (h->run_s[i] - r->mean_s);
+    r->stddev_s = reps > 1 ? sqrt(squares / (reps - 1)) : 0.0;
+    qsort(h->run_s, (size_t)reps, sizeof(double), bench_compare_double);
+    r->min_s = h->run_s[0];
+    r->median_s = reps % 2 ? h->run_s[reps / 2] : (h->run_s[reps / 2 - 1] + h->run_s[reps / 2]) / 2;
+    r->ops_per_sec = r->median_s > 0 ? ops / r->median_s : 0.0;
+    if (timed_latency) bench_set_latency(r, h->latency, ops);
+    const double total_ops = (double)ops * reps;
+    for (int i = 0; i < BENCH_COUNTERS; i++) {
+        const bool known = h->counters.fd[i] >= 0 && total_ops > 0;
+        r->per_op[i] = known ? h->counters.sum[i] / total_ops : NAN;
+        r->has_counters = r->has_counters || !isnan(r->per_op[i]);
+    }
+    if (h->config.format == BENCH_TEXT) bench_print_text(r);
+}
+
+/**
+ * @brief Report a group of individually timed operations, such as one kind in a mix.
+ *
+ * The result has a single "run" whose time is the sum of the samples, so its ops/sec is
+ * the rate of these operations alone (clock reads included).
+ *
+ * @param h Benchmark state.
+ * @param name Case name.
+ * @param samples Per-operation times in nanoseconds (sorted in place).
+ * @param count Number of samples (nothing is reported if 0).
+ */
+static inline void bench_report_latency(bench_harness *h, const char *name,
+                                        uint64_t *samples, const int count) {
+    if (count <= 0) return;
+    bench_result *r = bench_add_result(h, name, count);
+    uint64_t total_ns = 0;
+    for (int i = 0; i < count; i++) total_ns += samples[i];
+    r->reps = 1;
+    r->median_s = r->mean_s = r->min_s = (double)total_ns / 1e9;
+    r->ops_per_sec = total_ns > 0 ? count / r->median_s : 0.0;
+    bench_set_latency(r, samples, count);
+    if (h->config.format == BENCH_TEXT) bench_print_text(r);
+}
+
+/**
+ * @brief Attach the memory use of a data structure to the last finished case.
+ *
+ * @param h Benchmark state (with at least one finished case).
+ * @param bytes Memory of the structure.
+ * @param entries Number of entries it holds.
+ */
+static inline void bench_set_memory(bench_harness *h, const size_t bytes, const int entries) {
+    bench_result *r = &h->results[h->num_results - 1];
+    r->has_memory = true;
+    r->bytes_per_key = entries > 0 ? (double)bytes / entries : 0.0;
+    if (h->config.format == BENCH_TEXT) {
+        printf("%s: %zu bytes for %d entries (%.1f bytes per key)\n", r->name, bytes, entries,
+               r->bytes_per_key);
+    }
+}
+
+/**
+ * @brief Print the results in the chosen machine-readable format and release the state.
+ *
+ * @param h Benchmark state.
+ */
+static inline void bench_finish(bench_harness *h) {
+    const bench_config *c = &h->config;
+    if (c->format == BENCH_JSON) {
+        printf("{\"program\": ");
+        bench_json_string(stdout, c->program);
+        printf(",\n \"config\": {\"n\": %d, \"max_keys\": %d, \"seed\": %u, \"warmup\": %d, "
+               "\"reps\": %d},\n \"results\": [",
+               c->n, c->max_keys, c->seed, c->warmup, c->reps);
+        for (int i = 0; i < h->num_results; i++) {
+            const bench_result *r = &h->results[i];
+            printf("%s\n  {\"name\": ", i ? "," : "");
+            bench_json_string(stdout, r->name);
+            printf(", \"ops\": %d, \"reps\": %d, \"median_s\": %.9f, \"mean_s\": %.9f, "
+                   "\"stddev_s\": %.9f, \"min_s\": %.9f, \"ops_per_sec\": %.1f",
+                   r->ops, r->reps, r->median_s, r->mean_s, r->stddev_s, r->min_s,
+                   r->ops_per_sec);
+            for (int p = 0; p < BENCH_PERCENTILES && r->has_latency; p++) {
+                printf(", \"%s\": %.0f", bench_percentile_names[p], r->latency_ns[p]);
+            }
+            if (r->has_memory) printf(", \"bytes_per_key\": %.1f", r->bytes_per_key);
+            for (int i = 0; i < BENCH_COUNTERS && r->has_counters; i++) {
+                if (!isnan(r->per_op[i])) {
+                    printf(", \"%s_per_op\": %.3f", bench_counter_names[i], r->per_op[i]);
+                }
+            }
+            printf("}");
+        }
+        printf("\n ]}\n");
+    } else if (c->format == BENCH_CSV) {
+        printf("program,name,n,max_keys,seed,ops,reps,median_s,mean_s,stddev_s,min_s,ops_per_sec");
+        for (int p = 0; p < BENCH_PERCENTILES; p++) printf(",%s", bench_percentile_names[p]);
+        printf(",bytes_per_key");
+        for (int i = 0; i < BENCH_COUNTERS; i++) printf(",%s_per_op", bench_counter_names[i]);
+        printf("\n");
+        for (int i = 0; i < h->num_results; i++) {
+            const bench_result *r = &h->results[i];
+            printf("%s,\"%s\",%d,%d,%u,%d,%d,%.9f,%.9f,%.9f,%.9f,%.1f", c->program, r->name, c->n,
+                   c->max_keys, c->seed, r->ops, r->reps, r->median_s, r->mean_s, r->stddev_s,
+                   r->min_s, r->ops_per_sec);
+            for (int p = 0; p < BENCH_PERCENTILES; p++) {
+                if (r->has_latency) {
+                    printf(",%.0f", r->latency_ns[p]);
+                } else {
+                    printf(",");
+                }
+            }
+            if (r->has_memory) {
+                printf(",%.1f", r->bytes_per_key);
+            } else {
+                printf(",");
+            }
+            for (int i = 0; i < BENCH_COUNTERS; i++) {
+                if (r->has_counters && !isnan(r->per_op[i])) {
+                    printf(",%.3f", r->per_op[i]);
+                } else {
+                    printf(",");
+                }
+            }
+            printf("\n");
+        }
+    }
+#ifdef __linux__
+    for (int i = 0; i < BENCH_COUNTERS; i++) {
+        if (h->counters.fd[i] >= 0) close(h->counters.fd[i]);
+    }
+#endif
+    free(h->results);
+    free(h->run_s);
+    free(h->latency);
+    memset(h, 0, sizeof(*h));
+}
+
+/**
+ * @def BENCH(h, name, count, setup, body, teardown)
+ * @brief Run a benchmark case: `setup`, `count` runs of `body`, and `teardown`, repeatedly.
+ *
+ * Only the loop over `body` is timed. The loop index `bench_i` is available in `body`, and
+ * the run index `bench_r` in all three blocks.
+ *
+ * @param h Pointer to the benchmark state.
+ * @param name Case name.
+ * @param count Operations per run.
+ * @param setup Code run before each run (untimed).
+ * @param body Code of one operation.
+ * @param teardown Code run after each run (untimed).
+ */
+#define BENCH(h, name, count, setup, body, teardown)                        \
+    do {                                                                    \
+        const int bench_n = (count);                                        \
+        const int bench_runs = bench_begin((h), bench_n);                   \
+        bool bench_timed_latency = false;                                   \
+        for (int bench_r = 0; bench_r < bench_runs; bench_r++) {            \
+            setup;                                                          \
+            if (!bench_latency_run((h), bench_r)) {                         \
+                const uint64_t bench_start = bench_run_start((h), bench_r); \
+                for (int bench_i = 0; bench_i < bench_n; bench_i++) {       \
+                    body;                                                   \
+                }                                                           \
+                bench_run_done((h), bench_r, bench_now_ns() - bench_start); \
+            } else {                                                        \
+                for (int bench_i = 0; bench_i < bench_n; bench_i++) {       \
+                    const uint64_t bench_start = bench_now_ns();            \
+                    body;                                                   \
+                    (h)->latency[bench_i] = bench_now_ns() - bench_start;   \
+                }                                                           \
+                bench_timed_latency = true;                                 \
+            }                                                               \
+            teardown;                                                       \
+        }                                                                   \
+        bench_end((h), (name), bench_n, bench_timed_latency);               \
+    } while (0)
+
+#endif  // BENCH_COMMON_H
@@ -0,0 +1,496 @@
+/**
+ * @file bench_compare.cpp
+ * @brief Comparison of the B+ tree library (bptree.h) with other containers.
+ *
+ * Runs the same workloads, on the same keys in the same orders, against:
+ * - bptree (with the default comparator and MAX_ITEMS keys per node).
+ * - std::map (a red-black tree).
+ * - A sorted std::vector with binary search.
+ * - std::unordered_map (point operations only, as it has no key order).
+ * - A simple skiplist (four-way, as in Pugh's paper).
+ *
+ * The workloads are:
+ * - insert: N keys in random order into an empty container. The sorted vector appends
+ *   them and sorts once at the end (its natural bulk load); the sort is timed as part of
+ *   the last operation.
+ * - get: every key, in another random order.
+ * - scan: copy every value, in key order, into an array (bptree_get_range over all keys).
+ * - range: copy the values of 100 consecutive keys from a random start into an array.
+ * - delete: every key, in a third random order. The sorted vector only does this for
+ *   N up to 20000, since each erase moves half of the array on average.
+ *
+ * Each case is reported through bench_common.h, with the memory held by each container
+ * after the insert (node memory for bptree, memory from its allocator for the others)
+ * attached to its insert case. A table of throughput relative to bptree and of bytes per
+ * key follows.
+ *
+ * This program is C++; bptree itself is compiled as C into a separate object file.
+ *
+ * @version 0.4.1-beta
+ */
+
+#include "bench_common.h"  // Include first: it selects the POSIX clock API
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bptree.h"  // Include the B+ tree library (the implementation is in bptree.o)
+
+/** @brief Bytes currently allocated by the C++ containers (see counting_allocator). */
+static size_t live_bytes = 0;
+
+/** @brief Last result of each operation, so that the compiler cannot drop unused lookups. */
+static volatile uintptr_t sink;
+
+/** @brief Allocator that counts the bytes it hands out in live_bytes. */
+template <typename T>
+struct counting_allocator {
+    typedef T value_type;
+
+    counting_allocator() = default;
+    template <typename U>
+    counting_allocator(const counting_allocator<U> &) {}
+    T *allocate(const std::size_t n) {
+        live_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T *ptr, const std::size_t n) {
+        live_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(ptr, n);
+    }
+    template <typename U>
+    bool operator==(const counting_allocator<U> &) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const counting_allocator<U> &) const {
+        return false;
+    }
+};
+
+/** @brief Allocator of the entries of std::map and std::unordered_map. */
+typedef counting_allocator<std::pair<const int64_t, void *>> pair_allocator;
+
+/** @brief Number of keys covered by each range query. */
+static const int range_keys = 100;
+
+/** @brief Largest N for which the sorted vector runs the delete workload. */
+static const int vector_delete_max = 20000;
+
+/** @brief B+ tree adapter. */
+struct bptree_container {
+    bptree *tree; /**< The tree */
+
+    /**
+     * @brief Create an empty tree.
+     *
+     * @param max_keys Maximum keys per node.
+     */
+    explicit bptree_container(const int max_keys) : tree(bptree_create(max_keys, NULL, false)) {
+        if (!tree) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ~bptree_container() { bptree_free(tree); }
+    bptree_container(const bptree_container &) = delete;
+    bptree_container &operator=(const bptree_container &) = delete;
+
+    void insert(const int64_t key, void *value) {
+        const bptree_key_t k = key;
+        const bptree_status st = bptree_put(tree, &k, value);
+        assert(st == BPTREE_OK);
+        (void)st;
+    }
+    void finish_load() {}
+    void *get(const int64_t key) const {
+        const bptree_key_t k = key;
+        bptree_value_t value = NULL;
+        bptree_get(tree, &k, &value);
+        return value;
+    }
+    int range(const int64_t lo, const int64_t hi, void **out) const {
+        const bptree_key_t start = lo, end = hi;
+        bptree_value_t *values = NULL;
+        int found = 0;
+        if (bptree_get_range(tree, &start, &end, &values, &found) != BPTREE_OK) return 0;
+        std::copy(values, values + found, out);
+        bptree_free_range_results(values);
+        return found;
+    }
+    void erase(const int64_t key) {
+        const bptree_key_t k = key;
+        const bptree_status st = bptree_remove(tree, &k);
+        assert(st == BPTREE_OK);
+        (void)st;
+    }
+    // Nodes come from malloc, not counting_allocator, so they are counted here.
+    size_t extra_bytes() const { return bptree_get_memory(tree).total_bytes; }
+};
+
+/** @brief std::map adapter. */
+struct map_container {
+    std::map<int64_t, void *, std::less<int64_t>, pair_allocator> map; /**< The map */
+
+    explicit map_container(int) {}
+    void insert(const int64_t key, void *value) { map.emplace(key, value); }
+    void finish_load() {}
+    void *get(const int64_t key) const {
+        const auto it = map.find(key);
+        return it == map.end() ? NULL : it->second;
+    }
+    int range(const int64_t lo, const int64_t hi, void **out) const {
+        int found = 0;
+        for (auto it = map.lower_bound(lo); it != map.end() && it->first <= hi; ++it) {
+            out[found++] = it->second;
+        }
+        return found;
+    }
+    void erase(const int64_t key) { map.erase(key); }
+    size_t extra_bytes() const { return 0; }
+};
+
+/** @brief Sorted std::vector adapter. */
+struct vector_container {
+    typedef std::pair<int64_t, void *> entry; /**< Key and value */
+    typedef std::vector<entry, counting_allocator<entry>> entry_vector; /**< Entry array type */
+    entry_vector entries; /**< Entries sorted by key */
+
+    explicit vector_container(int) {}
+    void insert(const int64_t key, void *value) { entries.emplace_back(key, value); }
+    void finish_load() { std::sort(entries.begin(), entries.end()); }
+    entry_vector::const_iterator lower_bound(const int64_t key) const {
+        return std::lower_bound(entries.begin(), entries.end(), key,
+                                [](const entry &e, const int64_t k) { return e.first < k; });
+    }
+    void *get(const int64_t key) const {
+        const auto it = lower_bound(key);
+        return it != entries.end() && it->first == key ? it->second : NULL;
+    }
+    int range(const int64_t lo, const int64_t hi, void **out) const {
+        int found = 0;
+        for (auto it = lower_bound(lo); it != entries.end() && it->first <= hi; ++it) {
+            out[found++] = it->second;
+        }
+        return found;
+    }
+    void erase(const int64_t key) {
+        const auto it = lower_bound(key);
+        if (it != entries.end() && it->first == key) entries.erase(it);
+    }
+    size_t extra_bytes() const { return 0; }
+};
+
+/** @brief std::unordered_map adapter (no range queries). */
+struct hash_container {
+    typedef std::unordered_map<int64_t, void *, std::hash<int64_t>, std::equal_to<int64_t>,
+                               pair_allocator>
+        table; /**< Hash table type */
+    table map; /**< The hash table */
+
+    explicit hash_container(int) {}
+    void insert(const int64_t key, void *value) { map.emplace(key, value); }
+    void finish_load() {}
+    void *get(const int64_t key) const {
+        const auto it = map.find(key);
+        return it == map.end() ? NULL : it->second;
+    }
+    int range(int64_t, int64_t, void **) const { return 0; }
+    void erase(const int64_t key) { map.erase(key); }
+    size_t extra_bytes() const { return 0; }
+};
+
+/** @brief Skiplist with a promotion probability of 1/4. */
+struct skiplist_container {
+    /** @brief Skiplist node, followed in memory by `height` forward pointers. */
+    struct node {
+        int64_t key; /**< Key */
+        void *value; /**< Value */
+        int height;  /**< Number of forward pointers */
+
+        node **next() { return reinterpret_cast<node **>(this + 1); }
+    };
+
+    /** @brief Most levels of a node (enough for about 4^24 entries). */
+    static const int max_height = 24;
+
+    node *head;      /**< Sentinel with max_height forward pointers */
+    int height;      /**< Levels in use */
+    uint64_t random; /**< xorshift64 state for node heights */
+
+    explicit skiplist_container(int) : head(make_node(0, NULL, max_height)), height(1),
+                                       random(0x9E3779B97F4A7C15ULL) {}
+    ~skiplist_container() {
+        for (node *n = head; n;) {
+            node *next = n->next()[0];
+            free_node(n);
+            n = next;
+        }
+    }
+    skiplist_container(const skiplist_container &) = delete;
+    skiplist_container &operator=(const skiplist_container &) = delete;
+
+    static node *make_node(const int64_t key, void *value, const int levels) {
+        const size_t size = sizeof(node) + levels * sizeof(node *);
+        node *n = static_cast<node *>(malloc(size));
+        if (!n) throw std::bad_alloc();
+        live_bytes += size;
+        n->key = key;
+        n->value = value;
+        n->height = levels;
+        std::fill(n->next(), n->next() + levels, nullptr);
+        return n;
+    }
+    static void free_node(node *n) {
+        live_bytes -= sizeof(node) + n->height * sizeof(node *);
+        free(n);
+    }
+    int random_height() {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        int levels = 1;
+        for (uint64_t bits = random; levels < max_height && (bits & 3) == 0; bits >>= 2) {
+            levels++;
+        }
+        return levels;
+    }
+    // Fills path with the last node before key on every level, and returns the first node
+    // at or after key.
+    node *find(const int64_t key, node **path) const {
+        node *n = head;
+        for (int level = height - 1; level >= 0; level--) {
+            while (n->next()[level] && n->next()[level]->key < key) n = n->next()[level];
+            if (path) path[level] = n;
+        }
+        return n->next()[0];
+    }
+    void insert(const int64_t key, void *value) {
+        node *path[max_height];
+        node *at = find(key, path);
+        if (at && at->key == key) return;
+        const int levels = random_height();
+        for (; height < levels; height++) path[height] = head;
+        node *n = make_node(key, value, levels);
+        for (int level = 0; level < levels; level++) {
+            n->next()[level] = path[level]->next()[level];
+            path[level]->next()[level] = n;
+        }
+    }
+    void finish_load() {}
+    void *get(const int64_t key) const {
+        const node *n = find(key, NULL);
+        return n && n->key == key ? n->value : NULL;
+    }
+    int range(const int64_t lo, const int64_t hi, void **out) const {
+        int found = 0;
+        for (node *n = find(lo, NULL); n && n->key <= hi; n = n->next()[0]) {
+            out[found++] = n->value;
+        }
+        return found;
+    }
+    void erase(const int64_t key) {
+        node *path[max_height];
+        node *n = find(key, path);
+        if (!n || n->key != key) return;
+        for (int level = 0; level < n->height; level++) {
+            path[level]->next()[level] = n->next()[level];
+        }
+        while (height > 1 && !head->next()[height - 1]) height--;
+        free_node(n);
+    }
+    size_t extra_bytes() const { return 0; }
+};
+
+/** @brief Workloads, in the order they run. */
+enum { W_INSERT, W_GET, W_SCAN, W_RANGE, W_DELETE, W_COUNT };
+
+/** @brief Names of the workloads. */
+static const char *const workload_names[W_COUNT] = {"insert", "get", "scan", "range", "delete"};
+
+/** @brief Number of containers compared. */
+static const int num_containers = 5;
+
+/** @brief Names of the containers. */
+static const char *const container_names[num_containers] = {
+    "bptree", "std::map", "sorted vector", "std::unordered_map", "skiplist"};
+
+/** @brief Keys, orders, and buffers shared by every container. */
+struct workload_data {
+    int n;                             /**< Number of keys */
+    std::vector<int64_t> insert_keys;  /**< Keys 0 to N-1 in insertion order */
+    std::vector<int64_t> get_keys;     /**< The same keys in lookup order */
+    std::vector<int64_t> delete_keys;  /**< The same keys in deletion order */
+    std::vector<int64_t> range_starts; /**< First key of each range query */
+    std::vector<int64_t> values;       /**< Values (pointers to these are stored) */
+    std::vector<void *> out;           /**< Output buffer of scans and range queries */
+};
+
+/**
+ * @brief Fill an array with the keys 0 to N-1 in random order, shuffled with bench_shuffle.
+ *
+ * @param keys The array.
+ * @param n Number of keys.
+ */
+static void shuffled_keys(std::vector<int64_t> &keys, const int n) {
+    std::vector<uint32_t> ranks(static_cast<size_t>(n));
+    for (int i = 0; i < n; i++) ranks[static_cast<size_t>(i)] = static_cast<uint32_t>(i);
+    bench_shuffle(ranks.data(), n);
+    keys.assign(ranks.begin(), ranks.end());
+}
+
+/**
+ * @brief Create a container holding every key, and return the heap memory it took.
+ *
+ * @param max_keys Passed to the container (used by bptree).
+ * @param d Workload data.
+ * @param bytes Set to the memory of the container.
+ * @return The container.
+ */
+template <typename Container>
+static Container *load(const int max_keys, workload_data &d, size_t *bytes) {
+    const size_t before = live_bytes;
+    Container *c = new Container(max_keys);
+    for (int i = 0; i < d.n; i++) c->insert(d.insert_keys[i], &d.values[d.insert_keys[i]]);
+    c->finish_load();
+    if (bytes) *bytes = live_bytes - before + c->extra_bytes();
+    return c;
+}
+
+/**
+ * @brief Run every workload the container supports.
+ *
+ * @param h Benchmark state.
+ * @param index Index of the container in container_names.
+ * @param ordered False if the container has no key order (no scan or range).
+ * @param deletes False to skip the delete workload.
+ * @param d Workload data.
+ * @param ops_per_sec Set to the throughput of each workload (0 if not run).
+ * @param bytes_per_key Set to the memory of the loaded container per key.
+ */
+template <typename Container>
+static void run_container(bench_harness *h, const int index, const bool ordered,
+                          const bool deletes, workload_data &d, double ops_per_sec[W_COUNT],
+                          double *bytes_per_key) {
+    const int max_keys = h->config.max_keys;
+    const int n = d.n;
+    char name[64];
+    Container *c = NULL;
+    std::fill(ops_per_sec, ops_per_sec + W_COUNT, 0.0);
+
+    snprintf(name, sizeof(name), "%s: insert", container_names[index]);
+    BENCH(h, name, n, c = new Container(max_keys), {
+        c->insert(d.insert_keys[bench_i], &d.values[d.insert_keys[bench_i]]);
+        if (bench_i == bench_n - 1) c->finish_load();
+    }, delete c);
+    ops_per_sec[W_INSERT] = h->results[h->num_results - 1].ops_per_sec;
+    size_t bytes = 0;
+    c = load<Container>(max_keys, d, &bytes);
+    bench_set_memory(h, bytes, n);
+    *bytes_per_key = (double)bytes / n;
+
+    snprintf(name, sizeof(name), "%s: get", container_names[index]);
+    BENCH(h, name, n, {}, {
+        void *value = c->get(d.get_keys[bench_i]);
+        assert(value == &d.values[d.get_keys[bench_i]]);
+        sink = reinterpret_cast<uintptr_t>(value);
+    }, {});
+    ops_per_sec[W_GET] = h->results[h->num_results - 1].ops_per_sec;
+
+    if (ordered) {
+        const int scans = n > 10000 ? 10 : 100;
+        snprintf(name, sizeof(name), "%s: scan", container_names[index]);
+        BENCH(h, name, scans, {}, {
+            const int found = c->range(0, n - 1, d.out.data());
+            assert(found == n && d.out[n - 1] == &d.values[n - 1]);
+            sink = static_cast<uintptr_t>(found);
+        }, {});
+        ops_per_sec[W_SCAN] = h->results[h->num_results - 1].ops_per_sec;
+
+        const int queries = static_cast<int>(d.range_starts.size());
+        snprintf(name, sizeof(name), "%s: range", container_names[index]);
+        BENCH(h, name, queries, {}, {
+            const int64_t lo = d.range_starts[bench_i];
+            const int found = c->range(lo, lo + range_keys - 1, d.out.data());
+            assert(found == std::min<int64_t>(range_keys, n - lo));
+            sink = static_cast<uintptr_t>(found);
+        }, {});
+        ops_per_sec[W_RANGE] = h->results[h->num_results - 1].ops_per_sec;
+    }
+    delete c;
+
+    if (deletes) {
+        snprintf(name, sizeof(name), "%s: delete", container_names[index]);
+        BENCH(h, name, n, c = load<Container>(max_keys, d, NULL),
+              c->erase(d.delete_keys[bench_i]), {
+            assert(!c->get(d.delete_keys[0]));
+            delete c;
+        });
+        ops_per_sec[W_DELETE] = h->results[h->num_results - 1].ops_per_sec;
+    }
+}
+
+/**
+ * @brief Main entry point for the comparison.
+ *
+ * Prepares the keys and orders once, runs every container on them, and prints the table
+ * of relative throughput and memory.
+ *
+ * @return EXIT_SUCCESS.
+ */
+int main() {
+    bench_harness bench;
+    bench_init(&bench, "bench_compare");
+    workload_data d;
+    d.n = bench.config.n;
+    for (int i = 0; i < d.n; i++) d.values.push_back(i);
+    shuffled_keys(d.insert_keys, d.n);
+    shuffled_keys(d.get_keys, d.n);
+    shuffled_keys(d.delete_keys, d.n);
+    const int queries = d.n / range_keys > 100 ? d.n / range_keys : 100;
+    for (int i = 0; i < queries; i++) d.range_starts.push_back(rand() % d.n);
+    d.out.resize(static_cast<size_t>(d.n));
+
+    double ops[num_containers][W_COUNT];
+    double bytes_per_key[num_containers];
+    run_container<bptree_container>(&bench, 0, true, true, d, ops[0], &bytes_per_key[0]);
+    run_container<map_container>(&bench, 1, true, true, d, ops[1], &bytes_per_key[1]);
+    if (d.n > vector_delete_max) {
+        bench_note(&bench, "Skipping sorted vector deletes: N > %d.\n", vector_delete_max);
+    }
+    run_container<vector_container>(&bench, 2, true, d.n <= vector_delete_max, d, ops[2],
+                                     &bytes_per_key[2]);
+    run_container<hash_container>(&bench, 3, false, true, d, ops[3], &bytes_per_key[3]);
+    run_container<skiplist_container>(&bench, 4, true, true, d, ops[4], &bytes_per_key[4]);
+
+    // Summary: throughput relative to bptree (above 1 is faster than bptree)
+    bench_note(&bench, "\nThroughput relative to bptree, and memory per key:\n%-14s", "");
+    for (int c = 0; c < num_containers; c++) bench_note(&bench, " %18s", container_names[c]);
+    for (int w = 0; w < W_COUNT; w++) {
+        bench_note(&bench, "\n%-14s", workload_names[w]);
+        for (int c = 0; c < num_containers; c++) {
+            if (ops[c][w] > 0 && ops[0][w] > 0) {
+                bench_note(&bench, " %17.2fx", ops[c][w] / ops[0][w]);
+            } else {
+                bench_note(&bench, " %18s", "-");
+            }
+        }
+    }
+    bench_note(&bench, "\n%-14s", "bytes/key");
+    for (int c = 0; c < num_containers; c++) bench_note(&bench, " %18.1f", bytes_per_key[c]);
+    bench_note(&bench, "\n");
+
+    bench_note(&bench, "Benchmark finished.\n");
+    bench_finish(&bench);
+    return EXIT_SUCCESS;
+}
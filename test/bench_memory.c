@@ -0,0 +1,282 @@
+/**
+ * @file bench_memory.c
+ * @brief Memory footprint of the B+ tree library (bptree.h) per entry.
+ *
+ * For every max_keys value, builds trees of N entries in several ways and reports what
+ * they cost:
+ * - sequential: keys inserted in ascending order.
+ * - random: keys inserted in random order.
+ * - bulk: the random tree copied by bptree_union, which builds full nodes bottom-up.
+ * - deleted: the random tree after removing every other key, in random order.
+ * - compacted: the deleted tree after bptree_compact at full fill.
+ *
+ * Each row gives the node and key counts, the average leaf fill, and four sizes, both in
+ * total and per entry:
+ * - node bytes: memory the tree asked for (bptree_get_memory), of which slack bytes are
+ *   unused slots (the spare slot of every node and the room left by 50/50 splits) and
+ *   padding.
+ * - allocated bytes: what the allocator set aside for the nodes, including the rounding
+ *   of aligned_alloc (malloc_usable_size on glibc, the node bytes elsewhere).
+ * - RSS bytes: growth of the resident set, from /proc/self/statm, while the tree was
+ *   built (or copied, for bulk). Each build runs in a child process so the heap starts
+ *   fresh.
+ *
+ * The key and value types are fixed when the program is compiled (see
+ * BPTREE_NUMERIC_TYPE, BPTREE_KEY_TYPE_STRING, and BPTREE_VALUE_TYPE), so `make memory`
+ * builds one program per configuration and runs them in turn. Results are CSV on stdout.
+ *
+ * Settings come from environment variables:
+ * - N: number of entries, 1000000 by default.
+ * - ORDERS: comma-separated max_keys values, 4,8,16,32,64,128,256,512,1024 by default.
+ * - SEED: random seed, taken from the clock by default.
+ *
+ * @version 0.4.1-beta
+ */
+
+#define BPTREE_IMPLEMENTATION      // Include the bptree implementation
+#define BPTREE_TRIM_AFTER_COMPACT  // Return freed pages, so the RSS of compacted trees drops
+
+#include "bench_common.h"  // Include first: it selects the POSIX clock API
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "bptree.h"  // Include the B+ tree library
+
+/** @brief Global flag to enable/disable debug logging from the bptree library. */
+const bool debug_enabled = false;
+
+/** @brief Ways of building a tree. */
+typedef enum {
+    MEMORY_SEQUENTIAL, /**< Ascending insertions */
+    MEMORY_RANDOM,     /**< Random insertions */
+    MEMORY_BULK,       /**< Copy of the random tree built bottom-up */
+    MEMORY_DELETED,    /**< Random tree after removing half of the keys */
+    MEMORY_COMPACTED,  /**< Deleted tree after compaction */
+    MEMORY_BUILDS
+} memory_build;
+
+/** @brief Names of the builds, as used in the CSV output. */
+static const char *const memory_build_names[MEMORY_BUILDS] = {"sequential", "random", "bulk",
+                                                              "deleted", "compacted"};
+
+/** @brief Footprint of one tree, sent from the child process that built it. */
+typedef struct memory_result {
+    bool ok;                /**< False if the tree could not be built */
+    int64_t entries;        /**< Entries in the tree */
+    int64_t leaf_nodes;     /**< Number of leaves */
+    int64_t internal_nodes; /**< Number of internal nodes */
+    double avg_leaf_fill;   /**< Average leaf fill */
+    size_t node_bytes;      /**< Node memory asked for */
+    size_t slack_bytes;     /**< Part of node_bytes in unused slots and padding */
+    size_t allocated_bytes; /**< Node memory set aside by the allocator */
+    long long rss_bytes;    /**< Growth of the resident set while building */
+} memory_result;
+
+/** @brief Name of the key configuration, as used in the CSV output. */
+#ifdef BPTREE_KEY_TYPE_STRING
+static const char *const memory_key_type = "string";
+#else
+static const char *const memory_key_type = "integer";
+#endif
+
+/**
+ * @brief Read the resident set size.
+ *
+ * @return Resident bytes, or 0 if /proc/self/statm cannot be read.
+ */
+static long long memory_rss_bytes(void) {
+    FILE *in = fopen("/proc/self/statm", "r");
+    if (!in) return 0;
+    long long size = 0, resident = 0;
+    const int read = fscanf(in, "%lld %lld", &size, &resident);
+    fclose(in);
+    return read == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+/**
+ * @brief Add up what the allocator set aside for the nodes under a node.
+ *
+ * @param tree The tree.
+ * @param node Root of the subtree.
+ * @return Bytes of the nodes that were allocated on their own (slabs are counted apart).
+ */
+static size_t memory_allocated(const bptree *tree, bptree_node *node) {
+    size_t bytes = 0;
+    if (!node->in_slab) {
+#ifdef __GLIBC__
+        bytes += malloc_usable_size(node);
+#else
+        bytes += bptree_node_stride(tree, node->is_leaf);
+#endif
+    }
+    if (!node->is_leaf) {
+        bptree_node **children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) bytes += memory_allocated(tree, children[i]);
+    }
+    return bytes;
+}
+
+/**
+ * @brief Build a tree and measure it.
+ *
+ * @param build How to build it.
+ * @param max_keys Maximum keys per node.
+ * @param n Number of keys.
+ * @param ranks Key ranks in random order.
+ * @return The footprint.
+ */
+static memory_result memory_measure(const memory_build build, const int max_keys, const int n,
+                                    const uint32_t *ranks) {
+    memory_result result;
+    memset(&result, 0, sizeof(result));
+    long long rss_before = memory_rss_bytes();
+    bptree *tree = bptree_create(max_keys, NULL, debug_enabled);
+    if (!tree) return result;
+    bptree_key_t key;
+    for (int i = 0; i < n; i++) {
+        const uint32_t rank = build == MEMORY_SEQUENTIAL ? (uint32_t)i : ranks[i];
+        bench_make_key(rank, &key);
+        if (bptree_put(tree, &key, (bptree_value_t)(uintptr_t)rank) != BPTREE_OK) {
+            bptree_free(tree);
+            return result;
+        }
+    }
+    if (build == MEMORY_BULK) {
+        bptree *empty = bptree_create(max_keys, NULL, debug_enabled);
+        bptree *copy = NULL;
+        rss_before = memory_rss_bytes();
+        const bptree_status st =
+            empty ? bptree_union(tree, empty, &copy) : BPTREE_ALLOCATION_FAILURE;
+        bptree_free(empty);
+        if (st != BPTREE_OK) {
+            bptree_free(tree);
+            return result;
+        }
+        const long long rss_after = memory_rss_bytes();
+        bptree_free(tree);
+        tree = copy;
+        result.rss_bytes = rss_after - rss_before;
+    } else if (build == MEMORY_DELETED || build == MEMORY_COMPACTED) {
+        for (int i = 0; i < n; i++) {
+            if (ranks[i] % 2 == 0) continue;
+            bench_make_key(ranks[i], &key);
+            bptree_remove(tree, &key);
+        }
+        if (build == MEMORY_COMPACTED && bptree_compact(tree, 1.0) != BPTREE_OK) {
+            bptree_free(tree);
+            return result;
+        }
+    }
+    if (build != MEMORY_BULK) result.rss_bytes = memory_rss_bytes() - rss_before;
+
+    const bptree_stats stats = bptree_get_stats(tree);
+    const bptree_memory memory = bptree_get_memory(tree);
+    result.ok = true;
+    result.entries = stats.entries;
+    result.leaf_nodes = stats.leaf_nodes;
+    result.internal_nodes = stats.internal_nodes;
+    result.avg_leaf_fill = stats.avg_leaf_fill;
+    result.node_bytes = memory.total_bytes;
+    result.slack_bytes = memory.slack_bytes;
+    result.allocated_bytes = memory_allocated(tree, tree->root);
+    for (int i = 0; i < tree->num_slabs; i++) {
+#ifdef __GLIBC__
+        result.allocated_bytes += malloc_usable_size(tree->slabs[i].base);
+#else
+        result.allocated_bytes += tree->slabs[i].size;
+#endif
+    }
+    bptree_free(tree);
+    return result;
+}
+
+/**
+ * @brief Measure a build in a child process, so that it starts with a fresh heap.
+ *
+ * @param build How to build the tree.
+ * @param max_keys Maximum keys per node.
+ * @param n Number of keys.
+ * @param ranks Key ranks in random order.
+ * @return The footprint (with `ok` false if the child failed).
+ */
+static memory_result memory_measure_apart(const memory_build build, const int max_keys,
+                                          const int n, const uint32_t *ranks) {
+    memory_result result;
+    memset(&result, 0, sizeof(result));
+    int fds[2];
+    if (pipe(fds) != 0) return memory_measure(build, max_keys, n, ranks);
+    fflush(NULL);
+    const pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return memory_measure(build, max_keys, n, ranks);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        result = memory_measure(build, max_keys, n, ranks);
+        const bool sent = write(fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result);
+        _exit(sent ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != (ssize_t)sizeof(result)) result.ok = false;
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return result;
+}
+
+/**
+ * @brief Main entry point of the footprint benchmark.
+ *
+ * @param void Takes no arguments.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on allocation failure.
+ */
+int main(void) {
+    const int n = bench_env_int("N", 1000000, 1);
+    const unsigned seed = (unsigned)bench_env_int("SEED", (int)(time(NULL) & 0x7fffffff), 0);
+    srand(seed);
+    int orders[BENCH_MAX_LIST];
+    const int num_orders = bench_env_orders(orders);
+
+    uint32_t *ranks = malloc((size_t)n * sizeof(uint32_t));
+    if (!ranks) {
+        perror("Allocation failed for key ranks");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < n; i++) ranks[i] = (uint32_t)i;
+    bench_shuffle(ranks, n);
+
+    const size_t entry_bytes = sizeof(bptree_key_t) + sizeof(bptree_value_t);
+    fprintf(stderr, "%s keys of %zu bytes, values of %zu bytes, N=%d, SEED=%u\n",
+            memory_key_type, sizeof(bptree_key_t), sizeof(bptree_value_t), n, seed);
+    printf("key_type,key_bytes,value_bytes,max_keys,build,entries,leaf_nodes,internal_nodes,"
+           "avg_leaf_fill,node_bytes,slack_bytes,allocated_bytes,rss_bytes,entry_bytes,"
+           "node_bytes_per_entry,allocated_bytes_per_entry,rss_bytes_per_entry\n");
+    for (int o = 0; o < num_orders; o++) {
+        for (int b = 0; b < MEMORY_BUILDS; b++) {
+            const memory_result r = memory_measure_apart((memory_build)b, orders[o], n, ranks);
+            if (!r.ok) {
+                fprintf(stderr, "Failed to build the %s tree with max_keys=%d\n",
+                        memory_build_names[b], orders[o]);
+                continue;
+            }
+            const double entries = r.entries > 0 ? (double)r.entries : 1.0;
+            printf("%s,%zu,%zu,%d,%s,%lld,%lld,%lld,%.4f,%zu,%zu,%zu,%lld,%zu,%.2f,%.2f,%.2f\n",
+                   memory_key_type, sizeof(bptree_key_t), sizeof(bptree_value_t), orders[o],
+                   memory_build_names[b], (long long)r.entries, (long long)r.leaf_nodes,
+                   (long long)r.internal_nodes, r.avg_leaf_fill, r.node_bytes, r.slack_bytes,
+                   r.allocated_bytes, r.rss_bytes, entry_bytes, (double)r.node_bytes / entries,
+                   (double)r.allocated_bytes / entries, (double)r.rss_bytes / entries);
+            fflush(stdout);
+        }
+    }
+    free(ranks);
+    return EXIT_SUCCESS;
+}
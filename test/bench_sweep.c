@@ -0,0 +1,271 @@
+/**
+ * @file bench_sweep.c
+ * @brief Parameter sweep for the B+ tree library (bptree.h): node size against tree size.
+ *
+ * For every tree size and every max_keys value, builds a tree with keys in random order
+ * and measures four operations:
+ * - insert: building the tree, one key at a time (N operations).
+ * - lookup: OPS gets of random keys.
+ * - scan: range queries of SCAN_LEN keys from random starts, covering OPS keys in all
+ *   (its operations are keys visited).
+ * - delete: OPS removals of random keys.
+ *
+ * Tree sizes are multiples of the last-level cache (LLC): a factor of 1 gives a tree whose
+ * keys and values take as many bytes as the LLC has. The key type is fixed when the
+ * program is compiled (see BPTREE_NUMERIC_TYPE and BPTREE_KEY_TYPE_STRING), so `make
+ * sweep` builds one program per key configuration (int32, int64, and strings of 16, 32,
+ * and 64 bytes) and runs them in turn.
+ *
+ * Results are CSV on stdout, one row per key configuration, size, max_keys, and operation,
+ * with `best` set to 1 on the max_keys with the highest throughput for that key
+ * configuration, size, and operation. A summary of the best max_keys goes to stderr.
+ *
+ * Settings come from environment variables:
+ * - ORDERS: comma-separated max_keys values, 4,8,16,32,64,128,256,512,1024 by default.
+ * - FACTORS: comma-separated tree sizes as multiples of the LLC, 0.1,1,10,100 by default.
+ *   Sizes that would need more than half of the physical memory are skipped.
+ * - LLC_BYTES: size of the LLC, detected by default (8 MiB if it cannot be).
+ * - OPS: lookups, scanned keys, and removals per measurement, 1000000 by default (at
+ *   most the tree size).
+ * - SCAN_LEN: keys per range query, 100 by default.
+ * - REPS: runs of the lookup and scan measurements (the median is reported), 3 by default.
+ * - SEED: random seed, taken from the clock by default.
+ *
+ * @version 0.4.1-beta
+ */
+
+#define BPTREE_IMPLEMENTATION  // Include the bptree implementation
+
+#include "bench_common.h"  // Include first: it selects the POSIX clock API
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bptree.h"  // Include the B+ tree library
+
+/** @brief Global flag to enable/disable debug logging from the bptree library. */
+const bool debug_enabled = false;
+
+/** @brief Most runs of the lookup and scan measurements. */
+#define SWEEP_MAX_REPS 32
+
+/** @brief Operations measured for every configuration. */
+typedef enum { SWEEP_INSERT, SWEEP_LOOKUP, SWEEP_SCAN, SWEEP_DELETE, SWEEP_OPS } sweep_op;
+
+/** @brief Names of the operations, as used in the CSV output. */
+static const char *const sweep_op_names[SWEEP_OPS] = {"insert", "lookup", "scan", "delete"};
+
+/** @brief Measurement of one operation for one max_keys value. */
+typedef struct sweep_result {
+    long long ops;      /**< Operations done */
+    double seconds;     /**< Time they took (median over the runs for lookup and scan) */
+    double ops_per_sec; /**< Throughput */
+} sweep_result;
+
+/** @brief Name of the key configuration, as used in the CSV output. */
+#ifdef BPTREE_KEY_TYPE_STRING
+static const char *const sweep_key_type = "string";
+#else
+static const char *const sweep_key_type = "integer";
+#endif
+
+/**
+ * @brief Find the size of the last-level cache.
+ *
+ * @return Size in bytes (LLC_BYTES if set, the detected size otherwise, or 8 MiB).
+ */
+static double sweep_llc_bytes(void) {
+    const double configured = bench_env_double("LLC_BYTES", 0.0, 1.0, 1e15);
+    if (configured > 0) return configured;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    const long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (l3 > 0) return (double)l3;
+#endif
+    FILE *in = fopen("/sys/devices/system/cpu/cpu0/cache/index3/size", "r");
+    if (in) {
+        long kib = 0;
+        const int read = fscanf(in, "%ldK", &kib);
+        fclose(in);
+        if (read == 1 && kib > 0) return (double)kib * 1024.0;
+    }
+    return 8.0 * 1024 * 1024;
+}
+
+/**
+ * @brief Measure every operation on one tree.
+ *
+ * @param max_keys Maximum keys per node.
+ * @param n Number of keys in the tree.
+ * @param insert_keys The keys in insertion order.
+ * @param op_keys Keys of the lookups and removals (distinct, OPS of them).
+ * @param scan_starts Start ranks of the range queries.
+ * @param ops Number of lookups and removals.
+ * @param scans Number of range queries.
+ * @param scan_len Keys per range query.
+ * @param reps Runs of the lookup and scan measurements.
+ * @param out One result per operation.
+ * @return False if the tree could not be built.
+ */
+static bool sweep_measure(const int max_keys, const int n, const bptree_key_t *insert_keys,
+                          const bptree_key_t *op_keys, const uint32_t *scan_starts, const int ops,
+                          const int scans, const int scan_len, const int reps,
+                          sweep_result out[SWEEP_OPS]) {
+    double runs[2][SWEEP_MAX_REPS];
+    bptree *tree = bptree_create(max_keys, NULL, debug_enabled);
+    if (!tree) return false;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < n; i++) {
+        if (bptree_put(tree, &insert_keys[i], (bptree_value_t)&insert_keys[i]) != BPTREE_OK) {
+            bptree_free(tree);
+            return false;
+        }
+    }
+    out[SWEEP_INSERT].ops = n;
+    out[SWEEP_INSERT].seconds = (double)(bench_now_ns() - start) / 1e9;
+
+    long long found = 0;
+    for (int r = 0; r < reps; r++) {
+        start = bench_now_ns();
+        for (int i = 0; i < ops; i++) {
+            bptree_value_t value;
+            found += bptree_get(tree, &op_keys[i], &value) == BPTREE_OK;
+        }
+        runs[0][r] = (double)(bench_now_ns() - start) / 1e9;
+
+        start = bench_now_ns();
+        for (int i = 0; i < scans; i++) {
+            bptree_key_t lo, hi;
+            bench_make_key(scan_starts[i], &lo);
+            bench_make_key((uint64_t)scan_starts[i] + (uint64_t)scan_len - 1, &hi);
+            bptree_value_t *values = NULL;
+            int count = 0;
+            if (bptree_get_range(tree, &lo, &hi, &values, &count) == BPTREE_OK) {
+                found += count;
+                bptree_free_range_results(values);
+            }
+        }
+        runs[1][r] = (double)(bench_now_ns() - start) / 1e9;
+    }
+    qsort(runs[0], (size_t)reps, sizeof(double), bench_compare_double);
+    qsort(runs[1], (size_t)reps, sizeof(double), bench_compare_double);
+    out[SWEEP_LOOKUP].ops = ops;
+    out[SWEEP_LOOKUP].seconds = runs[0][reps / 2];
+    out[SWEEP_SCAN].ops = (long long)scans * scan_len;
+    out[SWEEP_SCAN].seconds = runs[1][reps / 2];
+
+    start = bench_now_ns();
+    for (int i = 0; i < ops; i++) found += bptree_remove(tree, &op_keys[i]) == BPTREE_OK;
+    out[SWEEP_DELETE].ops = ops;
+    out[SWEEP_DELETE].seconds = (double)(bench_now_ns() - start) / 1e9;
+
+    const long long expected = (long long)reps * (ops + (long long)scans * scan_len) + ops;
+    if (found != expected) {
+        fprintf(stderr, "Warning: %lld of %lld lookups, scanned keys, and removals succeeded\n",
+                found, expected);
+    }
+    bptree_free(tree);
+    for (int o = 0; o < SWEEP_OPS; o++) {
+        out[o].ops_per_sec = out[o].seconds > 0 ? (double)out[o].ops / out[o].seconds : 0.0;
+    }
+    return true;
+}
+
+/**
+ * @brief Main entry point of the sweep.
+ *
+ * @param void Takes no arguments.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on bad settings.
+ */
+int main(void) {
+    int orders[BENCH_MAX_LIST];
+    double factors[BENCH_MAX_LIST];
+    const int num_orders = bench_env_orders(orders);
+    const int num_factors = bench_env_list("FACTORS", "0.1,1,10,100", factors);
+    const double llc = sweep_llc_bytes();
+    const int max_ops = bench_env_int("OPS", 1000000, 1);
+    const int scan_len = bench_env_int("SCAN_LEN", 100, 1);
+    int reps = bench_env_int("REPS", 3, 1);
+    if (reps > SWEEP_MAX_REPS) reps = SWEEP_MAX_REPS;
+    const unsigned seed = (unsigned)bench_env_int("SEED", (int)(time(NULL) & 0x7fffffff), 0);
+    srand(seed);
+
+    const size_t entry_bytes = sizeof(bptree_key_t) + sizeof(bptree_value_t);
+    const double memory = (double)sysconf(_SC_PHYS_PAGES) * (double)sysconf(_SC_PAGESIZE);
+    fprintf(stderr, "%s keys of %zu bytes, LLC %.0f bytes, SEED=%u, OPS=%d, REPS=%d\n",
+            sweep_key_type, sizeof(bptree_key_t), llc, seed, max_ops, reps);
+    printf("key_type,key_bytes,llc_factor,n,max_keys,op,ops,seconds,ops_per_sec,best\n");
+
+    for (int f = 0; f < num_factors; f++) {
+        const double entries = factors[f] * llc / (double)entry_bytes;
+        const int n = entries >= INT32_MAX ? INT32_MAX : entries < 1 ? 1 : (int)entries;
+        // Keys in insertion order and in operation order, plus a tree at about 2/3 fill
+        const double needed = (double)n * ((double)entry_bytes * 1.5 + sizeof(bptree_key_t)) +
+                              (double)max_ops * sizeof(bptree_key_t);
+        if (memory > 0 && needed > memory / 2) {
+            fprintf(stderr, "Skipping factor %g (N=%d): needs about %.0f MiB\n", factors[f], n,
+                    needed / (1024.0 * 1024.0));
+            continue;
+        }
+        const int ops = max_ops < n ? max_ops : n;
+        const int scans = (ops + scan_len - 1) / scan_len;
+        uint32_t *ranks = malloc((size_t)n * sizeof(uint32_t));
+        bptree_key_t *insert_keys = malloc((size_t)n * sizeof(bptree_key_t));
+        bptree_key_t *op_keys = malloc((size_t)ops * sizeof(bptree_key_t));
+        uint32_t *scan_starts = malloc((size_t)scans * sizeof(uint32_t));
+        sweep_result (*results)[SWEEP_OPS] = malloc((size_t)num_orders * sizeof(*results));
+        if (!ranks || !insert_keys || !op_keys || !scan_starts || !results) {
+            fprintf(stderr, "Skipping factor %g (N=%d): allocation failed\n", factors[f], n);
+            free(ranks);
+            free(insert_keys);
+            free(op_keys);
+            free(scan_starts);
+            free(results);
+            continue;
+        }
+        for (int i = 0; i < n; i++) ranks[i] = (uint32_t)i;
+        bench_shuffle(ranks, n);
+        for (int i = 0; i < n; i++) bench_make_key(ranks[i], &insert_keys[i]);
+        bench_shuffle(ranks, n);
+        for (int i = 0; i < ops; i++) bench_make_key(ranks[i], &op_keys[i]);
+        const uint32_t last_start = n > scan_len ? (uint32_t)(n - scan_len) : 0;
+        for (int i = 0; i < scans; i++) scan_starts[i] = (uint32_t)rand() % (last_start + 1);
+        free(ranks);
+
+        int best[SWEEP_OPS] = {0};
+        for (int o = 0; o < num_orders; o++) {
+            const int max_keys = orders[o];
+            fprintf(stderr, "  factor %g, N=%d, max_keys=%d\n", factors[f], n, max_keys);
+            if (!sweep_measure(max_keys, n, insert_keys, op_keys, scan_starts, ops, scans,
+                               scan_len, reps, results[o])) {
+                fprintf(stderr, "Failed to build a tree with max_keys=%d\n", max_keys);
+                memset(results[o], 0, sizeof(results[o]));
+            }
+            for (int op = 0; op < SWEEP_OPS; op++) {
+                if (results[o][op].ops_per_sec > results[best[op]][op].ops_per_sec) best[op] = o;
+            }
+        }
+        for (int o = 0; o < num_orders; o++) {
+            for (int op = 0; op < SWEEP_OPS; op++) {
+                const sweep_result *r = &results[o][op];
+                printf("%s,%zu,%g,%d,%d,%s,%lld,%.9f,%.1f,%d\n", sweep_key_type,
+                       sizeof(bptree_key_t), factors[f], n, orders[o], sweep_op_names[op],
+                       r->ops, r->seconds, r->ops_per_sec, best[op] == o);
+            }
+        }
+        fflush(stdout);
+        fprintf(stderr, "Best max_keys for %s/%zu at factor %g (N=%d):", sweep_key_type,
+                sizeof(bptree_key_t), factors[f], n);
+        for (int op = 0; op < SWEEP_OPS; op++) {
+            fprintf(stderr, " %s %d", sweep_op_names[op], orders[best[op]]);
+        }
+        fprintf(stderr, "\n");
+        free(results);
+        free(scan_starts);
+        free(op_keys);
+        free(insert_keys);
+    }
+    return EXIT_SUCCESS;
+}
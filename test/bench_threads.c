@@ -0,0 +1,486 @@
+/**
+ * @file bench_threads.c
+ * @brief Multi-threaded scaling benchmark for the B+ tree library (bptree.h).
+ *
+ * The library is not thread-safe, so every mode here synchronizes from the outside, in the
+ * ways its contract allows:
+ * - mutex: one global mutex around every bptree_get, bptree_put, and bptree_remove (the
+ *   baseline).
+ * - rwlock: one reader-writer lock, shared for lookups and exclusive for updates. Plain
+ *   lookups do not modify the tree, so they run in parallel.
+ * - sharded: SHARDS trees, each holding the keys that hash to it and guarded by its own
+ *   reader-writer lock, so updates to different shards also run in parallel.
+ *
+ * Each mode loads N keys (0 to N-1) and then runs three operation mixes on 1, 2, 4, ... up
+ * to THREADS threads: read-only, read-mostly (95% lookups, 5% updates), and write-heavy
+ * (50% of each). An update is a remove followed by a put of the same key, done under one
+ * exclusive lock, so the set of keys (and the size of the tree) stays the same. Keys are
+ * uniform over the loaded ones and every thread runs OPS operations, pre-generated before
+ * timing, so the total work grows with the number of threads.
+ *
+ * A run starts when all threads have passed a barrier and ends when the last one finishes;
+ * each case reports the total operations per second of its timed runs, which gives one
+ * throughput curve per mode and mix. In the per-operation latency run, every thread records
+ * its latencies in a log-linear histogram of its own (within 1/16 of the value); the
+ * histograms are merged for the percentiles of the case, and the spread of the per-thread
+ * p99 shows how evenly the lock is shared.
+ *
+ * Settings come from environment variables, in addition to those of bench_common.h:
+ * - THREADS: largest number of threads, the number of online CPUs by default.
+ * - OPS: operations per thread and run, 100000 by default.
+ * - MODE: `mutex`, `rwlock`, `sharded`, or `all` (the default).
+ * - MIX: `read-only`, `read-mostly`, `write-heavy`, or `all` (the default).
+ * - SHARDS: number of trees in sharded mode, 16 by default.
+ * - PIN: 1 (the default) to pin thread i to the i-th CPU the process may use, 0 not to.
+ *
+ * @version 0.4.1-beta
+ */
+
+#define _GNU_SOURCE  // For pthread_setaffinity_np and sched_getaffinity
+
+#define BPTREE_IMPLEMENTATION  // Include the bptree implementation
+
+#include "bench_common.h"  // Include first: it selects the POSIX clock API
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bptree.h"  // Include the B+ tree library
+
+/** @brief Global flag to enable/disable debug logging from the bptree library. */
+const bool debug_enabled = false;
+
+/** @brief Ways of sharing the trees between threads. */
+typedef enum {
+    THREADS_MUTEX,   /**< One tree behind one mutex */
+    THREADS_RWLOCK,  /**< One tree behind one reader-writer lock */
+    THREADS_SHARDED, /**< One tree and reader-writer lock per shard */
+    THREADS_MODES
+} threads_mode;
+
+/** @brief Names of the modes, as read from MODE and used in case names. */
+static const char *const threads_mode_names[THREADS_MODES] = {"mutex", "rwlock", "sharded"};
+
+/** @brief Number of operation mixes. */
+#define THREADS_MIXES 3
+
+/** @brief Names of the operation mixes, as read from MIX and used in case names. */
+static const char *const threads_mix_names[THREADS_MIXES] = {"read-only", "read-mostly",
+                                                             "write-heavy"};
+
+/** @brief Percentage of updates in each operation mix. */
+static const int threads_mix_updates[THREADS_MIXES] = {0, 5, 50};
+
+/** @brief Linear sub-buckets per power of two in a latency histogram. */
+#define THREADS_SUB_BUCKETS 16
+
+/** @brief Buckets of a latency histogram: exact values below 16, then 16 per power of two. */
+#define THREADS_BUCKETS (THREADS_SUB_BUCKETS + 60 * THREADS_SUB_BUCKETS)
+
+/** @brief Latency histogram of one thread. */
+typedef struct threads_histogram {
+    uint64_t counts[THREADS_BUCKETS]; /**< Number of operations per bucket */
+    uint64_t total;                   /**< Number of operations */
+} threads_histogram;
+
+/** @brief A tree and the lock that guards it. */
+typedef struct threads_shard {
+    bptree *tree;            /**< The tree */
+    pthread_mutex_t mutex;   /**< Lock of the tree in mutex mode */
+    pthread_rwlock_t rwlock; /**< Lock of the tree in the other modes */
+} threads_shard;
+
+/** @brief One pre-generated operation. */
+typedef struct threads_op {
+    bptree_key_t key; /**< Key to look up or update */
+    bool update;      /**< True for a remove and put, false for a lookup */
+} threads_op;
+
+/** @brief State shared by the threads of a run. */
+typedef struct threads_shared {
+    threads_mode mode;         /**< How the trees are shared */
+    threads_shard *shards;     /**< The trees (one unless sharded) */
+    int num_shards;            /**< Number of trees */
+    int64_t *values;           /**< Value of each key (values[k] == k) */
+    pthread_barrier_t barrier; /**< Start line of the threads and the timer */
+} threads_shared;
+
+/** @brief Work and results of one thread. */
+typedef struct threads_worker {
+    threads_shared *shared;  /**< State shared by the threads */
+    const threads_op *ops;   /**< Operations of this thread */
+    int count;               /**< Number of operations */
+    int cpu;                 /**< CPU to pin to, or -1 not to pin */
+    bool pinned;             /**< True if pinning succeeded */
+    threads_histogram *hist; /**< Latency histogram, or NULL if not timing operations */
+    uint64_t sum;            /**< Sum of the values found (keeps lookups from being dropped) */
+} threads_worker;
+
+/**
+ * @brief Find the shard of a key.
+ *
+ * @param key The key.
+ * @param num_shards Number of shards.
+ * @return Index of the shard (Fibonacci hashing, so neighboring keys are spread out).
+ */
+static int threads_shard_of(const bptree_key_t key, const int num_shards) {
+    return (int)((((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32) % (uint64_t)num_shards);
+}
+
+/**
+ * @brief Find the histogram bucket of a latency.
+ *
+ * @param ns Latency in nanoseconds.
+ * @return Index of the bucket.
+ */
+static int threads_bucket(const uint64_t ns) {
+    if (ns < THREADS_SUB_BUCKETS) return (int)ns;
+    int exponent = 4;  // Position of the highest set bit, at least log2(THREADS_SUB_BUCKETS)
+    while (exponent < 63 && (ns >> (exponent + 1)) != 0) exponent++;
+    const int sub = (int)((ns >> (exponent - 4)) & (THREADS_SUB_BUCKETS - 1));
+    return THREADS_SUB_BUCKETS + (exponent - 4) * THREADS_SUB_BUCKETS + sub;
+}
+
+/**
+ * @brief Find the largest latency that falls in a histogram bucket.
+ *
+ * @param bucket Index of the bucket.
+ * @return Upper bound of the bucket in nanoseconds.
+ */
+static double threads_bucket_limit(const int bucket) {
+    if (bucket < THREADS_SUB_BUCKETS) return (double)bucket;
+    const int exponent = 4 + (bucket - THREADS_SUB_BUCKETS) / THREADS_SUB_BUCKETS;
+    const int sub = (bucket - THREADS_SUB_BUCKETS) % THREADS_SUB_BUCKETS;
+    return ldexp((double)(THREADS_SUB_BUCKETS + sub + 1), exponent - 4) - 1.0;
+}
+
+/**
+ * @brief Find a percentile of a latency histogram.
+ *
+ * @param hist The histogram (with at least one operation).
+ * @param percentile Percentile, from 0 to 100.
+ * @return Upper bound of the bucket holding the percentile, in nanoseconds.
+ */
+static double threads_percentile(const threads_histogram *hist, const double percentile) {
+    uint64_t rank = (uint64_t)ceil(percentile / 100.0 * (double)hist->total);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < THREADS_BUCKETS; b++) {
+        seen += hist->counts[b];
+        if (seen >= rank) return threads_bucket_limit(b);
+    }
+    return threads_bucket_limit(THREADS_BUCKETS - 1);
+}
+
+/**
+ * @brief Run one operation under the lock of its mode.
+ *
+ * @param s State shared by the threads.
+ * @param op The operation.
+ * @return The value found by a lookup, or 0.
+ */
+static uint64_t threads_execute(threads_shared *s, const threads_op *op) {
+    threads_shard *shard = &s->shards[threads_shard_of(op->key, s->num_shards)];
+    bptree_value_t value = NULL;
+    if (s->mode == THREADS_MUTEX) {
+        pthread_mutex_lock(&shard->mutex);
+    } else if (op->update) {
+        pthread_rwlock_wrlock(&shard->rwlock);
+    } else {
+        pthread_rwlock_rdlock(&shard->rwlock);
+    }
+    if (op->update) {
+        bptree_status st = bptree_remove(shard->tree, &op->key);
+        assert(st == BPTREE_OK);
+        st = bptree_put(shard->tree, &op->key, &s->values[op->key]);
+        assert(st == BPTREE_OK);
+        (void)st;
+    } else {
+        const bptree_status st = bptree_get(shard->tree, &op->key, &value);
+        assert(st == BPTREE_OK);
+        (void)st;
+    }
+    if (s->mode == THREADS_MUTEX) {
+        pthread_mutex_unlock(&shard->mutex);
+    } else {
+        pthread_rwlock_unlock(&shard->rwlock);
+    }
+    return value ? (uint64_t)*(const int64_t *)value : 0;
+}
+
+/**
+ * @brief Body of a thread: pin it, wait for the start, and run its operations.
+ *
+ * @param arg The threads_worker of the thread.
+ * @return NULL.
+ */
+static void *threads_main(void *arg) {
+    threads_worker *w = (threads_worker *)arg;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        w->pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+    threads_shared *s = w->shared;
+    uint64_t sum = 0;
+    pthread_barrier_wait(&s->barrier);
+    if (!w->hist) {
+        for (int i = 0; i < w->count; i++) sum += threads_execute(s, &w->ops[i]);
+    } else {
+        for (int i = 0; i < w->count; i++) {
+            const uint64_t start = bench_now_ns();
+            sum += threads_execute(s, &w->ops[i]);
+            w->hist->counts[threads_bucket(bench_now_ns() - start)]++;
+        }
+        w->hist->total += (uint64_t)w->count;
+    }
+    w->sum = sum;
+    return NULL;
+}
+
+/**
+ * @brief Run the operations of every thread once.
+ *
+ * @param h Benchmark state.
+ * @param run Index of the run (see bench_run_start; the latency run does not read the
+ *            counters).
+ * @param s State shared by the threads.
+ * @param workers The threads' work (with histograms to fill in, or without).
+ * @param num_threads Number of threads.
+ * @return Time from the release of the threads to the end of the last one, in nanoseconds.
+ */
+static uint64_t threads_run(bench_harness *h, const int run, threads_shared *s,
+                            threads_worker *workers, const int num_threads) {
+    pthread_t *ids = malloc((size_t)num_threads * sizeof(pthread_t));
+    if (!ids || pthread_barrier_init(&s->barrier, NULL, (unsigned)num_threads + 1) != 0) {
+        perror("Failed to set up the threads");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&ids[t], NULL, threads_main, &workers[t]) != 0) {
+            perror("Failed to start a thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Start the clock and counters before releasing the threads, so they see all the work.
+    const uint64_t start = bench_latency_run(h, run) ? bench_now_ns() : bench_run_start(h, run);
+    pthread_barrier_wait(&s->barrier);
+    for (int t = 0; t < num_threads; t++) pthread_join(ids[t], NULL);
+    const uint64_t ns = bench_now_ns() - start;
+    pthread_barrier_destroy(&s->barrier);
+    free(ids);
+    return ns;
+}
+
+/**
+ * @brief Attach the latencies of the threads to the last finished case.
+ *
+ * @param h Benchmark state (with at least one finished case).
+ * @param hists Histogram of each thread.
+ * @param num_threads Number of threads.
+ */
+static void threads_set_latency(bench_harness *h, const threads_histogram *hists,
+                                const int num_threads) {
+    static threads_histogram merged;
+    memset(&merged, 0, sizeof(merged));
+    double p99_min = 0.0;
+    double p99_max = 0.0;
+    for (int t = 0; t < num_threads; t++) {
+        for (int b = 0; b < THREADS_BUCKETS; b++) merged.counts[b] += hists[t].counts[b];
+        merged.total += hists[t].total;
+        const double p99 = threads_percentile(&hists[t], 99.0);
+        if (t == 0 || p99 < p99_min) p99_min = p99;
+        if (t == 0 || p99 > p99_max) p99_max = p99;
+    }
+    if (merged.total == 0) return;
+    bench_result *r = &h->results[h->num_results - 1];
+    for (int p = 0; p < BENCH_PERCENTILES; p++) {
+        r->latency_ns[p] = threads_percentile(&merged, bench_percentiles[p]);
+    }
+    r->has_latency = true;
+    if (h->config.format == BENCH_TEXT) {
+        printf("%s: latency p50 %.0f ns, p99 %.0f ns, max %.0f ns, per-thread p99 %.0f to "
+               "%.0f ns\n", r->name, r->latency_ns[0], r->latency_ns[2], r->latency_ns[4],
+               p99_min, p99_max);
+    }
+}
+
+/**
+ * @brief Step through the thread counts of a curve: 1, 2, 4, ..., and the largest.
+ *
+ * @param threads Current number of threads.
+ * @param max_threads Largest number of threads.
+ * @return The next number of threads, or more than @p max_threads after the last one.
+ */
+static int threads_next_count(const int threads, const int max_threads) {
+    if (threads == max_threads) return max_threads + 1;
+    return 2 * threads < max_threads ? 2 * threads : max_threads;
+}
+
+/**
+ * @brief Tell whether a name was selected by a setting.
+ *
+ * @param selected Value of the setting (NULL or empty for all).
+ * @param name The name.
+ * @return True if @p selected is `all`, unset, or equal to @p name.
+ */
+static bool threads_selected(const char *selected, const char *name) {
+    return !selected || !*selected || strcmp(selected, "all") == 0 || strcmp(selected, name) == 0;
+}
+
+/**
+ * @brief Main entry point for the scaling benchmark.
+ *
+ * Reads the settings, shuffles the load order, and then for each selected mode: loads the
+ * keys into its tree(s) and, for each selected mix and thread count, benchmarks the runs and
+ * records the latency histograms of the threads.
+ *
+ * @param void Takes no arguments.
+ * @return EXIT_SUCCESS on success; exits with EXIT_FAILURE on allocation or thread failure,
+ *         or if a tree is broken afterwards.
+ */
+int main(void) {
+    bench_harness bench;
+    bench_init(&bench, "bench_threads");
+    const int max_keys = bench.config.max_keys;
+    const int records = bench.config.n;
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    const int max_threads = bench_env_int("THREADS", online > 0 ? (int)online : 1, 1);
+    const int count = bench_env_int("OPS", 100000, 1);
+    const int num_shards = bench_env_int("SHARDS", 16, 1);
+    const bool pin = bench_env_int("PIN", 1, 0) != 0;
+    const char *mode_setting = getenv("MODE");
+    const char *mix_setting = getenv("MIX");
+
+    // CPUs the process may run on, in order; thread i is pinned to cpus[i % num_cpus].
+    int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+    int num_cpus = 0;
+    cpu_set_t allowed;
+    if (cpus && pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) cpus[num_cpus++] = c;
+        }
+    }
+    if (pin && num_cpus == 0) fprintf(stderr, "Cannot read the CPU affinity; not pinning\n");
+    if (num_cpus > 0 && max_threads > num_cpus) {
+        bench_note(&bench, "THREADS=%d is more than the %d CPUs available; threads share CPUs\n",
+                   max_threads, num_cpus);
+    }
+
+    int64_t *values = malloc((size_t)records * sizeof(int64_t));
+    uint32_t *order = malloc((size_t)records * sizeof(uint32_t));
+    threads_op *ops = malloc((size_t)max_threads * (size_t)count * sizeof(threads_op));
+    threads_worker *workers = malloc((size_t)max_threads * sizeof(threads_worker));
+    threads_histogram *hists = malloc((size_t)max_threads * sizeof(threads_histogram));
+    threads_shard *shards = malloc((size_t)num_shards * sizeof(threads_shard));
+    if (!cpus || !values || !order || !ops || !workers || !hists || !shards) {
+        perror("Allocation failed for workload data");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < records; i++) {
+        values[i] = i;
+        order[i] = (uint32_t)i;
+    }
+    bench_shuffle(order, records);
+    for (int s = 0; s < num_shards; s++) {
+        pthread_mutex_init(&shards[s].mutex, NULL);
+        pthread_rwlock_init(&shards[s].rwlock, NULL);
+    }
+
+    uint64_t sum = 0;
+    for (int m = 0; m < THREADS_MODES; m++) {
+        if (!threads_selected(mode_setting, threads_mode_names[m])) continue;
+        threads_shared shared;
+        shared.mode = (threads_mode)m;
+        shared.shards = shards;
+        shared.num_shards = m == THREADS_SHARDED ? num_shards : 1;
+        shared.values = values;
+
+        // Updates keep the set of keys, so one load serves every mix and thread count.
+        for (int s = 0; s < shared.num_shards; s++) {
+            shards[s].tree = bptree_create(max_keys, bench_compare_keys, debug_enabled);
+            if (!shards[s].tree) exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < records; i++) {
+            const bptree_key_t key = (bptree_key_t)order[i];
+            bptree *tree = shards[threads_shard_of(key, shared.num_shards)].tree;
+            if (bptree_put(tree, &key, &values[key]) != BPTREE_OK) exit(EXIT_FAILURE);
+        }
+        bench_note(&bench, "Mode %s: %d keys in %d tree(s)\n", threads_mode_names[m], records,
+                   shared.num_shards);
+
+        for (int x = 0; x < THREADS_MIXES; x++) {
+            if (!threads_selected(mix_setting, threads_mix_names[x])) continue;
+            uint64_t rng = (uint64_t)bench.config.seed * 2654435761u + (uint64_t)x + 1;
+            for (size_t i = 0; i < (size_t)max_threads * (size_t)count; i++) {
+                ops[i].key = (bptree_key_t)(bench_next(&rng) % (uint64_t)records);
+                ops[i].update = (int)(bench_next(&rng) % 100) < threads_mix_updates[x];
+            }
+
+            for (int threads = 1; threads <= max_threads;
+                 threads = threads_next_count(threads, max_threads)) {
+                for (int t = 0; t < threads; t++) {
+                    workers[t].shared = &shared;
+                    workers[t].ops = &ops[(size_t)t * (size_t)count];
+                    workers[t].count = count;
+                    workers[t].cpu = num_cpus > 0 ? cpus[t % num_cpus] : -1;
+                    workers[t].pinned = false;
+                }
+                const int total = threads * count;
+                // Resets the counters of the case; the latency run keeps its own histograms.
+                const int runs = bench_begin(&bench, 0);
+                for (int r = 0; r < runs; r++) {
+                    for (int t = 0; t < threads; t++) workers[t].hist = NULL;
+                    bench_run_done(&bench, r, threads_run(&bench, r, &shared, workers, threads));
+                    for (int t = 0; t < threads; t++) sum += workers[t].sum;
+                }
+                char name[64];
+                snprintf(name, sizeof(name), "%s %s %dT", threads_mode_names[m],
+                         threads_mix_names[x], threads);
+                bench_end(&bench, name, total, false);
+                if (bench.config.latency) {
+                    for (int t = 0; t < threads; t++) {
+                        memset(&hists[t], 0, sizeof(hists[t]));
+                        workers[t].hist = &hists[t];
+                    }
+                    threads_run(&bench, runs, &shared, workers, threads);
+                    threads_set_latency(&bench, hists, threads);
+                }
+                if (workers[0].cpu >= 0 && !workers[0].pinned) {
+                    fprintf(stderr, "Cannot pin threads; running them unpinned\n");
+                    num_cpus = 0;
+                }
+            }
+        }
+        for (int s = 0; s < shared.num_shards; s++) {
+            if (!bptree_check_invariants(shards[s].tree)) {
+                fprintf(stderr, "Tree of shard %d is broken after mode %s\n", s,
+                        threads_mode_names[m]);
+                exit(EXIT_FAILURE);
+            }
+            bptree_free(shards[s].tree);
+        }
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+        pthread_mutex_destroy(&shards[s].mutex);
+        pthread_rwlock_destroy(&shards[s].rwlock);
+    }
+    free(shards);
+    free(hists);
+    free(workers);
+    free(ops);
+    free(order);
+    free(values);
+    free(cpus);
+
+    bench_note(&bench, "Benchmark finished (checksum %llu).\n", (unsigned long long)sum);
+    bench_finish(&bench);
+    return EXIT_SUCCESS;
+}
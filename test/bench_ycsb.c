@@ -0,0 +1,497 @@
+/**
+ * @file bench_ycsb.c
+ * @brief YCSB-style workload driver for the B+ tree library (bptree.h).
+ *
+ * Each workload loads a tree with N records (keys 0 to N-1, inserted in random order) and
+ * then runs OPS operations drawn from a mix of reads, updates, inserts, scans, and
+ * read-modify-writes, following the core workloads of the Yahoo! Cloud Serving Benchmark:
+ * - A: 50% reads, 50% updates, Zipfian keys.
+ * - B: 95% reads, 5% updates, Zipfian keys.
+ * - C: 100% reads, Zipfian keys.
+ * - D: 95% reads, 5% inserts, latest keys.
+ * - E: 95% scans, 5% inserts, Zipfian keys.
+ * - F: 50% reads, 50% read-modify-writes, Zipfian keys.
+ *
+ * The operation stream (kinds, keys, and scan lengths) is generated before timing, so the
+ * timed runs only call the bptree API. The load and the whole run are reported like any
+ * other case (see bench_common.h), followed by one line per operation kind with its
+ * throughput and latency percentiles, taken from the per-operation latency run.
+ *
+ * Updates are a remove followed by a put, since the API has no in-place update, and a
+ * read-modify-write is a get followed by an update. Inserts append new keys after the
+ * loaded ones.
+ *
+ * Settings come from environment variables, in addition to those of bench_common.h:
+ * - WORKLOAD: `A` to `F`, or `all` (the default) to run each of them.
+ * - OPS: operations per run, N by default.
+ * - MIX: `read:update:insert:scan:rmw` percentages overriding the mix of the workload.
+ * - DIST: `uniform`, `zipfian`, `latest`, or `hotspot`, overriding the key distribution.
+ * - THETA: skew of the Zipfian distributions, 0.99 by default.
+ * - HOT_SET, HOT_OPS: fraction of the keys that are hot (0.2 by default), and fraction of
+ *   the operations that go to them (0.8 by default), for the hotspot distribution.
+ * - SCAN_MAX: longest scan in keys, 100 by default.
+ * - SCAN_DIST: `uniform` (the default) or `zipfian` scan lengths, from 1 to SCAN_MAX.
+ *
+ * @version 0.4.1-beta
+ */
+
+#define BPTREE_IMPLEMENTATION  // Include the bptree implementation
+
+#include "bench_common.h"  // Include first: it selects the POSIX clock API
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bptree.h"  // Include the B+ tree library
+
+/** @brief Global flag to enable/disable debug logging from the bptree library. */
+const bool debug_enabled = false;
+
+/** @brief Kinds of operations in a workload. */
+typedef enum {
+    YCSB_READ,   /**< Get an existing key */
+    YCSB_UPDATE, /**< Replace the value of an existing key */
+    YCSB_INSERT, /**< Put a new key */
+    YCSB_SCAN,   /**< Range query starting at an existing key */
+    YCSB_RMW,    /**< Get an existing key, then replace its value */
+    YCSB_OP_KINDS
+} ycsb_op_kind;
+
+/** @brief Names of the operation kinds, as used in case names. */
+static const char *const ycsb_op_names[YCSB_OP_KINDS] = {"read", "update", "insert", "scan",
+                                                         "rmw"};
+
+/** @brief Distributions of the keys (and scan lengths) of a workload. */
+typedef enum {
+    YCSB_UNIFORM, /**< Every existing key is equally likely */
+    YCSB_ZIPFIAN, /**< A few keys, scattered over the key space, get most operations */
+    YCSB_LATEST,  /**< The most recently inserted keys get most operations */
+    YCSB_HOTSPOT  /**< A fixed fraction of the operations go to a fixed set of keys */
+} ycsb_dist;
+
+/** @brief Names of the distributions, as read from DIST and SCAN_DIST. */
+static const char *const ycsb_dist_names[] = {"uniform", "zipfian", "latest", "hotspot"};
+
+/** @brief Definition of a workload. */
+typedef struct ycsb_workload {
+    char name;              /**< Letter of the workload */
+    int mix[YCSB_OP_KINDS]; /**< Percentage of each operation kind */
+    ycsb_dist dist;         /**< Distribution of the keys */
+} ycsb_workload;
+
+/** @brief The YCSB core workloads. */
+static const ycsb_workload ycsb_presets[] = {
+    {'A', {50, 50, 0, 0, 0}, YCSB_ZIPFIAN}, {'B', {95, 5, 0, 0, 0}, YCSB_ZIPFIAN},
+    {'C', {100, 0, 0, 0, 0}, YCSB_ZIPFIAN}, {'D', {95, 0, 5, 0, 0}, YCSB_LATEST},
+    {'E', {0, 0, 5, 95, 0}, YCSB_ZIPFIAN},  {'F', {50, 0, 0, 0, 50}, YCSB_ZIPFIAN},
+};
+
+/** @brief Settings of the key and scan length generators. */
+typedef struct ycsb_settings {
+    double theta;        /**< Skew of the Zipfian distributions */
+    double hot_set;      /**< Fraction of the keys that are hot */
+    double hot_ops;      /**< Fraction of the operations that go to the hot keys */
+    int scan_max;        /**< Longest scan */
+    ycsb_dist scan_dist; /**< Distribution of the scan lengths (uniform or Zipfian) */
+} ycsb_settings;
+
+/** @brief One pre-generated operation. */
+typedef struct ycsb_op {
+    bptree_key_t key; /**< Key (or first key of a scan) */
+    int kind;         /**< An ycsb_op_kind */
+    int scan_len;     /**< Number of keys covered by a scan */
+} ycsb_op;
+
+/**
+ * @brief Draw a uniformly distributed number in [0, 1).
+ *
+ * @param state Generator state.
+ * @return The number.
+ */
+static double ycsb_uniform(uint64_t *state) {
+    return (double)(bench_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Zipfian generator over [0, items), after Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases" (the algorithm YCSB uses).
+ *
+ * The normalization constant zeta(items) is extended incrementally when items grows, so
+ * the generator can follow a key space that inserts keep enlarging.
+ */
+typedef struct ycsb_zipf {
+    double theta;  /**< Skew (0 < theta < 1) */
+    int64_t items; /**< Number of values */
+    double zeta2;  /**< zeta(2) */
+    double zetan;  /**< zeta(items) */
+    double alpha;  /**< 1 / (1 - theta) */
+    double eta;    /**< Correction for the values above 1 */
+} ycsb_zipf;
+
+/**
+ * @brief Set the number of values of a Zipfian generator.
+ *
+ * @param z The generator.
+ * @param items New number of values (at least the current one, unless starting over).
+ */
+static void ycsb_zipf_resize(ycsb_zipf *z, const int64_t items) {
+    if (items < z->items) {
+        z->items = 0;
+        z->zetan = 0.0;
+    }
+    for (int64_t i = z->items + 1; i <= items; i++) z->zetan += 1.0 / pow((double)i, z->theta);
+    z->items = items;
+    z->eta = (1.0 - pow(2.0 / (double)items, 1.0 - z->theta)) / (1.0 - z->zeta2 / z->zetan);
+}
+
+/**
+ * @brief Set up a Zipfian generator.
+ *
+ * @param z The generator.
+ * @param items Number of values.
+ * @param theta Skew (0 < theta < 1).
+ */
+static void ycsb_zipf_init(ycsb_zipf *z, const int64_t items, const double theta) {
+    memset(z, 0, sizeof(*z));
+    z->theta = theta;
+    z->zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    ycsb_zipf_resize(z, items);
+}
+
+/**
+ * @brief Draw a value from a Zipfian generator (0 is the most likely).
+ *
+ * @param z The generator.
+ * @param state Random number generator state.
+ * @return A value in [0, items).
+ */
+static int64_t ycsb_zipf_next(const ycsb_zipf *z, uint64_t *state) {
+    const double u = ycsb_uniform(state);
+    const double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, z->theta)) return z->items > 1 ? 1 : 0;
+    const int64_t value = (int64_t)((double)z->items * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return value < z->items ? value : z->items - 1;
+}
+
+/**
+ * @brief Scatter a value over [0, items) with the 64-bit FNV-1a hash, so that the most
+ * likely Zipfian values are not neighbours in the tree.
+ *
+ * @param value The value.
+ * @param items Size of the range.
+ * @return The scattered value.
+ */
+static int64_t ycsb_scramble(const int64_t value, const int64_t items) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < 8; i++) {
+        hash ^= ((uint64_t)value >> (8 * i)) & 0xFF;
+        hash *= 0x100000001B3ULL;
+    }
+    return (int64_t)(hash % (uint64_t)items);
+}
+
+/**
+ * @brief Draw an existing key.
+ *
+ * @param dist Distribution of the keys.
+ * @param s Settings.
+ * @param zipf Zipfian generator over the existing keys.
+ * @param records Number of existing keys (keys 0 to records-1).
+ * @param state Random number generator state.
+ * @return The key.
+ */
+static int64_t ycsb_pick_key(const ycsb_dist dist, const ycsb_settings *s, const ycsb_zipf *zipf,
+                             const int64_t records, uint64_t *state) {
+    switch (dist) {
+        case YCSB_ZIPFIAN:
+            return ycsb_scramble(ycsb_zipf_next(zipf, state), records);
+        case YCSB_LATEST:
+            return records - 1 - ycsb_zipf_next(zipf, state);
+        case YCSB_HOTSPOT: {
+            int64_t hot = (int64_t)(s->hot_set * (double)records);
+            if (hot < 1) hot = 1;
+            if (hot >= records || ycsb_uniform(state) < s->hot_ops) {
+                return (int64_t)(bench_next(state) % (uint64_t)hot);
+            }
+            return hot + (int64_t)(bench_next(state) % (uint64_t)(records - hot));
+        }
+        case YCSB_UNIFORM:
+        default:
+            return (int64_t)(bench_next(state) % (uint64_t)records);
+    }
+}
+
+/**
+ * @brief Generate the operations of a workload.
+ *
+ * @param w The workload.
+ * @param s Settings.
+ * @param records Number of loaded keys.
+ * @param seed Random seed.
+ * @param ops Array to fill.
+ * @param count Number of operations.
+ * @param kinds Set to the number of operations of each kind.
+ */
+static void ycsb_generate(const ycsb_workload *w, const ycsb_settings *s, const int64_t records,
+                          const uint64_t seed, ycsb_op *ops, const int count,
+                          int kinds[YCSB_OP_KINDS]) {
+    uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    ycsb_zipf keys, lengths;
+    ycsb_zipf_init(&keys, records, s->theta);
+    ycsb_zipf_init(&lengths, s->scan_max, s->theta);
+    int64_t total = records;
+    int mix_total = 0;
+    for (int k = 0; k < YCSB_OP_KINDS; k++) mix_total += w->mix[k];
+    memset(kinds, 0, YCSB_OP_KINDS * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        int roll = (int)(bench_next(&state) % (uint64_t)mix_total);
+        int kind = 0;
+        while (roll >= w->mix[kind]) roll -= w->mix[kind++];
+        ycsb_op *op = &ops[i];
+        op->kind = kind;
+        op->scan_len = 0;
+        kinds[kind]++;
+        if (kind == YCSB_INSERT) {
+            op->key = (bptree_key_t)total++;
+            if (w->dist == YCSB_ZIPFIAN || w->dist == YCSB_LATEST) ycsb_zipf_resize(&keys, total);
+            continue;
+        }
+        op->key = (bptree_key_t)ycsb_pick_key(w->dist, s, &keys, total, &state);
+        if (kind == YCSB_SCAN) {
+            op->scan_len = s->scan_dist == YCSB_ZIPFIAN
+                               ? 1 + (int)ycsb_zipf_next(&lengths, &state)
+                               : 1 + (int)(bench_next(&state) % (uint64_t)s->scan_max);
+        }
+    }
+}
+
+/**
+ * @brief Replace the value of a key (there is no in-place update in the API).
+ *
+ * @param tree The tree.
+ * @param key The key.
+ * @param value The new value.
+ */
+static void ycsb_update(bptree *tree, const bptree_key_t *key, bptree_value_t value) {
+    bptree_status st = bptree_remove(tree, key);
+    assert(st == BPTREE_OK);
+    st = bptree_put(tree, key, value);
+    assert(st == BPTREE_OK);
+    (void)st;
+}
+
+/**
+ * @brief Run one pre-generated operation.
+ *
+ * @param tree The tree.
+ * @param op The operation.
+ * @param values Values to store, indexed by key.
+ */
+static void ycsb_execute(bptree *tree, const ycsb_op *op, int64_t *values) {
+    bptree_value_t res = NULL;
+    bptree_status st = BPTREE_OK;
+    switch (op->kind) {
+        case YCSB_READ:
+            st = bptree_get(tree, &op->key, &res);
+            assert(st == BPTREE_OK && res == &values[op->key]);
+            break;
+        case YCSB_UPDATE:
+            ycsb_update(tree, &op->key, &values[op->key]);
+            break;
+        case YCSB_INSERT:
+            st = bptree_put(tree, &op->key, &values[op->key]);
+            assert(st == BPTREE_OK);
+            break;
+        case YCSB_SCAN: {
+            const bptree_key_t end = op->key + op->scan_len - 1;
+            bptree_value_t *results = NULL;
+            int found = 0;
+            st = bptree_get_range(tree, &op->key, &end, &results, &found);
+            assert(st == BPTREE_OK && found >= 1);
+            bptree_free_range_results(results);
+            break;
+        }
+        case YCSB_RMW:
+        default:
+            st = bptree_get(tree, &op->key, &res);
+            assert(st == BPTREE_OK);
+            ycsb_update(tree, &op->key, res);
+            break;
+    }
+    (void)st;
+}
+
+/**
+ * @brief Create a tree holding keys in a given order, exiting on failure.
+ *
+ * @param max_keys Maximum keys per node.
+ * @param order Keys to insert.
+ * @param records Number of keys.
+ * @param values Values to store, indexed by key.
+ * @return The loaded tree.
+ */
+static bptree *ycsb_load(const int max_keys, const uint32_t *order, const int records,
+                         int64_t *values) {
+    bptree *tree = bptree_create(max_keys, bench_compare_keys, debug_enabled);
+    if (!tree) {
+        fprintf(stderr, "Failed to create tree\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < records; i++) {
+        const bptree_key_t key = (bptree_key_t)order[i];
+        if (bptree_put(tree, &key, &values[key]) != BPTREE_OK) {
+            fprintf(stderr, "Failed to load key %lld\n", (long long)key);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return tree;
+}
+
+/**
+ * @brief Parse a distribution name.
+ *
+ * @param name Value of the environment variable (may be NULL).
+ * @param fallback Distribution to use if @p name is not set or not valid.
+ * @param max_dist Last valid distribution.
+ * @return The distribution.
+ */
+static ycsb_dist ycsb_parse_dist(const char *name, const ycsb_dist fallback,
+                                 const ycsb_dist max_dist) {
+    if (!name || !*name) return fallback;
+    for (int d = 0; d <= (int)max_dist; d++) {
+        if (strcasecmp(name, ycsb_dist_names[d]) == 0) return (ycsb_dist)d;
+    }
+    fprintf(stderr, "Unknown distribution '%s'; defaulting to %s\n", name,
+            ycsb_dist_names[fallback]);
+    return fallback;
+}
+
+/**
+ * @brief Main entry point for the workload driver.
+ *
+ * Reads the settings, shuffles the load order, and then for each selected workload:
+ * generates its operations, benchmarks the load and the run, and reports every operation
+ * kind separately.
+ *
+ * @param void Takes no arguments.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on bad settings or allocation failure.
+ */
+int main(void) {
+    bench_harness bench;
+    bench_init(&bench, "bench_ycsb");
+    const int max_keys = bench.config.max_keys;
+    const int records = bench.config.n;
+    const int count = bench_env_int("OPS", records, 1);
+
+    ycsb_settings settings;
+    settings.theta = bench_env_double("THETA", 0.99, 0.01, 0.9999);
+    settings.hot_set = bench_env_double("HOT_SET", 0.2, 0.0, 1.0);
+    settings.hot_ops = bench_env_double("HOT_OPS", 0.8, 0.0, 1.0);
+    settings.scan_max = bench_env_int("SCAN_MAX", 100, 1);
+    settings.scan_dist = ycsb_parse_dist(getenv("SCAN_DIST"), YCSB_UNIFORM, YCSB_ZIPFIAN);
+    const char *dist = getenv("DIST");
+    const char *mix = getenv("MIX");
+    const char *selected = getenv("WORKLOAD");
+    if (!selected || !*selected) selected = "all";
+
+    // Override of the mix, if any
+    int mix_override[YCSB_OP_KINDS] = {0};
+    if (mix && *mix) {
+        int parsed = sscanf(mix, "%d:%d:%d:%d:%d", &mix_override[0], &mix_override[1],
+                            &mix_override[2], &mix_override[3], &mix_override[4]);
+        int sum = 0;
+        for (int k = 0; k < YCSB_OP_KINDS; k++) {
+            if (mix_override[k] < 0) parsed = 0;
+            sum += mix_override[k];
+        }
+        if (parsed < 1 || sum != 100) {
+            fprintf(stderr, "Invalid MIX '%s' (expected read:update:insert:scan:rmw summing to "
+                            "100)\n", mix);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Keys are record numbers: 0 to records-1 are loaded, inserts take the next ones.
+    uint32_t *order = malloc((size_t)records * sizeof(uint32_t));
+    int64_t *values = malloc(((size_t)records + (size_t)count) * sizeof(int64_t));
+    ycsb_op *ops = malloc((size_t)count * sizeof(ycsb_op));
+    uint64_t *samples[YCSB_OP_KINDS];
+    for (int k = 0; k < YCSB_OP_KINDS; k++) samples[k] = malloc((size_t)count * sizeof(uint64_t));
+    if (!order || !values || !ops || !samples[0] || !samples[1] || !samples[2] || !samples[3] ||
+        !samples[4]) {
+        perror("Allocation failed for workload data");
+        exit(EXIT_FAILURE);
+    }
+    for (int64_t i = 0; i < (int64_t)records + count; i++) values[i] = i;
+    for (int i = 0; i < records; i++) order[i] = (uint32_t)i;
+    bench_shuffle(order, records);
+
+    int workloads_run = 0;
+    for (size_t p = 0; p < sizeof(ycsb_presets) / sizeof(ycsb_presets[0]); p++) {
+        ycsb_workload w = ycsb_presets[p];
+        if (strcasecmp(selected, "all") != 0 && (strlen(selected) != 1 ||
+                                                 (selected[0] | 0x20) != (w.name | 0x20))) {
+            continue;
+        }
+        if (mix && *mix) memcpy(w.mix, mix_override, sizeof(w.mix));
+        w.dist = ycsb_parse_dist(dist, w.dist, YCSB_HOTSPOT);
+        workloads_run++;
+
+        int kinds[YCSB_OP_KINDS];
+        ycsb_generate(&w, &settings, records, bench.config.seed + p, ops, count, kinds);
+        bench_note(&bench, "Workload %c: %d%% read, %d%% update, %d%% insert, %d%% scan, "
+                           "%d%% rmw, %s keys\n", w.name, w.mix[YCSB_READ], w.mix[YCSB_UPDATE],
+                   w.mix[YCSB_INSERT], w.mix[YCSB_SCAN], w.mix[YCSB_RMW],
+                   ycsb_dist_names[w.dist]);
+
+        char name[64];
+        bptree *tree = NULL;
+        snprintf(name, sizeof(name), "YCSB-%c load", w.name);
+        BENCH(&bench, name, records, {
+            tree = bptree_create(max_keys, bench_compare_keys, debug_enabled);
+            if (!tree) exit(EXIT_FAILURE);
+        }, {
+            const bptree_key_t key = (bptree_key_t)order[bench_i];
+            const bptree_status st = bptree_put(tree, &key, &values[key]);
+            assert(st == BPTREE_OK);
+            (void)st;
+        }, bptree_free(tree));
+
+        // Every run starts from a freshly loaded tree (loading is not timed).
+        bool split = false;
+        snprintf(name, sizeof(name), "YCSB-%c run", w.name);
+        BENCH(&bench, name, count, tree = ycsb_load(max_keys, order, records, values),
+              ycsb_execute(tree, &ops[bench_i], values), {
+            if (bench_latency_run(&bench, bench_r)) {
+                int filled[YCSB_OP_KINDS] = {0};
+                for (int i = 0; i < count; i++) {
+                    samples[ops[i].kind][filled[ops[i].kind]++] = bench.latency[i];
+                }
+                split = true;
+            }
+            bptree_free(tree);
+        });
+        for (int k = 0; k < YCSB_OP_KINDS && split; k++) {
+            snprintf(name, sizeof(name), "YCSB-%c %s", w.name, ycsb_op_names[k]);
+            bench_report_latency(&bench, name, samples[k], kinds[k]);
+        }
+    }
+    if (workloads_run == 0) {
+        fprintf(stderr, "Unknown WORKLOAD '%s' (expected A to F or all)\n", selected);
+    }
+
+    for (int k = 0; k < YCSB_OP_KINDS; k++) free(samples[k]);
+    free(ops);
+    free(values);
+    free(order);
+
+    bench_note(&bench, "Benchmark finished.\n");
+    bench_finish(&bench);
+    return workloads_run ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -139,7 +139,7 @@ static void cleanup_records_and_tree(bptree *tree) {
 
     // Only iterate if there are records potentially stored
     if (tree->count > 0) {
-        printf("Iterating through leaves to free %d records...\n", tree->count);
+        printf("Iterating through leaves to free %lld records...\n", (long long)tree->count);
         // 1. Find the first leaf node
         bptree_node *leaf = tree->root;
         while (leaf && !leaf->is_leaf) {
@@ -185,9 +185,9 @@ static void cleanup_records_and_tree(bptree *tree) {
             // stored)
             if (freed_count != tree->count) {
                 fprintf(stderr,
-                        "Warning: Number of freed records (%d) may not match tree count (%d) if "
+                        "Warning: Number of freed records (%d) may not match tree count (%lld) if "
                         "NULL values were stored.\n",
-                        freed_count, tree->count);
+                        freed_count, (long long)tree->count);
             }
         }
     } else {
@@ -584,8 +584,8 @@ int main(void) {
         const bptree_stats stats = bptree_get_stats(tree);
         printf("Tree stats: count=%d, height=%d, node_count=%d\n", stats.count, stats.height,
                stats.node_count);
-        printf("Final tree size should be %d records.\n",
-               tree->count);  // Use tree's internal count
+        printf("Final tree size should be %lld records.\n",
+               (long long)tree->count);  // Use tree's internal count
     }
 
     // --- Cleanup ---
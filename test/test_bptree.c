@@ -24,10 +24,35 @@
 /** @brief Default max_keys value for the tree if not otherwise specified. */
 #define DEFAULT_MAX_KEYS 32
 
+// The optional features are all turned on, unless TEST_DEFAULT_FEATURES is defined to test the
+// library as it builds by default (see the `test` target of the Makefile, which runs both).
+#ifndef TEST_DEFAULT_FEATURES
+/** @brief Aggregate used to test subtree aggregates (sum, min, max, and count in one monoid). */
+typedef struct test_agg {
+    int64_t sum;   /**< Sum of the values */
+    int64_t min;   /**< Smallest value */
+    int64_t max;   /**< Largest value */
+    int64_t count; /**< Number of entries */
+} test_agg;
+#define BPTREE_AGGREGATE_TYPE test_agg
+#define BPTREE_ENABLE_THREADS
+#define BPTREE_ENABLE_TTL
+#define BPTREE_ENABLE_COUNTERS
+#define BPTREE_ENABLE_LATENCY
+#define BPTREE_ENABLE_PROBES
+#define BPTREE_ENABLE_TRACE
+#define BPTREE_ENABLE_HEATMAP
+#endif
+
 /** @brief Define BPTREE_IMPLEMENTATION to include the library's implementation. */
 #define BPTREE_IMPLEMENTATION
 #include "bptree.h"  // Include the B+ tree library header
 
+#ifdef BPTREE_ENABLE_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
 /** @brief Global flag for enabling/disabling debug logging from the bptree library during tests. */
 const bool global_debug_enabled = false;
 
@@ -617,7 +642,7 @@ void test_mixed_insert_delete(void) {
                    "Mixed delete (even) failed for key %lld", (long long)key);
         }
         ASSERT(tree->count == N / 2, "Count mismatch after deleting evens: expected %d, got %d",
-               N / 2, tree->count);
+               N / 2, (int)tree->count);
 
         // --- Phase 3: Check remaining odd keys ---
         for (int i = 1; i <= N; i += 2) {
@@ -665,7 +690,7 @@ void test_mixed_insert_delete(void) {
         }
         ASSERT(tree->count == expected_final_count,
                "Count mismatch after deleting 1-mod-3 keys: expected %d, got %d",
-               expected_final_count, tree->count);
+               expected_final_count, (int)tree->count);
         ASSERT(bptree_check_invariants(tree) == true,
                "Invariants check failed after final mixed delete stage");
 
@@ -751,6 +776,29 @@ void test_tree_stats(void) {
                "Node count %d seems low relative to N=%d, order=%d (expected min ~%d)",
                stats.node_count, N, order, expected_min_nodes);
 
+        // Per-level counts and fill factors agree with a full scan.
+        ASSERT(stats.entries == N, "64-bit entry count wrong");
+        ASSERT(stats.level_nodes[stats.height - 1] == 1, "Top level should hold only the root");
+        int64_t level_sum = 0;
+        for (int level = 0; level < stats.height; level++) level_sum += stats.level_nodes[level];
+        ASSERT(level_sum == stats.node_count && stats.leaf_nodes == stats.level_nodes[0],
+               "Level counts do not add up");
+        const double leaf_fill = (double)N / ((double)stats.leaf_nodes * order);
+        ASSERT(stats.avg_leaf_fill > leaf_fill - 1e-9 && stats.avg_leaf_fill < leaf_fill + 1e-9,
+               "Average leaf fill wrong");
+        bptree_fill_histogram hist;
+        ASSERT(bptree_scan_fill(tree, &hist) == BPTREE_OK, "Fill scan failed");
+        int64_t scanned_leaves = 0, scanned_internals = 0;
+        for (int b = 0; b < BPTREE_FILL_BUCKETS; b++) {
+            scanned_leaves += hist.leaves[b];
+            scanned_internals += hist.internals[b];
+        }
+        ASSERT(scanned_leaves == stats.leaf_nodes && scanned_internals == stats.internal_nodes,
+               "Histogram does not cover every node");
+        ASSERT(hist.min_leaf_fill >= (double)tree->min_leaf_keys / order - 1e-9 &&
+                   hist.min_leaf_fill <= stats.avg_leaf_fill + 1e-9,
+               "Minimum leaf fill out of range");
+
         bptree_free(tree);
 #ifdef BPTREE_KEY_TYPE_STRING
         cleanup_alloc_track();  // Although we inserted NULL, cleanup doesn't hurt
@@ -876,6 +924,1593 @@ void test_stress(void) {
     }
 }
 
+#ifndef BPTREE_KEY_TYPE_STRING
+/**
+ * @brief Test: Min/max lookups and pop_min/pop_max (priority queue usage).
+ * Inserts keys in a scrambled order, then alternately pops the smallest and largest keys,
+ * checking the order of the popped keys, their values, and the tree invariants as the
+ * leftmost and rightmost leaves merge away.
+ */
+void test_min_max_pop(void) {
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        bptree_key_t k;
+        bptree_value_t v;
+        ASSERT(bptree_min(tree, &k, &v) == BPTREE_KEY_NOT_FOUND, "Min on empty tree should fail");
+        ASSERT(bptree_pop_max(tree, &k, &v) == BPTREE_KEY_NOT_FOUND,
+               "Pop max on empty tree should fail");
+
+        const int N = 1000;  // Keys 0..N-1 inserted in the order (i * 7919) mod N
+        for (int i = 0; i < N; i++) {
+            k = (bptree_key_t)((i * 7919) % N);
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert failed");
+        }
+        ASSERT(bptree_min(tree, &k, &v) == BPTREE_OK && k == 0, "Min should be 0");
+        ASSERT(bptree_max(tree, &k, &v) == BPTREE_OK && k == N - 1, "Max should be N-1");
+
+        int lo = 0, hi = N - 1;
+        for (int i = 0; i < N; i++) {
+            const bool from_front = (i % 3 != 2);
+            const bptree_status st =
+                from_front ? bptree_pop_min(tree, &k, &v) : bptree_pop_max(tree, &k, &v);
+            ASSERT(st == BPTREE_OK, "Pop failed at step %d", i);
+            const int expected = from_front ? lo++ : hi--;
+            ASSERT(k == expected, "Popped %lld, expected %d", (long long)k, expected);
+            ASSERT(v == MAKE_VALUE_NUM(expected), "Popped value mismatch for key %d", expected);
+            if (i % 50 == 0) {
+                ASSERT(bptree_check_invariants(tree), "Invariants failed during pops (step %d)",
+                       i);
+            }
+        }
+        ASSERT(tree->count == 0, "Tree should be empty after popping everything");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after popping everything");
+        ASSERT(bptree_pop_min(tree, NULL, NULL) == BPTREE_KEY_NOT_FOUND,
+               "Pop min on drained tree should fail");
+        bptree_free(tree);
+    }
+}
+
+/**
+ * @brief Test: Nearest-key queries (floor, ceiling, bounds, predecessor, successor).
+ * Inserts multiples of 5, deletes some of them to leave stale separators behind, and
+ * compares every query against a brute-force scan for all probe keys around the range.
+ */
+void test_nearest_key_queries(void) {
+    enum { MAX_KEY = 2000 };
+    static bool present[MAX_KEY + 1];
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        bptree_key_t k = 10;
+        ASSERT(bptree_floor(tree, &k, NULL, NULL) == BPTREE_KEY_NOT_FOUND,
+               "Floor on empty tree should fail");
+        for (int i = 0; i <= MAX_KEY; i++) {
+            present[i] = (i % 5 == 0);
+            k = (bptree_key_t)i;
+            if (present[i]) bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        for (int i = 0; i <= MAX_KEY; i += 35) {  // Deletes every 7th key
+            k = (bptree_key_t)i;
+            ASSERT(bptree_remove(tree, &k) == BPTREE_OK, "Remove failed for %d", i);
+            present[i] = false;
+        }
+        for (int probe = -3; probe <= MAX_KEY + 3; probe++) {
+            int floor_k = -1, lower_k = -1, ceil_k = -1, higher_k = -1;
+            for (int i = 0; i <= MAX_KEY; i++) {
+                if (!present[i]) continue;
+                if (i <= probe) floor_k = i;
+                if (i < probe) lower_k = i;
+                if (i >= probe && ceil_k < 0) ceil_k = i;
+                if (i > probe && higher_k < 0) higher_k = i;
+            }
+            const bptree_key_t q = (bptree_key_t)probe;
+            bptree_key_t got;
+            bptree_value_t val;
+            bptree_status st = bptree_floor(tree, &q, &got, &val);
+            ASSERT(floor_k < 0 ? st == BPTREE_KEY_NOT_FOUND
+                               : (st == BPTREE_OK && got == floor_k && val == MAKE_VALUE_NUM(got)),
+                   "Floor(%d) wrong (order %d)", probe, order);
+            st = bptree_predecessor(tree, &q, &got, NULL);
+            ASSERT(lower_k < 0 ? st == BPTREE_KEY_NOT_FOUND : (st == BPTREE_OK && got == lower_k),
+                   "Predecessor(%d) wrong (order %d)", probe, order);
+            st = bptree_ceiling(tree, &q, &got, &val);
+            ASSERT(ceil_k < 0 ? st == BPTREE_KEY_NOT_FOUND
+                              : (st == BPTREE_OK && got == ceil_k && val == MAKE_VALUE_NUM(got)),
+                   "Ceiling(%d) wrong (order %d)", probe, order);
+            st = bptree_lower_bound(tree, &q, &got, NULL);
+            ASSERT(ceil_k < 0 ? st == BPTREE_KEY_NOT_FOUND : (st == BPTREE_OK && got == ceil_k),
+                   "Lower bound(%d) wrong (order %d)", probe, order);
+            st = bptree_successor(tree, &q, &got, NULL);
+            ASSERT(higher_k < 0 ? st == BPTREE_KEY_NOT_FOUND : (st == BPTREE_OK && got == higher_k),
+                   "Successor(%d) wrong (order %d)", probe, order);
+            st = bptree_upper_bound(tree, &q, &got, NULL);
+            ASSERT(higher_k < 0 ? st == BPTREE_KEY_NOT_FOUND : (st == BPTREE_OK && got == higher_k),
+                   "Upper bound(%d) wrong (order %d)", probe, order);
+        }
+        bptree_free(tree);
+    }
+}
+
+#ifdef BPTREE_AGGREGATE_TYPE
+/** @brief Lifts an entry into a test aggregate (the value holds an integer). */
+static test_agg test_agg_lift(const bptree_key_t *key, const bptree_value_t value) {
+    (void)key;
+    const int64_t v = (int64_t)(intptr_t)value;
+    return (test_agg){v, v, v, 1};
+}
+
+/** @brief Combines two test aggregates. */
+static test_agg test_agg_combine(const test_agg a, const test_agg b) {
+    return (test_agg){a.sum + b.sum, a.min < b.min ? a.min : b.min, a.max > b.max ? a.max : b.max,
+                      a.count + b.count};
+}
+
+/**
+ * @brief Compares bptree_aggregate_range with a brute-force computation for many ranges.
+ *
+ * @param tree Tree whose entries are the keys `i` with `present[i]`, each with value `3 * i`.
+ * @param present Which of the keys 0 to `max_key` are in the tree.
+ * @param max_key Largest key.
+ * @param identity Identity of the aggregate.
+ * @param what Description of the tree for failure messages.
+ */
+static void test_agg_check_ranges(const bptree *tree, const bool *present, const int max_key,
+                                  const test_agg identity, const char *what) {
+    for (int lo = -5; lo <= max_key + 5; lo += 37) {
+        for (int hi = lo; hi <= max_key + 5; hi += 53) {
+            test_agg expect = identity;
+            for (int i = lo < 0 ? 0 : lo; i <= hi && i <= max_key; i++) {
+                if (!present[i]) continue;
+                expect = test_agg_combine(expect, (test_agg){i * 3, i * 3, i * 3, 1});
+            }
+            const bptree_key_t start = (bptree_key_t)lo, end = (bptree_key_t)hi;
+            test_agg got;
+            ASSERT(bptree_aggregate_range(tree, &start, &end, &got) == BPTREE_OK,
+                   "Aggregate failed for [%d, %d]", lo, hi);
+            ASSERT(got.sum == expect.sum && got.count == expect.count &&
+                       got.min == expect.min && got.max == expect.max,
+                   "Aggregate mismatch for [%d, %d] (%s): sum %lld vs %lld", lo, hi, what,
+                   (long long)got.sum, (long long)expect.sum);
+        }
+    }
+}
+
+/**
+ * @brief Test: Range aggregates over subtree summaries.
+ * Keeps sum/min/max/count aggregates through insertions (with splits), removals (with
+ * borrows and merges), random puts and removes, and pops, and compares
+ * bptree_aggregate_range against a brute-force computation for many ranges.
+ */
+void test_aggregate_range(void) {
+    enum { MAX_KEY = 1500 };
+    static bool present[MAX_KEY + 1];
+    const bptree_monoid monoid = {{0, INT64_MAX, INT64_MIN, 0}, test_agg_lift, test_agg_combine};
+    char what[64];
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        // Part of the tree exists before the monoid is set, the rest is maintained incrementally.
+        for (int i = 0; i <= MAX_KEY; i++) {
+            present[i] = false;
+            const bptree_key_t k = (bptree_key_t)((i * 7) % (MAX_KEY + 1));
+            if (i == MAX_KEY / 2) {
+                ASSERT(bptree_set_monoid(tree, &monoid) == BPTREE_OK, "Setting monoid failed");
+            }
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k * 3));
+        }
+        for (int i = 0; i <= MAX_KEY; i++) present[i] = true;
+        for (int i = 0; i <= MAX_KEY; i++) {
+            if (i % 3 == 0 || i % 7 == 0) {
+                const bptree_key_t k = (bptree_key_t)i;
+                ASSERT(bptree_remove(tree, &k) == BPTREE_OK, "Remove failed for %d", i);
+                present[i] = false;
+            }
+        }
+        snprintf(what, sizeof(what), "order %d, after removals", order);
+        test_agg_check_ranges(tree, present, MAX_KEY, monoid.identity, what);
+
+        // Random puts and removes reach merges that stop rebalancing at every depth.
+        srand(7 + order);
+        for (int round = 0; round < 20; round++) {
+            for (int op = 0; op < 300; op++) {
+                const int i = rand() % (MAX_KEY + 1);
+                const bptree_key_t k = (bptree_key_t)i;
+                if (present[i]) {
+                    ASSERT(bptree_remove(tree, &k) == BPTREE_OK, "Remove failed for %d", i);
+                } else {
+                    ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k * 3)) == BPTREE_OK,
+                           "Put failed for %d", i);
+                }
+                present[i] = !present[i];
+            }
+            snprintf(what, sizeof(what), "order %d, random round %d", order, round);
+            test_agg_check_ranges(tree, present, MAX_KEY, monoid.identity, what);
+        }
+
+        bptree_key_t popped;
+        ASSERT(bptree_pop_min(tree, &popped, NULL) == BPTREE_OK, "Pop min failed");
+        present[popped] = false;
+        ASSERT(bptree_pop_max(tree, &popped, NULL) == BPTREE_OK, "Pop max failed");
+        present[popped] = false;
+        // Aggregates must survive a rebuild of the whole tree.
+        ASSERT(bptree_compact(tree, 0.8) == BPTREE_OK, "Compaction failed");
+        snprintf(what, sizeof(what), "order %d, after compaction", order);
+        test_agg_check_ranges(tree, present, MAX_KEY, monoid.identity, what);
+        const bptree_key_t lo = 10, hi = 5;
+        test_agg unused;
+        ASSERT(bptree_aggregate_range(tree, &lo, &hi, &unused) == BPTREE_INVALID_ARGUMENT,
+               "Inverted range should be rejected");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after aggregate test");
+        ASSERT(bptree_set_monoid(tree, NULL) == BPTREE_OK, "Clearing monoid failed");
+        ASSERT(bptree_aggregate_range(tree, &hi, &lo, &unused) == BPTREE_INVALID_ARGUMENT,
+               "Aggregating without a monoid should be rejected");
+        bptree_free(tree);
+    }
+}
+#endif  // BPTREE_AGGREGATE_TYPE
+
+/**
+ * @brief Test: Set operations between two trees.
+ * Builds A = multiples of 2 and B = multiples of 3 (plus a small, skewed B) and checks that
+ * union, intersection, and difference produce exactly the expected keys, take values from
+ * the first tree, and yield valid trees.
+ */
+void test_set_operations(void) {
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *a = create_test_tree_with_order(order);
+        bptree *b = create_test_tree_with_order(order);
+        bptree *small = create_test_tree_with_order(order);
+        ASSERT(a && b && small, "Tree creation failed for order %d", order);
+        const int N = 600;
+        for (int i = 0; i <= N; i++) {
+            bptree_key_t k = (bptree_key_t)i;
+            if (i % 2 == 0) bptree_put(a, &k, MAKE_VALUE_NUM(k));
+            if (i % 3 == 0) bptree_put(b, &k, MAKE_VALUE_NUM(k + 1));
+            if (i % 150 == 0) bptree_put(small, &k, MAKE_VALUE_NUM(k + 1));
+        }
+
+        bptree *u = NULL, *x = NULL, *d = NULL, *xs = NULL;
+        ASSERT(bptree_union(a, b, &u) == BPTREE_OK, "Union failed");
+        ASSERT(bptree_intersect(a, b, &x) == BPTREE_OK, "Intersect failed");
+        ASSERT(bptree_difference(a, b, &d) == BPTREE_OK, "Difference failed");
+        ASSERT(bptree_intersect(a, small, &xs) == BPTREE_OK, "Skewed intersect failed");
+        if (!u || !x || !d || !xs) {
+            bptree_free(a);
+            bptree_free(b);
+            bptree_free(small);
+            bptree_free(u);
+            bptree_free(x);
+            bptree_free(d);
+            bptree_free(xs);
+            continue;
+        }
+        ASSERT(bptree_check_invariants(u), "Invariants failed for union (order %d)", order);
+        ASSERT(bptree_check_invariants(x), "Invariants failed for intersect (order %d)", order);
+        ASSERT(bptree_check_invariants(d), "Invariants failed for difference (order %d)", order);
+        ASSERT(bptree_check_invariants(xs), "Invariants failed for skewed intersect");
+
+        int expect_u = 0, expect_x = 0, expect_d = 0;
+        for (int i = 0; i <= N; i++) {
+            const bool in_a = (i % 2 == 0), in_b = (i % 3 == 0);
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_value_t res;
+            expect_u += (in_a || in_b);
+            expect_x += (in_a && in_b);
+            expect_d += (in_a && !in_b);
+            ASSERT(bptree_contains(u, &k) == (in_a || in_b), "Union membership wrong for %d", i);
+            ASSERT(bptree_contains(x, &k) == (in_a && in_b), "Intersect membership wrong for %d",
+                   i);
+            ASSERT(bptree_contains(d, &k) == (in_a && !in_b), "Difference membership wrong for %d",
+                   i);
+            ASSERT(bptree_contains(xs, &k) == (in_a && i % 150 == 0),
+                   "Skewed intersect membership wrong for %d", i);
+            if (in_a && bptree_get(u, &k, &res) == BPTREE_OK) {
+                ASSERT(res == MAKE_VALUE_NUM(k), "Union value not taken from first tree for %d", i);
+            }
+        }
+        ASSERT(u->count == expect_u, "Union count %d != %d", (int)u->count, expect_u);
+        ASSERT(x->count == expect_x, "Intersect count %d != %d", (int)x->count, expect_x);
+        ASSERT(d->count == expect_d, "Difference count %d != %d", (int)d->count, expect_d);
+
+        bptree *empty = create_test_tree_with_order(order);
+        bptree *e = NULL;
+        ASSERT(bptree_intersect(a, empty, &e) == BPTREE_OK && e && e->count == 0,
+               "Intersect with empty tree should be empty");
+        ASSERT(e && bptree_check_invariants(e), "Invariants failed for empty result");
+        bptree_free(e);
+
+        bptree_free(a);
+        bptree_free(b);
+        bptree_free(small);
+        bptree_free(empty);
+        bptree_free(u);
+        bptree_free(x);
+        bptree_free(d);
+        bptree_free(xs);
+    }
+}
+
+/** @brief Predicate for bptree_remove_if: matches keys that are divisible by `*(int *)ctx`. */
+static bool test_key_divisible(const bptree_key_t *key, const bptree_value_t value, void *ctx) {
+    (void)value;
+    return *key % *(const int *)ctx == 0;
+}
+
+/** @brief Predicate for bptree_remove_if: matches keys outside the window `ctx` points to. */
+static bool test_key_outside(const bptree_key_t *key, const bptree_value_t value, void *ctx) {
+    (void)value;
+    const int *window = ctx;
+    return *key < window[0] || *key > window[1];
+}
+
+/**
+ * @brief Test: Bulk removal by predicate.
+ * Removes sparse, dense, contiguous, and all-matching subsets, then checks membership,
+ * counts, invariants, and that the tree keeps working for later inserts and removals.
+ */
+void test_remove_if(void) {
+    const int N = 2000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        ASSERT(bptree_remove_if(NULL, test_key_divisible, NULL) == BPTREE_INVALID_ARGUMENT,
+               "NULL tree should be rejected");
+        ASSERT(bptree_remove_if(tree, NULL, NULL) == BPTREE_INVALID_ARGUMENT,
+               "NULL predicate should be rejected");
+
+        int divisor = 7;  // Sparse removal: most leaves only shrink.
+        const size_t bytes_before = tree->node_bytes;
+        const int64_t internal_before = tree->internal_nodes;
+        ASSERT(bptree_remove_if(tree, test_key_divisible, &divisor) == BPTREE_OK,
+               "Remove-if failed");
+        // The rebuild reuses the old internal nodes and needs no fresh memory.
+        ASSERT(tree->node_bytes <= bytes_before && tree->internal_nodes <= internal_before,
+               "Remove-if allocated nodes (order %d)", order);
+        ASSERT(tree->count == N - N / 7, "Count %d after sparse removal (order %d)",
+               (int)tree->count, order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after sparse removal");
+        divisor = 2;  // Dense removal: about half of the surviving entries die.
+        ASSERT(bptree_remove_if(tree, test_key_divisible, &divisor) == BPTREE_OK,
+               "Remove-if failed");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after dense removal");
+        int expected = 0;
+        for (int i = 1; i <= N; i++) {
+            const bool alive = (i % 7 != 0 && i % 2 != 0);
+            const bptree_key_t k = (bptree_key_t)i;
+            expected += alive;
+            ASSERT(bptree_contains(tree, &k) == alive, "Membership wrong for %d (order %d)", i,
+                   order);
+        }
+        ASSERT(tree->count == expected, "Count %d != %d", (int)tree->count, expected);
+
+        // Contiguous removal: whole leaves and subtrees disappear.
+        int window[2] = {N / 3, N / 3 + 40};
+        ASSERT(bptree_remove_if(tree, test_key_outside, window) == BPTREE_OK, "Remove-if failed");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after window removal");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            if (i >= window[0] && i <= window[1] && i % 7 != 0 && i % 2 != 0) {
+                ASSERT(bptree_contains(tree, &k), "Key %d missing after window removal", i);
+            } else {
+                ASSERT(!bptree_contains(tree, &k), "Key %d survived window removal", i);
+            }
+        }
+        for (int i = N + 1; i <= N + 300; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Reinsert failed");
+        }
+        for (int i = N + 1; i <= N + 300; i += 3) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_remove(tree, &k) == BPTREE_OK, "Remove after remove-if failed");
+        }
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after reuse");
+
+        divisor = 1;  // Everything matches.
+        ASSERT(bptree_remove_if(tree, test_key_divisible, &divisor) == BPTREE_OK,
+               "Remove-if failed");
+        ASSERT(tree->count == 0 && tree->height == 1, "Tree not empty after removing everything");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed for emptied tree");
+        const bptree_key_t k = 5;
+        ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert into emptied tree");
+        ASSERT(bptree_contains(tree, &k), "Key missing from emptied tree");
+        bptree_free(tree);
+    }
+}
+
+/**
+ * @brief Test: Compaction into slab memory, in one call and in interleaved steps.
+ * Checks that compaction keeps the contents, packs the nodes, survives modifications
+ * between steps, and that slab nodes can later be split, merged, and freed.
+ */
+void test_compaction(void) {
+    const int N = 3000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        bool done = false;
+        ASSERT(bptree_compact_step(tree, 1.0, 10, &done) == BPTREE_OK && done,
+               "Compacting an empty tree should finish at once");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            if ((i * 7) % 10 < 5) bptree_remove(tree, &k);
+        }
+        const int count = tree->count;
+        const int nodes_before = bptree_get_stats(tree).node_count;
+        ASSERT(bptree_compact(tree, 0.0) == BPTREE_INVALID_ARGUMENT, "Zero fill should fail");
+        ASSERT(bptree_compact(tree, 1.5) == BPTREE_INVALID_ARGUMENT, "Fill above 1 should fail");
+        ASSERT(bptree_compact_step(tree, 1.0, 0, NULL) == BPTREE_INVALID_ARGUMENT,
+               "Zero step budget should fail");
+
+        ASSERT(bptree_compact(tree, 1.0) == BPTREE_OK, "Compaction failed (order %d)", order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after compaction");
+        ASSERT(tree->count == count, "Count changed by compaction");
+        ASSERT(bptree_get_stats(tree).node_count < nodes_before,
+               "Compaction did not reduce the node count (order %d)", order);
+        for (const bptree_node *leaf = tree->first_leaf; leaf; leaf = leaf->next) {
+            ASSERT(leaf->in_slab, "Compacted leaf not in a slab");
+        }
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_contains(tree, &k) == ((i * 7) % 10 >= 5),
+                   "Membership wrong for %d after compaction", i);
+        }
+
+        // Interleave steps with lookups and a write after every step, on keys both behind
+        // and ahead of the copy; the copy made so far must survive them.
+        int steps = 0;
+        int writes = 0;
+        done = false;
+        while (!done && steps < 10000) {
+            ASSERT(bptree_compact_step(tree, 0.75, 50, &done) == BPTREE_OK, "Step failed");
+            steps++;
+            const bptree_key_t probe = (bptree_key_t)(steps % N + 1);
+            ASSERT(bptree_contains(tree, &probe) == ((probe * 7) % 10 >= 5), "Lookup wrong");
+            if (done) break;
+            const bptree_key_t k = (bptree_key_t)(N + 1 + (steps * 7919) % N);
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert failed");
+            writes++;
+        }
+        // Copying takes count / 50 steps and the writes add to it; building the internal
+        // levels, charged a node's worth of copies per node, takes about as many again.
+        ASSERT(done && steps > count / 50 && steps < 4 * count / 50,
+               "Incremental compaction took %d steps (order %d)", steps, order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after incremental compaction");
+        ASSERT(tree->count == count + writes, "Count wrong after incremental compaction");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_value_t v;
+            const bool alive = (i * 7) % 10 >= 5;
+            ASSERT((bptree_get(tree, &k, &v) == BPTREE_OK) == alive,
+                   "Membership wrong for %d after incremental compaction", i);
+            ASSERT(!alive || v == MAKE_VALUE_NUM(k), "Value wrong for %d", i);
+        }
+        for (const bptree_node *leaf = tree->first_leaf; leaf; leaf = leaf->next) {
+            ASSERT(leaf->num_keys > 0, "Empty leaf after incremental compaction");
+        }
+
+        // Removals and re-insertions of copied keys, on a fresh compaction.
+        done = false;
+        steps = 0;
+        while (!done && steps < 10000) {
+            ASSERT(bptree_compact_step(tree, 1.0, 40, &done) == BPTREE_OK, "Step failed");
+            steps++;
+            const bptree_key_t k = (bptree_key_t)(N + 1 + (steps * 7919) % N);
+            if (done || !bptree_contains(tree, &k)) continue;
+            ASSERT(bptree_remove(tree, &k) == BPTREE_OK, "Remove failed");
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k + 1)) == BPTREE_OK, "Insert failed");
+        }
+        ASSERT(done, "Compaction with removals did not finish (order %d)", order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after compaction with removals");
+        ASSERT(tree->count == count + writes, "Count wrong after compaction with removals");
+        for (int i = 1; i < steps; i++) {
+            const bptree_key_t k = (bptree_key_t)(N + 1 + (i * 7919) % N);
+            bptree_value_t v;
+            ASSERT(bptree_get(tree, &k, &v) != BPTREE_OK || v == MAKE_VALUE_NUM(k + 1),
+                   "Rewritten key %d lost its new value in compaction", (int)k);
+        }
+
+        // Slab nodes must behave like any other node afterwards.
+        for (int i = 2 * N + 1; i <= 2 * N + 500; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert failed");
+        }
+        for (int i = 1; i <= 2 * N + 500; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            if (i % 4 != 0) bptree_remove(tree, &k);
+        }
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after reusing slab nodes");
+        // Leave an unfinished compaction behind for bptree_free to clean up.
+        ASSERT(bptree_compact_step(tree, 0.5, 1, &done) == BPTREE_OK && !done, "Step failed");
+        bptree_free(tree);
+    }
+}
+
+void test_deferred_work(void) {
+    const int N = 4000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        ASSERT(bptree_do_work(NULL, 0) == BPTREE_INVALID_ARGUMENT, "NULL tree should fail");
+        ASSERT(bptree_set_deferred(tree, true) == BPTREE_OK, "Enabling deferred mode failed");
+        ASSERT(bptree_do_work(tree, 0) == BPTREE_OK && bptree_pending_work(tree) == 0,
+               "Idle work should do nothing");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        srand(42 + order);
+        char *present = malloc(N + 1);
+        memset(present, 1, N + 1);
+        for (int r = 0; r < N; r++) {
+            const int i = rand() % N + 1;
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_remove(tree, &k) == (present[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND),
+                   "Deferred removal of %d wrong", i);
+            present[i] = 0;
+            if (r % 97 == 0) bptree_do_work(tree, 0);
+        }
+        ASSERT(bptree_pending_work(tree) > 0, "Removals queued no repairs (order %d)", order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed with repairs pending");
+        while (bptree_pending_work(tree) > 0) {
+            ASSERT(bptree_do_work(tree, 1000) == BPTREE_OK, "Work failed");
+        }
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after draining repairs");
+
+        // Only leaves with a pending repair may be underfull: queue one for the first leaf,
+        // then empty the last leaf by hand.
+        ASSERT(tree->first_leaf != tree->last_leaf, "Tree too small (order %d)", order);
+        while (tree->first_leaf->num_keys >= tree->min_leaf_keys) {
+            const bptree_node *leaf = tree->first_leaf;
+            const bptree_key_t k = bptree_node_keys(leaf)[leaf->num_keys - 1];
+            ASSERT(bptree_remove(tree, &k) == BPTREE_OK, "Remove failed");
+            present[(int)k] = 0;
+        }
+        ASSERT(bptree_pending_work(tree) == 1, "Repair not queued");
+        ASSERT(bptree_check_invariants(tree), "Queued underfull leaf rejected");
+        bptree_node *last = tree->last_leaf;
+        bptree_key_t dropped[DEFAULT_MAX_KEYS];
+        int num_dropped = 0;
+        while (last->num_keys >= tree->min_leaf_keys) {
+            dropped[num_dropped] = bptree_node_keys(last)[last->num_keys - 1];
+            last->num_keys--;
+            tree->count--;
+            bptree_refresh_path(tree, &dropped[num_dropped++]);
+        }
+        ASSERT(!bptree_check_invariants(tree), "Underfull leaf without a repair passed");
+        for (int i = 0; i < num_dropped; i++) {
+            bptree_put(tree, &dropped[i], MAKE_VALUE_NUM(dropped[i]));
+        }
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after refilling the leaf");
+        while (bptree_pending_work(tree) > 0) {
+            ASSERT(bptree_do_work(tree, 1000) == BPTREE_OK, "Work failed");
+        }
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_contains(tree, &k) == present[i], "Membership wrong for %d", i);
+        }
+
+        // A deferred compaction is carried out by bptree_do_work.
+        const int count = tree->count;
+        ASSERT(bptree_compact(tree, 1.0) == BPTREE_OK, "Starting compaction failed");
+        ASSERT(bptree_pending_work(tree) > 0, "Compaction was not deferred");
+        int units = 0;
+        while (bptree_pending_work(tree) > 0 && units < 100000) {
+            ASSERT(bptree_do_work(tree, 0) == BPTREE_OK, "Work failed");
+            units++;
+        }
+        ASSERT(bptree_pending_work(tree) == 0, "Deferred compaction never finished");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after deferred compaction");
+        ASSERT(tree->count == count, "Count changed by deferred compaction");
+        // After the copy, each unit refreshes one leaf or builds one parent.
+        ASSERT(units >= count / order + tree->leaf_nodes,
+               "Compaction built its levels in too few units (%d, order %d)", units, order);
+
+        // Under steady writes, each unit stays small and the compaction still finishes.
+        ASSERT(bptree_compact(tree, 0.9) == BPTREE_OK, "Starting compaction failed");
+        ASSERT(bptree_do_work(tree, 0) == BPTREE_OK, "Work failed");
+        ASSERT(tree->compaction && tree->compaction->builder.tree->leaf_nodes <= 2,
+               "One unit of compaction carved the whole slab (order %d)", order);
+        units = 0;
+        while (bptree_pending_work(tree) > 0 && units < 100000) {
+            const int i = rand() % N + 1;
+            const bptree_key_t k = (bptree_key_t)i;
+            if (present[i]) {
+                ASSERT(bptree_remove(tree, &k) == BPTREE_OK, "Remove failed");
+            } else {
+                ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert failed");
+            }
+            present[i] = !present[i];
+            ASSERT(bptree_do_work(tree, 0) == BPTREE_OK, "Work failed");
+            units++;
+        }
+        ASSERT(bptree_pending_work(tree) == 0 && !tree->compaction,
+               "Deferred compaction under writes never finished (order %d)", order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after compaction under writes");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_contains(tree, &k) == present[i], "Membership wrong for %d", i);
+        }
+
+        // Clearing is O(1); the old nodes are freed by later work.
+        ASSERT(bptree_clear(tree) == BPTREE_OK, "Clear failed");
+        ASSERT(tree->count == 0 && bptree_check_invariants(tree), "Tree not empty after clear");
+        ASSERT(bptree_pending_work(tree) > 0, "Clear freed the nodes synchronously");
+        const bptree_key_t k = 7;
+        ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert after clear failed");
+        ASSERT(bptree_do_work(tree, 0) == BPTREE_OK, "Work failed");
+        ASSERT(bptree_set_deferred(tree, false) == BPTREE_OK, "Disabling deferred mode failed");
+        ASSERT(bptree_pending_work(tree) == 0, "Disabling deferred mode left work behind");
+        ASSERT(bptree_contains(tree, &k) && tree->count == 1, "Tree wrong after clear");
+
+        // Leave queued garbage behind for bptree_free to clean up.
+        bptree_set_deferred(tree, true);
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t key = (bptree_key_t)i;
+            bptree_put(tree, &key, MAKE_VALUE_NUM(key));
+        }
+
+        // Dropping a compaction also leaves its partial copy to later work, whether it is
+        // still copying or building the internal levels.
+        ASSERT(bptree_pending_work(tree) == 0, "Unexpected work after inserting");
+        ASSERT(bptree_compact(tree, 1.0) == BPTREE_OK, "Starting compaction failed");
+        for (int u = 0; u < 3; u++) ASSERT(bptree_do_work(tree, 0) == BPTREE_OK, "Work failed");
+        const int copied_leaves = tree->compaction->builder.tree->leaf_nodes;
+        ASSERT(bptree_compact_step(tree, 0.5, 1, NULL) == BPTREE_OK, "Restart failed");
+        ASSERT(tree->garbage_count == copied_leaves,
+               "Restart freed the partial copy synchronously (order %d)", order);
+        while (tree->compaction && (!tree->compaction->builder.sealed ||
+                                    tree->compaction->builder.levels.parents == 0)) {
+            ASSERT(bptree_do_work(tree, 0) == BPTREE_OK, "Work failed");
+        }
+        ASSERT(tree->compaction && !tree->compaction->built, "Compaction finished too soon");
+        const int queued = tree->garbage_count;
+        ASSERT(bptree_clear(tree) == BPTREE_OK, "Clear failed");
+        ASSERT(tree->garbage_count >= queued + 3,
+               "Clear freed the partial levels synchronously (order %d)", order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after dropping a compaction");
+        while (bptree_pending_work(tree) > 0) {
+            ASSERT(bptree_do_work(tree, 1000) == BPTREE_OK, "Work failed");
+        }
+        ASSERT(tree->leaf_nodes == 1 && tree->internal_nodes == 0,
+               "Node counts wrong after freeing a dropped compaction");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t key = (bptree_key_t)i;
+            bptree_put(tree, &key, MAKE_VALUE_NUM(key));
+        }
+        ASSERT(bptree_clear(tree) == BPTREE_OK, "Clear failed");
+        free(present);
+        bptree_free(tree);
+    }
+}
+
+void test_free_async(void) {
+    const int N = 20000;
+    ASSERT(bptree_free_async(NULL, 1, NULL) == BPTREE_INVALID_ARGUMENT, "NULL tree should fail");
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        // Trees with heap nodes, slab nodes, a mix of both, and queued garbage.
+        for (int variant = 0; variant < 4; variant++) {
+            for (int threads = 1; threads <= 4; threads += 3) {
+                bptree *tree = create_test_tree_with_order(order);
+                ASSERT(tree != NULL, "Tree creation failed");
+                for (int i = 1; i <= N; i++) {
+                    const bptree_key_t k = (bptree_key_t)i;
+                    bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+                }
+                if (variant >= 1) bptree_compact(tree, 0.9);
+                if (variant == 2) {
+                    for (int i = N + 1; i <= N + 3000; i++) {
+                        const bptree_key_t k = (bptree_key_t)i;
+                        bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+                    }
+                }
+                if (variant == 3) {
+                    bptree_set_deferred(tree, true);
+                    bptree_clear(tree);
+                    const bptree_key_t k = 1;
+                    bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+                }
+                bptree_free_task *task = NULL;
+                ASSERT(bptree_free_async(tree, 0, &task) == BPTREE_INVALID_ARGUMENT,
+                       "Zero threads should fail");
+                ASSERT(bptree_free_async(tree, threads, &task) == BPTREE_OK,
+                       "Async free failed (order %d, variant %d)", order, variant);
+#ifdef BPTREE_ENABLE_THREADS
+                ASSERT(task != NULL, "No task handle returned");
+#else
+                ASSERT(task == NULL, "Freeing without threads should not return a handle");
+#endif
+                bptree_free_wait(task);
+            }
+        }
+        // Without a handle, the task frees itself; small trees finish before the call returns.
+        for (int round = 0; round < 50; round++) {
+            bptree *tree = create_test_tree_with_order(order);
+            ASSERT(tree != NULL, "Tree creation failed");
+            const int n = round % 2 ? 10 : N;
+            for (int i = 1; i <= n; i++) {
+                const bptree_key_t k = (bptree_key_t)i;
+                bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+            }
+            bptree_budget budget;
+            bptree_budget_init(&budget, 0, NULL, NULL);
+            ASSERT(bptree_set_budget(tree, &budget) == BPTREE_OK, "Attaching a budget failed");
+            ASSERT(bptree_free_async(tree, 1 + round % 4, NULL) == BPTREE_OK,
+                   "Detached async free failed (order %d)", order);
+            ASSERT(budget.used == 0, "Detached async free did not credit the budget");
+        }
+    }
+    bptree_free_wait(NULL);
+}
+
+void test_check_invariants(void) {
+    const int N = 3000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        ASSERT(bptree_check_invariants_parallel(tree, 0) == false, "Zero threads should fail");
+        ASSERT(bptree_check_invariants_parallel(tree, 4), "Empty tree check failed");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        for (int i = 1; i <= N; i += 3) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_remove(tree, &k);
+        }
+        for (int threads = 1; threads <= 8; threads *= 2) {
+            ASSERT(bptree_check_invariants_parallel(tree, threads),
+                   "Check failed (order %d, %d threads)", order, threads);
+
+            // A wrong entry count.
+            tree->count++;
+            ASSERT(!bptree_check_invariants_parallel(tree, threads), "Bad count not detected");
+            tree->count--;
+
+            // A leaf chain that skips a leaf in the middle of the tree.
+            bptree_node *leaf = tree->first_leaf;
+            for (int i = 0; i < 10 && leaf->next->next; i++) leaf = leaf->next;
+            bptree_node *skipped = leaf->next;
+            leaf->next = skipped->next;
+            ASSERT(!bptree_check_invariants_parallel(tree, threads), "Broken chain not detected");
+            leaf->next = skipped;
+
+            // A key that no longer fits between the separators above its leaf.
+            bptree_key_t *keys = bptree_node_keys(leaf);
+            const bptree_key_t saved = keys[0];
+            keys[0] = 0;
+            ASSERT(!bptree_check_invariants_parallel(tree, threads), "Bad key not detected");
+            keys[0] = saved;
+            ASSERT(bptree_check_invariants_parallel(tree, threads), "Restored tree check failed");
+        }
+        bptree_free(tree);
+    }
+}
+
+#ifdef BPTREE_ENABLE_TTL
+void test_expiry(void) {
+    const int N = 5000;
+    const int64_t past = 1;
+    const int64_t future = INT64_MAX - 1;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        // Every third key expires, every fifth one has a far-off expiry, the rest never expire.
+        int64_t *expiry = malloc((N + 1) * sizeof(int64_t));
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            expiry[i] = i % 3 == 0 ? past : i % 5 == 0 ? future : BPTREE_NO_EXPIRY;
+            ASSERT(bptree_put_expiring(tree, &k, MAKE_VALUE_NUM(k), expiry[i]) == BPTREE_OK,
+                   "Insert failed");
+        }
+        // Removals and a compaction move entries between leaves; expiries must follow them.
+        for (int i = 1; i <= N; i += 7) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_remove(tree, &k);
+            expiry[i] = 0;
+        }
+        ASSERT(bptree_compact(tree, 1.0) == BPTREE_OK, "Compaction failed");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed (order %d)", order);
+        int expected_expired = 0;
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            int64_t e;
+            bptree_value_t v;
+            if (expiry[i] == 0) {
+                ASSERT(bptree_get_expiry(tree, &k, &e) == BPTREE_KEY_NOT_FOUND, "Removed key");
+                continue;
+            }
+            ASSERT(bptree_get_expiry(tree, &k, &e) == BPTREE_OK && e == expiry[i],
+                   "Expiry of %d wrong", i);
+            ASSERT((bptree_get(tree, &k, &v) == BPTREE_OK) == (expiry[i] != past),
+                   "Lazy expiry wrong for %d", i);
+            if (expiry[i] == past) expected_expired++;
+        }
+        const bptree_key_t some = 2;
+        ASSERT(bptree_set_expiry(tree, &some, past) == BPTREE_OK, "Setting expiry failed");
+        ASSERT(!bptree_contains(tree, &some), "Newly expired key still visible");
+        ASSERT(bptree_set_expiry(tree, &some, BPTREE_NO_EXPIRY) == BPTREE_OK, "Clearing failed");
+        ASSERT(bptree_contains(tree, &some), "Key with cleared expiry hidden");
+
+        // An expired entry that was not swept yet can be put again, with a fresh expiry.
+        const int count = tree->count;
+        const bptree_key_t stale = 3, stale_expiring = 6, live = 4, live_expiring = 5;
+        bptree_value_t v;
+        int64_t e;
+        ASSERT(bptree_put(tree, &stale, MAKE_VALUE_NUM(30)) == BPTREE_OK,
+               "Put over an expired entry failed (order %d)", order);
+        ASSERT(bptree_get(tree, &stale, &v) == BPTREE_OK && v == MAKE_VALUE_NUM(30),
+               "Value of a re-put expired entry wrong");
+        ASSERT(bptree_get_expiry(tree, &stale, &e) == BPTREE_OK && e == BPTREE_NO_EXPIRY,
+               "Re-put entry still expires");
+        ASSERT(bptree_put_expiring(tree, &stale_expiring, MAKE_VALUE_NUM(60), future) ==
+                   BPTREE_OK,
+               "Expiring put over an expired entry failed");
+        ASSERT(bptree_get(tree, &stale_expiring, &v) == BPTREE_OK && v == MAKE_VALUE_NUM(60),
+               "Value of a re-put expiring entry wrong");
+        ASSERT(bptree_get_expiry(tree, &stale_expiring, &e) == BPTREE_OK && e == future,
+               "Re-put entry did not get its new expiry");
+        ASSERT(tree->count == count, "Replacing expired entries changed the count");
+        ASSERT(bptree_put(tree, &live, MAKE_VALUE_NUM(0)) == BPTREE_DUPLICATE_KEY &&
+                   bptree_put(tree, &live_expiring, MAKE_VALUE_NUM(0)) == BPTREE_DUPLICATE_KEY,
+               "Put over a live entry should fail");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after replacing expired entries");
+        expiry[stale] = BPTREE_NO_EXPIRY;
+        expiry[stale_expiring] = future;
+        expected_expired -= 2;
+
+        int removed = 0, total = 0;
+        ASSERT(bptree_expire(tree, 0, 0, NULL) == BPTREE_INVALID_ARGUMENT, "Zero budget");
+        do {
+            const int64_t now = bptree_now_ns();
+            ASSERT(bptree_expire(tree, now, 100, &removed) == BPTREE_OK, "Sweep failed");
+            ASSERT(removed <= 100, "Sweep exceeded its budget");
+            total += removed;
+            ASSERT(bptree_check_invariants(tree), "Invariants failed during sweep");
+        } while (removed > 0);
+        ASSERT(total == expected_expired, "Swept %d entries, expected %d", total, expected_expired);
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_contains(tree, &k) == (expiry[i] != 0 && expiry[i] != past),
+                   "Membership wrong for %d after sweep", i);
+        }
+        ASSERT(bptree_expire(tree, future, N, &removed) == BPTREE_OK, "Sweep failed");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed after sweeping to the future");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_contains(tree, &k) == (expiry[i] == BPTREE_NO_EXPIRY),
+                   "Membership wrong for %d after the last sweep", i);
+        }
+        free(expiry);
+        bptree_free(tree);
+    }
+}
+#endif  // BPTREE_ENABLE_TTL
+
+/** @brief Records evicted keys for test_capacity. */
+typedef struct test_evictions {
+    int count;         /**< Number of evictions seen */
+    bptree_key_t last; /**< Most recently evicted key */
+    bool ascending;    /**< True while every eviction had a larger key than the last */
+    bool descending;   /**< True while every eviction had a smaller key than the last */
+} test_evictions;
+
+static void test_record_eviction(const bptree_key_t *key, bptree_value_t value, void *ctx) {
+    test_evictions *ev = ctx;
+    (void)value;
+    if (ev->count > 0) {
+        ev->ascending = ev->ascending && *key > ev->last;
+        ev->descending = ev->descending && *key < ev->last;
+    }
+    ev->last = *key;
+    ev->count++;
+}
+
+void test_capacity(void) {
+    const int N = 3000;
+    const int cap = 200;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+
+        // Without a limit, lookups leave the CLOCK bit alone (readers do not write).
+        const bptree_key_t first = 1;
+        bptree_value_t found = NULL;
+        bptree_put(tree, &first, MAKE_VALUE_NUM(first));
+        ASSERT(bptree_get(tree, &first, &found) == BPTREE_OK && !tree->root->referenced,
+               "Lookup in an unbounded tree set the reference bit");
+        bptree_clear(tree);
+
+        ASSERT(bptree_set_capacity(tree, -1, 0, BPTREE_EVICT_CLOCK, NULL, NULL) ==
+                   BPTREE_INVALID_ARGUMENT,
+               "Negative capacity should fail");
+
+        // Oldest-key-first keeps the newest of ascending keys.
+        test_evictions ev = {0, 0, true, true};
+        bptree_set_capacity(tree, cap, 0, BPTREE_EVICT_SMALLEST, test_record_eviction, &ev);
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert failed");
+            ASSERT(tree->count <= cap, "Capacity exceeded");
+        }
+        ASSERT(ev.count == N - cap && ev.ascending, "Evicted %d entries, expected %d", ev.count,
+               N - cap);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed (order %d)", order);
+
+        // An insertion never evicts itself, even when it is the next victim.
+        const bptree_key_t smallest = 1;
+        ASSERT(bptree_put(tree, &smallest, MAKE_VALUE_NUM(smallest)) == BPTREE_OK, "Insert");
+        ASSERT(bptree_contains(tree, &smallest), "Newly inserted key was evicted");
+        ASSERT(bptree_pop_min(tree, NULL, NULL) == BPTREE_OK, "Pop failed");
+
+        // Largest-key-first, and a lower capacity evicts at once.
+        ev = (test_evictions){0, 0, true, true};
+        bptree_set_capacity(tree, cap / 2, 0, BPTREE_EVICT_LARGEST, test_record_eviction, &ev);
+        ASSERT(tree->count == cap / 2 && ev.count == cap / 2 - 1 && ev.descending,
+               "Shrinking the capacity evicted the wrong entries");
+        for (int i = N - cap + 2; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_contains(tree, &k) == (i < N - cap + 2 + cap / 2),
+                   "Key %d evicted wrongly", i);
+        }
+
+        // CLOCK keeps leaves that are read between insertions.
+        bptree_clear(tree);
+        bptree_set_capacity(tree, cap, 0, BPTREE_EVICT_CLOCK, NULL, NULL);
+        const int hot = 10;
+        int hot_misses = 0;
+        for (int h = 1; h <= hot; h++) {
+            const bptree_key_t hk = (bptree_key_t)h;
+            bptree_put(tree, &hk, MAKE_VALUE_NUM(hk));
+        }
+        for (int i = hot + 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert failed");
+            for (int h = 1; h <= hot; h++) {
+                const bptree_key_t hk = (bptree_key_t)h;
+                if (bptree_contains(tree, &hk)) continue;
+                hot_misses++;
+                bptree_put(tree, &hk, MAKE_VALUE_NUM(hk));
+            }
+        }
+        ASSERT(hot_misses == 0, "Hot keys missed %d times (order %d)", hot_misses, order);
+        ASSERT(tree->count == cap, "CLOCK cache holds %d entries", (int)tree->count);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed with CLOCK eviction");
+
+        // A byte limit bounds node memory, also in deferred mode.
+        for (int deferred = 0; deferred <= 1; deferred++) {
+            bptree_clear(tree);
+            bptree_set_deferred(tree, deferred);
+            const size_t limit = tree->node_bytes * 40;
+            bptree_set_capacity(tree, 0, limit, BPTREE_EVICT_CLOCK, NULL, NULL);
+            for (int i = 1; i <= N; i++) {
+                const bptree_key_t k = (bptree_key_t)((i * 7919) % N);
+                bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+                ASSERT(tree->node_bytes <= limit, "Byte limit exceeded (order %d)", order);
+            }
+            ASSERT(tree->count > 0 && bptree_check_invariants(tree), "Byte-bounded tree broken");
+            bptree_set_deferred(tree, false);
+        }
+
+        // Compacted nodes share a slab that is freed only once empty; the byte limit counts
+        // them one by one, so a few insertions past the limit evict only a few entries.
+        bptree_clear(tree);
+        bptree_set_capacity(tree, 0, 0, BPTREE_EVICT_SMALLEST, NULL, NULL);
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        ASSERT(bptree_compact(tree, 1.0) == BPTREE_OK, "Compaction failed");
+        bptree_memory mem = bptree_get_memory(tree);
+        const size_t limit = mem.leaf_bytes + mem.internal_bytes;
+        bptree_set_capacity(tree, 0, limit, BPTREE_EVICT_SMALLEST, NULL, NULL);
+        ASSERT(tree->count == N, "Compacted tree at its limit lost entries");
+        for (int i = N + 1; i <= N + N / 10; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            ASSERT(bptree_put(tree, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK, "Insert failed");
+            mem = bptree_get_memory(tree);
+            ASSERT(mem.leaf_bytes + mem.internal_bytes <= limit, "Byte limit exceeded");
+        }
+        ASSERT(tree->count >= N - N / 5, "Compacted tree kept %d of %d entries (order %d)",
+               (int)tree->count, N, order);
+        ASSERT(bptree_check_invariants(tree), "Invariants failed with compaction and byte limit");
+        bptree_free(tree);
+    }
+}
+
+/** @brief Sums the sizes of the nodes of a subtree that were not carved from a slab. */
+static size_t test_heap_node_bytes(const bptree *tree, const bptree_node *node) {
+    size_t bytes = node->in_slab ? 0 : bptree_node_stride(tree, node->is_leaf);
+    if (!node->is_leaf) {
+        bptree_node *const *children = bptree_node_children((bptree_node *)node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            bytes += test_heap_node_bytes(tree, children[i]);
+        }
+    }
+    return bytes;
+}
+
+/** @brief Sums the node memory of a tree by walking it: single nodes plus whole slabs. */
+static size_t test_node_memory(const bptree *tree) {
+    size_t bytes = test_heap_node_bytes(tree, tree->root);
+    for (int i = 0; i < tree->num_slabs; i++) bytes += tree->slabs[i].size;
+    return bytes;
+}
+
+/** @brief Pressure callback for test_memory_budget: pops the smallest keys of a tree. */
+static bool test_relieve_pressure(bptree_budget *budget, size_t needed, void *ctx) {
+    bptree *tree = ctx;
+    const size_t before = budget->used;
+    (void)needed;
+    while (budget->used >= before && tree->count > 0) {
+        bptree_pop_min(tree, NULL, NULL);
+    }
+    return budget->used < before;
+}
+
+void test_memory_budget(void) {
+    const int N = 3000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *a = create_test_tree_with_order(order);
+        bptree *b = create_test_tree_with_order(order);
+        ASSERT(a != NULL && b != NULL, "Tree creation failed");
+
+        // Accounting: the breakdown adds up and the budget follows every tree attached.
+        bptree_budget budget;
+        bptree_budget_init(&budget, 0, NULL, NULL);
+        ASSERT(bptree_set_budget(a, &budget) == BPTREE_OK, "Attaching a budget failed");
+        ASSERT(bptree_set_budget(b, &budget) == BPTREE_OK, "Attaching a budget failed");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)((i * 7919) % N);
+            bptree_put(a, &k, MAKE_VALUE_NUM(k));
+        }
+        for (int i = 1; i <= N / 2; i += 2) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_remove(a, &k);
+        }
+        ASSERT(budget.used == test_node_memory(a) + test_node_memory(b),
+               "Budget out of step with trees (order %d)", order);
+        bptree_memory mem = bptree_get_memory(a);
+        const bptree_stats stats = bptree_get_stats(a);
+        ASSERT(a->leaf_nodes + a->internal_nodes == stats.node_count,
+               "Node counts %d + %d, walk found %d", (int)a->leaf_nodes, (int)a->internal_nodes,
+               stats.node_count);
+        ASSERT(mem.total_bytes == mem.leaf_bytes + mem.internal_bytes,
+               "Breakdown does not add up (order %d)", order);
+        ASSERT(mem.slack_bytes > 0 && mem.slack_bytes < mem.total_bytes, "Slack out of range");
+        const size_t slack_before = mem.slack_bytes;
+        // A compaction is charged while it runs, and refused if its slab does not fit.
+        const size_t used_before = budget.used;
+        budget.limit = used_before + 1;
+        ASSERT(bptree_compact(a, 1.0) == BPTREE_MEMORY_LIMIT, "Compaction ignored the limit");
+        ASSERT(budget.used == used_before, "Refused compaction changed the budget");
+        budget.limit = 0;
+        bool done = false;
+        ASSERT(bptree_compact_step(a, 1.0, 10, &done) == BPTREE_OK && !done, "Step failed");
+        ASSERT(budget.used > used_before + a->node_bytes / 2,
+               "Compaction in progress not charged (order %d)", order);
+        while (!done) {
+            ASSERT(bptree_compact_step(a, 1.0, 100, &done) == BPTREE_OK, "Step failed");
+        }
+        mem = bptree_get_memory(a);
+        ASSERT(mem.slack_bytes < slack_before, "Compaction did not reduce slack");
+        ASSERT(a->leaf_nodes + a->internal_nodes == bptree_get_stats(a).node_count,
+               "Node counts wrong after compaction");
+        ASSERT(budget.used == test_node_memory(a) + test_node_memory(b),
+               "Budget out of step after compaction (order %d)", order);
+        // Detaching a tree mid-compaction takes the partial copy's charge along.
+        ASSERT(bptree_compact_step(a, 0.5, 10, &done) == BPTREE_OK && !done, "Step failed");
+        ASSERT(bptree_set_budget(a, NULL) == BPTREE_OK, "Detaching failed");
+        ASSERT(budget.used == test_node_memory(b), "Detaching left the copy charged");
+        ASSERT(bptree_set_budget(a, &budget) == BPTREE_OK, "Attaching failed");
+        while (!done) {
+            ASSERT(bptree_compact_step(a, 0.5, 100, &done) == BPTREE_OK, "Step failed");
+        }
+        ASSERT(bptree_compact(a, 1.0) == BPTREE_OK, "Compaction failed");
+        ASSERT(budget.used == test_node_memory(a) + test_node_memory(b),
+               "Budget out of step after reattaching (order %d)", order);
+
+        // A shared limit: insertions that need a new node fail and leave the tree unchanged.
+        budget.limit = budget.used + 4 * a->node_bytes / (size_t)a->leaf_nodes;
+        int failures = 0;
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)(N + i);
+            bptree *t = i % 2 ? a : b;
+            const int count = t->count;
+            const bptree_status status = bptree_put(t, &k, MAKE_VALUE_NUM(k));
+            ASSERT(budget.used <= budget.limit, "Budget exceeded (order %d)", order);
+            if (status == BPTREE_MEMORY_LIMIT) {
+                failures++;
+                ASSERT(t->count == count && !bptree_contains(t, &k), "Failed insert changed tree");
+            } else {
+                ASSERT(status == BPTREE_OK, "Insert failed with status %d", status);
+            }
+        }
+        ASSERT(failures > 0, "Limit never reached (order %d)", order);
+        ASSERT(bptree_check_invariants(a) && bptree_check_invariants(b), "Invariants failed");
+
+        // The pressure callback makes room by dropping the smallest keys of tree a.
+        budget.on_pressure = test_relieve_pressure;
+        budget.ctx = a;
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)(3 * N + i);
+            ASSERT(bptree_put(b, &k, MAKE_VALUE_NUM(k)) == BPTREE_OK || a->count == 0,
+                   "Insert failed despite pressure callback");
+            ASSERT(budget.used <= budget.limit, "Budget exceeded with callback");
+        }
+        ASSERT(bptree_check_invariants(a) && bptree_check_invariants(b), "Invariants failed");
+
+        // Detaching and freeing give the memory back.
+        ASSERT(bptree_set_budget(b, NULL) == BPTREE_OK, "Detaching failed");
+        ASSERT(budget.used == a->node_bytes, "Detaching did not credit the budget");
+        bptree_free(a);
+        ASSERT(budget.used == 0, "Freeing did not credit the budget");
+        budget.limit = 1;
+        ASSERT(bptree_set_budget(b, &budget) == BPTREE_MEMORY_LIMIT,
+               "Attaching a tree over the limit should fail");
+        bptree_free(b);
+    }
+}
+
+#ifdef BPTREE_ENABLE_COUNTERS
+void test_counters(void) {
+    const int N = 2000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        bptree_counters c = bptree_get_counters(tree);
+        ASSERT(c.puts == (uint64_t)N && c.leaf_splits > 0, "Insert counts wrong");
+        ASSERT(c.root_splits == (uint64_t)(tree->height - 1), "Root splits %llu, height %d",
+               (unsigned long long)c.root_splits, tree->height);
+        ASSERT(c.leaf_splits + 1 == (uint64_t)bptree_get_stats(tree).leaf_nodes,
+               "Every leaf but the first comes from a split");
+        ASSERT(c.compares > 0 && c.bytes_moved > 0, "Cost counts missing");
+
+        // Removing every other key, then the rest, borrows and merges at every level.
+        bptree_reset_counters(tree);
+        ASSERT(bptree_get_counters(tree).puts == 0, "Reset did not clear the counts");
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 1 + pass; i <= N; i += 2) {
+                const bptree_key_t k = (bptree_key_t)i;
+                bptree_remove(tree, &k);
+            }
+        }
+        c = bptree_get_counters(tree);
+        ASSERT(c.removes == (uint64_t)N && c.puts == 0, "Remove counts wrong");
+        ASSERT(c.leaf_merges > 0 && c.leaf_borrows > 0, "No leaf merges or borrows counted");
+        ASSERT(c.root_collapses > 0 && tree->height == 1, "Root collapses not counted");
+
+        // Prometheus text: truncated output reports the full length, and sums add up.
+        bptree_counters sum = {0};
+        bptree_counters_add(&sum, &c);
+        bptree_counters_add(&sum, &c);
+        ASSERT(sum.leaf_merges == 2 * c.leaf_merges, "Adding counts failed");
+        char small[16];
+        const size_t len = bptree_counters_format(&c, "a\"b", small, sizeof(small));
+        ASSERT(len > sizeof(small) && strlen(small) == sizeof(small) - 1, "Truncation wrong");
+        char *text = malloc(len + 1);
+        ASSERT(bptree_counters_format(&c, "a\"b", text, len + 1) == len, "Length mismatch");
+        char expect[96];
+        snprintf(expect, sizeof(expect), "bptree_removes_total{tree=\"a\\\"b\"} %d\n", N);
+        ASSERT(strstr(text, expect) != NULL, "Sample line missing: %s", expect);
+        ASSERT(strstr(text, "# TYPE bptree_leaf_merges_total counter\n") != NULL,
+               "TYPE line missing");
+        free(text);
+
+        // Pops count as removals, on the fast path as well, and their shifts as moved bytes.
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        bptree_reset_counters(tree);
+        for (int i = 0; i < N; i++) {
+            const bptree_status st = i % 2 ? bptree_pop_max(tree, NULL, NULL)
+                                           : bptree_pop_min(tree, NULL, NULL);
+            ASSERT(st == BPTREE_OK, "Pop %d failed", i);
+        }
+        c = bptree_get_counters(tree);
+        ASSERT(c.removes == (uint64_t)N && tree->count == 0, "Pop counts wrong");
+        const bptree_key_t keys3[3] = {1, 2, 3};
+        for (int i = 0; i < 3; i++) bptree_put(tree, &keys3[i], MAKE_VALUE_NUM(keys3[i]));
+        bptree_reset_counters(tree);
+        ASSERT(bptree_pop_min(tree, NULL, NULL) == BPTREE_OK, "Pop from the root leaf failed");
+        c = bptree_get_counters(tree);
+        ASSERT(c.removes == 1 &&
+                   c.bytes_moved >= 2 * (sizeof(bptree_key_t) + sizeof(bptree_value_t)),
+               "Fast-path pop not counted");
+        bptree_free(tree);
+    }
+}
+#endif  // BPTREE_ENABLE_COUNTERS
+
+#ifdef BPTREE_ENABLE_LATENCY
+void test_latency(void) {
+    // Each bucket holds the durations up to its bound, and nothing above.
+    for (int b = 0; b < BPTREE_LATENCY_BUCKETS; b++) {
+        const uint64_t bound = bptree_latency_bucket_max(b);
+        ASSERT(bptree_latency_bucket(bound) == b, "Bucket %d bound misplaced", b);
+        if (b + 1 < BPTREE_LATENCY_BUCKETS) {
+            ASSERT(bptree_latency_bucket(bound + 1) == b + 1, "Bucket %d overlaps", b);
+        }
+    }
+    const int N = 2000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        bptree_latency_snapshot snap;
+        ASSERT(bptree_set_latency_sampling(tree, 1) == BPTREE_OK, "Enabling sampling failed");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        ASSERT(bptree_get_latency(tree, &snap) == BPTREE_OK, "Snapshot failed");
+        ASSERT(snap.sample_every == 1 && snap.ns_per_tick > 0, "Snapshot header wrong");
+        const uint64_t splits = snap.ops[BPTREE_OP_PUT_SPLIT].samples;
+        ASSERT(splits + snap.ops[BPTREE_OP_PUT].samples == (uint64_t)N, "Not every put timed");
+        ASSERT(splits == bptree_get_counters(tree).leaf_splits, "Split puts %llu",
+               (unsigned long long)splits);
+        const double median = bptree_latency_quantile(&snap, BPTREE_OP_PUT, 0.5);
+        const double p99 = bptree_latency_quantile(&snap, BPTREE_OP_PUT, 0.99);
+        const double top = bptree_latency_quantile(&snap, BPTREE_OP_PUT, 1.0);
+        ASSERT(median <= p99 && p99 <= top, "Quantiles out of order");
+        ASSERT(top == (double)snap.ops[BPTREE_OP_PUT].max_ticks * snap.ns_per_tick,
+               "Top quantile should be the longest duration");
+        ASSERT(bptree_latency_quantile(&snap, BPTREE_OP_RANGE, 0.5) == 0.0,
+               "Empty kind should report zero");
+
+        // Every fourth operation from here on, split by outcome.
+        bptree_reset_latency(tree);
+        ASSERT(bptree_set_latency_sampling(tree, 4) == BPTREE_OK, "Changing period failed");
+        for (int i = 1; i <= 2 * N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_value_t v;
+            bptree_get(tree, &k, &v);
+        }
+        const bptree_key_t lo = 1, hi = 100;
+        for (int i = 0; i < 4; i++) {
+            bptree_value_t *values = NULL;
+            int n = 0;
+            bptree_get_range(tree, &lo, &hi, &values, &n);
+            bptree_free_range_results(values);
+        }
+        bptree_get_latency(tree, &snap);
+        ASSERT(snap.ops[BPTREE_OP_PUT].samples == 0, "Reset left samples");
+        ASSERT(snap.ops[BPTREE_OP_GET_HIT].samples == (uint64_t)N / 4 &&
+                   snap.ops[BPTREE_OP_GET_MISS].samples == (uint64_t)N / 4,
+               "Lookup samples wrong");
+        ASSERT(snap.ops[BPTREE_OP_RANGE].samples == 1, "Range samples wrong");
+
+        // Ascending removals keep emptying the first leaf, so many of them rebalance.
+        bptree_reset_latency(tree);
+        bptree_set_latency_sampling(tree, 1);
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_remove(tree, &k);
+        }
+        bptree_get_latency(tree, &snap);
+        const uint64_t rebalanced = snap.ops[BPTREE_OP_REMOVE_REBALANCE].samples;
+        ASSERT(rebalanced > 0 && rebalanced + snap.ops[BPTREE_OP_REMOVE].samples == (uint64_t)N,
+               "Remove samples wrong");
+
+        // Evictions remove entries from inside bptree_put; only the puts are sampled, and
+        // the period counts puts alone.
+        bptree_set_capacity(tree, 100, 0, BPTREE_EVICT_SMALLEST, NULL, NULL);
+        bptree_reset_latency(tree);
+        bptree_set_latency_sampling(tree, 2);
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        ASSERT(tree->count == 100, "Capacity not enforced");
+        bptree_get_latency(tree, &snap);
+        ASSERT(snap.ops[BPTREE_OP_REMOVE].samples + snap.ops[BPTREE_OP_REMOVE_REBALANCE].samples ==
+                   0,
+               "Evictions sampled as removals");
+        ASSERT(snap.ops[BPTREE_OP_PUT].samples + snap.ops[BPTREE_OP_PUT_SPLIT].samples ==
+                   (uint64_t)N / 2,
+               "Put samples wrong with evictions (order %d)", order);
+
+        ASSERT(bptree_set_latency_sampling(tree, 0) == BPTREE_OK, "Disabling sampling failed");
+        bptree_get_latency(tree, &snap);
+        ASSERT(snap.sample_every == 0 && snap.ops[BPTREE_OP_GET_HIT].samples == 0,
+               "Disabled sampling should report nothing");
+        bptree_free(tree);
+    }
+}
+#endif  // BPTREE_ENABLE_LATENCY
+
+#ifdef BPTREE_ENABLE_TRACE
+#ifdef BPTREE_ENABLE_THREADS
+/** @brief Tree a writer thread restructures while the test reads its trace ring. */
+typedef struct trace_writer_args {
+    bptree *tree;      /**< Tree with a trace ring */
+    int rounds;        /**< Rounds of puts and removals */
+    _Atomic bool done; /**< Set when the writer finished */
+} trace_writer_args;
+
+/** @brief Fill and empty the tree for a number of rounds, recording events. */
+static void *trace_writer(void *arg) {
+    trace_writer_args *args = arg;
+    for (int r = 0; r < args->rounds; r++) {
+        for (int i = 1; i <= 200; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(args->tree, &k, MAKE_VALUE_NUM(k));
+        }
+        for (int i = 1; i <= 200; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_remove(args->tree, &k);
+        }
+    }
+    atomic_store(&args->done, true);
+    return NULL;
+}
+#endif
+
+void test_trace(void) {
+    const int N = 500;
+    bptree *tree = create_test_tree_with_order(4);
+    ASSERT(tree != NULL, "Tree creation failed");
+    ASSERT(bptree_set_trace(tree, 3000) == BPTREE_OK, "Starting the trace failed");
+    for (int i = 1; i <= N; i++) {
+        const bptree_key_t k = (bptree_key_t)i;
+        bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+    }
+    const bptree_key_t lo = 10, hi = 20;
+    bptree_value_t *values = NULL;
+    int n = 0;
+    bptree_get_range(tree, &lo, &hi, &values, &n);
+    bptree_free_range_results(values);
+
+    // Every event so far fits, in order, and matches the counters.
+    bptree_trace_record records[4096];
+    const size_t got = bptree_trace_read(tree, records, 4096);
+    ASSERT(got > 0 && records[0].seq == 0 && records[got - 1].seq == got - 1,
+           "Records missing or out of order");
+    uint64_t per_event[BPTREE_TRACE_EVENTS] = {0};
+    for (size_t i = 0; i < got; i++) {
+        ASSERT(records[i].event < BPTREE_TRACE_EVENTS, "Bad event %d", (int)records[i].event);
+        ASSERT(i == 0 || records[i].ticks >= records[i - 1].ticks,
+               "Timestamps went backwards");
+        per_event[records[i].event]++;
+    }
+    const bptree_counters c = bptree_get_counters(tree);
+    ASSERT(per_event[BPTREE_TRACE_LEAF_SPLIT] == c.leaf_splits, "Leaf split events wrong");
+    ASSERT(per_event[BPTREE_TRACE_ROOT_SPLIT] == (uint64_t)(tree->height - 1),
+           "Root split events wrong");
+    ASSERT(per_event[BPTREE_TRACE_NODE_ALLOC] ==
+               c.leaf_splits + c.internal_splits + c.root_splits,
+           "Allocation events wrong");
+    ASSERT(per_event[BPTREE_TRACE_RANGE_START] == 1 && per_event[BPTREE_TRACE_RANGE_END] == 1,
+           "Range events missing");
+    const bptree_trace_record *last = &records[got - 1];
+    ASSERT(last->event == BPTREE_TRACE_RANGE_END && last->other_keys == n &&
+               last->depth == tree->height - 1,
+           "Range end record wrong");
+
+    // A small ring keeps only the newest events.
+    ASSERT(bptree_set_trace(tree, 5) == BPTREE_OK, "Resizing the trace failed");
+    for (int i = 1; i <= N; i++) {
+        const bptree_key_t k = (bptree_key_t)i;
+        bptree_remove(tree, &k);
+    }
+    const size_t kept = bptree_trace_read(tree, records, 4096);
+    ASSERT(kept == 8 && records[0].seq > 0, "Ring should hold the 8 newest events");
+    for (size_t i = 1; i < kept; i++) {
+        ASSERT(records[i].seq == records[i - 1].seq + 1, "Ring records not consecutive");
+    }
+    bptree_trace_record newest[3];
+    ASSERT(bptree_trace_read(tree, newest, 3) == 3 && newest[2].seq == records[7].seq,
+           "Partial read should return the newest records");
+
+    // The binary dump holds a header and the same records.
+    FILE *f = tmpfile();
+    ASSERT(f != NULL, "tmpfile failed");
+    if (f) {
+        ASSERT(bptree_trace_write(tree, f), "Writing the trace failed");
+        rewind(f);
+        bptree_trace_header header;
+        ASSERT(fread(&header, sizeof(header), 1, f) == 1, "Header missing");
+        ASSERT(strcmp(header.magic, "BPTRACE") == 0 && header.version == 1 &&
+                   header.record_size == sizeof(bptree_trace_record) && header.records == 8 &&
+                   header.dropped == records[0].seq,
+               "Header wrong");
+        bptree_trace_record first;
+        ASSERT(fread(&first, sizeof(first), 1, f) == 1 && first.seq == records[0].seq &&
+                   first.node == records[0].node,
+               "Records wrong");
+        fclose(f);
+    }
+    ASSERT(strcmp(bptree_trace_event_name(BPTREE_TRACE_MERGE), "merge") == 0, "Name wrong");
+    ASSERT(strcmp(bptree_trace_event_name(BPTREE_TRACE_EVENTS), "unknown") == 0,
+           "Out-of-range name wrong");
+    ASSERT(bptree_set_trace(tree, 0) == BPTREE_OK && bptree_trace_read(tree, records, 8) == 0,
+           "Stopped trace should be empty");
+    bptree_free(tree);
+
+#ifdef BPTREE_ENABLE_THREADS
+    // Reads racing with a writer return whole records, in order (busy or overwritten slots are
+    // skipped, not waited for).
+    trace_writer_args args = {create_test_tree_with_order(4), 50, false};
+    ASSERT(args.tree != NULL && bptree_set_trace(args.tree, 8) == BPTREE_OK,
+           "Starting the trace failed");
+    pthread_t writer;
+    ASSERT(pthread_create(&writer, NULL, trace_writer, &args) == 0, "Thread creation failed");
+    size_t reads = 0;
+    while (!atomic_load(&args.done)) {
+        const size_t got_now = bptree_trace_read(args.tree, records, 8);
+        for (size_t i = 0; i < got_now; i++) {
+            ASSERT(records[i].event < BPTREE_TRACE_EVENTS && records[i].node != 0 &&
+                       records[i].reserved == 0,
+                   "Torn record");
+            ASSERT(i == 0 || records[i].seq > records[i - 1].seq, "Records out of order");
+        }
+        reads++;
+    }
+    pthread_join(writer, NULL);
+    ASSERT(reads > 0, "Reader never ran");
+    bptree_free(args.tree);
+#endif
+}
+#endif  // BPTREE_ENABLE_TRACE
+
+#ifdef BPTREE_ENABLE_HEATMAP
+void test_heatmap(void) {
+    const int N = 2000;
+    for (int m = 0; m < num_test_max_keys; m++) {
+        const int order = test_max_keys_values[m];
+        bptree *tree = create_test_tree_with_order(order);
+        ASSERT(tree != NULL, "Tree creation failed");
+        bptree_hot_range hot[4];
+        bptree_heatmap map;
+        ASSERT(bptree_get_heatmap(tree, NULL, 1, &map) == BPTREE_INVALID_ARGUMENT,
+               "NULL ranges should fail");
+        ASSERT(bptree_get_heatmap(tree, hot, -1, &map) == BPTREE_INVALID_ARGUMENT,
+               "Negative k should fail");
+        for (int i = 1; i <= N; i++) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+        }
+        // Splits share the heat of a leaf, so every put is still accounted for.
+        ASSERT(bptree_get_heatmap(tree, hot, 4, &map) == BPTREE_OK, "Heatmap failed");
+        ASSERT(map.total_heat == (uint64_t)N, "Puts not counted (%llu)",
+               (unsigned long long)map.total_heat);
+
+        // Enough halvings cool every leaf down.
+        for (int i = 0; i < 40; i++) bptree_decay_heat(tree);
+        ASSERT(bptree_get_heatmap(tree, hot, 4, &map) == BPTREE_OK, "Heatmap failed");
+        ASSERT(map.total_heat == 0 && map.num_hot == 0 && map.epoch == 40,
+               "Heat left after decay");
+
+        // A hot spot, plus a few lookups spread over the tree.
+        bptree_value_t value;
+        for (int i = 0; i < 1000; i++) {
+            const bptree_key_t k = 1000;
+            bptree_get(tree, &k, &value);
+        }
+        for (int i = 1; i <= N; i += N / 10) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_get(tree, &k, &value);
+        }
+        ASSERT(bptree_get_heatmap(tree, hot, 4, &map) == BPTREE_OK, "Heatmap failed");
+        ASSERT(map.total_heat == 1010, "Lookups not counted (%llu)",
+               (unsigned long long)map.total_heat);
+        ASSERT(map.num_hot == 4, "Expected 4 hot ranges, got %d", map.num_hot);
+        ASSERT(hot[0].heat >= 1000 && hot[0].min_key <= 1000 && hot[0].max_key >= 1000,
+               "Hot spot not reported first");
+        for (int i = 1; i < map.num_hot; i++) {
+            ASSERT(hot[i].heat <= hot[i - 1].heat, "Hot ranges not sorted");
+        }
+        const bptree_stats stats = bptree_get_stats(tree);
+        for (int level = 0; level < stats.height; level++) {
+            int64_t nodes = 0;
+            for (int b = 0; b < BPTREE_HEAT_BUCKETS; b++) nodes += map.levels[level][b];
+            ASSERT(nodes == stats.level_nodes[level], "Level %d histogram incomplete", level);
+        }
+        ASSERT(map.levels[stats.height - 1][10] == 1, "Root not in the heat bucket of 1010");
+
+        // A scan touches every leaf once, and merges keep the heat of both leaves.
+        const bptree_key_t lo = 1, hi = (bptree_key_t)N;
+        bptree_value_t *values = NULL;
+        int n = 0;
+        bptree_get_range(tree, &lo, &hi, &values, &n);
+        bptree_free_range_results(values);
+        const uint64_t expected = 1010 + (uint64_t)stats.leaf_nodes;
+        for (int i = 2; i <= N; i += 2) {
+            const bptree_key_t k = (bptree_key_t)i;
+            bptree_remove(tree, &k);
+        }
+        ASSERT(bptree_get_heatmap(tree, hot, 0, &map) == BPTREE_OK, "Heatmap failed");
+        ASSERT(map.total_heat == expected, "Heat lost (%llu, expected %llu)",
+               (unsigned long long)map.total_heat, (unsigned long long)expected);
+
+        // With a half-life, the heat halves after that many accesses.
+        ASSERT(bptree_set_heat_half_life(tree, 100) == BPTREE_OK, "Setting half-life failed");
+        for (int i = 0; i < 100; i++) {
+            const bptree_key_t k = 1;
+            bptree_get(tree, &k, &value);
+        }
+        ASSERT(bptree_get_heatmap(tree, hot, 1, &map) == BPTREE_OK, "Heatmap failed");
+        ASSERT(map.epoch == 41 && map.total_heat <= (expected + 100) / 2 + stats.leaf_nodes,
+               "Half-life not applied");
+        ASSERT(bptree_check_invariants(tree), "Invariants failed");
+        bptree_free(tree);
+    }
+}
+#endif  // BPTREE_ENABLE_HEATMAP
+#endif
+
+#ifdef TEST_DEFAULT_FEATURES
+/**
+ * @brief Test: The optional features, when they are not compiled in.
+ * Their functions must still link and report that nothing is kept, and turning them on
+ * must fail instead of doing nothing silently.
+ */
+void test_disabled_features(void) {
+    const int N = 500;
+    bptree *tree = create_test_tree_with_order(4);
+    ASSERT(tree != NULL, "Tree creation failed");
+    for (int i = 1; i <= N; i++) {
+        const bptree_key_t k = (bptree_key_t)i;
+        bptree_put(tree, &k, MAKE_VALUE_NUM(k));
+    }
+    const bptree_counters counters = bptree_get_counters(tree);
+    ASSERT(counters.puts == 0 && counters.leaf_splits == 0, "Counters should stay zero");
+
+    bptree_latency_snapshot snap;
+    ASSERT(bptree_set_latency_sampling(tree, 1) == BPTREE_INVALID_ARGUMENT,
+           "Sampling should not turn on");
+    ASSERT(bptree_set_latency_sampling(tree, 0) == BPTREE_OK, "Turning sampling off failed");
+    ASSERT(bptree_get_latency(tree, &snap) == BPTREE_OK && snap.sample_every == 0 &&
+               snap.ops[BPTREE_OP_PUT].samples == 0,
+           "Latency snapshot should be empty");
+
+    bptree_trace_record record;
+    ASSERT(bptree_set_trace(tree, 64) == BPTREE_INVALID_ARGUMENT, "Trace should not turn on");
+    ASSERT(bptree_trace_read(tree, &record, 1) == 0, "Trace should be empty");
+    ASSERT(!bptree_trace_write(tree, stdout), "Writing a missing trace should fail");
+
+    bptree_hot_range hot[4];
+    bptree_heatmap heatmap;
+    ASSERT(bptree_set_heat_half_life(tree, 100) == BPTREE_INVALID_ARGUMENT,
+           "Heat decay should not turn on");
+    ASSERT(bptree_get_heatmap(tree, hot, 4, &heatmap) == BPTREE_OK && heatmap.num_hot == 0 &&
+               heatmap.total_heat == 0,
+           "Heatmap should be empty");
+
+    // Without threads, the parallel paths fall back to the calling thread.
+    ASSERT(bptree_check_invariants_parallel(tree, 4), "Invariants failed");
+    bptree_free_task *task = NULL;
+    ASSERT(bptree_free_async(tree, 4, &task) == BPTREE_OK && task == NULL,
+           "Freeing without threads should finish at once");
+}
+#endif
+
 /**
  * @brief Main entry point for the B+ tree test suite.
  *
@@ -932,6 +2567,39 @@ int main(void) {
     RUN_TEST(test_precise_boundary_conditions);
     RUN_TEST(test_stress);
     RUN_TEST(test_mixed_insert_delete);  // Often catches complex rebalancing issues
+#ifndef BPTREE_KEY_TYPE_STRING
+    RUN_TEST(test_set_operations);
+    RUN_TEST(test_min_max_pop);
+    RUN_TEST(test_nearest_key_queries);
+#ifdef BPTREE_AGGREGATE_TYPE
+    RUN_TEST(test_aggregate_range);
+#endif
+    RUN_TEST(test_remove_if);
+    RUN_TEST(test_compaction);
+    RUN_TEST(test_deferred_work);
+    RUN_TEST(test_free_async);
+    RUN_TEST(test_check_invariants);
+#ifdef BPTREE_ENABLE_TTL
+    RUN_TEST(test_expiry);
+#endif
+    RUN_TEST(test_capacity);
+    RUN_TEST(test_memory_budget);
+#ifdef BPTREE_ENABLE_COUNTERS
+    RUN_TEST(test_counters);
+#endif
+#ifdef BPTREE_ENABLE_LATENCY
+    RUN_TEST(test_latency);
+#endif
+#ifdef BPTREE_ENABLE_TRACE
+    RUN_TEST(test_trace);
+#endif
+#ifdef BPTREE_ENABLE_HEATMAP
+    RUN_TEST(test_heatmap);
+#endif
+#ifdef TEST_DEFAULT_FEATURES
+    RUN_TEST(test_disabled_features);
+#endif
+#endif
 
     // --- Test Summary ---
     fprintf(stderr, "----------------------------------------\n");